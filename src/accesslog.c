@@ -0,0 +1,325 @@
+/*
+
+An access log that stays off the request path.
+
+Each thread that logs gets a ring of fixed-size records of its own,
+so adding one is a copy and a store: no locks, no formatting, no
+system calls. Only that thread adds to its ring and only the log's
+writer thread takes from it, so head and tail are each written by one
+side and read by the other.
+
+The writer goes round the rings, formats what it finds and writes it
+out in batches with writev(). If it falls behind (a slow disk, a
+terminal or pipe nobody's reading) and a ring fills up, new records
+are dropped and counted rather than holding up the event loop.
+
+A process has one access log: a thread's ring belongs to the first log
+it adds to.
+
+Lines are in Common Log Format, plus the latency in us:
+
+    127.0.0.1 - - [19/Oct/2026:14:02:11 +0000] "GET /index.html" 200 1234 87
+
+The method and path are escaped (see accesslog_escape()), so whatever
+a client puts in them stays inside the quotes.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <sys/uio.h>
+#include "accesslog.h"
+
+// This thread's ring, once it's logged something
+__thread struct accesslog_ring *accesslog_ring;
+
+/**
+ * Give the calling thread a ring
+ *
+ * Returns NULL if out of memory.
+ */
+struct accesslog_ring *accesslog_ring_create(struct accesslog *log)
+{
+    struct accesslog_ring *ring = aligned_alloc(64, sizeof *ring);
+
+    if (ring == NULL) {
+        return NULL;
+    }
+
+    ring->head = 0;
+    ring->tail = 0;
+    ring->dropped = 0;
+
+    pthread_mutex_lock(&log->lock);
+    ring->next = log->rings;
+    __atomic_store_n(&log->rings, ring, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&log->lock);
+
+    accesslog_ring = ring;
+
+    return ring;
+}
+
+/**
+ * Log a request
+ *
+ * Never blocks: if the writer has fallen behind, the record is dropped.
+ */
+void accesslog_add(struct accesslog *log, struct accesslog_record *rec)
+{
+    struct accesslog_ring *ring = accesslog_ring;
+
+    if (ring == NULL && (ring = accesslog_ring_create(log)) == NULL) {
+        __atomic_fetch_add(&log->no_ring, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    unsigned long head = ring->head;
+
+    if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == ACCESSLOG_RING_SIZE) {
+        __atomic_store_n(&ring->dropped, ring->dropped + 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    ring->records[head & (ACCESSLOG_RING_SIZE - 1)] = *rec;
+
+    // The writer can have it now
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Return how many records have been dropped
+ */
+long accesslog_dropped(struct accesslog *log)
+{
+    long dropped = __atomic_load_n(&log->no_ring, __ATOMIC_RELAXED);
+
+    for (struct accesslog_ring *ring = __atomic_load_n(&log->rings, __ATOMIC_ACQUIRE);
+        ring != NULL; ring = ring->next) {
+
+        dropped += __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+    }
+
+    return dropped;
+}
+
+/**
+ * Copy a request field for a quoted log field, escaping it
+ *
+ * Quotes, backslashes and bytes that aren't printable ASCII come out as
+ * \", \\ and \xHH, as other combined-log writers do, so a request can't
+ * end the field or the line early and forge its own. dst has to have
+ * room for 4 bytes for every byte of src, plus the NUL.
+ */
+void accesslog_escape(char *dst, char *src)
+{
+    for (unsigned char *p = (unsigned char *)src; *p != '\0'; p++) {
+        if (*p == '"' || *p == '\\') {
+            *dst++ = '\\';
+            *dst++ = *p;
+        } else if (*p < 0x20 || *p >= 0x7f) {
+            dst += sprintf(dst, "\\x%02x", *p);
+        } else {
+            *dst++ = *p;
+        }
+    }
+
+    *dst = '\0';
+}
+
+/**
+ * Format a record as a log line
+ *
+ * when is the record's time, already formatted.
+ *
+ * Returns the length of the line.
+ */
+int accesslog_format(char *buf, int size, struct accesslog_record *rec, char *when)
+{
+    char addr[INET6_ADDRSTRLEN];
+    char method[sizeof rec->method * 4], path[sizeof rec->path * 4];
+
+    if (inet_ntop(rec->family, rec->addr, addr, sizeof addr) == NULL) {
+        strcpy(addr, "-");
+    }
+
+    accesslog_escape(method, rec->method);
+    accesslog_escape(path, rec->path);
+
+    int len = snprintf(buf, size, "%s - - [%s] \"%s %s\" %d %lld %ld\n",
+        addr, when, method, path, rec->status, rec->bytes, rec->latency);
+
+    // Truncated: still end the line
+    if (len >= size) {
+        len = size - 1;
+        buf[len - 1] = '\n';
+    }
+
+    return len;
+}
+
+/**
+ * Write a batch of lines, however many goes it takes
+ */
+void accesslog_write(struct accesslog *log, struct iovec *iov, int n)
+{
+    __atomic_fetch_add(&log->written, n, __ATOMIC_RELAXED);
+
+    while (n > 0) {
+        ssize_t rv = writev(log->fd, iov, n);
+
+        if (rv < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            __atomic_fetch_add(&log->write_errors, n, __ATOMIC_RELAXED);
+            return;
+        }
+
+        while (n > 0 && (size_t)rv >= iov->iov_len) {
+            rv -= iov->iov_len;
+            iov++;
+            n--;
+        }
+
+        if (n > 0) {
+            iov->iov_base = (char *)iov->iov_base + rv;
+            iov->iov_len -= rv;
+        }
+    }
+}
+
+/**
+ * The writer thread: drain the rings until the log is closed
+ */
+void *accesslog_run(void *arg)
+{
+    struct accesslog *log = arg;
+    static char lines[ACCESSLOG_BATCH][ACCESSLOG_LINE_SIZE];
+    struct iovec iov[ACCESSLOG_BATCH];
+    struct timespec interval = {0, ACCESSLOG_INTERVAL * 1000000L};
+
+    // Requests mostly finish in the same second as the one before, so
+    // the timestamp is only formatted when the second changes
+    char when[64] = "";
+    time_t when_sec = -1;
+
+    while (1) {
+        int n = 0, taken = 0;
+
+        // Read first: once it's set, this pass sees everything there'll be
+        int stop = __atomic_load_n(&log->stop, __ATOMIC_ACQUIRE);
+
+        for (struct accesslog_ring *ring = __atomic_load_n(&log->rings, __ATOMIC_ACQUIRE);
+            ring != NULL; ring = ring->next) {
+
+            unsigned long tail = ring->tail;
+            unsigned long head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+
+            for (; tail != head; tail++) {
+                struct accesslog_record *rec = &ring->records[tail & (ACCESSLOG_RING_SIZE - 1)];
+
+                if (rec->time != when_sec) {
+                    struct tm tm;
+
+                    gmtime_r(&rec->time, &tm);
+                    strftime(when, sizeof when, "%d/%b/%Y:%H:%M:%S +0000", &tm);
+                    when_sec = rec->time;
+                }
+
+                iov[n].iov_base = lines[n];
+                iov[n].iov_len = accesslog_format(lines[n], sizeof lines[n], rec, when);
+                n++;
+                taken++;
+
+                if (n == ACCESSLOG_BATCH) {
+                    // Copied out, so the slots can be reused while we write
+                    __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+                    accesslog_write(log, iov, n);
+                    n = 0;
+                }
+            }
+
+            __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+        }
+
+        if (n > 0) {
+            accesslog_write(log, iov, n);
+        }
+
+        if (taken == 0) {
+            if (stop) {
+                break;
+            }
+
+            nanosleep(&interval, NULL);
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Write out what's left and stop the writer
+ *
+ * Nothing may be added once this is called.
+ */
+void accesslog_close(struct accesslog *log)
+{
+    __atomic_store_n(&log->stop, 1, __ATOMIC_RELEASE);
+    pthread_join(log->thread, NULL);
+
+    if (log->fd != STDOUT_FILENO) {
+        close(log->fd);
+    }
+}
+
+/**
+ * Open (or create) an access log and start its writer
+ *
+ * path "-" logs to stdout.
+ *
+ * Returns NULL on error.
+ */
+struct accesslog *accesslog_open(char *path)
+{
+    struct accesslog *log = calloc(1, sizeof *log);
+
+    if (log == NULL) {
+        return NULL;
+    }
+
+    if (strcmp(path, "-") == 0) {
+        log->fd = STDOUT_FILENO;
+    } else {
+        log->fd = open(path, O_WRONLY|O_CREAT|O_APPEND|O_CLOEXEC, 0644);
+
+        if (log->fd < 0) {
+            perror(path);
+            free(log);
+            return NULL;
+        }
+    }
+
+    pthread_mutex_init(&log->lock, NULL);
+
+    if (pthread_create(&log->thread, NULL, accesslog_run, log) != 0) {
+        fprintf(stderr, "accesslog: can't start writer\n");
+
+        if (log->fd != STDOUT_FILENO) {
+            close(log->fd);
+        }
+
+        free(log);
+        return NULL;
+    }
+
+    return log;
+}
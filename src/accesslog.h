@@ -0,0 +1,57 @@
+#ifndef _ACCESSLOG_H_
+#define _ACCESSLOG_H_
+
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+#define ACCESSLOG_RING_SIZE 4096 // Records per thread's ring; a power of 2
+#define ACCESSLOG_PATH_SIZE 192  // Longer paths are truncated
+#define ACCESSLOG_BATCH 256      // Most lines written with one writev()
+#define ACCESSLOG_INTERVAL 20    // ms the writer sleeps when there's nothing to do
+#define ACCESSLOG_LINE_SIZE 1024 // Room for a formatted line, escapes and all
+
+// One finished (or abandoned) request
+struct accesslog_record {
+    time_t time;       // When it finished
+    long long bytes;   // Response bytes sent
+    long latency;      // us from the end of the request header
+    int status;        // 0 if there was no response
+    int family;        // AF_INET or AF_INET6; anything else logs as -
+    unsigned char addr[16]; // Client address, formatted by the writer
+    char method[8];
+    char path[ACCESSLOG_PATH_SIZE];
+};
+
+// A thread's records: it adds at head, the writer takes from tail
+struct accesslog_ring {
+    struct accesslog_ring *next; // All the log's rings
+
+    unsigned long head __attribute__((aligned(64)));
+    long dropped; // Records that didn't fit
+    unsigned long tail __attribute__((aligned(64)));
+
+    struct accesslog_record records[ACCESSLOG_RING_SIZE];
+};
+
+// An access log, written by a thread of its own
+struct accesslog {
+    int fd;
+    pthread_t thread;
+    pthread_mutex_t lock; // Held only to add a ring
+
+    struct accesslog_ring *rings;
+
+    long written;      // Records written out
+    long write_errors; // Records lost to failed writes
+    long no_ring;      // Records dropped because a thread couldn't get a ring
+
+    int stop; // Set by accesslog_close(): the writer finishes up and exits
+};
+
+extern struct accesslog *accesslog_open(char *path);
+extern void accesslog_add(struct accesslog *log, struct accesslog_record *rec);
+extern long accesslog_dropped(struct accesslog *log);
+extern void accesslog_close(struct accesslog *log);
+
+#endif
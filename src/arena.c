@@ -0,0 +1,114 @@
+/*
+
+Bump arenas, for temporaries that all die together.
+
+Each connection has one; whatever a request needs while it's being
+handled (its path, parsed values, the state of offloaded work) comes
+out of it, and the lot goes back in one go once the response is on its
+way. Allocating is just moving a pointer.
+
+Chunks come from the buffer pool, so an arena that's reset holds no
+memory at all, and setting it up again for the next request doesn't
+touch malloc().
+
+*/
+
+#include <string.h>
+#include "bufpool.h"
+#include "arena.h"
+
+#define ARENA_ALIGN 16
+
+struct arena_chunk {
+    struct arena_chunk *next;
+    char data[] __attribute__((aligned(ARENA_ALIGN)));
+};
+
+struct arena_stats arena_stats;
+
+#define COUNT(field) __atomic_add_fetch(&arena_stats.field, 1, __ATOMIC_RELAXED)
+
+/**
+ * Set up an empty arena
+ */
+void arena_init(struct arena *a)
+{
+    a->chunks = NULL;
+    a->ptr = a->end = NULL;
+}
+
+/**
+ * Allocate size bytes from an arena
+ *
+ * The memory lasts until the arena is reset. Returns NULL if out of
+ * memory.
+ */
+void *arena_alloc(struct arena *a, size_t size)
+{
+    size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+
+    COUNT(allocs);
+
+    if (a->ptr == NULL || (size_t)(a->end - a->ptr) < size) {
+        // Anything too big for a chunk gets one of its own
+        size_t room = size > ARENA_CHUNK_SIZE - sizeof(struct arena_chunk)?
+            size + sizeof(struct arena_chunk): ARENA_CHUNK_SIZE;
+        struct arena_chunk *chunk = bufpool_alloc(room);
+
+        if (chunk == NULL) {
+            return NULL;
+        }
+
+        COUNT(chunks);
+
+        chunk->next = a->chunks;
+        a->chunks = chunk;
+        a->ptr = chunk->data;
+        a->end = (char *)chunk + bufpool_size(chunk);
+    }
+
+    void *p = a->ptr;
+
+    a->ptr += size;
+
+    return p;
+}
+
+/**
+ * Allocate size zeroed bytes from an arena
+ */
+void *arena_calloc(struct arena *a, size_t size)
+{
+    void *p = arena_alloc(a, size);
+
+    if (p != NULL) {
+        memset(p, 0, size);
+    }
+
+    return p;
+}
+
+/**
+ * Free everything allocated from an arena
+ *
+ * The arena can be used again straight away.
+ */
+void arena_reset(struct arena *a)
+{
+    struct arena_chunk *chunk = a->chunks;
+
+    if (chunk == NULL) {
+        return;
+    }
+
+    COUNT(resets);
+
+    while (chunk != NULL) {
+        struct arena_chunk *next = chunk->next;
+
+        bufpool_free(chunk);
+        chunk = next;
+    }
+
+    arena_init(a);
+}
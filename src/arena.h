@@ -0,0 +1,30 @@
+#ifndef _ARENA_H_
+#define _ARENA_H_
+
+#include <stddef.h>
+
+#define ARENA_CHUNK_SIZE 16384 // Chunks are taken from the buffer pool this big
+
+struct arena_chunk;
+
+// A bump allocator: everything in it is freed at once
+struct arena {
+    struct arena_chunk *chunks; // Newest first
+    char *ptr, *end;            // Free space in the newest chunk
+};
+
+// Allocation counters, across all arenas
+struct arena_stats {
+    long allocs; // arena_alloc() calls
+    long chunks; // Chunks taken to satisfy them
+    long resets; // arena_reset() calls
+};
+
+extern struct arena_stats arena_stats;
+
+extern void arena_init(struct arena *a);
+extern void *arena_alloc(struct arena *a, size_t size);
+extern void *arena_calloc(struct arena *a, size_t size);
+extern void arena_reset(struct arena *a);
+
+#endif
@@ -0,0 +1,75 @@
+#!/bin/sh
+#
+# Run the standard load scenarios against a fresh server
+#
+# Run from src/ (`make bench` does that, after building server and
+# bench/loadgen). Each scenario prints req/s and p50/p99/p999 latency.
+#
+#    sh bench/bench.sh [server options...]
+#
+# Tunable from the environment:
+#
+#    BENCH_SECS     seconds per scenario (default 5)
+#    BENCH_CONNS    connections (default 64)
+#    BENCH_THREADS  load generator threads (default 2)
+#    BENCH_RATE     requests/s for the open-loop scenario (default 10000)
+#
+
+SECS=${BENCH_SECS:-5}
+CONNS=${BENCH_CONNS:-64}
+THREADS=${BENCH_THREADS:-2}
+RATE=${BENCH_RATE:-10000}
+
+# More files than the cache holds, requested round-robin, so every
+# request is an LRU miss
+THRASH_DIR=serverroot/bench-thrash
+THRASH_FILES=64
+
+# A file too big to cache whole, so it's cached in segments
+BIG_FILE=big.bin
+BIG_BYTES=3000000
+
+mkdir -p $THRASH_DIR
+
+i=0
+while [ $i -lt $THRASH_FILES ]; do
+    head -c 4096 /dev/urandom | od -An -tx1 > $THRASH_DIR/f$i.txt
+    i=$((i + 1))
+done
+
+head -c $BIG_BYTES /dev/urandom > $THRASH_DIR/$BIG_FILE
+
+./server -l "" "$@" > /dev/null 2>&1 &
+pid=$!
+
+cleanup() {
+    kill $pid 2> /dev/null
+    wait $pid 2> /dev/null
+    rm -rf $THRASH_DIR
+}
+
+trap cleanup EXIT INT TERM
+
+sleep 0.5
+
+if ! kill -0 $pid 2> /dev/null; then
+    echo "bench: server didn't start (is one running already?)" >&2
+    exit 1
+fi
+
+run() {
+    name=$1
+    shift
+
+    echo "== $name"
+    ./bench/loadgen -t $THREADS -c $CONNS -d $SECS "$@"
+    echo
+}
+
+run "tiny file: /index.html" /index.html
+run "large file: /cat.jpg" /cat.jpg
+run "segmented file: $BIG_BYTES bytes" /bench-thrash/$BIG_FILE
+run "endpoint: /d20" /d20
+run "404 storm: 10000 different missing paths" -k 10000 /missing/%d
+run "cache thrash: $THRASH_FILES files, LRU miss every time" -k $THRASH_FILES /bench-thrash/f%d.txt
+run "open loop: /index.html at $RATE req/s" -r $RATE /index.html
@@ -0,0 +1,304 @@
+/**
+ * burst.c -- A connection-burst benchmark
+ *
+ * Opens connections in bursts: n of them at once, as fast as connect()
+ * goes, each sending one request with Connection: close and reading
+ * the response to the end. The next burst starts once the last one is
+ * done. It prints how long the bursts took, and percentiles of each
+ * connection's time from connect() to the end of its response.
+ *
+ * This is what the listener's setup is for (see get_listener_socket()
+ * in net.c). A connection that finds the listen queue full has its SYN
+ * dropped, and the client only tries again after a second (then 3, 7,
+ * ...), so a short queue shows up as connections taking over a second,
+ * counted as "SYN retried". Refused and reset connections count as
+ * failed.
+ *
+ *    ./bench/burst -n 1000 -b 5 /index.html
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+
+#define MAX_EVENTS 256
+#define SLOW_NS 1000000000LL // Slower than this, a SYN was retried
+
+// A connection in a burst
+struct client {
+    int fd;
+    int connected;
+    int status_len;    // Bytes of the status line kept in status
+    char status[16];   // Start of the response, "HTTP/1.1 200"
+    long long start;   // When connect() was called, in ns
+};
+
+struct addrinfo *server_addr;
+char request[1024];
+int request_len;
+
+/**
+ * Return monotonic time in ns
+ */
+long long now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/**
+ * Start connecting
+ *
+ * Returns 0, or -1 if the connection failed outright.
+ */
+int client_connect(int epfd, struct client *cl)
+{
+    struct epoll_event ev;
+
+    memset(cl, 0, sizeof *cl);
+    cl->start = now_ns();
+    cl->fd = socket(server_addr->ai_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+
+    if (cl->fd < 0) {
+        perror("socket");
+        return -1;
+    }
+
+    if (connect(cl->fd, server_addr->ai_addr, server_addr->ai_addrlen) < 0 && errno != EINPROGRESS) {
+        close(cl->fd);
+        return -1;
+    }
+
+    ev.events = EPOLLOUT;
+    ev.data.ptr = cl;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, cl->fd, &ev);
+
+    return 0;
+}
+
+/**
+ * Move a connection along
+ *
+ * Returns 1 once it's done, 0 if there's more to come, or -1 on error.
+ */
+int client_event(int epfd, struct client *cl)
+{
+    char buf[65536];
+
+    if (!cl->connected) {
+        struct epoll_event ev;
+        int err = 0;
+        socklen_t len = sizeof err;
+
+        getsockopt(cl->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+
+        if (err != 0 || send(cl->fd, request, request_len, MSG_NOSIGNAL) != request_len) {
+            return -1;
+        }
+
+        cl->connected = 1;
+        ev.events = EPOLLIN;
+        ev.data.ptr = cl;
+        epoll_ctl(epfd, EPOLL_CTL_MOD, cl->fd, &ev);
+
+        return 0;
+    }
+
+    while (1) {
+        ssize_t rv = recv(cl->fd, buf, sizeof buf, 0);
+
+        if (rv < 0) {
+            return errno == EAGAIN || errno == EWOULDBLOCK? 0: -1;
+        }
+
+        if (rv == 0) {
+            return 1;
+        }
+
+        if (cl->status_len < (int)sizeof cl->status - 1) {
+            int n = sizeof cl->status - 1 - cl->status_len;
+
+            n = rv < n? rv: n;
+            memcpy(cl->status + cl->status_len, buf, n);
+            cl->status_len += n;
+        }
+    }
+}
+
+/**
+ * Print a latency in sensible units
+ */
+void print_latency(char *label, long long ns)
+{
+    if (ns < 1000000) {
+        printf("  %-5s %8.1f us\n", label, ns / 1000.0);
+    } else {
+        printf("  %-5s %8.2f ms\n", label, ns / 1000000.0);
+    }
+}
+
+int compare_ll(const void *a, const void *b)
+{
+    long long x = *(long long *)a, y = *(long long *)b;
+
+    return x < y? -1: x > y;
+}
+
+/**
+ * Print usage and exit
+ */
+void usage(char *progname)
+{
+    fprintf(stderr,
+        "usage: %s [-h host] [-p port] [-n connections] [-b bursts]\n"
+        "          [-w seconds] path\n"
+        "\n"
+        "  -n connections  connections opened at once (default 1000)\n"
+        "  -b bursts       how many bursts (default 5)\n"
+        "  -w seconds      longest a burst may take; connections still\n"
+        "                  going then count as failed (default 10)\n",
+        progname);
+
+    exit(2);
+}
+
+int main(int argc, char **argv)
+{
+    char *host = "localhost", *port = "3490";
+    int nclients = 1000, nbursts = 5, wait_secs = 10;
+    struct addrinfo hints;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "h:p:n:b:w:")) != -1) {
+        switch (opt) {
+            case 'h': host = optarg; break;
+            case 'p': port = optarg; break;
+            case 'n': nclients = atoi(optarg); break;
+            case 'b': nbursts = atoi(optarg); break;
+            case 'w': wait_secs = atoi(optarg); break;
+            default: usage(argv[0]);
+        }
+    }
+
+    if (optind != argc - 1 || nclients <= 0 || nbursts <= 0 || wait_secs <= 0) {
+        usage(argv[0]);
+    }
+
+    request_len = snprintf(request, sizeof request,
+        "GET %s HTTP/1.1\r\n"
+        "Host: %s\r\n"
+        "Connection: close\r\n"
+        "\r\n",
+        argv[optind], host);
+
+    memset(&hints, 0, sizeof hints);
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    if (getaddrinfo(host, port, &hints, &server_addr) != 0) {
+        fprintf(stderr, "burst: can't resolve %s\n", host);
+        exit(1);
+    }
+
+    struct client *clients = calloc(nclients, sizeof *clients);
+    long long *latencies = calloc((long)nclients * nbursts, sizeof *latencies);
+    int epfd = epoll_create1(0);
+
+    if (clients == NULL || latencies == NULL || epfd < 0) {
+        fprintf(stderr, "burst: out of memory\n");
+        exit(3);
+    }
+
+    long nlatencies = 0, failed = 0, slow = 0, not_ok = 0;
+    long long burst_total = 0, burst_max = 0;
+
+    for (int b = 0; b < nbursts; b++) {
+        struct epoll_event events[MAX_EVENTS];
+        long long start = now_ns(), deadline = start + wait_secs * 1000000000LL;
+        int left = 0;
+
+        for (int i = 0; i < nclients; i++) {
+            if (client_connect(epfd, &clients[i]) < 0) {
+                clients[i].fd = -1;
+                failed++;
+            } else {
+                left++;
+            }
+        }
+
+        while (left > 0) {
+            long long now = now_ns();
+
+            if (now >= deadline) {
+                break;
+            }
+
+            int n = epoll_wait(epfd, events, MAX_EVENTS, (deadline - now) / 1000000 + 1);
+
+            for (int i = 0; i < n; i++) {
+                struct client *cl = events[i].data.ptr;
+                int rv = client_event(epfd, cl);
+
+                if (rv == 0) {
+                    continue;
+                }
+
+                if (rv == 1) {
+                    long long ns = now_ns() - cl->start;
+
+                    latencies[nlatencies++] = ns;
+                    slow += ns >= SLOW_NS;
+                    not_ok += strncmp(cl->status + 8, " 2", 2) != 0;
+                } else {
+                    failed++;
+                }
+
+                close(cl->fd);
+                cl->fd = -1;
+                left--;
+            }
+        }
+
+        // Whatever's still going has had its chance
+        for (int i = 0; i < nclients; i++) {
+            if (clients[i].fd >= 0) {
+                close(clients[i].fd);
+                failed++;
+            }
+        }
+
+        long long took = now_ns() - start;
+
+        burst_total += took;
+        burst_max = took > burst_max? took: burst_max;
+
+        // Let TIME_WAIT and the server's queues settle a little
+        usleep(100000);
+    }
+
+    printf("%d bursts of %d connections: %ld completed, %ld failed\n",
+        nbursts, nclients, nlatencies, failed);
+    printf("  %ld SYN retried (over 1s), %ld not 2xx\n", slow, not_ok);
+    print_latency("burst", burst_total / nbursts);
+    print_latency("worst", burst_max);
+
+    if (nlatencies > 0) {
+        qsort(latencies, nlatencies, sizeof *latencies, compare_ll);
+
+        print_latency("p50", latencies[nlatencies / 2]);
+        print_latency("p99", latencies[nlatencies * 99 / 100]);
+        print_latency("max", latencies[nlatencies - 1]);
+    }
+
+    return failed > 0;
+}
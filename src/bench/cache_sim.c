@@ -0,0 +1,451 @@
+/**
+ * cache_sim.c -- Replay an access log through the cache, offline
+ *
+ * Reads a trace of requests and replays it through cache_get() and
+ * cache_put() from cache.c, once for each cache size in a sweep, to see
+ * how big the cache needs to be before deploying it. For each size it
+ * prints the hit ratio, the byte hit ratio (how much of what was sent
+ * came from the cache) and the churn (entries evicted per request), one
+ * line per point, so each policy is a curve to plot.
+ *
+ * The cache is LRU. The policies swept are how it's bounded (by
+ * entries, like the server's -e, or by bytes, like its -b) and which
+ * objects are admitted at all: the server sends files over
+ * MAX_CACHE_FILE_SIZE (1M) straight from disk, and -a tries other
+ * cut-offs. Entries are sized without any content stored, so replaying
+ * is quick: the sizes run on threads of their own, each at over a
+ * million requests/s.
+ *
+ * The trace is the server's access log (or any Common Log Format log):
+ * GET and HEAD requests answered 200, 206 or 304 are replayed, and an
+ * object's size is the most bytes any response for it sent. (The log
+ * can't tell files from generated responses like /d20, so those count
+ * as cacheable too.) A file of "path size" lines works too. "-" reads
+ * stdin.
+ *
+ *    ./bench/cache_sim serverfiles/access.log
+ *    ./bench/cache_sim -e 100,1000 -b 64m,1g -a 1m,0 access.log > curves.tsv
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <time.h>
+#include <pthread.h>
+#include "../cache.h"
+#include "../hashtable.h"
+
+#define MAX_SWEEP 64 // Most values per list
+
+// Something requested
+struct object {
+    char *path;
+    int size;
+};
+
+// A cache to replay the trace through, and how it did
+struct sim {
+    char *policy;
+    int max_entries; // INT_MAX for no limit
+    long max_bytes;  // 0 for no limit
+    long admit;      // Largest object cached, 0 for any size
+
+    long requests, hits;
+    long long bytes, hit_bytes;
+    long evictions;
+    long long evicted_bytes;
+    double secs;
+};
+
+struct object *objects;
+int nobjects, objects_size;
+
+int *trace; // Object numbers, in request order
+long ntrace, trace_size;
+
+struct sim *sims;
+int nsims;
+int next_sim; // Next one for a thread to take
+
+/**
+ * Return monotonic time in seconds
+ */
+double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * FNV-1a, for the path index
+ */
+int path_hashf(void *data, int data_size, int bucket_count)
+{
+    unsigned char *p = data;
+    unsigned int h = 2166136261u;
+
+    for (int i = 0; i < data_size; i++) {
+        h = (h ^ p[i]) * 16777619u;
+    }
+
+    return h % bucket_count;
+}
+
+/**
+ * Parse a size like 4096, 64k, 16m or 1g
+ */
+long parse_size(char *s)
+{
+    char *end;
+    long n = strtol(s, &end, 10);
+
+    switch (*end) {
+        case 'k': case 'K': return n << 10;
+        case 'm': case 'M': return n << 20;
+        case 'g': case 'G': return n << 30;
+    }
+
+    return n;
+}
+
+/**
+ * Parse a comma-separated list of sizes
+ *
+ * Returns how many there were.
+ */
+int parse_list(char *s, long *list)
+{
+    int n = 0;
+
+    for (char *p = strtok(s, ","); p != NULL && n < MAX_SWEEP; p = strtok(NULL, ",")) {
+        list[n++] = parse_size(p);
+    }
+
+    return n;
+}
+
+/**
+ * Format a size the way parse_size() takes it
+ */
+char *format_size(char *buf, int size, long n)
+{
+    if (n > 0 && n % (1 << 30) == 0) {
+        snprintf(buf, size, "%ldg", n >> 30);
+    } else if (n > 0 && n % (1 << 20) == 0) {
+        snprintf(buf, size, "%ldm", n >> 20);
+    } else if (n > 0 && n % (1 << 10) == 0) {
+        snprintf(buf, size, "%ldk", n >> 10);
+    } else {
+        snprintf(buf, size, "%ld", n);
+    }
+
+    return buf;
+}
+
+/**
+ * Add a request for path to the trace
+ */
+void trace_add(struct hashtable *index, char *path, long size)
+{
+    long id = (long)hashtable_get(index, path) - 1;
+
+    if (id < 0) {
+        if (nobjects == objects_size) {
+            objects_size = objects_size? objects_size * 2: 4096;
+            objects = realloc(objects, objects_size * sizeof *objects);
+        }
+
+        id = nobjects++;
+        objects[id].path = strdup(path);
+        objects[id].size = 0;
+
+        // Stored off by one, so that 0 can mean not there
+        hashtable_put(index, objects[id].path, (void *)(id + 1));
+    }
+
+    if (size > objects[id].size) {
+        objects[id].size = size > INT_MAX? INT_MAX: size;
+    }
+
+    if (ntrace == trace_size) {
+        trace_size = trace_size? trace_size * 2: 1 << 20;
+        trace = realloc(trace, trace_size * sizeof *trace);
+    }
+
+    trace[ntrace++] = id;
+}
+
+/**
+ * Pick the path and size out of a log line
+ *
+ * Returns 0 if it's a request to replay, -1 if not.
+ */
+int parse_line(char *line, char **path, long *size)
+{
+    // path size
+    if (line[0] == '/') {
+        char *sp = strchr(line, ' ');
+
+        if (sp == NULL) {
+            return -1;
+        }
+
+        *sp = '\0';
+        *path = line;
+        *size = strtol(sp + 1, NULL, 10);
+
+        return 0;
+    }
+
+    // host ident user [date] "METHOD path[ protocol]" status bytes ...
+    char *method = strchr(line, '"');
+
+    if (method == NULL) {
+        return -1;
+    }
+
+    method++;
+
+    if (strncmp(method, "GET ", 4) != 0 && strncmp(method, "HEAD ", 5) != 0) {
+        return -1;
+    }
+
+    char *p = strchr(method, ' ') + 1;
+    char *end = p + strcspn(p, " \"");
+    char *quote = strchr(end, '"');
+
+    if (quote == NULL) {
+        return -1;
+    }
+
+    char *rest;
+    long status = strtol(quote + 1, &rest, 10);
+
+    if (status != 200 && status != 206 && status != 304) {
+        return -1;
+    }
+
+    *end = '\0';
+    *path = p;
+    *size = strtol(rest, NULL, 10);
+
+    return 0;
+}
+
+/**
+ * Read the whole trace into memory
+ */
+int trace_load(char *filename)
+{
+    FILE *fp = strcmp(filename, "-") == 0? stdin: fopen(filename, "r");
+
+    if (fp == NULL) {
+        perror(filename);
+        return -1;
+    }
+
+    struct hashtable *index = hashtable_create(1 << 16, path_hashf);
+    char *line = NULL;
+    size_t line_size = 0;
+    long skipped = 0;
+
+    while (getline(&line, &line_size, fp) != -1) {
+        char *path;
+        long size;
+
+        line[strcspn(line, "\n")] = '\0';
+
+        if (parse_line(line, &path, &size) < 0) {
+            skipped++;
+            continue;
+        }
+
+        trace_add(index, path, size);
+    }
+
+    free(line);
+    hashtable_destroy(index);
+
+    if (fp != stdin) {
+        fclose(fp);
+    }
+
+    fprintf(stderr, "%ld requests for %d objects (%ld lines skipped)\n", ntrace, nobjects, skipped);
+
+    return 0;
+}
+
+/**
+ * Replay the trace through one cache
+ */
+void sim_run(struct sim *s)
+{
+    // The index only needs to be big enough to be quick
+    int hashsize = s->max_entries < nobjects? s->max_entries: nobjects;
+    struct cache *cache = cache_create(s->max_entries, hashsize > 0? hashsize: 1);
+    double start = now();
+
+    cache_set_max_bytes(cache, s->max_bytes);
+
+    for (long i = 0; i < ntrace; i++) {
+        struct object *o = &objects[trace[i]];
+
+        s->bytes += o->size;
+
+        // Too big to be cached at all: the server sends it from disk
+        if (s->admit > 0 && o->size > s->admit) {
+            continue;
+        }
+
+        if (cache_get(cache, o->path) != NULL) {
+            s->hits++;
+            s->hit_bytes += o->size;
+        } else {
+            cache_put(cache, o->path, "", NULL, o->size);
+        }
+    }
+
+    s->secs = now() - start;
+    s->requests = ntrace;
+    s->evictions = cache->evictions;
+    s->evicted_bytes = cache->evicted_bytes;
+
+    cache_free(cache);
+}
+
+/**
+ * A replay thread: take caches off the list until there are none left
+ */
+void *sim_thread(void *arg)
+{
+    (void)arg;
+
+    int i;
+
+    while ((i = __atomic_fetch_add(&next_sim, 1, __ATOMIC_RELAXED)) < nsims) {
+        sim_run(&sims[i]);
+    }
+
+    return NULL;
+}
+
+/**
+ * Add a cache to the sweep
+ */
+void sim_add(char *policy, int max_entries, long max_bytes, long admit)
+{
+    sims = realloc(sims, (nsims + 1) * sizeof *sims);
+    memset(&sims[nsims], 0, sizeof *sims);
+
+    sims[nsims].policy = policy;
+    sims[nsims].max_entries = max_entries;
+    sims[nsims].max_bytes = max_bytes;
+    sims[nsims].admit = admit;
+    nsims++;
+}
+
+int main(int argc, char **argv)
+{
+    char entries_arg[] = "10,100,1000,10000,100000";
+    char bytes_arg[] = "1m,16m,64m,256m,1g";
+    char admit_arg[] = "1m";
+    char *entries_list = entries_arg, *bytes_list = bytes_arg, *admit_list = admit_arg;
+    int nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    int opt;
+
+    while ((opt = getopt(argc, argv, "e:b:a:j:")) != -1) {
+        switch (opt) {
+            case 'e': entries_list = optarg; break;
+            case 'b': bytes_list = optarg; break;
+            case 'a': admit_list = optarg; break;
+            case 'j': nthreads = atoi(optarg); break;
+            default:
+                goto usage;
+        }
+    }
+
+    if (optind != argc - 1) {
+usage:
+        fprintf(stderr, "usage: %s [-e entries,...] [-b bytes,...] [-a largest admitted,...|0] [-j threads] trace|-\n", argv[0]);
+        exit(1);
+    }
+
+    long entries[MAX_SWEEP], bytes[MAX_SWEEP], admits[MAX_SWEEP];
+    int nentries = *entries_list? parse_list(entries_list, entries): 0;
+    int nbytes = *bytes_list? parse_list(bytes_list, bytes): 0;
+    int nadmits = parse_list(admit_list, admits);
+
+    if (nadmits == 0) {
+        admits[nadmits++] = 0;
+    }
+
+    double start = now();
+
+    if (trace_load(argv[optind]) < 0) {
+        exit(1);
+    }
+
+    fprintf(stderr, "loaded in %.2fs\n", now() - start);
+
+    if (ntrace == 0) {
+        exit(1);
+    }
+
+    for (int a = 0; a < nadmits; a++) {
+        for (int i = 0; i < nentries; i++) {
+            sim_add("lru-entries", entries[i], 0, admits[a]);
+        }
+
+        for (int i = 0; i < nbytes; i++) {
+            sim_add("lru-bytes", INT_MAX, bytes[i], admits[a]);
+        }
+    }
+
+    if (nthreads < 1) {
+        nthreads = 1;
+    }
+
+    pthread_t *threads = malloc(nthreads * sizeof *threads);
+
+    start = now();
+
+    for (int i = 0; i < nthreads; i++) {
+        pthread_create(&threads[i], NULL, sim_thread, NULL);
+    }
+
+    for (int i = 0; i < nthreads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    double secs = now() - start;
+
+    free(threads);
+
+    fprintf(stderr, "%d caches replayed in %.2fs on %d threads: %.1fM requests/s\n",
+        nsims, secs, nthreads, (double)ntrace * nsims / secs / 1e6);
+
+    printf("policy\tadmit\tmax_entries\tmax_bytes\trequests\thit_ratio\tbyte_hit_ratio\tevictions\tevicted_bytes\tchurn\n");
+
+    for (int i = 0; i < nsims; i++) {
+        struct sim *s = &sims[i];
+        char admit[32], max_entries[32], max_bytes[32];
+
+        printf("%s\t%s\t%s\t%s\t%ld\t%.4f\t%.4f\t%ld\t%lld\t%.4f\n",
+            s->policy,
+            s->admit > 0? format_size(admit, sizeof admit, s->admit): "-",
+            s->max_entries < INT_MAX? format_size(max_entries, sizeof max_entries, s->max_entries): "-",
+            s->max_bytes > 0? format_size(max_bytes, sizeof max_bytes, s->max_bytes): "-",
+            s->requests,
+            (double)s->hits / s->requests,
+            s->bytes > 0? (double)s->hit_bytes / s->bytes: 0,
+            s->evictions, s->evicted_bytes,
+            (double)s->evictions / s->requests);
+    }
+
+    return 0;
+}
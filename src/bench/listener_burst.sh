@@ -0,0 +1,29 @@
+#!/bin/sh
+#
+# Compare listener setups under connection bursts
+#
+# Run from src/ after `make server bench/burst`:
+#
+#    sh bench/listener_burst.sh [connections] [bursts]
+#
+
+CONNS=${1:-1000}
+BURSTS=${2:-5}
+
+run() {
+    ./server -l "" $1 > /dev/null 2>&1 &
+    pid=$!
+    sleep 0.5
+
+    echo "== $2: bursts of $CONNS connections to /index.html"
+    ./bench/burst -n $CONNS -b $BURSTS /index.html
+    echo
+
+    kill $pid
+    wait $pid 2> /dev/null || true
+}
+
+run "-q 10" "old listener (backlog 10)"
+run "" "default listener (backlog 4096)"
+run "-D 1" "default listener, TCP_DEFER_ACCEPT"
+run "-u" "default listener, io_uring"
@@ -0,0 +1,597 @@
+/**
+ * loadgen.c -- A keep-alive HTTP load generator
+ *
+ * Holds a number of connections open to the server, spread over some
+ * threads, each with its own epoll loop. At the end it prints
+ * throughput and latency percentiles.
+ *
+ * Closed loop (the default): on each connection, a request goes out as
+ * soon as the previous response is in. This finds the most the server
+ * can do, but a server that stalls also stops the requests coming, so
+ * the stall only shows up as one slow response.
+ *
+ * Open loop (-r): requests are due at a constant rate whatever the
+ * server is doing, and go out on whichever connection is free. A
+ * request's latency is timed from when it was due, not when it was
+ * sent, so time spent waiting behind a stall is counted (the
+ * "coordinated omission" correction).
+ *
+ *    ./bench/loadgen -c 64 -d 10 /index.html /d20
+ *    ./bench/loadgen -t 2 -c 64 -r 20000 /index.html
+ *    ./bench/loadgen -k 5000 /missing/%d
+ *    ./bench/loadgen -U web.sock /index.html
+ *
+ * Paths are requested round-robin. A path with a %d in it gets a
+ * number from 0 to keys - 1, a different one each time round.
+ */
+
+#define _GNU_SOURCE // strcasestr()
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#define BUFFER_SIZE 65536
+#define MAX_EVENTS 256
+#define PATH_SIZE 1024
+
+// A connection to the server
+struct client {
+    int fd;
+    int connected;
+    char buf[BUFFER_SIZE]; // Response header, then whatever comes after
+    int len;
+    int header_len;   // Length of the response header, once it's in
+    long body_left;   // Body bytes still to come
+    int close_after;  // Server said Connection: close
+    long long start;  // When the current request was due, in ns
+    struct client *next_idle;
+};
+
+// A thread generating load, and what it measured
+struct worker {
+    pthread_t thread;
+    int epfd;
+    struct client *clients;
+    int nclients;
+    struct client *idle; // Connected, with nothing outstanding (open loop)
+
+    long next_path;
+    long long interval; // ns between requests (open loop), or 0
+    long long next_due; // When the next request is due (open loop)
+
+    long long *latencies; // ns, one per response
+    long nlatencies, latencies_size;
+    long errors, statuses[6];
+};
+
+struct addrinfo *server_addr;
+char **paths;
+int npaths;
+int keys = 1000;
+long long end_time;
+
+/**
+ * Return monotonic time in ns
+ */
+long long now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/**
+ * Open a (non-blocking) connection to the server
+ *
+ * If wait is set, this doesn't return until it's connected: that way
+ * the connections set up before a run don't all arrive at once and
+ * overflow the server's listen queue.
+ */
+int client_connect(struct worker *w, struct client *cl, int wait)
+{
+    struct epoll_event ev;
+    int one = 1;
+
+    cl->fd = socket(server_addr->ai_family, SOCK_STREAM | (wait? 0: SOCK_NONBLOCK), 0);
+
+    if (cl->fd < 0) {
+        perror("socket");
+        return -1;
+    }
+
+    setsockopt(cl->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+
+    if (connect(cl->fd, server_addr->ai_addr, server_addr->ai_addrlen) < 0 && errno != EINPROGRESS) {
+        perror("connect");
+        close(cl->fd);
+        return -1;
+    }
+
+    if (wait) {
+        fcntl(cl->fd, F_SETFL, fcntl(cl->fd, F_GETFL) | O_NONBLOCK);
+    }
+
+    cl->connected = wait;
+    cl->len = 0;
+
+    ev.events = wait? EPOLLIN: EPOLLOUT;
+    ev.data.ptr = cl;
+    epoll_ctl(w->epfd, EPOLL_CTL_ADD, cl->fd, &ev);
+
+    return 0;
+}
+
+/**
+ * Send the next request
+ *
+ * due is when it was due, which its latency is timed from.
+ */
+int client_send(struct worker *w, struct client *cl, long long due)
+{
+    char request[PATH_SIZE + 64], path[PATH_SIZE];
+    long n = w->next_path++;
+    char *p = paths[n % npaths];
+    char *d = strstr(p, "%d");
+
+    if (d != NULL) {
+        snprintf(path, sizeof path, "%.*s%ld%s", (int)(d - p), p, n / npaths % keys, d + 2);
+        p = path;
+    }
+
+    int len = snprintf(request, sizeof request,
+        "GET %s HTTP/1.1\r\n"
+        "Host: localhost\r\n"
+        "\r\n",
+        p);
+
+    cl->header_len = 0;
+    cl->body_left = 0;
+    cl->close_after = 0;
+    cl->start = due;
+
+    // Requests are tiny; a fresh socket always takes one whole
+    return send(cl->fd, request, len, MSG_NOSIGNAL) == len? 0: -1;
+}
+
+/**
+ * Record a latency sample
+ */
+void record(struct worker *w, long long ns)
+{
+    if (w->nlatencies == w->latencies_size) {
+        w->latencies_size = w->latencies_size? w->latencies_size * 2: 65536;
+        w->latencies = realloc(w->latencies, w->latencies_size * sizeof *w->latencies);
+
+        if (w->latencies == NULL) {
+            fprintf(stderr, "loadgen: out of memory\n");
+            exit(3);
+        }
+    }
+
+    w->latencies[w->nlatencies++] = ns;
+}
+
+/**
+ * Look at a complete response header
+ */
+void client_header(struct worker *w, struct client *cl, char *end)
+{
+    char *p;
+    int status = 0;
+
+    cl->header_len = end - cl->buf;
+    *end = '\0'; // Header only, for the searches below
+
+    sscanf(cl->buf, "HTTP/%*s %d", &status);
+    w->statuses[status / 100 < 6? status / 100: 0]++;
+
+    cl->body_left = 0;
+
+    if ((p = strcasestr(cl->buf, "\nContent-Length:")) != NULL) {
+        cl->body_left = atol(p + 16);
+    }
+
+    // 304s have a Content-Length with no body
+    if (status == 304 || status / 100 == 1) {
+        cl->body_left = 0;
+    }
+
+    cl->close_after = strcasestr(cl->buf, "\nConnection: close") != NULL;
+}
+
+/**
+ * Read whatever's arrived
+ *
+ * Returns 1 when the response is complete, 0 if there's more to come,
+ * or -1 on error.
+ */
+int client_read(struct worker *w, struct client *cl)
+{
+    while (1) {
+        ssize_t rv = recv(cl->fd, cl->buf + cl->len, BUFFER_SIZE - 1 - cl->len, 0);
+
+        if (rv < 0) {
+            return errno == EAGAIN || errno == EWOULDBLOCK? 0: -1;
+        }
+
+        if (rv == 0) {
+            return -1;
+        }
+
+        if (cl->header_len == 0) {
+            cl->len += rv;
+            cl->buf[cl->len] = '\0';
+
+            char *end = strstr(cl->buf, "\r\n\r\n");
+
+            if (end == NULL) {
+                if (cl->len == BUFFER_SIZE - 1) {
+                    return -1;
+                }
+                continue;
+            }
+
+            client_header(w, cl, end + 4);
+
+            // Whatever followed the header is body
+            rv = cl->len - cl->header_len;
+        }
+
+        cl->body_left -= rv;
+        cl->len = 0;
+
+        if (cl->body_left <= 0) {
+            return 1;
+        }
+    }
+}
+
+/**
+ * A connection is ready for its next request
+ *
+ * Closed loop, that's now; open loop, it waits its turn.
+ */
+int client_ready(struct worker *w, struct client *cl)
+{
+    if (w->interval == 0) {
+        return client_send(w, cl, now_ns());
+    }
+
+    cl->next_idle = w->idle;
+    w->idle = cl;
+
+    return 0;
+}
+
+/**
+ * Drop a connection and start another in its place
+ */
+void client_reconnect(struct worker *w, struct client *cl)
+{
+    struct client **p;
+
+    // Errors and closes both get a fresh connection
+    if (!cl->close_after) {
+        w->errors++;
+    }
+
+    for (p = &w->idle; *p != NULL; p = &(*p)->next_idle) {
+        if (*p == cl) {
+            *p = cl->next_idle;
+            break;
+        }
+    }
+
+    close(cl->fd);
+    client_connect(w, cl, 0);
+}
+
+/**
+ * Open loop: send whatever's due, as far as free connections go
+ *
+ * Requests that find no free connection wait, and their latency
+ * includes the wait.
+ */
+void worker_send_due(struct worker *w, long long now)
+{
+    while (w->next_due <= now && w->idle != NULL) {
+        struct client *cl = w->idle;
+
+        w->idle = cl->next_idle;
+
+        if (client_send(w, cl, w->next_due) < 0) {
+            client_reconnect(w, cl);
+        }
+
+        w->next_due += w->interval;
+    }
+}
+
+/**
+ * Thread: generate load until the end time
+ */
+void *worker_run(void *arg)
+{
+    struct worker *w = arg;
+    struct epoll_event events[MAX_EVENTS];
+
+    w->next_due = now_ns();
+
+    // Everything's connected already
+    for (int i = 0; i < w->nclients; i++) {
+        if (client_ready(w, &w->clients[i]) < 0) {
+            client_reconnect(w, &w->clients[i]);
+        }
+    }
+
+    while (1) {
+        long long now = now_ns();
+        int timeout = 100;
+
+        if (now >= end_time) {
+            break;
+        }
+
+        if (w->interval != 0) {
+            worker_send_due(w, now);
+
+            // Wake for the next one due, if there's a connection to
+            // send it on
+            if (w->idle != NULL) {
+                timeout = w->next_due > now? (w->next_due - now + 999999) / 1000000: 0;
+            }
+        }
+
+        int n = epoll_wait(w->epfd, events, MAX_EVENTS, timeout);
+
+        for (int i = 0; i < n; i++) {
+            struct client *cl = events[i].data.ptr;
+            int rv = 0;
+
+            if (!cl->connected) {
+                struct epoll_event ev;
+
+                cl->connected = 1;
+                ev.events = EPOLLIN;
+                ev.data.ptr = cl;
+                epoll_ctl(w->epfd, EPOLL_CTL_MOD, cl->fd, &ev);
+
+                rv = client_ready(w, cl);
+
+            } else {
+                rv = client_read(w, cl);
+
+                if (rv == 1) {
+                    record(w, now_ns() - cl->start);
+
+                    rv = cl->close_after? -1: client_ready(w, cl);
+                }
+            }
+
+            if (rv < 0) {
+                client_reconnect(w, cl);
+            }
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Print a latency in sensible units
+ */
+void print_latency(char *label, long long ns)
+{
+    if (ns < 1000000) {
+        printf("  %-5s %8.1f us\n", label, ns / 1000.0);
+    } else {
+        printf("  %-5s %8.2f ms\n", label, ns / 1000000.0);
+    }
+}
+
+int compare_ll(const void *a, const void *b)
+{
+    long long x = *(long long *)a, y = *(long long *)b;
+
+    return x < y? -1: x > y;
+}
+
+/**
+ * Print usage and exit
+ */
+void usage(char *progname)
+{
+    fprintf(stderr,
+        "usage: %s [-h host] [-p port] [-t threads] [-c connections]\n"
+        "          [-d seconds] [-r rate] [-k keys] [-U socket] path...\n"
+        "\n"
+        "  -t threads      threads generating load (default 1)\n"
+        "  -c connections  connections, spread over the threads (default 16)\n"
+        "  -d seconds      how long to run (default 5)\n"
+        "  -r rate         open loop: requests per second, in total\n"
+        "                  (default closed loop)\n"
+        "  -k keys         numbers to fill in a %%d in a path (default 1000)\n"
+        "  -U socket       connect to a Unix socket rather than host and\n"
+        "                  port; @name is in the abstract namespace\n",
+        progname);
+
+    exit(2);
+}
+
+int main(int argc, char **argv)
+{
+    char *host = "localhost", *port = "3490", *unix_path = NULL;
+    int nclients = 16, nworkers = 1, duration = 5;
+    double rate = 0;
+    struct addrinfo hints, unix_ai;
+    struct sockaddr_un sun;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "h:p:t:c:d:r:k:U:")) != -1) {
+        switch (opt) {
+            case 'h': host = optarg; break;
+            case 'p': port = optarg; break;
+            case 't': nworkers = atoi(optarg); break;
+            case 'c': nclients = atoi(optarg); break;
+            case 'd': duration = atoi(optarg); break;
+            case 'r': rate = atof(optarg); break;
+            case 'k': keys = atoi(optarg); break;
+            case 'U': unix_path = optarg; break;
+            default: usage(argv[0]);
+        }
+    }
+
+    if (optind == argc || nworkers <= 0 || nclients < nworkers || rate < 0 || keys <= 0) {
+        usage(argv[0]);
+    }
+
+    paths = argv + optind;
+    npaths = argc - optind;
+
+    memset(&hints, 0, sizeof hints);
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    if (unix_path != NULL) {
+        int len = strlen(unix_path);
+
+        if (len >= (int)sizeof sun.sun_path) {
+            fprintf(stderr, "loadgen: socket path too long\n");
+            exit(1);
+        }
+
+        // Abstract names are exactly their length, with a leading NUL
+        memset(&sun, 0, sizeof sun);
+        sun.sun_family = AF_UNIX;
+        memcpy(sun.sun_path, unix_path, len);
+
+        unix_ai = hints;
+        unix_ai.ai_family = AF_UNIX;
+        unix_ai.ai_addr = (struct sockaddr *)&sun;
+        unix_ai.ai_addrlen = sizeof sun;
+
+        if (unix_path[0] == '@') {
+            sun.sun_path[0] = '\0';
+            unix_ai.ai_addrlen = offsetof(struct sockaddr_un, sun_path) + len;
+        }
+
+        server_addr = &unix_ai;
+
+    } else if (getaddrinfo(host, port, &hints, &server_addr) != 0) {
+        fprintf(stderr, "loadgen: can't resolve %s\n", host);
+        exit(1);
+    }
+
+    struct worker *workers = calloc(nworkers, sizeof *workers);
+
+    if (workers == NULL) {
+        fprintf(stderr, "loadgen: out of memory\n");
+        exit(3);
+    }
+
+    // Connections and the rate are split evenly between the threads
+    for (int i = 0; i < nworkers; i++) {
+        struct worker *w = &workers[i];
+
+        w->nclients = nclients / nworkers + (i < nclients % nworkers);
+        w->clients = calloc(w->nclients, sizeof *w->clients);
+        w->epfd = epoll_create1(0);
+        w->interval = rate > 0? (long long)(1e9 * nworkers / rate): 0;
+        w->next_path = i;
+
+        if (w->clients == NULL || w->epfd < 0) {
+            fprintf(stderr, "loadgen: out of memory\n");
+            exit(3);
+        }
+
+        for (int j = 0; j < w->nclients; j++) {
+            if (client_connect(w, &w->clients[j], 1) < 0) {
+                exit(1);
+            }
+        }
+    }
+
+    long long start = now_ns();
+
+    end_time = start + duration * 1000000000LL;
+
+    for (int i = 0; i < nworkers; i++) {
+        if (pthread_create(&workers[i].thread, NULL, worker_run, &workers[i]) != 0) {
+            fprintf(stderr, "loadgen: can't start thread\n");
+            exit(1);
+        }
+    }
+
+    // Gather up what they measured
+    long long *latencies = NULL;
+    long nlatencies = 0, errors = 0, statuses[6] = {0}, behind = 0;
+
+    for (int i = 0; i < nworkers; i++) {
+        struct worker *w = &workers[i];
+
+        pthread_join(w->thread, NULL);
+
+        latencies = realloc(latencies, (nlatencies + w->nlatencies + 1) * sizeof *latencies);
+
+        if (latencies == NULL) {
+            fprintf(stderr, "loadgen: out of memory\n");
+            exit(3);
+        }
+
+        memcpy(latencies + nlatencies, w->latencies, w->nlatencies * sizeof *latencies);
+        nlatencies += w->nlatencies;
+        errors += w->errors;
+
+        for (int j = 0; j < 6; j++) {
+            statuses[j] += w->statuses[j];
+        }
+
+        // Requests that came due but never went out
+        if (w->interval != 0 && w->next_due < end_time) {
+            behind += (end_time - w->next_due) / w->interval;
+        }
+    }
+
+    double elapsed = (now_ns() - start) / 1e9;
+
+    if (rate > 0) {
+        printf("open loop at %.0f req/s, %d threads, %d connections\n", rate, nworkers, nclients);
+    } else {
+        printf("closed loop, %d threads, %d connections\n", nworkers, nclients);
+    }
+
+    printf("%ld requests in %.2fs: %.0f req/s, %ld errors\n",
+        nlatencies, elapsed, nlatencies / elapsed, errors);
+    printf("  2xx %ld, 3xx %ld, 4xx %ld, 5xx %ld\n",
+        statuses[2], statuses[3], statuses[4], statuses[5]);
+
+    if (behind > 0) {
+        printf("  %ld requests never sent: the server couldn't keep up\n", behind);
+    }
+
+    if (nlatencies > 0) {
+        qsort(latencies, nlatencies, sizeof *latencies, compare_ll);
+
+        print_latency("p50", latencies[nlatencies / 2]);
+        print_latency("p99", latencies[nlatencies * 99 / 100]);
+        print_latency("p999", latencies[nlatencies * 999 / 1000]);
+        print_latency("max", latencies[nlatencies - 1]);
+    }
+
+    return 0;
+}
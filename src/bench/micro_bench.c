@@ -0,0 +1,595 @@
+/**
+ * micro_bench.c -- Time the cache's building blocks
+ *
+ * Times cache_get()/cache_put() under uniform and Zipf keys,
+ * hashtable_get_bin()/hashtable_put_bin() at a range of load factors,
+ * llist_find()/llist_append() at a range of lengths, and
+ * mime_type_get().
+ *
+ * To keep runs comparable, it pins itself to one CPU, uses the same
+ * pseudo-random keys every time, and sizes each run to take a while.
+ * Then, after warming up, it runs each benchmark several times and
+ * reports the min, median, mean and max ns per operation. The
+ * median is the number to compare; a wide spread means a noisy
+ * machine.
+ *
+ * Results go to stdout as JSON, progress to stderr:
+ *
+ *    ./bench/micro_bench -l $(git rev-parse --short HEAD) > before.json
+ *    ./bench/micro_bench -f cache_ -r 11 -t 200
+ */
+
+#define _GNU_SOURCE // sched_setaffinity()
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+#include <time.h>
+#include <sched.h>
+#include "../cache.h"
+#include "../hashtable.h"
+#include "../llist.h"
+#include "../mime.h"
+
+#define SEQ_SIZE 65536       // Keys to cycle through; a power of 2
+#define ZIPF_S 0.99          // Zipf exponent, about what web traffic shows
+#define CACHE_CAPACITY 1024  // Entries the cache benchmarks' cache holds
+#define CONTENT_SIZE 256     // Bytes per cache entry
+#define HASHTABLE_SIZE 1024  // Buckets in the hashtable benchmarks
+#define SEED 0x9e3779b97f4a7c15ULL
+
+// One thing to time, with its parameters
+struct bench {
+    char *name;
+    char *dist;   // Key distribution, "uniform" or "zipf", or NULL
+    char *n_name; // What n is, e.g. "keys", or NULL
+    int n;
+    double load;  // Hashtable load factor, or 0
+
+    void (*setup)(struct bench *b);
+    long long (*run)(struct bench *b, long iters); // Returns ns timed
+    void (*teardown)(struct bench *b);
+
+    void *state;
+    long hits, lookups; // cache_get() results while measured
+};
+
+// What the benchmarks work on
+struct cache_state {
+    struct cache *cache;
+    char **paths;
+    int *seq;
+};
+
+struct hashtable_state {
+    struct hashtable *ht;
+    int *keys;
+    int *seq;
+};
+
+struct llist_state {
+    struct llist *list;
+    int *values;
+    int *seq;
+};
+
+// Keep the compiler from dropping what's looked up
+void * volatile sink;
+
+char content[CONTENT_SIZE];
+
+/**
+ * Return monotonic time in ns
+ */
+long long now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/**
+ * Return the next pseudo-random number (xorshift64*)
+ */
+unsigned long long rand_next(unsigned long long *s)
+{
+    *s ^= *s >> 12;
+    *s ^= *s << 25;
+    *s ^= *s >> 27;
+
+    return *s * 2685821657736338717ULL;
+}
+
+/**
+ * Make a sequence of SEQ_SIZE keys from 0 to n - 1
+ *
+ * dist "zipf" makes key k come up in proportion to 1 / (k + 1)^ZIPF_S;
+ * anything else makes them all equally likely. The sequence is the
+ * same every run.
+ */
+int *seq_create(char *dist, int n)
+{
+    int *seq = malloc(SEQ_SIZE * sizeof *seq);
+    unsigned long long s = SEED;
+
+    if (dist == NULL || strcmp(dist, "zipf") != 0) {
+        for (int i = 0; i < SEQ_SIZE; i++) {
+            seq[i] = rand_next(&s) % n;
+        }
+
+        return seq;
+    }
+
+    double *cdf = malloc(n * sizeof *cdf);
+    double total = 0;
+
+    for (int k = 0; k < n; k++) {
+        total += 1 / pow(k + 1, ZIPF_S);
+        cdf[k] = total;
+    }
+
+    for (int i = 0; i < SEQ_SIZE; i++) {
+        double u = (rand_next(&s) >> 11) * (1.0 / (1ULL << 53)) * total;
+        int lo = 0, hi = n - 1;
+
+        // First key whose cdf reaches u
+        while (lo < hi) {
+            int mid = (lo + hi) / 2;
+
+            if (cdf[mid] < u) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+
+        seq[i] = lo;
+    }
+
+    free(cdf);
+
+    return seq;
+}
+
+/**
+ * cache_get(), and cache_put() on a miss, as the server does
+ */
+void cache_setup(struct bench *b)
+{
+    struct cache_state *st = malloc(sizeof *st);
+    char path[64];
+
+    st->cache = cache_create(CACHE_CAPACITY, 0);
+    st->paths = malloc(b->n * sizeof *st->paths);
+    st->seq = seq_create(b->dist, b->n);
+
+    for (int i = 0; i < b->n; i++) {
+        snprintf(path, sizeof path, "/bench/%d.html", i);
+        st->paths[i] = strdup(path);
+    }
+
+    b->state = st;
+}
+
+long long cache_run(struct bench *b, long iters)
+{
+    struct cache_state *st = b->state;
+    long hits = st->cache->hits, misses = st->cache->misses;
+    long long start = now_ns();
+
+    for (long i = 0; i < iters; i++) {
+        char *path = st->paths[st->seq[i & (SEQ_SIZE - 1)]];
+        struct cache_entry *ce = cache_get(st->cache, path);
+
+        if (ce == NULL) {
+            ce = cache_put(st->cache, path, "text/html", content, CONTENT_SIZE);
+        }
+
+        sink = ce;
+    }
+
+    long long ns = now_ns() - start;
+
+    b->hits += st->cache->hits - hits;
+    b->lookups += st->cache->hits - hits + st->cache->misses - misses;
+
+    return ns;
+}
+
+void cache_teardown(struct bench *b)
+{
+    struct cache_state *st = b->state;
+
+    for (int i = 0; i < b->n; i++) {
+        free(st->paths[i]);
+    }
+
+    cache_free(st->cache);
+    free(st->paths);
+    free(st->seq);
+    free(st);
+}
+
+/**
+ * hashtable_get_bin() of keys that are there, load * HASHTABLE_SIZE of
+ * them
+ */
+void hashtable_setup(struct bench *b)
+{
+    struct hashtable_state *st = malloc(sizeof *st);
+
+    b->n = b->load * HASHTABLE_SIZE;
+
+    st->ht = hashtable_create(HASHTABLE_SIZE, NULL);
+    st->keys = malloc(b->n * sizeof *st->keys);
+    st->seq = seq_create("uniform", b->n);
+
+    for (int i = 0; i < b->n; i++) {
+        st->keys[i] = i;
+        hashtable_put_bin(st->ht, &st->keys[i], sizeof st->keys[i], &st->keys[i]);
+    }
+
+    b->state = st;
+}
+
+long long hashtable_get_run(struct bench *b, long iters)
+{
+    struct hashtable_state *st = b->state;
+    long long start = now_ns();
+
+    for (long i = 0; i < iters; i++) {
+        int *key = &st->keys[st->seq[i & (SEQ_SIZE - 1)]];
+
+        sink = hashtable_get_bin(st->ht, key, sizeof *key);
+    }
+
+    return now_ns() - start;
+}
+
+/**
+ * hashtable_put_bin() filling an empty table up to the load factor,
+ * again and again
+ *
+ * Only the puts are timed, not making and freeing the tables.
+ */
+long long hashtable_put_run(struct bench *b, long iters)
+{
+    struct hashtable_state *st = b->state;
+    long long ns = 0;
+    long done;
+
+    for (done = 0; done < iters; done += b->n) {
+        struct hashtable *ht = hashtable_create(HASHTABLE_SIZE, NULL);
+        long long start = now_ns();
+
+        for (int i = 0; i < b->n; i++) {
+            hashtable_put_bin(ht, &st->keys[i], sizeof st->keys[i], &st->keys[i]);
+        }
+
+        ns += now_ns() - start;
+
+        hashtable_destroy(ht);
+    }
+
+    // Whole tables were filled, which can be more than asked for
+    return ns * iters / done;
+}
+
+void hashtable_teardown(struct bench *b)
+{
+    struct hashtable_state *st = b->state;
+
+    hashtable_destroy(st->ht);
+    free(st->keys);
+    free(st->seq);
+    free(st);
+}
+
+/**
+ * Compare the ints two pointers point to
+ */
+int intcmp(void *a, void *b)
+{
+    return *(int *)a - *(int *)b;
+}
+
+/**
+ * llist_find() of values anywhere in a list n long
+ */
+void llist_setup(struct bench *b)
+{
+    struct llist_state *st = malloc(sizeof *st);
+
+    st->list = llist_create();
+    st->values = malloc(b->n * sizeof *st->values);
+    st->seq = seq_create("uniform", b->n);
+
+    for (int i = 0; i < b->n; i++) {
+        st->values[i] = i;
+        llist_append(st->list, &st->values[i]);
+    }
+
+    b->state = st;
+}
+
+long long llist_find_run(struct bench *b, long iters)
+{
+    struct llist_state *st = b->state;
+    long long start = now_ns();
+
+    for (long i = 0; i < iters; i++) {
+        sink = llist_find(st->list, &st->values[st->seq[i & (SEQ_SIZE - 1)]], intcmp);
+    }
+
+    return now_ns() - start;
+}
+
+/**
+ * llist_append() growing an empty list to n long, again and again
+ *
+ * Only the appends are timed.
+ */
+long long llist_append_run(struct bench *b, long iters)
+{
+    struct llist_state *st = b->state;
+    long long ns = 0;
+    long done;
+
+    for (done = 0; done < iters; done += b->n) {
+        struct llist *list = llist_create();
+        long long start = now_ns();
+
+        for (int i = 0; i < b->n; i++) {
+            llist_append(list, &st->values[i]);
+        }
+
+        ns += now_ns() - start;
+
+        llist_destroy(list);
+    }
+
+    return ns * iters / done;
+}
+
+void llist_teardown(struct bench *b)
+{
+    struct llist_state *st = b->state;
+
+    llist_destroy(st->list);
+    free(st->values);
+    free(st->seq);
+    free(st);
+}
+
+/**
+ * mime_type_get() of a mix of file names, some it doesn't know
+ */
+char *mime_names[] = {
+    "index.html", "cat.jpg", "style.css", "app.js", "data.json",
+    "README.txt", "logo.png", "spinner.gif", "archive.tar.gz", "Makefile",
+    "PHOTO.JPEG", "page.htm", "font.woff2", "notes.TXT", "video.mp4", "d20",
+};
+
+#define MIME_NAMES (int)(sizeof mime_names / sizeof mime_names[0])
+
+void mime_setup(struct bench *b)
+{
+    // mime_type_get() lowercases the extension in place
+    char **names = malloc(MIME_NAMES * sizeof *names);
+
+    for (int i = 0; i < MIME_NAMES; i++) {
+        names[i] = strdup(mime_names[i]);
+    }
+
+    b->n = MIME_NAMES;
+    b->state = names;
+}
+
+long long mime_run(struct bench *b, long iters)
+{
+    char **names = b->state;
+    long long start = now_ns();
+
+    for (long i = 0; i < iters; i++) {
+        sink = mime_type_get(names[i % MIME_NAMES]);
+    }
+
+    return now_ns() - start;
+}
+
+void mime_teardown(struct bench *b)
+{
+    char **names = b->state;
+
+    for (int i = 0; i < MIME_NAMES; i++) {
+        free(names[i]);
+    }
+
+    free(names);
+}
+
+#define CACHE_BENCH(dist, keys) \
+    {"cache_get_put", dist, "keys", keys, 0, cache_setup, cache_run, cache_teardown, NULL, 0, 0}
+#define HT_BENCH(name, dist, run, load) \
+    {name, dist, "entries", 0, load, hashtable_setup, run, hashtable_teardown, NULL, 0, 0}
+#define LLIST_BENCH(name, dist, run, len) \
+    {name, dist, "length", len, 0, llist_setup, run, llist_teardown, NULL, 0, 0}
+
+struct bench benches[] = {
+    CACHE_BENCH("uniform", 1024),  // Everything fits
+    CACHE_BENCH("zipf", 1024),
+    CACHE_BENCH("uniform", 8192),  // 1 in 8 fits
+    CACHE_BENCH("zipf", 8192),
+    CACHE_BENCH("uniform", 65536),
+    CACHE_BENCH("zipf", 65536),
+
+    HT_BENCH("hashtable_get_bin", "uniform", hashtable_get_run, 0.5),
+    HT_BENCH("hashtable_get_bin", "uniform", hashtable_get_run, 1),
+    HT_BENCH("hashtable_get_bin", "uniform", hashtable_get_run, 2),
+    HT_BENCH("hashtable_get_bin", "uniform", hashtable_get_run, 4),
+    HT_BENCH("hashtable_get_bin", "uniform", hashtable_get_run, 8),
+    HT_BENCH("hashtable_put_bin", NULL, hashtable_put_run, 0.5),
+    HT_BENCH("hashtable_put_bin", NULL, hashtable_put_run, 1),
+    HT_BENCH("hashtable_put_bin", NULL, hashtable_put_run, 2),
+    HT_BENCH("hashtable_put_bin", NULL, hashtable_put_run, 4),
+    HT_BENCH("hashtable_put_bin", NULL, hashtable_put_run, 8),
+
+    LLIST_BENCH("llist_find", "uniform", llist_find_run, 1),
+    LLIST_BENCH("llist_find", "uniform", llist_find_run, 8),
+    LLIST_BENCH("llist_find", "uniform", llist_find_run, 64),
+    LLIST_BENCH("llist_find", "uniform", llist_find_run, 512),
+    LLIST_BENCH("llist_append", NULL, llist_append_run, 8),
+    LLIST_BENCH("llist_append", NULL, llist_append_run, 64),
+    LLIST_BENCH("llist_append", NULL, llist_append_run, 512),
+
+    {"mime_type_get", NULL, "names", 0, 0, mime_setup, mime_run, mime_teardown, NULL, 0, 0},
+};
+
+#define NBENCHES (int)(sizeof benches / sizeof benches[0])
+
+int cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+
+    return (x > y) - (x < y);
+}
+
+/**
+ * Pin ourselves to a CPU, so the scheduler can't move us mid-run
+ */
+void pin_cpu(int cpu)
+{
+    cpu_set_t set;
+
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+
+    if (sched_setaffinity(0, sizeof set, &set) < 0) {
+        perror("sched_setaffinity");
+    }
+}
+
+int main(int argc, char **argv)
+{
+    int cpu = 0;
+    int reps = 7;
+    int rep_ms = 100;
+    char *filter = NULL;
+    char *label = "";
+    int opt;
+
+    while ((opt = getopt(argc, argv, "c:r:t:f:l:")) != -1) {
+        switch (opt) {
+            case 'c': cpu = atoi(optarg); break;
+            case 'r': reps = atoi(optarg); break;
+            case 't': rep_ms = atoi(optarg); break;
+            case 'f': filter = optarg; break;
+            case 'l': label = optarg; break;
+            default:
+                fprintf(stderr, "usage: %s [-c cpu|-1] [-r reps] [-t ms per rep] [-f name filter] [-l label]\n", argv[0]);
+                exit(1);
+        }
+    }
+
+    if (reps < 1) {
+        reps = 1;
+    }
+
+    if (cpu >= 0) {
+        pin_cpu(cpu);
+    }
+
+    memset(content, 'x', sizeof content);
+
+    long long rep_ns = rep_ms * 1000000LL;
+    double *samples = malloc(reps * sizeof *samples);
+    char date[32];
+    time_t now = time(NULL);
+
+    strftime(date, sizeof date, "%Y-%m-%dT%H:%M:%SZ", gmtime(&now));
+
+    printf("{\n  \"label\": \"%s\",\n  \"date\": \"%s\",\n  \"cpu\": %d,\n  \"reps\": %d,\n  \"rep_ms\": %d,\n  \"results\": [",
+        label, date, cpu, reps, rep_ms);
+
+    int first = 1;
+
+    for (int i = 0; i < NBENCHES; i++) {
+        struct bench *b = &benches[i];
+
+        if (filter != NULL && strstr(b->name, filter) == NULL) {
+            continue;
+        }
+
+        b->setup(b);
+
+        // Find how many iterations take rep_ns; this warms up too
+        long iters = 1000;
+
+        while (1) {
+            long long ns = b->run(b, iters);
+
+            if (ns >= rep_ns) {
+                break;
+            }
+
+            double scale = ns > 0? 1.2 * rep_ns / ns: 10;
+
+            iters = scale < 2? iters * 2: scale > 10? iters * 10: (long)(iters * scale);
+        }
+
+        b->hits = b->lookups = 0;
+
+        for (int r = 0; r < reps; r++) {
+            samples[r] = (double)b->run(b, iters) / iters;
+        }
+
+        b->teardown(b);
+
+        double mean = 0;
+
+        for (int r = 0; r < reps; r++) {
+            mean += samples[r];
+        }
+
+        mean /= reps;
+
+        qsort(samples, reps, sizeof *samples, cmp_double);
+
+        double median = reps % 2? samples[reps / 2]: (samples[reps / 2 - 1] + samples[reps / 2]) / 2;
+
+        fprintf(stderr, "%-18s %-8s %s=%-6d %10.1f ns/op (min %.1f, max %.1f)\n",
+            b->name, b->dist != NULL? b->dist: "", b->n_name, b->n, median, samples[0], samples[reps - 1]);
+
+        printf("%s\n    {\"name\": \"%s\", \"params\": {", first? "": ",", b->name);
+
+        if (b->dist != NULL) {
+            printf("\"dist\": \"%s\", ", b->dist);
+        }
+
+        if (b->load > 0) {
+            printf("\"load\": %g, ", b->load);
+        }
+
+        printf("\"%s\": %d}, \"iterations\": %ld, ", b->n_name, b->n, iters);
+        printf("\"ns_per_op\": {\"min\": %.2f, \"median\": %.2f, \"mean\": %.2f, \"max\": %.2f}",
+            samples[0], median, mean, samples[reps - 1]);
+
+        if (b->lookups > 0) {
+            printf(", \"hit_ratio\": %.4f", (double)b->hits / b->lookups);
+        }
+
+        printf("}");
+
+        first = 0;
+    }
+
+    printf("\n  ]\n}\n");
+
+    free(samples);
+
+    return 0;
+}
@@ -0,0 +1,202 @@
+/**
+ * router_bench.c -- Compiled route trie vs. a chain of comparisons
+ *
+ * Registers a few hundred REST-style routes, then times looking up a
+ * mix of paths (exact hits, prefix hits and misses) with the compiled
+ * trie and with the linear scan it replaces. Both must agree on every
+ * answer.
+ *
+ *    ./bench/router_bench -n 500 -i 2000000
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include "../router.h"
+
+// Handlers are only compared, never called. Routes cycle through these
+// so a wrong match shows up.
+void h0(struct conn *c, struct cache *cache, char *path) { (void)c; (void)cache; (void)path; }
+void h1(struct conn *c, struct cache *cache, char *path) { (void)c; (void)cache; (void)path; }
+void h2(struct conn *c, struct cache *cache, char *path) { (void)c; (void)cache; (void)path; }
+void h3(struct conn *c, struct cache *cache, char *path) { (void)c; (void)cache; (void)path; }
+void not_found(struct conn *c, struct cache *cache, char *path) { (void)c; (void)cache; (void)path; }
+
+route_handler handlers[] = {h0, h1, h2, h3};
+
+char *resources[] = {"users", "orders", "products", "invoices", "carts", "reviews", "sessions", "tickets"};
+char *actions[] = {"list", "show", "search", "export", "stats"};
+
+struct route *routes;
+int nroutes;
+
+/**
+ * Return monotonic time in ns
+ */
+long long now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/**
+ * The old way: try every route in turn
+ */
+route_handler linear_lookup(char *method, char *path, int path_len)
+{
+    route_handler best = not_found;
+    int best_len = -1;
+
+    for (int i = 0; i < nroutes; i++) {
+        struct route *r = &routes[i];
+        int len = strlen(r->path);
+
+        if (strcmp(r->method, method) != 0 || len > path_len || strncmp(r->path, path, len) != 0) {
+            continue;
+        }
+
+        if (r->flags == ROUTE_EXACT) {
+            if (len == path_len) {
+                return r->handler;
+            }
+        } else if (len > best_len) {
+            best = r->handler;
+            best_len = len;
+        }
+    }
+
+    return best;
+}
+
+/**
+ * Add a route to both the router and our own list
+ */
+void add(struct router *r, char *method, char *path, int flags)
+{
+    route_handler h = handlers[nroutes % 4];
+
+    routes = realloc(routes, (nroutes + 1) * sizeof *routes);
+    routes[nroutes].method = method;
+    routes[nroutes].path = strdup(path);
+    routes[nroutes].flags = flags;
+    routes[nroutes].handler = h;
+    nroutes++;
+
+    if (router_add(r, method, path, flags, h) < 0) {
+        fprintf(stderr, "router_add failed\n");
+        exit(1);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    int target = 500;
+    long iterations = 2000000;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:i:")) != -1) {
+        switch (opt) {
+            case 'n': target = atoi(optarg); break;
+            case 'i': iterations = atol(optarg); break;
+            default:
+                fprintf(stderr, "usage: %s [-n routes] [-i lookups]\n", argv[0]);
+                exit(1);
+        }
+    }
+
+    struct router *r = router_create(not_found);
+    char path[256];
+
+    // /api/v<n>/<resource>/<action>, plus a prefix route per resource
+    // and a catch-all for static files, as a real server might have
+    add(r, "GET", "/", ROUTE_PREFIX);
+
+    for (int v = 1; nroutes < target; v++) {
+        for (int i = 0; i < 8 && nroutes < target; i++) {
+            snprintf(path, sizeof path, "/api/v%d/%s/", v, resources[i]);
+            add(r, "GET", path, ROUTE_PREFIX);
+
+            for (int j = 0; j < 5 && nroutes < target; j++) {
+                snprintf(path, sizeof path, "/api/v%d/%s/%s", v, resources[i], actions[j]);
+                add(r, j % 2? "POST": "GET", path, ROUTE_EXACT);
+            }
+        }
+    }
+
+    long long start = now_ns();
+
+    if (router_compile(r) < 0) {
+        fprintf(stderr, "router_compile failed\n");
+        exit(1);
+    }
+
+    printf("%d routes compiled in %.1f us: %d trie nodes\n",
+        nroutes, (now_ns() - start) / 1000.0, r->nnodes);
+
+    // What to look up: every route's own path, a path under each, and
+    // some misses
+    int nprobes = 3 * nroutes;
+    char **probes = malloc(nprobes * sizeof *probes);
+    char **methods = malloc(nprobes * sizeof *methods);
+
+    for (int i = 0; i < nroutes; i++) {
+        probes[3 * i] = routes[i].path;
+        methods[3 * i] = routes[i].method;
+
+        snprintf(path, sizeof path, "%s/123", routes[i].path);
+        probes[3 * i + 1] = strdup(path);
+        methods[3 * i + 1] = routes[i].method;
+
+        snprintf(path, sizeof path, "/nope%s", routes[i].path);
+        probes[3 * i + 2] = strdup(path);
+        methods[3 * i + 2] = "POST";
+    }
+
+    for (int i = 0; i < nprobes; i++) {
+        int len = strlen(probes[i]);
+
+        if (router_lookup(r, methods[i], probes[i], len) != linear_lookup(methods[i], probes[i], len)) {
+            fprintf(stderr, "mismatch: %s %s\n", methods[i], probes[i]);
+            exit(1);
+        }
+    }
+
+    int *lens = malloc(nprobes * sizeof *lens);
+
+    for (int i = 0; i < nprobes; i++) {
+        lens[i] = strlen(probes[i]);
+    }
+
+    // Keep the compiler from dropping the lookups
+    volatile route_handler sink;
+
+    start = now_ns();
+
+    for (long i = 0; i < iterations; i++) {
+        int p = i % nprobes;
+        sink = router_lookup(r, methods[p], probes[p], lens[p]);
+    }
+
+    double trie_ns = (double)(now_ns() - start) / iterations;
+
+    start = now_ns();
+
+    for (long i = 0; i < iterations; i++) {
+        int p = i % nprobes;
+        sink = linear_lookup(methods[p], probes[p], lens[p]);
+    }
+
+    double linear_ns = (double)(now_ns() - start) / iterations;
+
+    (void)sink;
+
+    printf("trie:   %8.1f ns/lookup\n", trie_ns);
+    printf("linear: %8.1f ns/lookup\n", linear_ns);
+
+    return 0;
+}
@@ -0,0 +1,31 @@
+#!/bin/sh
+#
+# Compare loopback TCP with a Unix socket, as a local proxy would
+# connect
+#
+# Run from src/ after `make server bench/loadgen`:
+#
+#    sh bench/tcp_vs_unix.sh [connections] [seconds]
+#
+
+CONNS=${1:-64}
+SECS=${2:-5}
+SOCK=@webserver-bench
+
+run() {
+    ./server -l "" $1 > /dev/null 2>&1 &
+    pid=$!
+    sleep 0.5
+
+    echo "== $2: /index.html, $CONNS connections"
+    ./bench/loadgen -c $CONNS -d $SECS $3 /index.html
+
+    echo "== $2: /d20 /cat.jpg /missing, $CONNS connections"
+    ./bench/loadgen -c $CONNS -d $SECS $3 /d20 /cat.jpg /missing
+
+    kill $pid
+    wait $pid 2> /dev/null || true
+}
+
+run "" "loopback TCP"
+run "-U $SOCK" "Unix socket" "-U $SOCK"
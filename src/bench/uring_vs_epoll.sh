@@ -0,0 +1,29 @@
+#!/bin/sh
+#
+# Compare the epoll and io_uring event loop backends
+#
+# Run from src/ after `make server bench/loadgen`:
+#
+#    sh bench/uring_vs_epoll.sh [connections] [seconds]
+#
+
+CONNS=${1:-64}
+SECS=${2:-5}
+
+run() {
+    ./server -l "" $1 > /dev/null 2>&1 &
+    pid=$!
+    sleep 0.5
+
+    echo "== $2: /index.html, $CONNS connections"
+    ./bench/loadgen -c $CONNS -d $SECS /index.html
+
+    echo "== $2: /d20 /cat.jpg /missing, $CONNS connections"
+    ./bench/loadgen -c $CONNS -d $SECS /d20 /cat.jpg /missing
+
+    kill $pid
+    wait $pid 2> /dev/null || true
+}
+
+run "" epoll
+run -u io_uring
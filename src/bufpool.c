@@ -0,0 +1,136 @@
+/*
+
+Pooled buffers for I/O and other short-lived allocations.
+
+Sizes are rounded up to a power-of-4 size class. Freed buffers go onto
+a free list for their class, one set of lists per thread, so taking a
+buffer and giving it back again needs no locking and, once the lists
+have filled up, no malloc() either. A buffer freed on a different
+thread from the one that allocated it simply joins that thread's lists.
+
+Each buffer carries a small header recording its class; anything
+bigger than the largest class bypasses the lists.
+
+*/
+
+#include <stdlib.h>
+#include "bufpool.h"
+
+#define BUFPOOL_MIN_SHIFT 6 // Smallest class is 64 bytes
+#define BUFPOOL_OVERSIZE BUFPOOL_CLASSES // "Class" of unpooled buffers
+
+// In front of every buffer. Sized to keep the buffer 16-byte aligned.
+struct bufpool_header {
+    union {
+        struct bufpool_header *next; // Next on the free list
+        size_t size;                 // Room in an unpooled buffer
+    };
+    int cls;
+};
+
+// This thread's free lists
+__thread struct bufpool_header *bufpool_free_list[BUFPOOL_CLASSES];
+__thread int bufpool_free_count[BUFPOOL_CLASSES];
+
+struct bufpool_stats bufpool_stats;
+
+#define COUNT(field) __atomic_add_fetch(&bufpool_stats.field, 1, __ATOMIC_RELAXED)
+
+/**
+ * Return the size of a class
+ */
+size_t bufpool_class_size(int cls)
+{
+    return (size_t)1 << (BUFPOOL_MIN_SHIFT + 2 * cls);
+}
+
+/**
+ * Return the smallest class that holds size bytes, or BUFPOOL_OVERSIZE
+ */
+int bufpool_class(size_t size)
+{
+    for (int cls = 0; cls < BUFPOOL_CLASSES; cls++) {
+        if (size <= bufpool_class_size(cls)) {
+            return cls;
+        }
+    }
+
+    return BUFPOOL_OVERSIZE;
+}
+
+/**
+ * Allocate a buffer of at least size bytes
+ *
+ * Returns NULL if out of memory. Free it with bufpool_free().
+ */
+void *bufpool_alloc(size_t size)
+{
+    int cls = bufpool_class(size);
+    struct bufpool_header *h;
+
+    COUNT(allocs);
+
+    if (cls < BUFPOOL_CLASSES && bufpool_free_list[cls] != NULL) {
+        h = bufpool_free_list[cls];
+        bufpool_free_list[cls] = h->next;
+        bufpool_free_count[cls]--;
+
+        COUNT(hits);
+
+        return h + 1;
+    }
+
+    size_t room = cls < BUFPOOL_CLASSES? bufpool_class_size(cls): size;
+
+    h = malloc(sizeof *h + room);
+
+    if (h == NULL) {
+        return NULL;
+    }
+
+    COUNT(mallocs);
+
+    h->cls = cls;
+
+    if (cls == BUFPOOL_OVERSIZE) {
+        h->size = size;
+    }
+
+    return h + 1;
+}
+
+/**
+ * Give a buffer back
+ */
+void bufpool_free(void *p)
+{
+    if (p == NULL) {
+        return;
+    }
+
+    struct bufpool_header *h = (struct bufpool_header *)p - 1;
+    int cls = h->cls;
+
+    COUNT(frees);
+
+    if (cls < BUFPOOL_CLASSES && bufpool_free_count[cls] < (int)(BUFPOOL_CACHE_BYTES / bufpool_class_size(cls))) {
+        h->next = bufpool_free_list[cls];
+        bufpool_free_list[cls] = h;
+        bufpool_free_count[cls]++;
+        return;
+    }
+
+    COUNT(releases);
+
+    free(h);
+}
+
+/**
+ * Return how many bytes a buffer really has room for
+ */
+size_t bufpool_size(void *p)
+{
+    struct bufpool_header *h = (struct bufpool_header *)p - 1;
+
+    return h->cls < BUFPOOL_CLASSES? bufpool_class_size(h->cls): h->size;
+}
@@ -0,0 +1,24 @@
+#ifndef _BUFPOOL_H_
+#define _BUFPOOL_H_
+
+#include <stddef.h>
+
+#define BUFPOOL_CLASSES 6             // 64 B, 256 B, 1 KB, 4 KB, 16 KB, 64 KB
+#define BUFPOOL_CACHE_BYTES (4 << 20) // Most bytes of each class a thread keeps
+
+// Allocation counters, across all threads
+struct bufpool_stats {
+    long allocs;   // bufpool_alloc() calls
+    long hits;     // ...served from a free list
+    long mallocs;  // ...that had to call malloc()
+    long frees;    // bufpool_free() calls
+    long releases; // ...that called free(): list full, or too big to pool
+};
+
+extern struct bufpool_stats bufpool_stats;
+
+extern void *bufpool_alloc(size_t size);
+extern void bufpool_free(void *p);
+extern size_t bufpool_size(void *p);
+
+#endif
@@ -1,27 +1,115 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stddef.h>
+#include <time.h>
 #include "hashtable.h"
+#include "lz4.h"
 #include "cache.h"
 
+#define COMPRESS_MIN_SIZE 64 // Don't bother compressing tiny entries
+
+// Content encodings an imported entry can have. Ordinary entries don't
+// own theirs, so the one it came with is swapped for the same string
+// from here.
+char *cache_encodings[] = { "gzip", "br", NULL };
+
+// Per-thread buffer that compressed entries are decompressed into on a hit
+__thread void *scratch;
+__thread int scratch_size;
+
 /**
  * Allocate a cache entry
+ *
+ * content can be NULL for an entry that only stands for content_length
+ * bytes, with nothing stored: enough to size a cache without the
+ * content to hand, as bench/cache_sim does.
  */
 struct cache_entry *alloc_entry(char *path, char *content_type, void *content, int content_length)
 {
-    ///////////////////
-    // IMPLEMENT ME! //
-    ///////////////////
+    struct cache_entry *ce = malloc(sizeof *ce);
+
+    if (ce == NULL) {
+        return NULL;
+    }
+
+    ce->path = strdup(path);
+    ce->content_type = strdup(content_type);
+    ce->content_length = content_length;
+    ce->content = content != NULL? malloc(content_length): NULL;
+
+    if (ce->path == NULL || ce->content_type == NULL || (content != NULL && ce->content == NULL)) {
+        free_entry(ce);
+        return NULL;
+    }
+
+    if (content != NULL) {
+        memcpy(ce->content, content, content_length);
+    }
+
+    ce->compressed_length = 0;
+    ce->content_encoding = NULL;
+    ce->hot = 0;
+
+    ce->expires = 0;
+    timer_init(&ce->timer, NULL, NULL);
+
+    ce->refcount = 0;
+    ce->removed = 0;
+
+    // Validators are computed once here so conditional requests never
+    // have to look at the body again
+    if (content != NULL) {
+        cache_etag(ce->etag, sizeof ce->etag, content, content_length);
+    } else {
+        ce->etag[0] = '\0';
+    }
+    ce->last_modified = time(NULL);
+
+    ce->prev = ce->next = NULL;
+
+    ce->shm = NULL;
+    ce->shm_entry = 0;
+
+    return ce;
 }
 
 /**
  * Deallocate a cache entry
+ *
+ * A view of a shared entry only gives up its reference to it.
  */
 void free_entry(struct cache_entry *entry)
 {
-    ///////////////////
-    // IMPLEMENT ME! //
-    ///////////////////
+    if (entry->shm != NULL) {
+        shmcache_unref(entry->shm, entry->shm_entry);
+        free(entry);
+        return;
+    }
+
+    free(entry->path);
+    free(entry->content_type);
+    free(entry->content);
+    free(entry);
+}
+
+/**
+ * Build a strong ETag from the content
+ *
+ * The tag is a quoted 64-bit FNV-1a hash of the body, e.g.
+ * "cbf29ce484222325". buf must hold at least CACHE_ETAG_SIZE bytes.
+ */
+void cache_etag(char *buf, int bufsize, void *content, int content_length)
+{
+    unsigned long long h = 0xcbf29ce484222325ULL;
+    unsigned char *p = content;
+
+    for (int i = 0; i < content_length; i++) {
+        h ^= p[i];
+        h *= 0x100000001b3ULL;
+    }
+
+    snprintf(buf, bufsize, "\"%016llx\"", h);
 }
 
 /**
@@ -66,6 +154,30 @@ void dllist_move_to_head(struct cache *cache, struct cache_entry *ce)
 }
 
 
+/**
+ * Unlink a cache entry from anywhere in the list
+ *
+ * NOTE: does not deallocate the entry
+ */
+void dllist_remove(struct cache *cache, struct cache_entry *ce)
+{
+    if (ce->prev == NULL) {
+        cache->head = ce->next;
+    } else {
+        ce->prev->next = ce->next;
+    }
+
+    if (ce->next == NULL) {
+        cache->tail = ce->prev;
+    } else {
+        ce->next->prev = ce->prev;
+    }
+
+    ce->prev = ce->next = NULL;
+
+    cache->cur_size--;
+}
+
 /**
  * Removes the tail from the list and returns it
  * 
@@ -76,7 +188,13 @@ struct cache_entry *dllist_remove_tail(struct cache *cache)
     struct cache_entry *oldtail = cache->tail;
 
     cache->tail = oldtail->prev;
-    cache->tail->next = NULL;
+
+    if (cache->tail == NULL) {
+        // That was the only entry
+        cache->head = NULL;
+    } else {
+        cache->tail->next = NULL;
+    }
 
     cache->cur_size--;
 
@@ -91,16 +209,460 @@ struct cache_entry *dllist_remove_tail(struct cache *cache)
  */
 struct cache *cache_create(int max_size, int hashsize)
 {
-    ///////////////////
-    // IMPLEMENT ME! //
-    ///////////////////
+    struct cache *cache = malloc(sizeof *cache);
+
+    if (cache == NULL) {
+        return NULL;
+    }
+
+    cache->index = hashtable_create(hashsize, NULL);
+    cache->timers = timerwheel_create(time(NULL));
+
+    if (cache->index == NULL || cache->timers == NULL) {
+        if (cache->index != NULL) {
+            hashtable_destroy(cache->index);
+        }
+
+        free(cache->timers);
+        free(cache);
+        return NULL;
+    }
+
+    cache->expirations = 0;
+    cache->hits = cache->misses = 0;
+    cache->insertions = cache->evictions = 0;
+    cache->evicted_bytes = 0;
+
+    cache->head = cache->tail = NULL;
+    cache->max_size = max_size;
+    cache->cur_size = 0;
+
+    cache->max_bytes = 0;
+    cache->cur_bytes = cache->raw_bytes = 0;
+
+    cache->hot_max = 0;
+    cache->hot_count = 0;
+    cache->cold = NULL;
+
+    cache->compressions = cache->decompressions = cache->promotions = 0;
+    cache->decompress_ns = 0;
+
+    cache->shm = NULL;
+    memset(cache->views, 0, sizeof cache->views);
+    cache->next_view = 0;
+
+    return cache;
+}
+
+/**
+ * Create a cache in shared memory
+ *
+ * Processes forked after this share its entries. max_bytes sizes the
+ * segment, which is allocated up front (see shmcache_create()).
+ *
+ * Entries handed out are this process's views of the shared ones.
+ * Like ordinary entries they stay good until the cache is next changed
+ * here, and for a while after: the last CACHE_VIEWS of them are kept.
+ * Past that, take a reference with cache_entry_ref().
+ *
+ * LZ4 compression isn't supported, and neither is a timer wheel for
+ * TTLs: expired entries are dropped when looked up, and cache_expire()
+ * does nothing.
+ */
+struct cache *cache_create_shared(int max_size, long max_bytes)
+{
+    struct cache *cache = cache_create(max_size, 1);
+
+    if (cache == NULL) {
+        return NULL;
+    }
+
+    cache->shm = shmcache_create(max_size, max_bytes, NULL);
+
+    if (cache->shm == NULL) {
+        cache_free(cache);
+        return NULL;
+    }
+
+    cache->max_bytes = cache->shm->heap_size;
+
+    return cache;
+}
+
+/**
+ * Copy a shared cache's counters into the cache
+ *
+ * They're for every process, not just this one.
+ */
+void shared_stats(struct cache *cache)
+{
+    struct shmcache *shm = cache->shm;
+
+    cache->cur_size = shm->cur_size;
+    cache->cur_bytes = cache->raw_bytes = shm->cur_bytes;
+    cache->hits = shm->hits;
+    cache->misses = shm->misses;
+    cache->insertions = shm->insertions;
+    cache->evictions = shm->evictions;
+    cache->evicted_bytes = shm->evicted_bytes;
+    cache->expirations = shm->expirations;
+}
+
+/**
+ * Make a view of a shared entry, which takes over the reference to it
+ *
+ * The view is kept until CACHE_VIEWS more have been made, then freed
+ * unless it's been referenced meanwhile.
+ */
+struct cache_entry *shared_view(struct cache *cache, unsigned long off)
+{
+    struct shmcache_entry *e = SHMCACHE_ENTRY(cache->shm, off);
+    struct cache_entry *ce = malloc(sizeof *ce);
+
+    if (ce == NULL) {
+        shmcache_unref(cache->shm, off);
+        return NULL;
+    }
+
+    ce->path = e->data;
+    ce->content_type = e->content_type;
+    ce->content_length = e->content_length;
+    ce->content = e->data + e->path_length + 1;
+    ce->compressed_length = 0;
+    ce->content_encoding = e->content_encoding[0] != '\0'? e->content_encoding: NULL;
+
+    memcpy(ce->etag, e->etag, sizeof ce->etag);
+    ce->last_modified = e->last_modified;
+
+    ce->hot = 0;
+    ce->expires = e->expires;
+    timer_init(&ce->timer, NULL, NULL);
+
+    // Only ever in the list of views, whose reference this is
+    ce->refcount = 1;
+    ce->removed = 1;
+    ce->prev = ce->next = NULL;
+
+    ce->shm = cache->shm;
+    ce->shm_entry = off;
+
+    struct cache_entry *old = cache->views[cache->next_view];
+
+    if (old != NULL) {
+        cache_entry_unref(old);
+    }
+
+    cache->views[cache->next_view] = ce;
+    cache->next_view = (cache->next_view + 1) % CACHE_VIEWS;
+
+    return ce;
+}
+
+/**
+ * Limit the total bytes of content in the cache
+ *
+ * Least-recently-used entries are evicted to stay under max_bytes, on
+ * top of the max_size entry limit. 0 means no byte limit.
+ */
+void cache_set_max_bytes(struct cache *cache, long max_bytes)
+{
+    // A shared cache's size is fixed when it's created
+    if (cache->shm != NULL) {
+        return;
+    }
+
+    cache->max_bytes = max_bytes;
+}
+
+/**
+ * Store cold entries LZ4-compressed
+ *
+ * The hot_max most-recently-used entries are kept as-is; anything that
+ * drops out of that window is compressed. A hit on a compressed entry
+ * is decompressed into a per-thread scratch buffer (see
+ * cache_entry_content()) and the entry moves back into the hot window,
+ * still compressed. If it's hit again while hot, it's stored
+ * uncompressed again.
+ *
+ * 0 (the default) turns compression off. Call this before anything is
+ * put in the cache. A shared cache doesn't compress.
+ */
+void cache_set_compression(struct cache *cache, int hot_max)
+{
+    if (cache->shm != NULL) {
+        return;
+    }
+
+    cache->hot_max = hot_max;
+}
+
+/**
+ * Compress an entry's content in place, if that saves enough to bother
+ */
+void entry_compress(struct cache *cache, struct cache_entry *ce)
+{
+    // Content that's still being sent has to stay put
+    if (ce->content == NULL || ce->compressed_length > 0 || ce->content_length < COMPRESS_MIN_SIZE || ce->refcount > 0) {
+        return;
+    }
+
+    int bound = LZ4_COMPRESS_BOUND(ce->content_length);
+    void *compressed = malloc(bound);
+
+    if (compressed == NULL) {
+        return;
+    }
+
+    int compressed_length = lz4_compress(ce->content, ce->content_length, compressed, bound);
+
+    // Needs to save at least an eighth to be worth the decompression
+    if (compressed_length == 0 || compressed_length > ce->content_length - ce->content_length / 8) {
+        free(compressed);
+        return;
+    }
+
+    void *shrunk = realloc(compressed, compressed_length);
+
+    if (shrunk != NULL) {
+        compressed = shrunk;
+    }
+
+    free(ce->content);
+    ce->content = compressed;
+    ce->compressed_length = compressed_length;
+
+    cache->cur_bytes -= ce->content_length - compressed_length;
+    cache->compressions++;
+}
+
+/**
+ * Store a compressed entry's content uncompressed again
+ */
+void entry_inflate(struct cache *cache, struct cache_entry *ce)
+{
+    void *content = malloc(ce->content_length);
+
+    if (content == NULL) {
+        return;
+    }
+
+    if (lz4_decompress(ce->content, ce->compressed_length, content, ce->content_length) != ce->content_length) {
+        free(content);
+        return;
+    }
+
+    cache->cur_bytes += ce->content_length - ce->compressed_length;
+    cache->promotions++;
+
+    free(ce->content);
+    ce->content = content;
+    ce->compressed_length = 0;
+}
+
+/**
+ * Push entries off the end of the hot window until it's back to size
+ *
+ * Entries leaving the window are compressed.
+ */
+void hot_window_trim(struct cache *cache)
+{
+    while (cache->hot_count > cache->hot_max) {
+        struct cache_entry *last_hot = cache->cold != NULL? cache->cold->prev: cache->tail;
+
+        last_hot->hot = 0;
+        cache->cold = last_hot;
+        cache->hot_count--;
+
+        entry_compress(cache, last_hot);
+    }
+}
+
+/**
+ * Get the uncompressed content of an entry
+ *
+ * Compressed entries are decompressed into a per-thread scratch buffer,
+ * which is only good until the next call on this thread.
+ *
+ * Returns NULL if the content can't be decompressed.
+ */
+void *cache_entry_content(struct cache *cache, struct cache_entry *ce)
+{
+    struct timespec start, end;
+
+    if (ce->compressed_length == 0) {
+        return ce->content;
+    }
+
+    if (scratch_size < ce->content_length) {
+        void *p = realloc(scratch, ce->content_length);
+
+        if (p == NULL) {
+            return NULL;
+        }
+
+        scratch = p;
+        scratch_size = ce->content_length;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    if (lz4_decompress(ce->content, ce->compressed_length, scratch, ce->content_length) != ce->content_length) {
+        return NULL;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    cache->decompressions++;
+    cache->decompress_ns += (end.tv_sec - start.tv_sec) * 1000000000LL + (end.tv_nsec - start.tv_nsec);
+
+    return scratch;
+}
+
+/**
+ * Hold on to an entry's content while a response is sent from it
+ *
+ * Only uncompressed content may be referenced this way. The entry can
+ * still be evicted meanwhile, but isn't freed until the last reference
+ * is dropped with cache_entry_unref().
+ */
+void cache_entry_ref(struct cache_entry *ce)
+{
+    ce->refcount++;
+}
+
+/**
+ * Drop a reference taken with cache_entry_ref()
+ *
+ * Takes a void * so it can be used directly as a release callback.
+ */
+void cache_entry_unref(void *arg)
+{
+    struct cache_entry *ce = arg;
+
+    if (--ce->refcount == 0 && ce->removed) {
+        free_entry(ce);
+    }
+}
+
+/**
+ * Remove an entry from the cache and free it
+ *
+ * If it's still referenced, freeing waits for the last reference.
+ */
+void cache_delete(struct cache *cache, struct cache_entry *ce)
+{
+    if (ce->shm != NULL) {
+        shmcache_remove(cache->shm, ce->shm_entry);
+        shared_stats(cache);
+        return;
+    }
+
+    if (ce == cache->cold) {
+        cache->cold = ce->next;
+    }
+
+    if (ce->hot) {
+        cache->hot_count--;
+    }
+
+    timerwheel_del(cache->timers, &ce->timer);
+
+    dllist_remove(cache, ce);
+    hashtable_delete(cache->index, ce->path);
+
+    cache->cur_bytes -= ce->compressed_length > 0? ce->compressed_length: ce->content_length;
+    cache->raw_bytes -= ce->content_length;
+
+    if (ce->refcount > 0) {
+        ce->removed = 1;
+        return;
+    }
+
+    free_entry(ce);
+}
+
+/**
+ * Timer callback for an expired entry
+ */
+void cache_entry_expired(struct timer *t, void *arg)
+{
+    struct cache *cache = arg;
+    struct cache_entry *ce = (struct cache_entry *)((char *)t - offsetof(struct cache_entry, timer));
+
+    cache->expirations++;
+    cache_delete(cache, ce);
+}
+
+/**
+ * Give an entry a time-to-live, in seconds
+ *
+ * Lookups after that return NULL, and cache_expire() reclaims the
+ * entry in the background. 0 means the entry never expires.
+ */
+void cache_set_ttl(struct cache *cache, struct cache_entry *ce, int ttl)
+{
+    if (ce->shm != NULL) {
+        ce->expires = ttl > 0? time(NULL) + ttl: 0;
+        shmcache_set_expires(cache->shm, ce->shm_entry, ce->expires);
+        return;
+    }
+
+    if (ttl <= 0) {
+        ce->expires = 0;
+        timerwheel_del(cache->timers, &ce->timer);
+        return;
+    }
+
+    ce->expires = time(NULL) + ttl;
+
+    timer_init(&ce->timer, cache_entry_expired, cache);
+    timerwheel_add(cache->timers, &ce->timer, ce->expires);
+}
+
+/**
+ * Reclaim expired entries
+ *
+ * Frees at most max entries (0 for no limit) so this can run between
+ * requests without stalling them.
+ *
+ * Returns the number of entries freed; if that's max, there may be
+ * more waiting.
+ */
+int cache_expire(struct cache *cache, time_t now, int max)
+{
+    if (cache->shm != NULL) {
+        return 0;
+    }
+
+    return timerwheel_run(cache->timers, now, max);
+}
+
+/**
+ * Remove the least-recently-used entry from the cache and free it
+ */
+void cache_evict_tail(struct cache *cache)
+{
+    cache->evictions++;
+    cache->evicted_bytes += cache->tail->content_length;
+    cache_delete(cache, cache->tail);
 }
 
 void cache_free(struct cache *cache)
 {
     struct cache_entry *cur_entry = cache->head;
 
+    for (int i = 0; i < CACHE_VIEWS; i++) {
+        if (cache->views[i] != NULL) {
+            cache_entry_unref(cache->views[i]);
+        }
+    }
+
+    if (cache->shm != NULL) {
+        shmcache_destroy(cache->shm);
+    }
+
     hashtable_destroy(cache->index);
+    timerwheel_free(cache->timers);
 
     while (cur_entry != NULL) {
         struct cache_entry *next_entry = cur_entry->next;
@@ -117,14 +679,85 @@ void cache_free(struct cache *cache)
  * Store an entry in the cache
  *
  * This will also remove the least-recently-used items as necessary.
- * 
- * NOTE: doesn't check for duplicate cache entries
+ * An existing entry for the same path is replaced.
+ * content can be NULL to only account for its size (see alloc_entry()).
+ *
+ * Returns the new entry, or NULL on allocation failure.
  */
-void cache_put(struct cache *cache, char *path, char *content_type, void *content, int content_length)
+struct cache_entry *cache_put(struct cache *cache, char *path, char *content_type, void *content, int content_length)
 {
-    ///////////////////
-    // IMPLEMENT ME! //
-    ///////////////////
+    return cache_put_meta(cache, path, content_type, content, content_length, NULL, time(NULL));
+}
+
+/**
+ * Store an entry in a shared cache
+ */
+struct cache_entry *shared_put(struct cache *cache, char *path, char *content_type, void *content, int content_length, char *content_encoding, time_t last_modified)
+{
+    char etag[CACHE_ETAG_SIZE];
+
+    cache_etag(etag, sizeof etag, content, content_length);
+
+    unsigned long off = shmcache_put(cache->shm, path, content_type, content, content_length, etag, content_encoding, last_modified);
+
+    shared_stats(cache);
+
+    return off != 0? shared_view(cache, off): NULL;
+}
+
+/**
+ * Store an entry with its Content-Encoding and Last-Modified
+ *
+ * Like cache_put(), but a shared cache needs these to go in with the
+ * entry: other processes can see it as soon as it's stored.
+ * content_encoding isn't copied for an ordinary entry, so it must stay
+ * put, e.g. a string constant.
+ */
+struct cache_entry *cache_put_meta(struct cache *cache, char *path, char *content_type, void *content, int content_length, char *content_encoding, time_t last_modified)
+{
+    if (cache->shm != NULL) {
+        return shared_put(cache, path, content_type, content, content_length, content_encoding, last_modified);
+    }
+
+    struct cache_entry *ce = alloc_entry(path, content_type, content, content_length);
+
+    if (ce == NULL) {
+        return NULL;
+    }
+
+    ce->content_encoding = content_encoding;
+    ce->last_modified = last_modified;
+
+    // A new entry for a path replaces the old one
+    struct cache_entry *old = hashtable_get(cache->index, path);
+
+    if (old != NULL) {
+        cache_delete(cache, old);
+    }
+
+    dllist_insert_head(cache, ce);
+    hashtable_put(cache->index, ce->path, ce);
+    cache->cur_size++;
+    cache->insertions++;
+
+    cache->cur_bytes += content_length;
+    cache->raw_bytes += content_length;
+
+    if (cache->hot_max > 0) {
+        ce->hot = 1;
+        cache->hot_count++;
+        hot_window_trim(cache);
+    }
+
+    // Never evict the entry we just added
+    while ((cache->cur_size > cache->max_size ||
+        (cache->max_bytes > 0 && cache->cur_bytes > cache->max_bytes)) &&
+        cache->tail != ce) {
+
+        cache_evict_tail(cache);
+    }
+
+    return ce;
 }
 
 /**
@@ -132,7 +765,203 @@ void cache_put(struct cache *cache, char *path, char *content_type, void *conten
  */
 struct cache_entry *cache_get(struct cache *cache, char *path)
 {
-    ///////////////////
-    // IMPLEMENT ME! //
-    ///////////////////
+    if (cache->shm != NULL) {
+        unsigned long off = shmcache_get(cache->shm, path);
+
+        shared_stats(cache);
+
+        return off != 0? shared_view(cache, off): NULL;
+    }
+
+    struct cache_entry *ce = hashtable_get(cache->index, path);
+
+    if (ce == NULL) {
+        cache->misses++;
+        return NULL;
+    }
+
+    // Don't wait for the timer wheel to notice a stale entry
+    if (ce->expires != 0 && ce->expires <= time(NULL)) {
+        cache->expirations++;
+        cache->misses++;
+        cache_delete(cache, ce);
+        return NULL;
+    }
+
+    cache->hits++;
+
+    if (cache->hot_max > 0) {
+        if (ce->hot) {
+            // Second hit while hot: worth keeping uncompressed
+            if (ce->compressed_length > 0) {
+                entry_inflate(cache, ce);
+            }
+
+        } else {
+            // Coming back into the hot window
+            if (ce == cache->cold) {
+                cache->cold = ce->next;
+            }
+
+            ce->hot = 1;
+            cache->hot_count++;
+        }
+    }
+
+    dllist_move_to_head(cache, ce);
+
+    if (cache->hot_max > 0) {
+        hot_window_trim(cache);
+    }
+
+    return ce;
+}
+
+/**
+ * Copy an entry into a segment being exported
+ */
+void export_entry(struct shmcache *to, char *path, char *content_type, void *content, int content_length, char *etag, char *content_encoding, time_t last_modified, time_t expires)
+{
+    unsigned long off = shmcache_put(to, path, content_type, content, content_length, etag, content_encoding, last_modified);
+
+    if (off != 0) {
+        if (expires != 0) {
+            shmcache_set_expires(to, off, expires);
+        }
+
+        shmcache_unref(to, off);
+    }
+}
+
+/**
+ * Copy the cache's entries into a new shared cache segment
+ *
+ * This is how a cache is handed to another process, e.g. on a hot
+ * restart (see restart.c); cache_import() reads it back. Entries keep
+ * their validators, encoding and expiry time, and their order.
+ *
+ * Returns the segment's memfd, or -1 on error.
+ */
+int cache_export(struct cache *cache)
+{
+    struct shmcache *from = cache->shm, *to;
+    unsigned long *offs = NULL;
+    long bytes = 0;
+    int n = 0, fd = -1;
+
+    if (from != NULL) {
+        offs = malloc((from->cur_size + 1) * sizeof *offs);
+
+        if (offs == NULL) {
+            return -1;
+        }
+
+        n = shmcache_snapshot(from, offs, from->cur_size);
+
+        for (int i = 0; i < n; i++) {
+            struct shmcache_entry *e = SHMCACHE_ENTRY(from, offs[i]);
+
+            bytes += shmcache_block_size(e->path_length, e->content_length);
+        }
+
+    } else {
+        for (struct cache_entry *ce = cache->head; ce != NULL; ce = ce->next) {
+            bytes += shmcache_block_size(strlen(ce->path), ce->content_length);
+            n++;
+        }
+    }
+
+    to = shmcache_create(n, bytes, &fd);
+
+    if (to != NULL) {
+        // Least recently used first, so the order comes out the same
+        if (from != NULL) {
+            for (int i = 0; i < n; i++) {
+                struct shmcache_entry *e = SHMCACHE_ENTRY(from, offs[i]);
+
+                export_entry(to, e->data, e->content_type, e->data + e->path_length + 1, e->content_length,
+                    e->etag, e->content_encoding, e->last_modified, e->expires);
+            }
+
+        } else {
+            for (struct cache_entry *ce = cache->tail; ce != NULL; ce = ce->prev) {
+                void *content = ce->content != NULL? cache_entry_content(cache, ce): NULL;
+
+                if (content != NULL) {
+                    export_entry(to, ce->path, ce->content_type, content, ce->content_length,
+                        ce->etag, ce->content_encoding, ce->last_modified, ce->expires);
+                }
+            }
+        }
+
+        shmcache_destroy(to);
+    }
+
+    for (int i = 0; i < n && from != NULL; i++) {
+        shmcache_unref(from, offs[i]);
+    }
+
+    free(offs);
+
+    return fd;
+}
+
+/**
+ * Store the entries from a segment made by cache_export()
+ *
+ * Closes fd. Expired entries are left out, and so are any in an
+ * encoding not in cache_encodings.
+ *
+ * Returns the number of entries stored, or -1 if fd isn't a segment
+ * we can read.
+ */
+int cache_import(struct cache *cache, int fd)
+{
+    struct shmcache *from = shmcache_attach(fd);
+
+    if (from == NULL) {
+        return -1;
+    }
+
+    unsigned long *offs = malloc((from->cur_size + 1) * sizeof *offs);
+
+    if (offs == NULL) {
+        shmcache_destroy(from);
+        return -1;
+    }
+
+    int n = shmcache_snapshot(from, offs, from->cur_size);
+    int imported = 0;
+    time_t now = time(NULL);
+
+    for (int i = 0; i < n; i++) {
+        struct shmcache_entry *e = SHMCACHE_ENTRY(from, offs[i]);
+        char *encoding = NULL;
+
+        for (char **p = cache_encodings; *p != NULL && e->content_encoding[0] != '\0'; p++) {
+            if (strcmp(*p, e->content_encoding) == 0) {
+                encoding = *p;
+            }
+        }
+
+        if ((encoding != NULL || e->content_encoding[0] == '\0') && (e->expires == 0 || e->expires > now)) {
+            struct cache_entry *ce = cache_put_meta(cache, e->data, e->content_type, e->data + e->path_length + 1,
+                e->content_length, encoding, e->last_modified);
+
+            if (ce != NULL) {
+                if (e->expires != 0) {
+                    cache_set_ttl(cache, ce, e->expires - now);
+                }
+
+                imported++;
+            }
+        }
+
+        shmcache_unref(from, offs[i]);
+    }
+
+    free(offs);
+    shmcache_destroy(from);
+
+    return imported;
 }
@@ -1,14 +1,39 @@
 #ifndef _WEBCACHE_H_
 #define _WEBCACHE_H_
 
+#include <time.h>
+#include "timerwheel.h"
+#include "shmcache.h"
+
+#define CACHE_ETAG_SIZE 20 // Quoted 16-digit hex hash plus NUL
+#define CACHE_VIEWS 16     // Lookups a shared cache's entries stay good for, unreferenced
+
 // Individual hash table entry
 struct cache_entry {
     char *path;   // Endpoint path--key to the cache
     char *content_type;
     int content_length;
     void *content;
+    int compressed_length;  // Size of content if it's LZ4-compressed, else 0
+    char *content_encoding; // "gzip", "br" or NULL--not owned by the entry
+
+    char etag[CACHE_ETAG_SIZE]; // Strong validator, hash of content
+    time_t last_modified;       // Validator for If-Modified-Since
+
+    int hot; // In the uncompressed window at the head of the list
+
+    time_t expires;     // When the entry goes stale, 0 for never
+    struct timer timer; // Reclaims the entry once it expires
+
+    int refcount; // Responses still sending straight from content
+    int removed;  // Deleted from the cache; freed once refcount drops to 0
 
     struct cache_entry *prev, *next; // Doubly-linked list
+
+    // A view of an entry in a shared cache: this process's copy of the
+    // fields, pointing into the segment for the rest
+    struct shmcache *shm; // NULL if it's an ordinary entry
+    unsigned long shm_entry;
 };
 
 // A cache
@@ -17,13 +42,54 @@ struct cache {
     struct cache_entry *head, *tail; // Doubly-linked list
     int max_size; // Maxiumum number of entries
     int cur_size; // Current number of entries
+
+    long max_bytes; // Maximum bytes of content stored, 0 for no limit
+    long cur_bytes; // Bytes of content actually stored (after compression)
+    long raw_bytes; // Bytes of content stored, as if none were compressed
+
+    // Cold-entry compression, see cache_set_compression()
+    int hot_max;   // Most recent entries kept uncompressed, 0 to never compress
+    int hot_count; // Entries currently in the hot window
+    struct cache_entry *cold; // First entry past the hot window, or NULL
+
+    struct timerwheel *timers; // Entry expiry, ticking in seconds
+    long expirations; // Entries removed because their TTL ran out
+
+    long hits, misses; // cache_get() results
+    long insertions;   // cache_put() calls
+    long evictions;    // Entries removed to make room
+    long long evicted_bytes; // Content bytes they had, uncompressed
+
+    long compressions;   // Entries compressed on leaving the hot window
+    long decompressions; // Hits served from the scratch buffer
+    long promotions;     // Compressed entries stored uncompressed again
+    long long decompress_ns; // Total time spent decompressing on hits
+
+    // Entries live in this shared segment instead, if it's set; the
+    // counters above are copied from it after each call
+    struct shmcache *shm;
+    struct cache_entry *views[CACHE_VIEWS]; // Most recent views handed out
+    int next_view;
 };
 
 extern struct cache_entry *alloc_entry(char *path, char *content_type, void *content, int content_length);
 extern void free_entry(struct cache_entry *entry);
 extern struct cache *cache_create(int max_size, int hashsize);
+extern struct cache *cache_create_shared(int max_size, long max_bytes);
 extern void cache_free(struct cache *cache);
-extern void cache_put(struct cache *cache, char *path, char *content_type, void *content, int content_length);
+extern void cache_etag(char *buf, int bufsize, void *content, int content_length);
+extern struct cache_entry *cache_put(struct cache *cache, char *path, char *content_type, void *content, int content_length);
+extern struct cache_entry *cache_put_meta(struct cache *cache, char *path, char *content_type, void *content, int content_length, char *content_encoding, time_t last_modified);
 extern struct cache_entry *cache_get(struct cache *cache, char *path);
+extern void cache_delete(struct cache *cache, struct cache_entry *ce);
+extern void cache_set_ttl(struct cache *cache, struct cache_entry *ce, int ttl);
+extern int cache_expire(struct cache *cache, time_t now, int max);
+extern void cache_set_max_bytes(struct cache *cache, long max_bytes);
+extern void cache_set_compression(struct cache *cache, int hot_max);
+extern void *cache_entry_content(struct cache *cache, struct cache_entry *ce);
+extern void cache_entry_ref(struct cache_entry *ce);
+extern void cache_entry_unref(void *ce);
+extern int cache_export(struct cache *cache);
+extern int cache_import(struct cache *cache, int fd);
 
 #endif
\ No newline at end of file
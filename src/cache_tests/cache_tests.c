@@ -1,5 +1,7 @@
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
 #include "utils.h"
 #include "minunit.h"
 #include "../cache.h"
@@ -146,6 +148,262 @@ char *test_cache_get()
   return NULL;
 }
 
+char *test_cache_etag()
+{
+  struct cache_entry *ce1 = alloc_entry("/1", "text/plain", "same", 5);
+  struct cache_entry *ce2 = alloc_entry("/2", "text/plain", "same", 5);
+  struct cache_entry *ce3 = alloc_entry("/3", "text/plain", "diff", 5);
+
+  // Check that the ETag is a quoted strong validator derived from the content
+  mu_assert(ce1->etag[0] == '"' && ce1->etag[strlen(ce1->etag) - 1] == '"', "Your alloc_entry function did not produce a quoted ETag");
+  mu_assert(strcmp(ce1->etag, ce2->etag) == 0, "Your alloc_entry function produced different ETags for the same content");
+  mu_assert(strcmp(ce1->etag, ce3->etag) != 0, "Your alloc_entry function produced the same ETag for different content");
+
+  free_entry(ce1);
+  free_entry(ce2);
+  free_entry(ce3);
+
+  return NULL;
+}
+
+char *test_cache_compression()
+{
+  // Keep 1 entry hot, compress the rest
+  struct cache *cache = cache_create(3, 0);
+  cache_set_compression(cache, 1);
+
+  char content[1024];
+  for (int i = 0; i < (int)sizeof content; i++) {
+    content[i] = "abcdefgh"[i % 8];
+  }
+
+  struct cache_entry *entry_1 = cache_put(cache, "/1", "text/plain", content, sizeof content);
+  mu_assert(entry_1->compressed_length == 0, "The hottest cache entry should not be compressed");
+  mu_assert(cache->cur_bytes == sizeof content && cache->raw_bytes == sizeof content, "The cache did not account for the bytes of a new entry");
+
+  cache_put(cache, "/2", "text/plain", content, sizeof content);
+  // Check that /1 fell out of the hot window and was compressed
+  mu_assert(entry_1->hot == 0 && entry_1->compressed_length > 0, "An entry that left the hot window was not compressed");
+  mu_assert(cache->raw_bytes == 2 * sizeof content, "The cache did not account for raw bytes");
+  mu_assert(cache->cur_bytes < cache->raw_bytes, "The cache did not account for compressed bytes");
+  mu_assert(cache->cold == entry_1, "The cold pointer should point at the first entry past the hot window");
+
+  // A hit on a compressed entry is served from the scratch buffer
+  struct cache_entry *entry = cache_get(cache, "/1");
+  mu_assert(entry == entry_1 && entry->hot == 1 && entry->compressed_length > 0, "A first hit on a cold entry should make it hot but leave it compressed");
+  mu_assert(memcmp(cache_entry_content(cache, entry), content, sizeof content) == 0, "cache_entry_content did not decompress the entry");
+  mu_assert(cache->decompressions == 1, "The cache did not count a decompression");
+
+  // A second hit while hot stores it uncompressed again
+  cache_get(cache, "/1");
+  mu_assert(entry_1->compressed_length == 0 && memcmp(entry_1->content, content, sizeof content) == 0, "A second hit on a hot compressed entry did not decompress it in place");
+  mu_assert(cache->promotions == 1, "The cache did not count a promotion");
+
+  // Evicting compressed entries keeps the accounting straight
+  cache_put(cache, "/3", "text/plain", content, sizeof content);
+  cache_put(cache, "/4", "text/plain", content, sizeof content);
+  mu_assert(cache->cur_size == 3 && cache->raw_bytes == 3 * sizeof content, "The cache did not account for evicted entries");
+  mu_assert(cache->hot_count == 1, "The hot window should hold exactly hot_max entries");
+
+  cache_free(cache);
+
+  return NULL;
+}
+
+char *test_cache_max_bytes()
+{
+  struct cache *cache = cache_create(10, 0);
+  cache_set_max_bytes(cache, 5);
+
+  cache_put(cache, "/1", "text/plain", "12", 2);
+  cache_put(cache, "/2", "text/plain", "34", 2);
+  cache_put(cache, "/3", "text/plain", "56", 2);
+
+  // Check that the least-recently used entry was evicted to stay under the byte limit
+  mu_assert(cache->cur_size == 2 && cache->cur_bytes == 4, "Your cache_put function did not evict entries to stay under max_bytes");
+  mu_assert(cache_get(cache, "/1") == NULL, "Your cache_put function did not evict the least-recently used entry for max_bytes");
+
+  cache_free(cache);
+
+  return NULL;
+}
+
+char *test_cache_ttl()
+{
+  struct cache *cache = cache_create(10, 0);
+  time_t now = time(NULL);
+
+  struct cache_entry *entry_1 = cache_put(cache, "/1", "text/plain", "1", 2);
+  struct cache_entry *entry_2 = cache_put(cache, "/2", "text/plain", "2", 2);
+  cache_put(cache, "/3", "text/plain", "3", 2);
+
+  cache_set_ttl(cache, entry_1, 10);
+  cache_set_ttl(cache, entry_2, 100);
+
+  // Nothing has expired yet
+  mu_assert(cache_expire(cache, now, 0) == 0, "cache_expire removed entries before their TTL ran out");
+  mu_assert(cache_get(cache, "/1") == entry_1, "cache_get did not return an entry before its TTL ran out");
+
+  // Only the first entry has expired at now + 50
+  mu_assert(cache_expire(cache, now + 50, 0) == 1, "cache_expire did not remove exactly the expired entry");
+  mu_assert(cache_get(cache, "/1") == NULL, "cache_get returned an expired entry");
+  mu_assert(cache->cur_size == 2 && cache->cur_bytes == 4, "cache_expire did not update the cache size");
+  mu_assert(check_cache_entries(cache->tail, entry_2) == 0, "cache_expire did not unlink the expired entry from the list");
+
+  // Expiry happens in batches
+  mu_assert(cache_expire(cache, now + 1000, 1) == 1, "cache_expire did not stop at its batch limit");
+  mu_assert(cache->cur_size == 1 && cache->expirations == 2, "cache_expire did not count expirations");
+
+  // Lookups check expiry lazily, without waiting for cache_expire
+  struct cache_entry *entry_3 = cache_get(cache, "/3");
+  entry_3->expires = now - 1;
+  mu_assert(cache_get(cache, "/3") == NULL && cache->cur_size == 0, "cache_get did not remove a stale entry");
+  mu_assert(cache->head == NULL && cache->tail == NULL, "cache_get did not empty the list when removing the last stale entry");
+
+  cache_free(cache);
+
+  return NULL;
+}
+
+char *test_cache_put_replace()
+{
+  struct cache *cache = cache_create(10, 0);
+
+  cache_put(cache, "/1", "text/plain", "old", 4);
+  struct cache_entry *entry = cache_put(cache, "/1", "text/plain", "new!", 5);
+
+  // Check that the second put replaced the first entry rather than adding another
+  mu_assert(cache->cur_size == 1 && cache->cur_bytes == 5, "cache_put did not replace an existing entry for the same path");
+  mu_assert(cache_get(cache, "/1") == entry && cache->head == entry && cache->tail == entry, "cache_put did not leave just the new entry in the cache");
+
+  cache_free(cache);
+
+  return NULL;
+}
+
+char *test_cache_entry_ref()
+{
+  struct cache *cache = cache_create(1, 0);
+
+  struct cache_entry *entry_1 = cache_put(cache, "/1", "text/plain", "1", 2);
+  cache_entry_ref(entry_1);
+
+  // A referenced entry can still be evicted, but isn't freed yet
+  cache_put(cache, "/2", "text/plain", "2", 2);
+  mu_assert(cache_get(cache, "/1") == NULL && cache->cur_size == 1, "A referenced entry was not evicted");
+  mu_assert(entry_1->removed && strcmp(entry_1->content, "1") == 0, "An evicted entry was freed while still referenced");
+
+  // Dropping the last reference frees it
+  cache_entry_unref(entry_1);
+
+  cache_free(cache);
+
+  return NULL;
+}
+
+char *test_cache_stats()
+{
+  struct cache *cache = cache_create(2, 0);
+
+  cache_put(cache, "/1", "text/plain", "1", 2);
+  cache_put(cache, "/2", "text/plain", "2", 2);
+  cache_get(cache, "/1");
+  cache_get(cache, "/3");
+
+  // A third entry pushes out the least recently used one (/2)
+  cache_put(cache, "/3", "text/plain", "3", 2);
+  cache_get(cache, "/2");
+
+  mu_assert(cache->hits == 1 && cache->misses == 2, "cache_get did not count its hits and misses");
+  mu_assert(cache->insertions == 3 && cache->evictions == 1, "cache_put did not count its insertions and evictions");
+
+  // Every lookup is counted by probe length in the index: one per
+  // cache_put() (to find what it replaces) and one per cache_get()
+  long lookups = 0;
+
+  for (int i = 0; i < HASHTABLE_PROBES; i++) {
+    lookups += cache->index->probes[i];
+  }
+
+  mu_assert(lookups == 6, "The cache index did not count its lookups");
+
+  cache_free(cache);
+
+  return NULL;
+}
+
+char *test_cache_sizes_only()
+{
+  struct cache *cache = cache_create(10, 0);
+
+  cache_set_max_bytes(cache, 1500);
+
+  // No content: the entries only take up room
+  struct cache_entry *ce = cache_put(cache, "/1", "text/html", NULL, 1000);
+
+  mu_assert(ce != NULL && ce->content == NULL, "cache_put did not take an entry without content");
+  mu_assert(cache->cur_bytes == 1000, "An entry without content did not count its size");
+
+  cache_put(cache, "/2", "text/html", NULL, 800);
+
+  mu_assert(cache_get(cache, "/1") == NULL && cache_get(cache, "/2") != NULL, "An entry without content was not evicted to make room");
+  mu_assert(cache->evictions == 1 && cache->evicted_bytes == 1000, "cache_put did not count the bytes it evicted");
+
+  cache_free(cache);
+
+  return NULL;
+}
+
+char *test_cache_shared()
+{
+  struct cache *cache = cache_create_shared(2, 0);
+  char *content = "<html><body>Shared</body></html>";
+  int status;
+
+  struct cache_entry *ce = cache_put_meta(cache, "/index.html", "text/html", content, strlen(content), "gzip", 1234);
+
+  mu_assert(ce != NULL && ce->content != content, "cache_put_meta did not store a shared entry");
+  mu_assert(strcmp(ce->content_encoding, "gzip") == 0 && ce->last_modified == 1234, "A shared entry did not keep its encoding and mtime");
+
+  // Another process sees it, and what it stores is seen here
+  pid_t pid = fork();
+
+  if (pid == 0) {
+    struct cache_entry *found = cache_get(cache, "/index.html");
+    int ok = found != NULL && found->content_length == (int)strlen(content) &&
+      memcmp(found->content, content, found->content_length) == 0 &&
+      cache_put(cache, "/child.html", "text/html", "child", 5) != NULL;
+
+    _exit(ok? 0: 1);
+  }
+
+  waitpid(pid, &status, 0);
+
+  mu_assert(WIFEXITED(status) && WEXITSTATUS(status) == 0, "Another process did not find the shared entry");
+  mu_assert(cache_get(cache, "/child.html") != NULL, "An entry stored by another process was not found");
+
+  // Still limited by entries, LRU first
+  cache_put(cache, "/3", "text/plain", "3", 1);
+
+  mu_assert(cache_get(cache, "/index.html") == NULL && cache->cur_size == 2, "The shared cache did not evict its LRU entry");
+
+  // A referenced view outlives its entry and the other views
+  ce = cache_get(cache, "/3");
+  cache_entry_ref(ce);
+  cache_delete(cache, ce);
+
+  for (int i = 0; i < CACHE_VIEWS * 2; i++) {
+    cache_get(cache, "/child.html");
+  }
+
+  mu_assert(cache_get(cache, "/3") == NULL && memcmp(ce->content, "3", 1) == 0, "A referenced shared entry did not outlive its deletion");
+
+  cache_entry_unref(ce);
+  cache_free(cache);
+
+  return NULL;
+}
+
 char *all_tests()
 {
   mu_suite_start();
@@ -154,6 +412,15 @@ char *all_tests()
   mu_run_test(test_cache_alloc_entry);
   mu_run_test(test_cache_put);
   mu_run_test(test_cache_get);
+  mu_run_test(test_cache_etag);
+  mu_run_test(test_cache_compression);
+  mu_run_test(test_cache_max_bytes);
+  mu_run_test(test_cache_ttl);
+  mu_run_test(test_cache_put_replace);
+  mu_run_test(test_cache_entry_ref);
+  mu_run_test(test_cache_stats);
+  mu_run_test(test_cache_sizes_only);
+  mu_run_test(test_cache_shared);
 
   return NULL;
 }
@@ -0,0 +1,102 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include "minunit.h"
+#include "../conn.h"
+
+char *header = "HTTP/1.1 200 OK\r\nContent-Length: 5\r\n\r\n";
+
+/**
+ * A connection on one end of a socket pair, for queueing output on
+ */
+struct conn *test_conn()
+{
+  int sv[2];
+
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+    return NULL;
+  }
+
+  close(sv[1]);
+
+  return conn_create(sv[0], NULL);
+}
+
+char *test_conn_send_flags_file()
+{
+  struct iovec iov[CONN_MAX_IOV];
+  struct conn *c = test_conn();
+  int fd = open("/dev/null", O_RDONLY);
+
+  mu_assert(c != NULL && fd >= 0, "Could not set up a connection");
+
+  conn_write(c, header, strlen(header));
+  conn_write_file(c, fd, 0, 5);
+  conn_write_close(c, fd);
+
+  int iovcnt = conn_gather(c, iov, CONN_MAX_IOV);
+
+  mu_assert(iovcnt == 1, "conn_gather did not gather the header");
+  mu_assert(conn_send_flags(c, iovcnt) == MSG_MORE, "A header followed by a file range was not sent with MSG_MORE");
+
+  conn_free(c);
+
+  return NULL;
+}
+
+char *test_conn_send_flags_close_marker()
+{
+  struct iovec iov[CONN_MAX_IOV];
+  struct conn *c = test_conn();
+  int fd = open("/dev/null", O_RDONLY);
+
+  mu_assert(c != NULL && fd >= 0, "Could not set up a connection");
+
+  // A header-only response (a 304, a 416) for a file that's then closed
+  conn_write(c, header, strlen(header));
+  conn_write_close(c, fd);
+
+  int iovcnt = conn_gather(c, iov, CONN_MAX_IOV);
+
+  mu_assert(iovcnt == 1, "conn_gather did not gather the header");
+  mu_assert(conn_send_flags(c, iovcnt) == 0, "A header followed only by a close marker was sent with MSG_MORE");
+
+  conn_free(c);
+
+  return NULL;
+}
+
+char *test_conn_send_flags_memory()
+{
+  struct iovec iov[CONN_MAX_IOV];
+  struct conn *c = test_conn();
+
+  mu_assert(c != NULL, "Could not set up a connection");
+
+  conn_write(c, header, strlen(header));
+  conn_write(c, "hello", 5);
+
+  int iovcnt = conn_gather(c, iov, CONN_MAX_IOV);
+
+  mu_assert(iovcnt >= 1, "conn_gather did not gather the response");
+  mu_assert(conn_send_flags(c, iovcnt) == 0, "A response all in memory was sent with MSG_MORE");
+
+  conn_free(c);
+
+  return NULL;
+}
+
+char *all_tests()
+{
+  mu_suite_start();
+
+  mu_run_test(test_conn_send_flags_file);
+  mu_run_test(test_conn_send_flags_close_marker);
+  mu_run_test(test_conn_send_flags_memory);
+
+  return NULL;
+}
+
+RUN_TESTS(all_tests)
@@ -0,0 +1,95 @@
+#include <stdlib.h>
+#include <string.h>
+#include "minunit.h"
+#include "../negcache.h"
+
+char *test_negcache_add()
+{
+  struct negcache *nc = negcache_create(64, 60);
+
+  mu_assert(nc != NULL, "Could not create a negative cache");
+
+  mu_assert(negcache_contains(nc, "/missing") == 0, "negcache_contains found a path never added");
+
+  negcache_add(nc, "/missing");
+
+  mu_assert(negcache_contains(nc, "/missing") == 1, "negcache_contains did not find an added path");
+  mu_assert(negcache_contains(nc, "/missing2") == 0, "negcache_contains found a different path");
+  mu_assert(nc->hits == 1 && nc->inserts == 1, "negcache did not count a hit and an insert");
+
+  negcache_free(nc);
+
+  return NULL;
+}
+
+char *test_negcache_expiry()
+{
+  struct negcache *nc = negcache_create(64, 60);
+
+  mu_assert(nc != NULL, "Could not create a negative cache");
+
+  negcache_add(nc, "/missing");
+
+  mu_assert(negcache_contains(nc, "/missing") == 1, "negcache_contains did not find an added path");
+
+  // Wind the slot's clock back past the TTL rather than sleeping
+  for (int i = 0; i < nc->size; i++) {
+    nc->slot[i].expires -= 61;
+  }
+
+  mu_assert(negcache_contains(nc, "/missing") == 0, "negcache_contains found a path past its TTL");
+
+  negcache_free(nc);
+
+  // With no TTL, a miss is never remembered
+  nc = negcache_create(64, 0);
+
+  mu_assert(nc != NULL, "Could not create a negative cache");
+
+  negcache_add(nc, "/missing");
+
+  mu_assert(negcache_contains(nc, "/missing") == 0, "negcache_contains found a path with a TTL of 0");
+
+  negcache_free(nc);
+
+  return NULL;
+}
+
+char *test_negcache_replace()
+{
+  // A single slot, so every path maps to it
+  struct negcache *nc = negcache_create(1, 60);
+
+  mu_assert(nc != NULL, "Could not create a negative cache");
+  mu_assert(nc->size == 1, "negcache_create did not make a single slot");
+
+  negcache_add(nc, "/first");
+  negcache_add(nc, "/second");
+
+  mu_assert(negcache_contains(nc, "/first") == 0, "negcache_add did not replace the path in its slot");
+  mu_assert(negcache_contains(nc, "/second") == 1, "negcache_contains did not find the replacing path");
+  mu_assert(strcmp(nc->slot[0].path, "/second") == 0, "negcache_add did not store the replacing path");
+
+  // Adding the same path again just refreshes it
+  negcache_add(nc, "/second");
+
+  mu_assert(negcache_contains(nc, "/second") == 1, "negcache_contains lost a re-added path");
+  mu_assert(nc->inserts == 3, "negcache did not count every insert");
+
+  negcache_free(nc);
+
+  return NULL;
+}
+
+char *all_tests()
+{
+  mu_suite_start();
+
+  mu_run_test(test_negcache_add);
+  mu_run_test(test_negcache_expiry);
+  mu_run_test(test_negcache_replace);
+
+  return NULL;
+}
+
+RUN_TESTS(all_tests)
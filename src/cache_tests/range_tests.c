@@ -0,0 +1,70 @@
+#include <stdlib.h>
+#include <string.h>
+#include "minunit.h"
+#include "../range.h"
+
+char *test_range_parse()
+{
+  struct byte_range r[RANGE_MAX];
+
+  mu_assert(range_parse("bytes=0-99", 1000, r, RANGE_MAX) == 1 && r[0].start == 0 && r[0].end == 99, "range_parse did not parse a plain range");
+  mu_assert(range_parse("bytes=900-", 1000, r, RANGE_MAX) == 1 && r[0].start == 900 && r[0].end == 999, "range_parse did not parse an open-ended range");
+  mu_assert(range_parse("bytes=-100", 1000, r, RANGE_MAX) == 1 && r[0].start == 900 && r[0].end == 999, "range_parse did not parse a suffix range");
+  mu_assert(range_parse("bytes=0-0, 5-9", 1000, r, RANGE_MAX) == 2 && r[1].start == 5 && r[1].end == 9, "range_parse did not parse a list of ranges");
+
+  return NULL;
+}
+
+char *test_range_parse_bad()
+{
+  struct byte_range r[RANGE_MAX];
+
+  // Ignored: the whole representation goes out
+  mu_assert(range_parse("items=0-99", 1000, r, RANGE_MAX) == 0, "range_parse accepted an unknown unit");
+  mu_assert(range_parse("bytes=-5-10", 1000, r, RANGE_MAX) == 0, "range_parse accepted a negative first position");
+  mu_assert(range_parse("bytes=--5", 1000, r, RANGE_MAX) == 0, "range_parse accepted a negative suffix");
+  mu_assert(range_parse("bytes=10-5", 1000, r, RANGE_MAX) == 0, "range_parse accepted a backwards range");
+  mu_assert(range_parse("bytes=-", 1000, r, RANGE_MAX) == 0, "range_parse accepted a range with no positions");
+
+  return NULL;
+}
+
+char *test_range_parse_beyond_eof()
+{
+  struct byte_range r[RANGE_MAX];
+
+  mu_assert(range_parse("bytes=1000-", 1000, r, RANGE_MAX) == -1, "range_parse satisfied a range starting at the end");
+  mu_assert(range_parse("bytes=2000-3000", 1000, r, RANGE_MAX) == -1, "range_parse satisfied a range past the end");
+  mu_assert(range_parse("bytes=2000-3000, 0-1", 1000, r, RANGE_MAX) == 1 && r[0].start == 0, "range_parse did not drop only the range past the end");
+  mu_assert(range_parse("bytes=500-5000", 1000, r, RANGE_MAX) == 1 && r[0].end == 999, "range_parse did not clamp a range to the end");
+  mu_assert(range_parse("bytes=-5000", 1000, r, RANGE_MAX) == 1 && r[0].start == 0 && r[0].end == 999, "range_parse did not clamp a suffix to the start");
+
+  return NULL;
+}
+
+char *test_range_parse_overflow()
+{
+  struct byte_range r[RANGE_MAX];
+
+  // 2^64 - 100: wraps to -100 if the digits overflow
+  mu_assert(range_parse("bytes=18446744073709551516-", 159, r, RANGE_MAX) == -1, "range_parse satisfied a first position that overflows");
+  mu_assert(range_parse("bytes=99999999999999999999999999-99999999999999999999999999", 159, r, RANGE_MAX) == -1, "range_parse satisfied a huge range");
+  mu_assert(range_parse("bytes=100-18446744073709551516", 159, r, RANGE_MAX) == 1 && r[0].start == 100 && r[0].end == 158, "range_parse did not clamp a last position that overflows");
+  mu_assert(range_parse("bytes=-18446744073709551516", 159, r, RANGE_MAX) == 1 && r[0].start == 0 && r[0].end == 158, "range_parse did not clamp a suffix that overflows");
+
+  return NULL;
+}
+
+char *all_tests()
+{
+  mu_suite_start();
+
+  mu_run_test(test_range_parse);
+  mu_run_test(test_range_parse_bad);
+  mu_run_test(test_range_parse_beyond_eof);
+  mu_run_test(test_range_parse_overflow);
+
+  return NULL;
+}
+
+RUN_TESTS(all_tests)
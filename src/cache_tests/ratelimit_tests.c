@@ -0,0 +1,135 @@
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include "minunit.h"
+#include "../ratelimit.h"
+
+/**
+ * An IPv4 address, 10.0.0.n
+ */
+struct sockaddr_storage test_addr(int n)
+{
+  struct sockaddr_storage ss;
+  struct sockaddr_in *sin = (struct sockaddr_in *)&ss;
+
+  memset(&ss, 0, sizeof ss);
+  sin->sin_family = AF_INET;
+  sin->sin_addr.s_addr = htonl(0x0a000000 | n);
+
+  return ss;
+}
+
+char *test_ratelimit_burst()
+{
+  struct ratelimit *rl = ratelimit_create(64, 1, 3);
+  struct sockaddr_storage a = test_addr(1);
+
+  mu_assert(rl != NULL, "Could not create a rate limiter");
+
+  // All at the same moment, so nothing refills
+  mu_assert(ratelimit_allow(rl, &a, 1000) == 1, "ratelimit_allow refused a new client");
+  mu_assert(ratelimit_allow(rl, &a, 1000) == 1, "ratelimit_allow refused a request within the burst");
+  mu_assert(ratelimit_allow(rl, &a, 1000) == 1, "ratelimit_allow refused the last request of the burst");
+  mu_assert(ratelimit_allow(rl, &a, 1000) == 0, "ratelimit_allow allowed a request past the burst");
+
+  // Another client has a bucket of its own
+  struct sockaddr_storage b = test_addr(2);
+  mu_assert(ratelimit_allow(rl, &b, 1000) == 1, "One client's burst used up another's");
+
+  ratelimit_free(rl);
+
+  return NULL;
+}
+
+char *test_ratelimit_refill()
+{
+  struct ratelimit *rl = ratelimit_create(64, 10, 2);
+  struct sockaddr_storage a = test_addr(1);
+
+  mu_assert(rl != NULL, "Could not create a rate limiter");
+
+  mu_assert(ratelimit_allow(rl, &a, 1000) == 1 && ratelimit_allow(rl, &a, 1000) == 1, "ratelimit_allow refused the burst");
+  mu_assert(ratelimit_allow(rl, &a, 1000) == 0, "ratelimit_allow allowed a request past the burst");
+
+  // At 10 a second, a token takes 100 ms
+  mu_assert(ratelimit_allow(rl, &a, 1050) == 0, "ratelimit_allow allowed a request before a token refilled");
+  mu_assert(ratelimit_allow(rl, &a, 1100) == 1, "ratelimit_allow refused a request after a token refilled");
+  mu_assert(ratelimit_allow(rl, &a, 1100) == 0, "ratelimit_allow refilled more than one token");
+
+  // Long enough idle, the bucket is full but no fuller
+  mu_assert(ratelimit_allow(rl, &a, 60000) == 1 && ratelimit_allow(rl, &a, 60000) == 1, "ratelimit_allow did not refill the bucket");
+  mu_assert(ratelimit_allow(rl, &a, 60000) == 0, "ratelimit_allow refilled past the burst");
+
+  ratelimit_free(rl);
+
+  return NULL;
+}
+
+char *test_ratelimit_evict()
+{
+  // The smallest table: a single set, so every address shares it
+  struct ratelimit *rl = ratelimit_create(1, 1, 1);
+  struct sockaddr_storage a[RATELIMIT_WAYS + 1];
+
+  mu_assert(rl != NULL, "Could not create a rate limiter");
+  mu_assert(rl->size == RATELIMIT_WAYS, "ratelimit_create did not make a single set");
+
+  // Fill the set, using up each bucket
+  for (int i = 0; i < RATELIMIT_WAYS; i++) {
+    a[i] = test_addr(i + 1);
+    mu_assert(ratelimit_allow(rl, &a[i], 1 + i) == 1, "ratelimit_allow refused a new client");
+  }
+
+  // Touch the first, so the second is now used longest ago
+  mu_assert(ratelimit_allow(rl, &a[0], 10) == 0, "ratelimit_allow forgot a client in a set with room");
+  mu_assert(rl->evictions == 0, "ratelimit_allow evicted a bucket from a set with room");
+
+  a[RATELIMIT_WAYS] = test_addr(RATELIMIT_WAYS + 1);
+  mu_assert(ratelimit_allow(rl, &a[RATELIMIT_WAYS], 20) == 1, "ratelimit_allow refused a new client in a full set");
+  mu_assert(rl->evictions == 1, "ratelimit_allow did not evict a bucket from a full set");
+
+  // The first is still remembered (and empty); the second was forgotten
+  mu_assert(ratelimit_allow(rl, &a[0], 30) == 0, "ratelimit_allow evicted a recently used bucket");
+  mu_assert(ratelimit_allow(rl, &a[1], 40) == 1, "ratelimit_allow did not evict the least recently used bucket");
+
+  ratelimit_free(rl);
+
+  return NULL;
+}
+
+char *test_ratelimit_unix()
+{
+  struct ratelimit *rl = ratelimit_create(64, 1, 1);
+  struct sockaddr_storage ss;
+
+  mu_assert(rl != NULL, "Could not create a rate limiter");
+
+  memset(&ss, 0, sizeof ss);
+  ss.ss_family = AF_UNIX;
+
+  for (int i = 0; i < 100; i++) {
+    mu_assert(ratelimit_allow(rl, &ss, 1000) == 1, "ratelimit_allow limited a Unix socket client");
+  }
+
+  mu_assert(rl->evictions == 0, "ratelimit_allow gave a Unix socket client a bucket");
+
+  ratelimit_free(rl);
+
+  return NULL;
+}
+
+char *all_tests()
+{
+  mu_suite_start();
+
+  mu_run_test(test_ratelimit_burst);
+  mu_run_test(test_ratelimit_refill);
+  mu_run_test(test_ratelimit_evict);
+  mu_run_test(test_ratelimit_unix);
+
+  return NULL;
+}
+
+RUN_TESTS(all_tests)
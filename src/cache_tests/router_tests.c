@@ -0,0 +1,142 @@
+#include <stdlib.h>
+#include <string.h>
+#include "minunit.h"
+#include "../router.h"
+
+// Handlers are only compared, never called
+void h_not_found(struct conn *c, struct cache *cache, char *path) {}
+void h_file(struct conn *c, struct cache *cache, char *path) {}
+void h_static(struct conn *c, struct cache *cache, char *path) {}
+void h_date(struct conn *c, struct cache *cache, char *path) {}
+void h_d20(struct conn *c, struct cache *cache, char *path) {}
+void h_save(struct conn *c, struct cache *cache, char *path) {}
+
+/**
+ * Look up a whole path
+ */
+route_handler lookup(struct router *r, char *method, char *path)
+{
+  return router_lookup(r, method, path, strlen(path));
+}
+
+/**
+ * A router like the server's, with a longer prefix under /
+ */
+struct router *test_router()
+{
+  struct router *r = router_create(h_not_found);
+
+  if (r == NULL
+      || router_add(r, "GET", "/", ROUTE_PREFIX, h_file) < 0
+      || router_add(r, "GET", "/static/", ROUTE_PREFIX, h_static) < 0
+      || router_add(r, "GET", "/date", ROUTE_EXACT, h_date) < 0
+      || router_add(r, "GET", "/d20", ROUTE_EXACT, h_d20) < 0
+      || router_add(r, "POST", "/save", ROUTE_EXACT, h_save) < 0
+      || router_compile(r) < 0) {
+    return NULL;
+  }
+
+  return r;
+}
+
+char *test_router_exact()
+{
+  struct router *r = test_router();
+
+  mu_assert(r != NULL, "Could not build a router");
+
+  mu_assert(lookup(r, "GET", "/date") == h_date, "router_lookup did not find an exact route");
+  mu_assert(lookup(r, "GET", "/d20") == h_d20, "router_lookup did not find an exact route sharing a prefix");
+  mu_assert(lookup(r, "POST", "/save") == h_save, "router_lookup did not find a route for another method");
+
+  // The exact route beats the / prefix route it's also under
+  mu_assert(lookup(r, "GET", "/date") != h_file, "A prefix route beat an exact match");
+
+  // Only exactly
+  mu_assert(lookup(r, "GET", "/dates") == h_file, "An exact route matched a longer path");
+  mu_assert(lookup(r, "GET", "/d2") == h_file, "An exact route matched a shorter path");
+
+  router_free(r);
+
+  return NULL;
+}
+
+char *test_router_prefix()
+{
+  struct router *r = test_router();
+
+  mu_assert(r != NULL, "Could not build a router");
+
+  mu_assert(lookup(r, "GET", "/index.html") == h_file, "router_lookup did not fall back to the / prefix");
+  mu_assert(lookup(r, "GET", "/static/app.js") == h_static, "The longest prefix did not win");
+  mu_assert(lookup(r, "GET", "/static/") == h_static, "A prefix did not match itself");
+  mu_assert(lookup(r, "GET", "/static") == h_file, "A prefix matched a shorter path");
+
+  router_free(r);
+
+  return NULL;
+}
+
+char *test_router_not_found()
+{
+  struct router *r = test_router();
+
+  mu_assert(r != NULL, "Could not build a router");
+
+  mu_assert(lookup(r, "DELETE", "/date") == h_not_found, "An unknown method did not fall back to not_found");
+  mu_assert(lookup(r, "POST", "/date") == h_not_found, "A path with no route for its method did not fall back to not_found");
+  mu_assert(lookup(r, "POST", "/saved") == h_not_found, "An unmatched path did not fall back to not_found");
+  mu_assert(lookup(r, "GET", "date") == h_not_found, "A path not starting with / did not fall back to not_found");
+
+  router_free(r);
+
+  return NULL;
+}
+
+char *test_router_path_len()
+{
+  struct router *r = test_router();
+  char *path = "/d20?n=10";
+
+  mu_assert(r != NULL, "Could not build a router");
+
+  // The server passes the length up to the query string
+  mu_assert(router_lookup(r, "GET", path, strcspn(path, "?")) == h_d20, "path_len did not cut off the query string");
+  mu_assert(router_lookup(r, "GET", path, strlen(path)) == h_file, "The query string was ignored without path_len");
+  mu_assert(router_lookup(r, "GET", "/datexyz", 5) == h_date, "router_lookup looked past path_len");
+
+  router_free(r);
+
+  return NULL;
+}
+
+char *test_router_duplicate()
+{
+  struct router *r = router_create(h_not_found);
+
+  mu_assert(r != NULL, "Could not create a router");
+
+  router_add(r, "GET", "/date", ROUTE_EXACT, h_date);
+  router_add(r, "GET", "/date", ROUTE_EXACT, h_d20);
+
+  mu_assert(router_compile(r) < 0, "router_compile accepted a duplicate route");
+
+  router_free(r);
+
+  return NULL;
+}
+
+char *all_tests()
+{
+  mu_suite_start();
+
+  mu_run_test(test_router_exact);
+  mu_run_test(test_router_prefix);
+  mu_run_test(test_router_not_found);
+  mu_run_test(test_router_path_len);
+  mu_run_test(test_router_duplicate);
+
+  return NULL;
+}
+
+RUN_TESTS(all_tests)
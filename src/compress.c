@@ -0,0 +1,168 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+#include <brotli/encode.h>
+#include "compress.h"
+
+#define GZIP_WINDOW_BITS (15 + 16) // +16 asks zlib for a gzip wrapper
+#define BROTLI_QUALITY 9 // Nearly as small as 11, much faster on first hit
+
+/**
+ * Return true if content of this type is worth compressing
+ */
+int compress_type_ok(char *content_type)
+{
+    return strncmp(content_type, "text/", 5) == 0 ||
+        strcmp(content_type, "application/javascript") == 0 ||
+        strcmp(content_type, "application/json") == 0;
+}
+
+/**
+ * Pick a content coding from an Accept-Encoding header value
+ *
+ * Only "br" and "gzip" are supported. The coding with the highest
+ * q-value wins, with br preferred on ties; q=0 means "not acceptable".
+ *
+ * Returns "br", "gzip", or NULL for identity.
+ */
+char *compress_negotiate(char *accept_encoding)
+{
+    double q_br = -1, q_gzip = -1, q_star = -1;
+    char *p = accept_encoding;
+
+    while (*p != '\0') {
+        p += strspn(p, " \t,");
+
+        if (*p == '\0') {
+            break;
+        }
+
+        int name_len = strcspn(p, " \t,;");
+        char *name = p;
+        double q = 1;
+
+        p += name_len;
+        p += strspn(p, " \t");
+
+        // Look for a q-value in the parameters
+        while (*p == ';') {
+            p++;
+            p += strspn(p, " \t");
+
+            if ((p[0] == 'q' || p[0] == 'Q') && p[1] == '=') {
+                q = strtod(p + 2, NULL);
+            }
+
+            p += strcspn(p, ",;");
+        }
+
+        if (name_len == 2 && strncasecmp(name, "br", 2) == 0) {
+            q_br = q;
+        } else if ((name_len == 4 && strncasecmp(name, "gzip", 4) == 0) ||
+            (name_len == 6 && strncasecmp(name, "x-gzip", 6) == 0)) {
+            q_gzip = q;
+        } else if (name_len == 1 && *name == '*') {
+            q_star = q;
+        }
+    }
+
+    // A wildcard covers anything not listed explicitly
+    if (q_br < 0) { q_br = q_star; }
+    if (q_gzip < 0) { q_gzip = q_star; }
+
+    if (q_br > 0 && q_br >= q_gzip) {
+        return "br";
+    }
+
+    if (q_gzip > 0) {
+        return "gzip";
+    }
+
+    return NULL;
+}
+
+/**
+ * Return the file suffix for precompressed siblings of a coding
+ */
+char *compress_suffix(char *encoding)
+{
+    return strcmp(encoding, "br") == 0? ".br": ".gz";
+}
+
+/**
+ * gzip a buffer
+ */
+void *compress_gzip(void *data, int size, int *compressed_size)
+{
+    z_stream zs;
+
+    memset(&zs, 0, sizeof zs);
+
+    if (deflateInit2(&zs, Z_BEST_COMPRESSION, Z_DEFLATED, GZIP_WINDOW_BITS, 9, Z_DEFAULT_STRATEGY) != Z_OK) {
+        return NULL;
+    }
+
+    uLong bound = deflateBound(&zs, size);
+    unsigned char *out = malloc(bound);
+
+    if (out == NULL) {
+        deflateEnd(&zs);
+        return NULL;
+    }
+
+    zs.next_in = data;
+    zs.avail_in = size;
+    zs.next_out = out;
+    zs.avail_out = bound;
+
+    if (deflate(&zs, Z_FINISH) != Z_STREAM_END) {
+        deflateEnd(&zs);
+        free(out);
+        return NULL;
+    }
+
+    *compressed_size = zs.total_out;
+
+    deflateEnd(&zs);
+
+    return out;
+}
+
+/**
+ * Brotli-compress a buffer
+ */
+void *compress_brotli(void *data, int size, int *compressed_size)
+{
+    size_t out_size = BrotliEncoderMaxCompressedSize(size);
+    unsigned char *out = malloc(out_size);
+
+    if (out == NULL) {
+        return NULL;
+    }
+
+    if (!BrotliEncoderCompress(BROTLI_QUALITY, BROTLI_DEFAULT_WINDOW, BROTLI_MODE_TEXT,
+        size, data, &out_size, out)) {
+
+        free(out);
+        return NULL;
+    }
+
+    *compressed_size = out_size;
+
+    return out;
+}
+
+/**
+ * Compress a buffer with the given content coding
+ *
+ * Returns a malloc()'d buffer the caller must free(), or NULL on error.
+ */
+void *compress_buffer(char *encoding, void *data, int size, int *compressed_size)
+{
+    if (strcmp(encoding, "br") == 0) {
+        return compress_brotli(data, size, compressed_size);
+    }
+
+    return compress_gzip(data, size, compressed_size);
+}
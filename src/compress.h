@@ -0,0 +1,11 @@
+#ifndef _COMPRESS_H_
+#define _COMPRESS_H_
+
+#define COMPRESS_MIN_SIZE 256 // Not worth compressing anything smaller
+
+extern int compress_type_ok(char *content_type);
+extern char *compress_negotiate(char *accept_encoding);
+extern char *compress_suffix(char *encoding);
+extern void *compress_buffer(char *encoding, void *data, int size, int *compressed_size);
+
+#endif
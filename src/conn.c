@@ -0,0 +1,471 @@
+/*
+
+Client connections and their output queues.
+
+Handlers don't write to the socket directly; they queue output on the
+connection and the event loop sends it as the socket becomes writable.
+Output can be:
+
+  * copied (conn_write()): for headers and small generated bodies;
+    small writes are coalesced into shared buffers
+  * referenced (conn_write_ref()): zero-copy, e.g. straight out of a
+    cache entry, with a callback to release it once sent
+  * a file range (conn_write_file()): sent with sendfile()
+
+A body that isn't all known up front can be streamed instead: a
+producer is called for more whenever everything queued has gone out
+(see conn_produce() in loop.c), and writes it with conn_write_chunk().
+
+Connections, their buffers and their output segments all come from the
+buffer pool (bufpool.c), so once it's warmed up, serving requests
+doesn't call malloc().
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
+#include "bufpool.h"
+#include "conn.h"
+
+/**
+ * Allocate a connection for an accepted socket
+ */
+struct conn *conn_create(int fd, struct loop *loop)
+{
+    struct conn *c = bufpool_alloc(sizeof *c);
+
+    if (c == NULL) {
+        return NULL;
+    }
+
+    memset(c, 0, sizeof *c);
+
+    c->in = bufpool_alloc(CONN_BUFFER_SIZE);
+
+    if (c->in == NULL) {
+        bufpool_free(c);
+        return NULL;
+    }
+
+    c->in[0] = '\0';
+    c->fd = fd;
+    c->state = CONN_READ_HEADER;
+    c->loop = loop;
+
+    arena_init(&c->arena);
+    timer_init(&c->timer, NULL, NULL);
+
+    return c;
+}
+
+/**
+ * Finish with an output segment
+ */
+void seg_free(struct conn_seg *seg)
+{
+    if (seg->release != NULL) {
+        seg->release(seg->release_arg);
+    }
+
+    if (seg->close_fd) {
+        close(seg->file_fd);
+    }
+
+    if (seg->owned) {
+        bufpool_free(seg->data);
+    }
+
+    bufpool_free(seg);
+}
+
+/**
+ * Close a connection's socket and free it, along with anything still
+ * queued on it
+ *
+ * NOTE: the caller is responsible for any timer
+ */
+void conn_free(struct conn *c)
+{
+    struct conn_seg *seg = c->out_head;
+
+    while (seg != NULL) {
+        struct conn_seg *next = seg->next;
+
+        seg_free(seg);
+        seg = next;
+    }
+
+    conn_produce_end(c);
+    close(c->fd);
+    arena_reset(&c->arena);
+    bufpool_free(c->iov);
+    bufpool_free(c->in);
+    bufpool_free(c);
+}
+
+/**
+ * Add a segment to the end of the output queue
+ */
+struct conn_seg *conn_append(struct conn *c)
+{
+    struct conn_seg *seg = bufpool_alloc(sizeof *seg);
+
+    if (seg == NULL) {
+        return NULL;
+    }
+
+    memset(seg, 0, sizeof *seg);
+    seg->file_fd = -1;
+
+    if (c->out_tail == NULL) {
+        c->out_head = c->out_tail = seg;
+    } else {
+        c->out_tail->next = seg;
+        c->out_tail = seg;
+    }
+
+    return seg;
+}
+
+/**
+ * Queue a copy of some data
+ *
+ * Returns 0, or -1 if out of memory.
+ */
+int conn_write(struct conn *c, void *buf, size_t len)
+{
+    struct conn_seg *tail = c->out_tail;
+
+    // Append to the last buffer if there's room
+    if (tail != NULL && tail->owned && tail->cap - tail->len >= len) {
+        memcpy(tail->data + tail->len, buf, len);
+        tail->len += len;
+        return 0;
+    }
+
+    char *data = bufpool_alloc(len > CONN_CHUNK_SIZE? len: CONN_CHUNK_SIZE);
+
+    if (data == NULL) {
+        return -1;
+    }
+
+    struct conn_seg *seg = conn_append(c);
+
+    if (seg == NULL) {
+        bufpool_free(data);
+        return -1;
+    }
+
+    memcpy(data, buf, len);
+
+    seg->data = data;
+    seg->len = len;
+    seg->cap = bufpool_size(data);
+    seg->owned = 1;
+
+    return 0;
+}
+
+/**
+ * Queue data without copying it
+ *
+ * The data must stay put until release(arg) is called, which happens
+ * once it's been sent or the connection is closed. release may be NULL
+ * for data that's never freed.
+ *
+ * Returns 0, or -1 if out of memory (release is called right away).
+ */
+int conn_write_ref(struct conn *c, void *buf, size_t len, void (*release)(void *), void *arg)
+{
+    struct conn_seg *seg = conn_append(c);
+
+    if (seg == NULL) {
+        if (release != NULL) {
+            release(arg);
+        }
+        return -1;
+    }
+
+    seg->data = buf;
+    seg->len = len;
+    seg->release = release;
+    seg->release_arg = arg;
+
+    return 0;
+}
+
+/**
+ * Queue a range of a file, to go out with sendfile()
+ *
+ * file_fd must stay open until it's sent; see conn_write_close().
+ *
+ * Returns 0, or -1 if out of memory.
+ */
+int conn_write_file(struct conn *c, int file_fd, off_t offset, size_t len)
+{
+    struct conn_seg *seg = conn_append(c);
+
+    if (seg == NULL) {
+        return -1;
+    }
+
+    seg->file_fd = file_fd;
+    seg->file_offset = offset;
+    seg->len = len;
+
+    return 0;
+}
+
+/**
+ * Close a file once everything queued before now has been sent
+ *
+ * Returns 0, or -1 if out of memory (the file is closed right away).
+ */
+int conn_write_close(struct conn *c, int file_fd)
+{
+    struct conn_seg *seg = conn_append(c);
+
+    if (seg == NULL) {
+        close(file_fd);
+        return -1;
+    }
+
+    seg->file_fd = file_fd;
+    seg->close_fd = 1;
+
+    return 0;
+}
+
+/**
+ * Queue a piece of a streamed response body
+ *
+ * Frames it as a chunk if the response is chunked. Empty pieces are
+ * ignored, as they'd end the body.
+ *
+ * Returns 0, or -1 if out of memory.
+ */
+int conn_write_chunk(struct conn *c, void *buf, size_t len)
+{
+    char size[24];
+
+    if (len == 0) {
+        return 0;
+    }
+
+    if (!c->out_chunked) {
+        return conn_write(c, buf, len);
+    }
+
+    int n = snprintf(size, sizeof size, "%zx\r\n", len);
+
+    if (conn_write(c, size, n) < 0 || conn_write(c, buf, len) < 0 || conn_write(c, "\r\n", 2) < 0) {
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Stop producing a streamed response, releasing the producer
+ */
+void conn_produce_end(struct conn *c)
+{
+    if (c->produce == NULL) {
+        return;
+    }
+
+    c->produce = NULL;
+
+    if (c->produce_release != NULL) {
+        c->produce_release(c->produce_arg);
+    }
+}
+
+/**
+ * Drop the first segment of the output queue
+ */
+void conn_pop(struct conn *c)
+{
+    struct conn_seg *seg = c->out_head;
+
+    c->out_head = seg->next;
+
+    if (c->out_head == NULL) {
+        c->out_tail = NULL;
+    }
+
+    seg_free(seg);
+}
+
+/**
+ * Send some of the file range at the front of the output queue
+ *
+ * Returns what sendfile() did, except that a file that's shrunk
+ * underneath us is an error.
+ */
+ssize_t conn_sendfile(struct conn *c)
+{
+    struct conn_seg *seg = c->out_head;
+    ssize_t rv = sendfile(c->fd, seg->file_fd, &seg->file_offset, seg->len);
+
+    if (rv == 0) {
+        errno = EIO;
+        return -1;
+    }
+
+    if (rv > 0) {
+        seg->len -= rv;
+        c->sent += rv;
+    }
+
+    return rv;
+}
+
+/**
+ * Gather the run of memory segments at the front of the output queue
+ *
+ * Segments that are already done are retired first.
+ *
+ * Returns the number of iovecs filled in (at most max), or 0 if the
+ * queue is empty or starts with a file range.
+ */
+int conn_gather(struct conn *c, struct iovec *iov, int max)
+{
+    int iovcnt = 0;
+
+    while (c->out_head != NULL && c->out_head->off == c->out_head->len) {
+        conn_pop(c);
+    }
+
+    for (struct conn_seg *s = c->out_head; s != NULL && s->data != NULL && iovcnt < max; s = s->next) {
+        iov[iovcnt].iov_base = s->data + s->off;
+        iov[iovcnt].iov_len = s->len - s->off;
+        iovcnt++;
+    }
+
+    return iovcnt;
+}
+
+/**
+ * Flags for sending the iovcnt memory segments conn_gather() just
+ * gathered
+ *
+ * If a file range comes straight after them, that's MSG_MORE: the
+ * kernel holds on to a partly filled packet, and the start of the file
+ * goes out in it. A response header and the file it's for then share
+ * a packet, as TCP_CORK would have them, without the setsockopt()s
+ * to cork and uncork.
+ *
+ * Markers that only close a file (see conn_write_close()) don't count:
+ * after a header-only response, say a 304, nothing would come to push
+ * the held packet out.
+ */
+int conn_send_flags(struct conn *c, int iovcnt)
+{
+    struct conn_seg *s = c->out_head;
+
+    while (s != NULL && iovcnt-- > 0) {
+        s = s->next;
+    }
+
+    while (s != NULL && s->data == NULL && s->len == 0) {
+        s = s->next;
+    }
+
+    return s != NULL && s->data == NULL? MSG_MORE: 0;
+}
+
+/**
+ * Retire len bytes of memory segments from the output queue once
+ * they've gone out
+ */
+void conn_sent(struct conn *c, size_t len)
+{
+    c->sent += len;
+
+    while (len > 0) {
+        struct conn_seg *seg = c->out_head;
+
+        if (len < seg->len - seg->off) {
+            seg->off += len;
+            break;
+        }
+
+        len -= seg->len - seg->off;
+        conn_pop(c);
+    }
+}
+
+/**
+ * Send as much queued output as the socket will take
+ *
+ * Runs of memory segments go out with one sendmsg(); file ranges go out
+ * with sendfile().
+ *
+ * Returns 1 if the queue is empty, 0 if the socket is full, or -1 on
+ * error.
+ */
+int conn_flush(struct conn *c)
+{
+    struct iovec iov[CONN_MAX_IOV];
+
+    while (1) {
+        int iovcnt = conn_gather(c, iov, CONN_MAX_IOV);
+        struct conn_seg *seg = c->out_head;
+        ssize_t rv;
+
+        if (seg == NULL) {
+            return 1;
+        }
+
+        if (iovcnt == 0) {
+            rv = conn_sendfile(c);
+
+            if (rv > 0) {
+                continue;
+            }
+
+        } else {
+            struct msghdr msg = { .msg_iov = iov, .msg_iovlen = iovcnt };
+
+            rv = sendmsg(c->fd, &msg, conn_send_flags(c, iovcnt));
+
+            if (rv > 0) {
+                conn_sent(c, rv);
+                continue;
+            }
+        }
+
+        if (rv < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (rv < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return 0;
+        }
+
+        return -1;
+    }
+}
+
+/**
+ * Remove len bytes (a handled request) from the front of the request
+ * buffer, keeping anything pipelined behind it, and free the request's
+ * temporaries
+ */
+void conn_consume(struct conn *c, int len)
+{
+    arena_reset(&c->arena);
+
+    memmove(c->in, c->in + len, c->in_len - len);
+
+    c->in_len -= len;
+    c->in[c->in_len] = '\0';
+    c->header_len = 0;
+    c->body_len = 0;
+}
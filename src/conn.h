@@ -0,0 +1,124 @@
+#ifndef _CONN_H_
+#define _CONN_H_
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include "timerwheel.h"
+#include "arena.h"
+
+#define CONN_BUFFER_SIZE 65536 // 64K: biggest request (header + body) we buffer
+#define CONN_CHUNK_SIZE 4096   // Room in each buffer of copied output
+#define CONN_MAX_IOV 64        // Most memory segments sent in one go
+
+// Where a connection is in the request/response cycle
+enum conn_state {
+    CONN_READ_HEADER, // Waiting for (the rest of) a request header
+    CONN_READ_BODY,   // Waiting for the rest of the request body
+    CONN_WRITE,       // Sending the response
+};
+
+// Where a chunked request body is up to
+enum chunk_state {
+    CHUNK_SIZE,     // Waiting for a chunk-size line
+    CHUNK_DATA,     // Reading chunk data
+    CHUNK_DATA_END, // Waiting for the CRLF after the data
+    CHUNK_TRAILER,  // Skipping trailer fields, up to the blank line
+};
+
+// A piece of queued output: memory, or a range of a file
+struct conn_seg {
+    struct conn_seg *next;
+
+    char *data;   // Memory to send, or NULL for a file range
+    size_t off;   // Bytes of data already sent
+    size_t len;   // Bytes of data; for a file, bytes left to send
+    size_t cap;   // Room in data if we own it (so more can be appended)
+    int owned;    // True if data is ours to free
+
+    int file_fd;       // File to send from, or -1
+    off_t file_offset; // Where in the file we're up to
+    int close_fd;      // Close file_fd once this segment is sent
+
+    void (*release)(void *arg); // Called once the segment is sent, or NULL
+    void *release_arg;
+};
+
+// A client connection
+struct conn {
+    int fd;
+    int state;      // enum conn_state
+    int keep_alive; // True if the connection stays open after this response
+    int http10;     // The request was HTTP/1.0, so no chunked responses
+    int requests;   // Requests handled so far
+    int idle;       // True while kept alive waiting for the next request
+    int events;     // epoll events we're waiting for
+    int in_handler; // The request handler is running
+    int pending;    // Offloaded work is producing the response
+    int closed;     // Closed while work was pending; freed when it's back
+
+    struct sockaddr_storage addr; // Client address
+
+    char *in;       // Request buffer, always NUL-terminated
+    int in_len;     // Bytes in the request buffer
+    int header_len; // Length of the current request header, once complete
+    int body_len;   // Length of the current request body
+
+    struct arena arena; // The current request's temporaries
+
+    // Streamed request bodies (see conn_stream_body())
+    int streaming;   // The body goes to body_data() as it arrives
+    int chunked;     // The body is in chunked transfer encoding
+    int chunk_state; // enum chunk_state
+    long body_left;  // Bytes still to come: of the body, or of this chunk
+    int (*body_data)(struct conn *c, char *data, int len);
+    void (*body_done)(struct conn *c, int error);
+    void *body_arg;
+
+    struct conn_seg *out_head, *out_tail; // Queued response
+
+    // Streamed responses (see conn_produce())
+    int (*produce)(struct conn *c, void *arg); // Queues more of the body
+    void (*produce_release)(void *arg);         // Called once it's done
+    void *produce_arg;
+    int out_chunked; // The body is in chunked transfer encoding
+
+    // For the access log and metrics
+    int status;            // Of the response, once its header is queued
+    int metric;            // Histogram for the request's latency, or -1
+    long long sent;        // Bytes sent on this connection
+    long long req_start;   // When the request header was complete (ns), or 0
+    long long req_sent;    // What sent was then
+    long long req_handled; // When the handler returned (ns), or 0
+
+    // Phase tracing (see trace.h)
+    unsigned long trace_id;         // The current request's, if it's traced, else 0
+    unsigned long long trace_start; // When it started, in trace_clock() ticks
+
+    struct timer timer; // Whichever timeout applies to the current state
+    struct loop *loop;  // The event loop that owns this connection
+
+    // io_uring backend only
+    int ops;     // Operations in flight; the connection can't be freed until 0
+    int closing; // Closed, waiting for ops to finish
+    int sending; // A send is in flight
+    struct iovec *iov; // What that send is sending
+    struct msghdr msg; // ...and how
+};
+
+extern struct conn *conn_create(int fd, struct loop *loop);
+extern void conn_free(struct conn *c);
+extern int conn_write(struct conn *c, void *buf, size_t len);
+extern int conn_write_ref(struct conn *c, void *buf, size_t len, void (*release)(void *), void *arg);
+extern int conn_write_file(struct conn *c, int file_fd, off_t offset, size_t len);
+extern int conn_write_close(struct conn *c, int file_fd);
+extern int conn_write_chunk(struct conn *c, void *buf, size_t len);
+extern void conn_produce_end(struct conn *c);
+extern int conn_gather(struct conn *c, struct iovec *iov, int max);
+extern int conn_send_flags(struct conn *c, int iovcnt);
+extern void conn_sent(struct conn *c, size_t len);
+extern ssize_t conn_sendfile(struct conn *c);
+extern int conn_flush(struct conn *c);
+extern void conn_consume(struct conn *c, int len);
+
+#endif
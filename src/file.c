@@ -36,6 +36,7 @@ struct file_data *file_load(char *filename)
     p = buffer = malloc(bytes_remaining);
 
     if (buffer == NULL) {
+        fclose(fp);
         return NULL;
     }
 
@@ -43,6 +44,7 @@ struct file_data *file_load(char *filename)
     while (bytes_read = fread(p, 1, bytes_remaining, fp), bytes_read != 0 && bytes_remaining > 0) {
         if (bytes_read == -1) {
             free(buffer);
+            fclose(fp);
             return NULL;
         }
 
@@ -51,6 +53,8 @@ struct file_data *file_load(char *filename)
         total_bytes += bytes_read;
     }
 
+    fclose(fp);
+
     // Allocate the file data struct
     struct file_data *filedata = malloc(sizeof *filedata);
 
@@ -61,6 +65,7 @@ struct file_data *file_load(char *filename)
 
     filedata->data = buffer;
     filedata->size = total_bytes;
+    filedata->mtime = buf.st_mtime;
 
     return filedata;
 }
@@ -1,9 +1,12 @@
 #ifndef _FILELS_H_ // This was just _FILE_H_, but that interfered with Cygwin
 #define _FILELS_H_
 
+#include <time.h>
+
 struct file_data {
     int size;
     void *data;
+    time_t mtime; // Last modification time, from stat()
 };
 
 extern struct file_data *file_load(char *filename);
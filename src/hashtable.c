@@ -52,6 +52,12 @@ struct htent {
     void *data;
 };
 
+// A key being looked up, counting the entries compared against
+struct htprobe {
+    struct htent ent; // Must be first
+    int probes;
+};
+
 // Used to cleanup the linked lists
 struct foreach_callback_payload {
 	void *arg;
@@ -72,15 +78,15 @@ void add_entry_count(struct hashtable *ht, int d)
  */
 int default_hashf(void *data, int data_size, int bucket_count)
 {
-    const int R = 31; // Small prime
-    int h = 0;
+    const unsigned int R = 31; // Small prime
+    unsigned int h = 0;
     unsigned char *p = data;
 
     for (int i = 0; i < data_size; i++) {
-        h = (R * h + p[i]) % bucket_count;
+        h = R * h + p[i];
     }
 
-    return h;
+    return h % bucket_count;
 }
 
 /**
@@ -105,6 +111,7 @@ struct hashtable *hashtable_create(int size, int (*hashf)(void *, int, int))
     ht->load = 0;
     ht->bucket = malloc(size * sizeof(struct llist *));
     ht->hashf = hashf;
+    memset(ht->probes, 0, sizeof ht->probes);
 
     for (int i = 0; i < size; i++) {
         ht->bucket[i] = llist_create();
@@ -120,6 +127,7 @@ void htent_free(void *htent, void *arg)
 {
 	(void)arg;
 
+	free(((struct htent *)htent)->key);
 	free(htent);
 }
 
@@ -137,6 +145,7 @@ void hashtable_destroy(struct hashtable *ht)
         llist_destroy(llist);
     }
 
+    free(ht->bucket);
     free(ht);
 }
 
@@ -191,6 +200,16 @@ int htcmp(void *a, void *b)
     return memcmp(entA->key, entB->key, entA->key_size);
 }
 
+/**
+ * Compare a key being looked up, and count the probe
+ */
+int htcmp_probe(void *a, void *b)
+{
+    ((struct htprobe *)a)->probes++;
+
+    return htcmp(a, b);
+}
+
 /**
  * Get from the hash table with a string key
  */
@@ -208,11 +227,14 @@ void *hashtable_get_bin(struct hashtable *ht, void *key, int key_size)
 
     struct llist *llist = ht->bucket[index];
 
-    struct htent cmpent;
-    cmpent.key = key;
-    cmpent.key_size = key_size;
+    struct htprobe cmpent;
+    cmpent.ent.key = key;
+    cmpent.ent.key_size = key_size;
+    cmpent.probes = 0;
+
+    struct htent *n = llist_find(llist, &cmpent, htcmp_probe);
 
-    struct htent *n = llist_find(llist, &cmpent, htcmp);
+    ht->probes[cmpent.probes < HASHTABLE_PROBES? cmpent.probes: HASHTABLE_PROBES - 1]++;
 
     if (n == NULL) { return NULL; }
 
@@ -250,6 +272,7 @@ void *hashtable_delete_bin(struct hashtable *ht, void *key, int key_size)
 
 	void *data = ent->data;
 
+	free(ent->key);
 	free(ent);
 
     add_entry_count(ht, -1);
@@ -1,12 +1,17 @@
 #ifndef _HASHTABLE_H_
 #define _HASHTABLE_H_
 
+#define HASHTABLE_PROBES 9 // Probe lengths counted separately; the last is "or more"
+
 struct hashtable {
     int size; // Read-only
     int num_entries; // Read-only
     float load; // Read-only
     struct llist **bucket;
     int (*hashf)(void *data, int data_size, int bucket_count);
+
+    // Lookups, by how many entries they compared against; read-only
+    long probes[HASHTABLE_PROBES];
 };
 
 extern struct hashtable *hashtable_create(int size, int (*hashf)(void *, int, int));
@@ -0,0 +1,129 @@
+#define _GNU_SOURCE // strptime(), timegm()
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include "http.h"
+
+/**
+ * Format a time as an HTTP-date (RFC 7231), e.g.
+ * "Sun, 06 Nov 1994 08:49:37 GMT"
+ */
+void http_date(char *buf, int bufsize, time_t t)
+{
+    struct tm tm;
+
+    gmtime_r(&t, &tm);
+    strftime(buf, bufsize, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+}
+
+/**
+ * Parse an HTTP-date
+ *
+ * Returns -1 if the date can't be parsed.
+ */
+time_t http_date_parse(char *s)
+{
+    struct tm tm;
+
+    memset(&tm, 0, sizeof tm);
+
+    if (strptime(s, "%a, %d %b %Y %H:%M:%S GMT", &tm) == NULL) {
+        return -1;
+    }
+
+    return timegm(&tm);
+}
+
+/**
+ * Find a header field in the request header
+ *
+ * The name match is case-insensitive. The value (without leading
+ * whitespace or the trailing newline) is copied into value. The search
+ * stops at the blank line that ends the header, so the body is never
+ * mistaken for header fields.
+ *
+ * Returns value, or NULL if the header isn't present.
+ */
+char *get_header(char *header, char *name, char *value, int value_size)
+{
+    int name_len = strlen(name);
+
+    // Skip the request line
+    char *p = strpbrk(header, "\r\n");
+
+    while (p != NULL) {
+        // Step over exactly one line ending; a second one is the blank
+        // line at the end of the header
+        if (p[0] == '\r' && p[1] == '\n') {
+            p += 2;
+        } else {
+            p++;
+        }
+
+        if (*p == '\0' || *p == '\r' || *p == '\n') {
+            break;
+        }
+
+        if (strncasecmp(p, name, name_len) == 0 && p[name_len] == ':') {
+            char *v = p + name_len + 1;
+            v += strspn(v, " \t");
+
+            int len = strcspn(v, "\r\n");
+
+            // Trailing whitespace isn't part of the value
+            while (len > 0 && (v[len - 1] == ' ' || v[len - 1] == '\t')) {
+                len--;
+            }
+
+            if (len >= value_size) {
+                len = value_size - 1;
+            }
+
+            memcpy(value, v, len);
+            value[len] = '\0';
+
+            return value;
+        }
+
+        p = strpbrk(p, "\r\n");
+    }
+
+    return NULL;
+}
+
+/**
+ * Search for the end of the HTTP header
+ * 
+ * "Newlines" in HTTP can be \r\n (carriage return followed by newline) or \n
+ * (newline) or \r (carriage return).
+ *
+ * Returns a pointer to the start of the body, or NULL if the header
+ * isn't complete yet.
+ */
+char *find_start_of_body(char *header)
+{
+    for (char *p = header; *p != '\0'; p++) {
+        if (strncmp(p, "\r\n\r\n", 4) == 0) {
+            return p + 4;
+        }
+
+        if (strncmp(p, "\n\n", 2) == 0 || strncmp(p, "\r\r", 2) == 0) {
+            return p + 2;
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Return the status code from a status line, e.g. 404 from
+ * "HTTP/1.1 404 NOT FOUND", or 0 if there isn't one
+ */
+int http_status(char *status_line)
+{
+    char *p = strchr(status_line, ' ');
+
+    return p != NULL? atoi(p + 1): 0;
+}
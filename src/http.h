@@ -0,0 +1,14 @@
+#ifndef _HTTP_H_
+#define _HTTP_H_
+
+#include <time.h>
+
+#define HTTP_DATE_LENGTH 29 // strlen("Sun, 06 Nov 1994 08:49:37 GMT")
+
+extern void http_date(char *buf, int bufsize, time_t t);
+extern time_t http_date_parse(char *s);
+extern char *get_header(char *header, char *name, char *value, int value_size);
+extern char *find_start_of_body(char *header);
+extern int http_status(char *status_line);
+
+#endif
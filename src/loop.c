@@ -0,0 +1,1454 @@
+/*
+
+The event loop.
+
+Every socket is non-blocking and watched with epoll. Each connection
+moves through:
+
+    READ_HEADER -> READ_BODY -> WRITE -> (keep-alive) READ_HEADER ...
+
+A request is handed to the handler only once it's all in the buffer;
+the handler queues its response on the connection (see conn.c) and we
+send it as the socket allows. Pipelined requests are picked up from
+the buffer as soon as the previous response is out.
+
+Bodies too big to buffer, or chunked ones, can be streamed instead: the
+header handler sees each request header as soon as it's in and can
+claim the body with conn_stream_body(). The body is then decoded and
+handed over piece by piece as it arrives, and the handler's body_done()
+takes the place of the request handler.
+
+Responses can be streamed the same way: a handler that doesn't know its
+whole body up front sets a producer with conn_produce(), and we call it
+for more each time everything queued has gone out. That way a slow
+client holds up the producer rather than making us buffer for it.
+
+Every connection has one timer in a timer wheel, set for whatever it's
+waiting on:
+
+    header:     the whole request header must arrive in time, so a
+                client trickling bytes (slowloris) can't hold it forever
+    body:       the body must keep arriving
+    write:      the client must keep reading the response
+    keep-alive: an idle connection is closed
+
+Two backends wait for I/O: epoll (readiness, the default) and io_uring
+(completions, see uring.c). Everything else here is shared.
+
+`kill -USR1` the server to have it print its allocation counters and
+the like to stderr. `kill -USR2` turns phase tracing on (see trace.c);
+the next one turns it off and writes out the trace. `kill -QUIT` stops
+it gracefully: it stops accepting, lets its connections finish and
+exits. Handing over to a new server (see restart.c) does the same.
+
+*/
+
+#define _GNU_SOURCE // strcasestr(), accept4()
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "net.h"
+#include "http.h"
+#include "loop.h"
+#include "uring.h"
+#include "bufpool.h"
+#include "arena.h"
+#include "accesslog.h"
+#include "metrics.h"
+#include "trace.h"
+#include "restart.h"
+
+#define MAX_EVENTS 64
+
+#define ACCEPT_BATCH 64 // Most connections accepted per wakeup
+
+#define EXPIRE_INTERVAL 1000 // ms between sweeps for expired cache entries
+#define EXPIRE_BATCH 64      // Most expired entries freed per sweep
+
+#define CHUNK_LINE_MAX 1024 // Longest chunk-size or trailer line we wait for
+
+// Set by SIGUSR1; the stats are printed on the next tick
+volatile sig_atomic_t loop_stats_wanted;
+
+// Set by SIGUSR2; tracing is turned on or off on the next tick
+volatile sig_atomic_t loop_trace_wanted;
+
+// Set by SIGQUIT; draining starts on the next tick
+volatile sig_atomic_t loop_drain_wanted;
+
+// Labels for counting responses by status / 100
+char *loop_status_labels[] = {
+    "code=\"none\"", "code=\"1xx\"", "code=\"2xx\"",
+    "code=\"3xx\"", "code=\"4xx\"", "code=\"5xx\"",
+};
+
+// Labels for counting rejections, by enum loop_reject
+char *loop_reject_labels[] = {
+    "reason=\"connections\"", "reason=\"rate\"", "reason=\"overload\"",
+};
+
+// Sent to connections past loop->max_conns, all in one go. Servers may
+// leave Date out of a 5xx, and so it never changes.
+char loop_refusal[] =
+    "HTTP/1.1 503 SERVICE UNAVAILABLE\r\n"
+    "Retry-After: 1\r\n"
+    "Connection: close\r\n"
+    "Content-Length: 0\r\n"
+    "\r\n";
+
+/**
+ * Return monotonic time in ms
+ */
+unsigned long long loop_clock(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+/**
+ * Make a file descriptor non-blocking
+ */
+int set_nonblocking(int fd)
+{
+    int flags = fcntl(fd, F_GETFL, 0);
+
+    if (flags == -1) {
+        return -1;
+    }
+
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+/**
+ * Create an event loop for a listening socket
+ *
+ * handler is called with each complete request.
+ */
+struct loop *loop_create(int listenfd, struct cache *cache, void (*handler)(struct conn *, struct cache *))
+{
+    struct loop *loop = calloc(1, sizeof *loop);
+
+    if (loop == NULL) {
+        return NULL;
+    }
+
+    loop->listenfd = listenfd;
+    loop->cache = cache;
+    loop->handler = handler;
+    loop->now = loop_clock();
+
+    loop->header_timeout = HEADER_TIMEOUT;
+    loop->body_timeout = BODY_TIMEOUT;
+    loop->write_timeout = WRITE_TIMEOUT;
+    loop->keepalive_timeout = KEEPALIVE_TIMEOUT;
+
+    loop->trace_every = 1;
+    loop->trace_file = TRACE_FILE;
+    loop->restart_fd = -1;
+
+    loop->metric_parse = metrics_histogram("webserver_phase_duration_seconds",
+        "Time spent in each phase of handling a request", "phase=\"parse\"");
+    loop->metric_send = metrics_histogram("webserver_phase_duration_seconds",
+        "Time spent in each phase of handling a request", "phase=\"send\"");
+    loop->metric_bytes = metrics_counter("webserver_response_bytes_total",
+        "Response bytes sent", "");
+
+    for (int i = 0; i < 6; i++) {
+        loop->metric_responses[i] = metrics_counter("webserver_responses_total",
+            "Responses sent, by status class", loop_status_labels[i]);
+    }
+
+    for (int i = 0; i < LOOP_REJECT_REASONS; i++) {
+        loop->metric_rejected[i] = metrics_counter("webserver_rejected_total",
+            "Connections and requests turned away by admission control", loop_reject_labels[i]);
+    }
+
+    loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+    loop->timers = timerwheel_create(loop->now);
+
+    if (loop->epfd < 0 || loop->timers == NULL || set_nonblocking(listenfd) < 0) {
+        perror("loop_create");
+
+        if (loop->epfd >= 0) {
+            close(loop->epfd);
+        }
+
+        free(loop->timers);
+        free(loop);
+        return NULL;
+    }
+
+    struct epoll_event ev;
+
+    // Exclusive, so that when preforked workers share the listener a
+    // connection only wakes one of them
+    ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+    ev.data.ptr = NULL; // NULL means the listener
+
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, listenfd, &ev) < 0) {
+        perror("epoll_ctl");
+        close(loop->epfd);
+        timerwheel_free(loop->timers);
+        free(loop);
+        return NULL;
+    }
+
+    return loop;
+}
+
+/**
+ * Switch an event loop over to io_uring
+ *
+ * Returns 0, or -1 if io_uring isn't available, in which case the loop
+ * stays on epoll.
+ */
+int loop_use_uring(struct loop *loop)
+{
+    loop->uring = uring_create(loop);
+
+    if (loop->uring == NULL) {
+        return -1;
+    }
+
+    // Don't need this any more
+    close(loop->epfd);
+    loop->epfd = -1;
+
+    return 0;
+}
+
+/**
+ * Run finished offloaded work through the event loop
+ *
+ * Tasks submitted to the pool get their done() callbacks called from
+ * the loop, once they've run.
+ */
+void loop_set_pool(struct loop *loop, struct pool *pool)
+{
+    loop->pool = pool;
+
+    if (loop->uring != NULL) {
+        uring_watch(loop->uring, pool->efd);
+        return;
+    }
+
+    struct epoll_event ev;
+
+    ev.events = EPOLLIN;
+    ev.data.ptr = pool;
+
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, pool->efd, &ev) < 0) {
+        perror("epoll_ctl");
+    }
+}
+
+/**
+ * Free a connection, however the backend does it
+ */
+void conn_destroy(struct conn *c)
+{
+    if (c->loop->uring != NULL) {
+        uring_close(c);
+    } else {
+        conn_free(c);
+    }
+}
+
+/**
+ * Decide whether to trace the request that's starting on a connection
+ */
+void conn_trace_start(struct conn *c)
+{
+    c->trace_id = trace_request();
+
+    if (c->trace_id != 0) {
+        c->trace_start = trace_clock();
+    }
+}
+
+/**
+ * Start timing a request, for the access log and metrics
+ */
+void conn_request_start(struct conn *c)
+{
+    // Already picked (or not) when its first bytes were read, unless
+    // it came in behind the one before
+    if (c->trace_id == 0 && trace_every != 0) {
+        conn_trace_start(c);
+    }
+
+    c->req_start = metrics_clock();
+    c->req_sent = c->sent;
+    c->req_handled = 0;
+    c->status = 0;
+    c->metric = -1;
+}
+
+/**
+ * Copy the next space-separated word of the request line
+ *
+ * Returns the rest of the line.
+ */
+char *conn_log_word(char *dst, int size, char *src)
+{
+    int len = strcspn(src, " \r\n");
+
+    if (len == 0) {
+        strcpy(dst, "-");
+    } else {
+        if (len > size - 1) {
+            len = size - 1;
+        }
+
+        memcpy(dst, src, len);
+        dst[len] = '\0';
+    }
+
+    src += strcspn(src, " \r\n");
+
+    return src + strspn(src, " ");
+}
+
+/**
+ * Log the current request and record its metrics, if it's being timed
+ *
+ * Called once it's been answered, or given up on.
+ */
+void conn_request_done(struct conn *c)
+{
+    struct loop *loop = c->loop;
+    struct accesslog_record rec;
+
+    if (c->req_start == 0) {
+        c->trace_id = 0;
+        return;
+    }
+
+    TRACE_END(c->trace_id, "request", c->trace_start);
+    c->trace_id = 0;
+
+    long long now = metrics_clock();
+    long long latency = now - c->req_start;
+    int class = c->status / 100;
+
+    metrics_observe(c->metric, latency);
+    metrics_add(loop->metric_responses[class >= 1 && class <= 5? class: 0], 1);
+    metrics_add(loop->metric_bytes, c->sent - c->req_sent);
+
+    if (c->req_handled != 0) {
+        metrics_observe(loop->metric_send, now - c->req_handled);
+    }
+
+    c->req_start = 0;
+
+    if (loop->accesslog == NULL) {
+        return;
+    }
+
+    rec.time = time(NULL);
+    rec.latency = latency / 1000;
+    rec.bytes = c->sent - c->req_sent;
+    rec.status = c->status;
+    rec.family = c->addr.ss_family;
+
+    // A Unix socket's client has no address to log
+    if (rec.family == AF_INET || rec.family == AF_INET6) {
+        memcpy(rec.addr, get_in_addr((struct sockaddr *)&c->addr),
+            rec.family == AF_INET6? 16: 4);
+    }
+
+    conn_log_word(rec.path, sizeof rec.path,
+        conn_log_word(rec.method, sizeof rec.method, c->in));
+
+    accesslog_add(loop->accesslog, &rec);
+}
+
+/**
+ * Close a connection
+ *
+ * If offloaded work is still under way for it, it's freed once that
+ * comes back (see conn_resume()).
+ */
+void conn_close(struct conn *c)
+{
+    struct loop *loop = c->loop;
+
+    timerwheel_del(loop->timers, &c->timer);
+    loop->nconns--;
+
+    conn_request_done(c);
+
+    // Hung up partway through a streamed body
+    if (c->streaming) {
+        c->streaming = 0;
+        c->body_done(c, -1);
+        c->body_done = NULL;
+    }
+
+    if (c->pending) {
+        c->closed = 1;
+
+        if (loop->uring == NULL) {
+            epoll_ctl(loop->epfd, EPOLL_CTL_DEL, c->fd, NULL);
+        }
+        return;
+    }
+
+    conn_destroy(c);
+}
+
+/**
+ * Tell the loop the response is being produced elsewhere (e.g. by a
+ * task in the pool)
+ *
+ * The connection waits, sending nothing, until conn_resume().
+ */
+void conn_suspend(struct conn *c)
+{
+    c->pending = 1;
+}
+
+/**
+ * The response for a suspended connection is queued; carry on
+ */
+void conn_resume(struct conn *c)
+{
+    c->pending = 0;
+
+    if (c->closed) {
+        conn_destroy(c);
+        return;
+    }
+
+    // If the work finished right away, we're still in the handler and
+    // conn_process() will carry on by itself
+    if (!c->in_handler) {
+        conn_writable(c);
+    }
+}
+
+/**
+ * Take the request body as it arrives, rather than once it's all
+ * buffered
+ *
+ * Only for the header handler. data() is given each piece of the body,
+ * decoded if it's chunked, and returns 0, or -1 to give up (we send a
+ * 500). Once it's all in, done(c, 0) is called in place of the request
+ * handler to queue the response. If the body can't be finished (the
+ * client hangs up or sends garbage), done(c, -1) is called instead and
+ * mustn't respond.
+ */
+void conn_stream_body(struct conn *c, int (*data)(struct conn *, char *, int), void (*done)(struct conn *, int), void *arg)
+{
+    c->streaming = 1;
+    c->body_data = data;
+    c->body_done = done;
+    c->body_arg = arg;
+}
+
+/**
+ * Stream the response body from a producer
+ *
+ * For handlers, before queueing the response header: afterward,
+ * c->out_chunked says whether the body will be chunked (it's not for
+ * HTTP/1.0 clients; the body then ends when the connection closes).
+ *
+ * produce(c, arg) is called each time everything queued so far has
+ * been sent. It queues the next piece with conn_write_chunk() and
+ * returns 1 if there's more to come, 0 if that's the end, or -1 to
+ * give up, which closes the connection with the body cut short. If the
+ * next piece isn't ready, it can conn_suspend() the connection rather
+ * than queue anything.
+ *
+ * release(arg), if not NULL, is called once the producer is finished
+ * with, however that happens.
+ */
+void conn_produce(struct conn *c, int (*produce)(struct conn *, void *), void (*release)(void *), void *arg)
+{
+    c->produce = produce;
+    c->produce_release = release;
+    c->produce_arg = arg;
+    c->out_chunked = !c->http10;
+
+    if (c->http10) {
+        c->keep_alive = 0;
+    }
+}
+
+/**
+ * Have the producer queue the next piece of a streamed response
+ *
+ * Returns 0, or -1 if the connection should be closed.
+ */
+int conn_produce_more(struct conn *c)
+{
+    int rv = c->produce(c, c->produce_arg);
+
+    if (rv < 0 || (rv > 0 && c->out_head == NULL && !c->pending)) {
+        // Gave up, or would have us spin
+        conn_produce_end(c);
+        return -1;
+    }
+
+    if (rv == 0) {
+        conn_produce_end(c);
+
+        if (c->out_chunked) {
+            char *last = "0\r\n\r\n";
+
+            return conn_write(c, last, strlen(last));
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Set the connection's timer to fire ms from now
+ */
+void conn_timeout_in(struct conn *c, int ms)
+{
+    timerwheel_add(c->loop->timers, &c->timer, c->loop->now + ms);
+}
+
+/**
+ * Change which events we're waiting for on a connection
+ */
+void conn_want(struct conn *c, int events)
+{
+    struct epoll_event ev;
+
+    if (c->events == events) {
+        return;
+    }
+
+    ev.events = events;
+    ev.data.ptr = c;
+
+    if (epoll_ctl(c->loop->epfd, EPOLL_CTL_MOD, c->fd, &ev) < 0) {
+        perror("epoll_ctl");
+    }
+
+    c->events = events;
+}
+
+/**
+ * Send what's queued on a connection, however the backend does it
+ *
+ * Returns 1 if everything has gone out, 0 if we'll be back when more
+ * can go, or -1 on error.
+ */
+int conn_send(struct conn *c)
+{
+    if (c->loop->uring != NULL) {
+        return uring_send(c);
+    }
+
+    int rv = conn_flush(c);
+
+    if (rv == 0) {
+        conn_want(c, EPOLLOUT);
+    }
+
+    return rv;
+}
+
+/**
+ * Queue a bodyless error response, with extra header fields, and
+ * arrange to close afterward
+ */
+void conn_error_extra(struct conn *c, char *status, char *extra)
+{
+    char response[256];
+    char date[64];
+
+    http_date(date, sizeof date, time(NULL));
+
+    int len = snprintf(response, sizeof response,
+        "%s\r\n"
+        "Date: %s\r\n"
+        "%s"
+        "Connection: close\r\n"
+        "Content-Length: 0\r\n"
+        "\r\n",
+        status, date, extra);
+
+    conn_write(c, response, len);
+
+    // Logged too, even if the header never finished
+    if (c->req_start == 0) {
+        conn_request_start(c);
+    }
+
+    c->status = http_status(status);
+    c->keep_alive = 0;
+    c->state = CONN_WRITE;
+}
+
+/**
+ * Queue a bodyless error response and arrange to close afterward
+ */
+void conn_error(struct conn *c, char *status)
+{
+    conn_error_extra(c, status, "");
+}
+
+/**
+ * Timer callback: the connection took too long at something
+ */
+void conn_timed_out(struct timer *t, void *arg)
+{
+    struct conn *c = arg;
+    (void)t;
+
+    // If they were partway through a request, tell them why we're
+    // hanging up. Best effort: we don't wait around for it to go out.
+    if ((c->state == CONN_READ_HEADER && !c->idle) || c->state == CONN_READ_BODY) {
+        conn_error(c, "HTTP/1.1 408 REQUEST TIMEOUT");
+        conn_flush(c);
+    }
+
+    conn_close(c);
+}
+
+/**
+ * Look at a complete request header and work out how to read the rest
+ *
+ * Returns 0, or -1 if an error response has been queued.
+ */
+int conn_parse_header(struct conn *c)
+{
+    char value[128], protocol[16];
+
+    // Over its client's rate: turned away before anything else is done
+    // for it. Hanging up makes a client that keeps at it pay for new
+    // connections too.
+    if (c->loop->ratelimit != NULL && !ratelimit_allow(c->loop->ratelimit, &c->addr, c->loop->now)) {
+        metrics_add(c->loop->metric_rejected[LOOP_REJECT_RATE], 1);
+        conn_error_extra(c, "HTTP/1.1 429 TOO MANY REQUESTS", "Retry-After: 1\r\n");
+        return -1;
+    }
+
+    if (sscanf(c->in, "%*s %*s %15s", protocol) != 1) {
+        conn_error(c, "HTTP/1.1 400 BAD REQUEST");
+        return -1;
+    }
+
+    c->http10 = strcmp(protocol, "HTTP/1.0") == 0;
+    c->out_chunked = 0;
+
+    // HTTP/1.1 connections persist unless told otherwise; HTTP/1.0
+    // ones only if asked
+    if (get_header(c->in, "Connection", value, sizeof value) != NULL) {
+        if (strcasestr(value, "close") != NULL) {
+            c->keep_alive = 0;
+        } else {
+            c->keep_alive = strcasestr(value, "keep-alive") != NULL || strcmp(protocol, "HTTP/1.1") == 0;
+        }
+    } else {
+        c->keep_alive = strcmp(protocol, "HTTP/1.1") == 0;
+    }
+
+    // A draining server answers this request and hangs up
+    if (c->loop->draining) {
+        c->keep_alive = 0;
+    }
+
+    c->body_len = 0;
+    c->chunked = 0;
+
+    if (get_header(c->in, "Transfer-Encoding", value, sizeof value) != NULL) {
+        if (strcasecmp(value, "chunked") != 0) {
+            conn_error(c, "HTTP/1.1 501 NOT IMPLEMENTED");
+            return -1;
+        }
+
+        c->chunked = 1;
+        c->chunk_state = CHUNK_SIZE;
+    }
+
+    long len = 0;
+
+    if (get_header(c->in, "Content-Length", value, sizeof value) != NULL) {
+        char *end;
+
+        len = strtol(value, &end, 10);
+
+        // Both is a request smuggling trick
+        if (end == value || *end != '\0' || len < 0 || c->chunked) {
+            conn_error(c, "HTTP/1.1 400 BAD REQUEST");
+            return -1;
+        }
+    }
+
+    c->body_left = c->chunked? 0: len;
+
+    if (c->loop->header_handler != NULL) {
+        c->loop->header_handler(c, c->loop->cache);
+    }
+
+    int more = c->chunked || len > c->in_len - c->header_len;
+
+    if (!c->streaming) {
+        if (c->chunked) {
+            // Only streamed bodies get decoded
+            conn_error(c, "HTTP/1.1 501 NOT IMPLEMENTED");
+            return -1;
+        }
+
+        if (len > CONN_BUFFER_SIZE - 1 - c->header_len) {
+            conn_error(c, "HTTP/1.1 413 PAYLOAD TOO LARGE");
+            return -1;
+        }
+
+        c->body_len = len;
+    }
+
+    // Clients waiting for the go-ahead get it now, ahead of the
+    // response
+    if (more &&
+        get_header(c->in, "Expect", value, sizeof value) != NULL &&
+        strcasecmp(value, "100-continue") == 0) {
+
+        char *go_ahead = "HTTP/1.1 100 Continue\r\n\r\n";
+
+        conn_write(c, go_ahead, strlen(go_ahead));
+        conn_flush(c);
+    }
+
+    return 0;
+}
+
+/**
+ * Parse a chunk-size line: hex digits, then maybe an extension
+ *
+ * Returns the size, or -1 if it's not valid.
+ */
+long chunk_size(char *line, int len)
+{
+    long size = 0;
+    int i;
+
+    for (i = 0; i < len && isxdigit((unsigned char)line[i]); i++) {
+        if (i == 15) {
+            return -1; // Absurdly big
+        }
+
+        size = size * 16 + (isdigit((unsigned char)line[i])? line[i] - '0': tolower((unsigned char)line[i]) - 'a' + 10);
+    }
+
+    if (i == 0 || (i < len && line[i] != ';' && line[i] != ' ' && line[i] != '\t')) {
+        return -1;
+    }
+
+    return size;
+}
+
+/**
+ * Hand what's arrived of a streamed body to its handler
+ *
+ * The body is removed from the buffer as it's handed over, leaving the
+ * header in place and anything pipelined behind the body.
+ *
+ * Returns 1 once the whole body is in, 0 if there's more to come, or
+ * -1 if an error response has been queued.
+ */
+int conn_stream(struct conn *c)
+{
+    char *p = c->in + c->header_len;
+    int avail = c->in_len - c->header_len;
+    int used = 0, done = 0;
+    char *error = NULL;
+
+    while (!done && error == NULL) {
+        char *line = p + used;
+        int left = avail - used;
+
+        if (!c->chunked || c->chunk_state == CHUNK_DATA) {
+            int n = left < c->body_left? left: c->body_left;
+
+            if (n > 0 && c->body_data(c, line, n) < 0) {
+                error = "HTTP/1.1 500 INTERNAL SERVER ERROR";
+                break;
+            }
+
+            used += n;
+            c->body_left -= n;
+
+            if (c->body_left > 0) {
+                break;
+            }
+
+            if (!c->chunked) {
+                done = 1;
+            } else {
+                c->chunk_state = CHUNK_DATA_END;
+            }
+            continue;
+        }
+
+        // Everything else is a line
+        char *eol = memmem(line, left, "\r\n", 2);
+
+        if (eol == NULL) {
+            if (left > CHUNK_LINE_MAX) {
+                error = "HTTP/1.1 400 BAD REQUEST";
+            }
+            break;
+        }
+
+        int line_len = eol - line;
+
+        used += line_len + 2;
+
+        switch (c->chunk_state) {
+            case CHUNK_SIZE:
+                c->body_left = chunk_size(line, line_len);
+
+                if (c->body_left < 0) {
+                    error = "HTTP/1.1 400 BAD REQUEST";
+                } else {
+                    c->chunk_state = c->body_left == 0? CHUNK_TRAILER: CHUNK_DATA;
+                }
+                break;
+
+            case CHUNK_DATA_END:
+                if (line_len != 0) {
+                    error = "HTTP/1.1 400 BAD REQUEST";
+                }
+                c->chunk_state = CHUNK_SIZE;
+                break;
+
+            case CHUNK_TRAILER:
+                done = line_len == 0;
+                break;
+        }
+    }
+
+    memmove(p, p + used, avail - used);
+    c->in_len -= used;
+    c->in[c->in_len] = '\0';
+
+    if (error != NULL) {
+        c->streaming = 0;
+        c->body_done(c, -1);
+        c->body_done = NULL;
+        conn_error(c, error);
+        return -1;
+    }
+
+    return done;
+}
+
+/**
+ * Move a connection along as far as it can go without blocking
+ */
+void conn_process(struct conn *c)
+{
+    struct loop *loop = c->loop;
+
+    while (1) {
+        switch (c->state) {
+            case CONN_READ_HEADER: {
+                char *body = find_start_of_body(c->in);
+
+                if (body == NULL) {
+                    if (c->in_len >= CONN_BUFFER_SIZE - 1) {
+                        conn_error(c, "HTTP/1.1 431 REQUEST HEADER FIELDS TOO LARGE");
+                    }
+                    if (c->state == CONN_READ_HEADER) {
+                        return;
+                    }
+                    break;
+                }
+
+                c->header_len = body - c->in;
+                c->state = CONN_READ_BODY;
+                conn_request_start(c);
+
+                unsigned long long t = TRACE_BEGIN(c->trace_id);
+                int rv = conn_parse_header(c);
+
+                TRACE_END(c->trace_id, "parse", t);
+                metrics_observe(loop->metric_parse, metrics_clock() - c->req_start);
+
+                if (rv < 0) {
+                    break;
+                }
+
+                conn_timeout_in(c, loop->body_timeout);
+                break;
+            }
+
+            case CONN_READ_BODY:
+                if (c->streaming) {
+                    int rv = conn_stream(c);
+
+                    if (rv < 0) {
+                        break;
+                    }
+
+                    if (rv == 0) {
+                        return;
+                    }
+
+                    c->streaming = 0;
+                } else if (c->in_len < c->header_len + c->body_len) {
+                    return;
+                }
+
+                c->state = CONN_WRITE;
+                c->in_handler = 1;
+
+                unsigned long long t = TRACE_BEGIN(c->trace_id);
+
+                if (c->body_done != NULL) {
+                    c->body_done(c, 0);
+                    c->body_done = NULL;
+                } else {
+                    loop->handler(c, loop->cache);
+                }
+
+                TRACE_END(c->trace_id, "handle", t);
+                c->in_handler = 0;
+                c->requests++;
+                c->req_handled = metrics_clock();
+
+                conn_timeout_in(c, loop->write_timeout);
+                break;
+
+            case CONN_WRITE: {
+                if (c->pending) {
+                    return;
+                }
+
+                // Everything's gone out: time for more of a streamed body
+                if (c->out_head == NULL && c->produce != NULL) {
+                    if (conn_produce_more(c) < 0) {
+                        conn_close(c);
+                        return;
+                    }
+                    break;
+                }
+
+                unsigned long long t = TRACE_BEGIN(c->trace_id);
+                int rv = conn_send(c);
+
+                TRACE_END(c->trace_id, "send", t);
+
+                if (rv < 0) {
+                    conn_close(c);
+                    return;
+                }
+
+                if (rv == 0) {
+                    return;
+                }
+
+                if (c->produce != NULL) {
+                    break;
+                }
+
+                conn_request_done(c);
+
+                if (!c->keep_alive) {
+                    conn_close(c);
+                    return;
+                }
+
+                conn_consume(c, c->header_len + c->body_len);
+                c->state = CONN_READ_HEADER;
+
+                // io_uring never stops receiving
+                if (loop->uring == NULL) {
+                    conn_want(c, EPOLLIN);
+                }
+
+                if (c->in_len == 0) {
+                    c->idle = 1;
+                    conn_timeout_in(c, loop->keepalive_timeout);
+                    return;
+                }
+
+                // Already have (some of) the next request
+                conn_timeout_in(c, loop->header_timeout);
+                break;
+            }
+        }
+    }
+}
+
+/**
+ * New data has been added to the request buffer
+ */
+void conn_received(struct conn *c)
+{
+    struct loop *loop = c->loop;
+
+    if (c->state == CONN_READ_HEADER && c->idle) {
+        // A new request on a kept-alive connection: the header clock
+        // starts now
+        c->idle = 0;
+        conn_timeout_in(c, loop->header_timeout);
+
+    } else if (c->state == CONN_READ_BODY) {
+        conn_timeout_in(c, loop->body_timeout);
+    }
+
+    conn_process(c);
+}
+
+/**
+ * The socket has data for us
+ */
+void conn_readable(struct conn *c)
+{
+    int got = 0;
+
+    // The start of a new request
+    if (c->state == CONN_READ_HEADER && c->trace_id == 0 && trace_every != 0) {
+        conn_trace_start(c);
+    }
+
+    unsigned long long t = TRACE_BEGIN(c->trace_id);
+
+    while (c->in_len < CONN_BUFFER_SIZE - 1) {
+        ssize_t rv = recv(c->fd, c->in + c->in_len, CONN_BUFFER_SIZE - 1 - c->in_len, 0);
+
+        if (rv > 0) {
+            c->in_len += rv;
+            got = 1;
+            continue;
+        }
+
+        if (rv < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (rv < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        }
+
+        // Hung up, or an error
+        conn_close(c);
+        return;
+    }
+
+    c->in[c->in_len] = '\0';
+
+    TRACE_END(c->trace_id, "recv", t);
+
+    if (got) {
+        conn_received(c);
+    }
+}
+
+/**
+ * The socket has room for more of the response
+ */
+void conn_writable(struct conn *c)
+{
+    // Progress, so the write clock starts over
+    conn_timeout_in(c, c->loop->write_timeout);
+
+    conn_process(c);
+}
+
+/**
+ * Turn a connection away: we have too many already
+ *
+ * It gets a canned 503 and is closed, without ever being set up. Any
+ * request already in is read and thrown away first; closing with it
+ * unread would reset the connection, and the 503 could be lost.
+ */
+void loop_refuse(struct loop *loop, int fd)
+{
+    char discard[4096];
+
+    while (recv(fd, discard, sizeof discard, MSG_DONTWAIT) > 0) {
+    }
+
+    send(fd, loop_refusal, sizeof loop_refusal - 1, MSG_DONTWAIT | MSG_NOSIGNAL);
+    close(fd);
+
+    metrics_add(loop->metric_rejected[LOOP_REJECT_CONNS], 1);
+}
+
+/**
+ * Whether work for the pool should be refused
+ *
+ * Once the pool's this far behind, new work would only wait in its
+ * queue, making every response behind it slow too. Refusing it now
+ * (with a 503) keeps the queue short, and lets the client go
+ * elsewhere or come back. Counted as a rejection if so.
+ */
+int loop_shed(struct loop *loop)
+{
+    if (loop->shed_queue <= 0 || loop->pool == NULL ||
+        loop->pool->submitted - loop->pool->completed < loop->shed_queue) {
+
+        return 0;
+    }
+
+    metrics_add(loop->metric_rejected[LOOP_REJECT_OVERLOAD], 1);
+
+    return 1;
+}
+
+/**
+ * Start serving a newly accepted connection
+ *
+ * addr is the client's address, or NULL to look it up.
+ */
+void loop_add_conn(struct loop *loop, int newfd, struct sockaddr_storage *addr)
+{
+    struct sockaddr_storage their_addr; // connector's address information
+
+    if (loop->max_conns > 0 && loop->nconns >= loop->max_conns) {
+        loop_refuse(loop, newfd);
+        return;
+    }
+
+    if (addr == NULL) {
+        socklen_t sin_size = sizeof their_addr;
+
+        memset(&their_addr, 0, sizeof their_addr);
+        getpeername(newfd, (struct sockaddr *)&their_addr, &sin_size);
+        addr = &their_addr;
+    }
+
+    struct conn *c = conn_create(newfd, loop);
+
+    if (c == NULL) {
+        fprintf(stderr, "webserver: can't set up connection\n");
+        close(newfd);
+        return;
+    }
+
+    c->addr = *addr;
+    unmap_in_addr(&c->addr);
+
+    if (loop->uring != NULL) {
+        if (uring_add(c) < 0) {
+            fprintf(stderr, "webserver: can't set up connection\n");
+            conn_free(c);
+            return;
+        }
+
+    } else {
+        struct epoll_event ev;
+
+        ev.events = EPOLLIN;
+        ev.data.ptr = c;
+
+        if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, newfd, &ev) < 0) {
+            perror("epoll_ctl");
+            conn_free(c);
+            return;
+        }
+
+        c->events = EPOLLIN;
+    }
+
+    loop->nconns++;
+
+    timer_init(&c->timer, conn_timed_out, c);
+    conn_timeout_in(c, loop->header_timeout);
+}
+
+/**
+ * Accept new connections
+ *
+ * Takes whatever's queued, up to ACCEPT_BATCH, so a burst doesn't cost
+ * an epoll_wait() per connection. Anything left over is still there
+ * next time round (the listener is level-triggered).
+ */
+void loop_accept(struct loop *loop)
+{
+    for (int i = 0; i < ACCEPT_BATCH; i++) {
+        struct sockaddr_storage their_addr; // connector's address information
+        socklen_t sin_size = sizeof their_addr;
+
+        // Born non-blocking and close-on-exec: no fcntl()s
+        int newfd = accept4(loop->listenfd, (struct sockaddr *)&their_addr, &sin_size, SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+        if (newfd == -1) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                perror("accept");
+            }
+            return;
+        }
+
+        loop_add_conn(loop, newfd, &their_addr);
+    }
+}
+
+/**
+ * SIGUSR1 handler
+ */
+void loop_stats_signal(int sig)
+{
+    (void)sig;
+
+    loop_stats_wanted = 1;
+}
+
+/**
+ * SIGUSR2 handler
+ */
+void loop_trace_signal(int sig)
+{
+    (void)sig;
+
+    loop_trace_wanted = 1;
+}
+
+/**
+ * SIGQUIT handler
+ */
+void loop_drain_signal(int sig)
+{
+    (void)sig;
+
+    loop_drain_wanted = 1;
+}
+
+/**
+ * Stop accepting connections, and exit once the open ones are done
+ *
+ * Requests from here on are answered with Connection: close. Idle
+ * keep-alive connections are left to time out, so this takes up to the
+ * keep-alive timeout after the last response, and at most
+ * DRAIN_TIMEOUT.
+ */
+void loop_drain(struct loop *loop)
+{
+    if (loop->draining) {
+        return;
+    }
+
+    loop->draining = 1;
+    loop->drain_deadline = loop->now + DRAIN_TIMEOUT;
+
+    if (loop->uring != NULL) {
+        uring_stop_accept(loop->uring);
+    } else {
+        epoll_ctl(loop->epfd, EPOLL_CTL_DEL, loop->listenfd, NULL);
+    }
+
+    // Whoever has it now keeps it open
+    close(loop->listenfd);
+
+    if (loop->restart_fd >= 0) {
+        close(loop->restart_fd);
+        loop->restart_fd = -1;
+    }
+
+    fprintf(stderr, "webserver: draining %d connections\n", loop->nconns);
+}
+
+/**
+ * Hand the listener, and the cache if it's wanted, to a replacement
+ * that's asking for them, then drain
+ */
+void loop_handoff(struct loop *loop)
+{
+    int want_cache;
+    int fd = restart_accept(loop->restart_fd, &want_cache);
+
+    if (fd < 0) {
+        return;
+    }
+
+    int cachefd = want_cache? cache_export(loop->cache): -1;
+    int rv = restart_send(fd, loop->listenfd, cachefd);
+
+    if (cachefd >= 0) {
+        close(cachefd);
+    }
+
+    if (rv == 0) {
+        fprintf(stderr, "webserver: handed over to a new server\n");
+        loop_drain(loop);
+    }
+}
+
+/**
+ * Exit once draining is done
+ *
+ * Nothing's left once the connections are closed and the pool has
+ * handed back everything it was given (a save's sync, say).
+ */
+void loop_drained(struct loop *loop)
+{
+    int idle = loop->nconns == 0 && (loop->pool == NULL || loop->pool->completed == loop->pool->submitted);
+
+    if (!idle && loop->now < loop->drain_deadline) {
+        return;
+    }
+
+    if (!idle) {
+        fprintf(stderr, "webserver: %d connections still open, exiting anyway\n", loop->nconns);
+    }
+
+    if (loop->accesslog != NULL) {
+        accesslog_close(loop->accesslog);
+    }
+
+    exit(0);
+}
+
+/**
+ * Turn tracing on, or off and write out what was traced
+ */
+void loop_toggle_trace(struct loop *loop)
+{
+    if (trace_every == 0) {
+        trace_start(loop->trace_every);
+        fprintf(stderr, "trace: tracing 1 in %d requests\n", trace_every);
+        return;
+    }
+
+    trace_stop();
+
+    int n = trace_dump(loop->trace_file);
+
+    if (n >= 0) {
+        fprintf(stderr, "trace: %d events written to %s\n", n, loop->trace_file);
+    }
+}
+
+/**
+ * Print counters to stderr
+ */
+void loop_print_stats(struct loop *loop)
+{
+    fprintf(stderr, "connections: %d open\n", loop->nconns);
+
+    fprintf(stderr, "bufpool: %ld allocs (%ld reused, %ld malloc), %ld frees (%ld free)\n",
+        bufpool_stats.allocs, bufpool_stats.hits, bufpool_stats.mallocs,
+        bufpool_stats.frees, bufpool_stats.releases);
+
+    fprintf(stderr, "arena: %ld allocs, %ld chunks, %ld resets\n",
+        arena_stats.allocs, arena_stats.chunks, arena_stats.resets);
+
+    if (loop->pool != NULL) {
+        fprintf(stderr, "pool: %ld submitted, %ld completed\n",
+            loop->pool->submitted, loop->pool->completed);
+    }
+
+    if (loop->accesslog != NULL) {
+        fprintf(stderr, "accesslog: %ld written, %ld dropped, %ld write errors\n",
+            __atomic_load_n(&loop->accesslog->written, __ATOMIC_RELAXED),
+            accesslog_dropped(loop->accesslog),
+            __atomic_load_n(&loop->accesslog->write_errors, __ATOMIC_RELAXED));
+    }
+}
+
+/**
+ * Do the periodic work: run due timers and reclaim expired cache
+ * entries
+ */
+void loop_tick(struct loop *loop)
+{
+    if (loop_stats_wanted) {
+        loop_stats_wanted = 0;
+        loop_print_stats(loop);
+    }
+
+    if (loop_trace_wanted) {
+        loop_trace_wanted = 0;
+        loop_toggle_trace(loop);
+    }
+
+    if (loop_drain_wanted) {
+        loop_drain_wanted = 0;
+        loop_drain(loop);
+    }
+
+    // An accept() on the restart socket, at most once a tick
+    if (loop->restart_fd >= 0 && loop->now >= loop->next_restart_check) {
+        loop->next_restart_check = loop->now + LOOP_TICK;
+        loop_handoff(loop);
+    }
+
+    timerwheel_run(loop->timers, loop->now, 0);
+
+    // Reclaim expired cache entries a batch at a time. If a batch came
+    // back full, there's more to do, so go again next time around.
+    if (loop->now >= loop->next_expire) {
+        if (cache_expire(loop->cache, time(NULL), EXPIRE_BATCH) < EXPIRE_BATCH) {
+            loop->next_expire = loop->now + EXPIRE_INTERVAL;
+        }
+    }
+
+    if (loop->draining) {
+        loop_drained(loop);
+    }
+}
+
+/**
+ * Run the event loop forever
+ */
+void loop_run(struct loop *loop)
+{
+    struct epoll_event events[MAX_EVENTS];
+    struct sigaction sa;
+
+    memset(&sa, 0, sizeof sa);
+    sa.sa_handler = loop_stats_signal;
+    sa.sa_flags = SA_RESTART;
+    sigaction(SIGUSR1, &sa, NULL);
+
+    sa.sa_handler = loop_trace_signal;
+    sigaction(SIGUSR2, &sa, NULL);
+
+    sa.sa_handler = loop_drain_signal;
+    sigaction(SIGQUIT, &sa, NULL);
+
+    if (loop->uring != NULL) {
+        uring_run(loop);
+        return;
+    }
+
+    while (1) {
+        int n = epoll_wait(loop->epfd, events, MAX_EVENTS, LOOP_TICK);
+
+        if (n < 0 && errno != EINTR) {
+            perror("epoll_wait");
+        }
+
+        loop->now = loop_clock();
+
+        for (int i = 0; i < n; i++) {
+            struct conn *c = events[i].data.ptr;
+
+            if (c == NULL) {
+                loop_accept(loop);
+            } else if ((void *)c == loop->pool) {
+                pool_drain(loop->pool);
+            } else if (c->state == CONN_WRITE) {
+                conn_writable(c);
+            } else {
+                conn_readable(c);
+            }
+        }
+
+        loop_tick(loop);
+    }
+}
@@ -0,0 +1,100 @@
+#ifndef _LOOP_H_
+#define _LOOP_H_
+
+#include "conn.h"
+#include "cache.h"
+#include "timerwheel.h"
+#include "pool.h"
+#include "accesslog.h"
+#include "ratelimit.h"
+
+// Default timeouts, in ms
+#define HEADER_TIMEOUT 10000    // To receive a whole request header
+#define BODY_TIMEOUT 30000      // Without progress reading a request body
+#define WRITE_TIMEOUT 30000     // Without progress sending a response
+#define KEEPALIVE_TIMEOUT 5000  // For an idle connection between requests
+
+#define LOOP_TICK 100 // ms; how often timers are checked when idle
+
+#define DRAIN_TIMEOUT 30000 // ms a draining loop waits for its connections
+
+#define TRACE_FILE "./serverfiles/trace.json" // Default for loop->trace_file
+
+// Why a connection or request was turned away (see loop->metric_rejected)
+enum loop_reject {
+    LOOP_REJECT_CONNS,    // Too many connections open
+    LOOP_REJECT_RATE,     // Client over its rate
+    LOOP_REJECT_OVERLOAD, // The pool too far behind
+    LOOP_REJECT_REASONS
+};
+
+// An event loop serving connections from a listening socket
+struct loop {
+    int epfd;
+    int listenfd;
+
+    struct cache *cache;
+    void (*handler)(struct conn *c, struct cache *cache); // Handles one request
+
+    // If set, called with each request header before its body is read;
+    // it can take the body as it arrives with conn_stream_body()
+    void (*header_handler)(struct conn *c, struct cache *cache);
+
+    struct timerwheel *timers; // Connection timeouts, ticking in ms
+    unsigned long long now;    // Monotonic ms as of the last wakeup
+    unsigned long long next_expire; // When to next sweep the cache
+
+    struct uring *uring; // io_uring backend, or NULL for epoll
+    struct pool *pool;   // Where blocking work goes, or NULL
+    struct accesslog *accesslog; // Where finished requests are logged, or NULL
+
+    int header_timeout;
+    int body_timeout;
+    int write_timeout;
+    int keepalive_timeout;
+
+    int nconns; // Open connections
+
+    // Admission control; 0 or NULL for none
+    int max_conns;               // Connections past this are refused a 503
+    struct ratelimit *ratelimit; // Requests over their client's rate get a 429
+    int shed_queue;              // Pool backlog at which work gets a 503 (see loop_shed())
+
+    // Hot restart (see restart.c), and draining, which SIGQUIT starts
+    int restart_fd;    // Where a replacement asks to take over, or -1
+    unsigned long long next_restart_check;
+    int draining;      // Not accepting; exits once its connections are done
+    unsigned long long drain_deadline; // Exits by then regardless
+
+    // Phase tracing (see trace.h), turned on and off by SIGUSR2
+    int trace_every;  // 1 in this many requests is traced, when on
+    char *trace_file; // Where the trace is written when it's turned off
+
+    // Metric ids (see metrics.h)
+    int metric_parse;        // Reading the request header
+    int metric_send;         // From the handler returning to the last byte out
+    int metric_responses[6]; // Responses by status class; 0 is none at all
+    int metric_bytes;        // Response bytes sent
+    int metric_rejected[LOOP_REJECT_REASONS];
+};
+
+extern struct loop *loop_create(int listenfd, struct cache *cache, void (*handler)(struct conn *, struct cache *));
+extern int loop_use_uring(struct loop *loop);
+extern void loop_set_pool(struct loop *loop, struct pool *pool);
+extern void loop_drain(struct loop *loop);
+extern int loop_shed(struct loop *loop);
+extern void conn_suspend(struct conn *c);
+extern void conn_resume(struct conn *c);
+extern void conn_produce(struct conn *c, int (*produce)(struct conn *, void *), void (*release)(void *), void *arg);
+extern void conn_stream_body(struct conn *c, int (*data)(struct conn *, char *, int), void (*done)(struct conn *, int), void *arg);
+extern void loop_run(struct loop *loop);
+
+// For the backends
+extern unsigned long long loop_clock(void);
+extern void loop_add_conn(struct loop *loop, int newfd, struct sockaddr_storage *addr);
+extern void loop_tick(struct loop *loop);
+extern void conn_received(struct conn *c);
+extern void conn_writable(struct conn *c);
+extern void conn_close(struct conn *c);
+
+#endif
@@ -0,0 +1,247 @@
+/*
+
+A small LZ4 block-format codec.
+
+Compressed blocks are compatible with the reference LZ4_compress_default()
+and LZ4_decompress_safe(), but the compressor is the simplest greedy
+single-probe version: fast, not tight.
+
+A block is a series of sequences. Each sequence is:
+
+    token        high nybble: literal count, low nybble: match length - 4
+                 (15 means "more length bytes follow, each adding up to 255")
+    literals
+    offset       2 bytes, little-endian, how far back the match starts
+    match length extra bytes, if the low nybble was 15
+
+The last sequence is literals only.
+
+*/
+
+#include <string.h>
+#include "lz4.h"
+
+#define HASH_LOG 12
+#define HASH_SIZE (1 << HASH_LOG)
+#define MIN_MATCH 4
+#define LAST_LITERALS 5 // The last 5 bytes are always literals
+#define MF_LIMIT 12 // The last match must start at least 12 bytes before the end
+#define MAX_OFFSET 65535
+
+/**
+ * Read 4 unaligned bytes
+ */
+unsigned int lz4_read32(unsigned char *p)
+{
+    unsigned int v;
+
+    memcpy(&v, p, sizeof v);
+
+    return v;
+}
+
+/**
+ * Hash 4 bytes down to a table index
+ */
+int lz4_hash(unsigned int v)
+{
+    return (v * 2654435761U) >> (32 - HASH_LOG);
+}
+
+/**
+ * Write an LZ4 extended length (the part past the nybble)
+ */
+unsigned char *lz4_write_length(unsigned char *op, int len)
+{
+    while (len >= 255) {
+        *op++ = 255;
+        len -= 255;
+    }
+
+    *op++ = len;
+
+    return op;
+}
+
+/**
+ * Emit one sequence: literals from anchor up to ip, then (if match_len
+ * is nonzero) a match
+ *
+ * Returns the new output pointer, or NULL if it won't fit.
+ */
+unsigned char *lz4_emit(unsigned char *op, unsigned char *oend, unsigned char *anchor, int lit_len, int offset, int match_len)
+{
+    // Worst case for the lengths, the literals and the offset
+    if (oend - op < 1 + lit_len / 255 + 1 + lit_len + 2 + match_len / 255 + 1) {
+        return NULL;
+    }
+
+    unsigned char *token = op++;
+    int ml = match_len - MIN_MATCH;
+
+    *token = (lit_len >= 15? 15: lit_len) << 4;
+
+    if (lit_len >= 15) {
+        op = lz4_write_length(op, lit_len - 15);
+    }
+
+    memcpy(op, anchor, lit_len);
+    op += lit_len;
+
+    if (match_len == 0) {
+        return op;
+    }
+
+    *op++ = offset & 0xff;
+    *op++ = offset >> 8;
+
+    *token |= ml >= 15? 15: ml;
+
+    if (ml >= 15) {
+        op = lz4_write_length(op, ml - 15);
+    }
+
+    return op;
+}
+
+/**
+ * Compress a buffer into an LZ4 block
+ *
+ * capacity should be at least LZ4_COMPRESS_BOUND(size) to be sure the
+ * block fits.
+ *
+ * Returns the compressed size, or 0 if it didn't fit in capacity.
+ */
+int lz4_compress(void *source, int size, void *dest, int capacity)
+{
+    unsigned char *src = source;
+    unsigned char *ip = src, *anchor = src, *end = src + size;
+    unsigned char *mf_limit = end - MF_LIMIT, *match_limit = end - LAST_LITERALS;
+    unsigned char *op = dest, *oend = op + capacity;
+    int table[HASH_SIZE];
+
+    memset(table, 0, sizeof table);
+
+    if (size > MF_LIMIT) {
+        while (ip < mf_limit) {
+            unsigned int seq = lz4_read32(ip);
+            int h = lz4_hash(seq);
+            unsigned char *ref = src + table[h];
+
+            table[h] = ip - src;
+
+            if (ref >= ip || ip - ref > MAX_OFFSET || lz4_read32(ref) != seq) {
+                ip++;
+                continue;
+            }
+
+            // Found one; see how far it goes
+            unsigned char *mp = ip + MIN_MATCH, *rp = ref + MIN_MATCH;
+
+            while (mp < match_limit && *mp == *rp) {
+                mp++;
+                rp++;
+            }
+
+            op = lz4_emit(op, oend, anchor, ip - anchor, ip - ref, mp - ip);
+
+            if (op == NULL) {
+                return 0;
+            }
+
+            ip = anchor = mp;
+        }
+    }
+
+    // Whatever's left goes out as literals
+    op = lz4_emit(op, oend, anchor, end - anchor, 0, 0);
+
+    if (op == NULL) {
+        return 0;
+    }
+
+    return op - (unsigned char *)dest;
+}
+
+/**
+ * Decompress an LZ4 block
+ *
+ * Never reads or writes out of bounds, even on corrupt input.
+ *
+ * Returns the decompressed size, or -1 if the block is corrupt or
+ * doesn't fit in capacity.
+ */
+int lz4_decompress(void *source, int size, void *dest, int capacity)
+{
+    unsigned char *ip = source, *iend = ip + size;
+    unsigned char *op = dest, *oend = op + capacity;
+    int b;
+
+    while (ip < iend) {
+        int token = *ip++;
+        int lit_len = token >> 4;
+
+        if (lit_len == 15) {
+            do {
+                if (ip >= iend) {
+                    return -1;
+                }
+
+                b = *ip++;
+                lit_len += b;
+            } while (b == 255);
+        }
+
+        if (lit_len > iend - ip || lit_len > oend - op) {
+            return -1;
+        }
+
+        memcpy(op, ip, lit_len);
+        op += lit_len;
+        ip += lit_len;
+
+        // The last sequence has no match
+        if (ip == iend) {
+            break;
+        }
+
+        if (iend - ip < 2) {
+            return -1;
+        }
+
+        int offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+
+        if (offset == 0 || offset > op - (unsigned char *)dest) {
+            return -1;
+        }
+
+        int match_len = token & 15;
+
+        if (match_len == 15) {
+            do {
+                if (ip >= iend) {
+                    return -1;
+                }
+
+                b = *ip++;
+                match_len += b;
+            } while (b == 255);
+        }
+
+        match_len += MIN_MATCH;
+
+        if (match_len > oend - op) {
+            return -1;
+        }
+
+        // Byte at a time: matches may overlap their own output
+        unsigned char *match = op - offset;
+
+        while (match_len-- > 0) {
+            *op++ = *match++;
+        }
+    }
+
+    return op - (unsigned char *)dest;
+}
@@ -0,0 +1,10 @@
+#ifndef _LZ4_H_
+#define _LZ4_H_
+
+// Worst-case compressed size for size bytes of input
+#define LZ4_COMPRESS_BOUND(size) ((size) + (size) / 255 + 16)
+
+extern int lz4_compress(void *source, int size, void *dest, int capacity);
+extern int lz4_decompress(void *source, int size, void *dest, int capacity);
+
+#endif
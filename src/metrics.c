@@ -0,0 +1,405 @@
+/*
+
+Latency histograms and counters, exported in Prometheus text format.
+
+Metrics are registered once at startup (before other threads start
+recording) and named by the id that comes back. Every thread records
+into a shard of its own, so recording is a few plain increments: no
+locks, and no cache lines bouncing between threads. Shards are only
+added up when someone asks for the numbers.
+
+Histograms are HdrHistogram-style: values (ns) go into buckets that
+split each power of 2 into 8, so any value from 1 ns to centuries is
+kept to within 12.5% in a fixed 4K of counts. On export they're folded
+into Prometheus buckets at round numbers (1us, 2.5us, 5us ... 10s),
+plus gauges for the usual quantiles, which come straight from the fine
+buckets.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <time.h>
+#include <pthread.h>
+#include "metrics.h"
+
+// What was registered
+struct metrics_info {
+    char *name;
+    char *help;
+    char *labels; // e.g. route="/d20", or ""
+};
+
+struct metrics_info metrics_hists[METRICS_HISTOGRAMS];
+struct metrics_info metrics_counters[METRICS_COUNTERS];
+int metrics_nhists, metrics_ncounters;
+
+struct metrics_shard *metrics_shards;
+pthread_mutex_t metrics_lock = PTHREAD_MUTEX_INITIALIZER; // Held only to add a shard
+
+// This thread's shard, once it's recorded something
+__thread struct metrics_shard *metrics_shard;
+
+// Prometheus bucket bounds (ns)
+long long metrics_bounds[] = {
+    1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 500000,
+    1000000, 2500000, 5000000, 10000000, 25000000, 50000000,
+    100000000, 250000000, 500000000,
+    1000000000, 2500000000LL, 5000000000LL, 10000000000LL,
+};
+
+#define METRICS_NBOUNDS (int)(sizeof metrics_bounds / sizeof metrics_bounds[0])
+
+double metrics_quantiles[] = {0.5, 0.9, 0.99, 0.999};
+
+#define METRICS_NQUANTILES (int)(sizeof metrics_quantiles / sizeof metrics_quantiles[0])
+
+/**
+ * Return monotonic time in ns
+ */
+long long metrics_clock(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/**
+ * Register a metric, or find it if it already is
+ *
+ * Returns its id, or -1 if there's no room.
+ */
+int metrics_register(struct metrics_info *info, int *n, int max, char *name, char *help, char *labels)
+{
+    for (int i = 0; i < *n; i++) {
+        if (strcmp(info[i].name, name) == 0 && strcmp(info[i].labels, labels) == 0) {
+            return i;
+        }
+    }
+
+    if (*n == max) {
+        fprintf(stderr, "metrics: too many to register %s\n", name);
+        return -1;
+    }
+
+    info[*n].name = name;
+    info[*n].help = help;
+    info[*n].labels = labels;
+
+    return (*n)++;
+}
+
+/**
+ * Register a latency histogram
+ *
+ * Histograms with the same name are exported as one metric, told apart
+ * by their labels. name, help and labels must stay put.
+ *
+ * Returns its id, or -1 if there's no room.
+ */
+int metrics_histogram(char *name, char *help, char *labels)
+{
+    return metrics_register(metrics_hists, &metrics_nhists, METRICS_HISTOGRAMS, name, help, labels);
+}
+
+/**
+ * Register a counter
+ *
+ * Returns its id, or -1 if there's no room.
+ */
+int metrics_counter(char *name, char *help, char *labels)
+{
+    return metrics_register(metrics_counters, &metrics_ncounters, METRICS_COUNTERS, name, help, labels);
+}
+
+/**
+ * Return this thread's shard, creating it if need be
+ */
+struct metrics_shard *metrics_my_shard(void)
+{
+    if (metrics_shard == NULL) {
+        struct metrics_shard *s = calloc(1, sizeof *s);
+
+        if (s == NULL) {
+            return NULL;
+        }
+
+        pthread_mutex_lock(&metrics_lock);
+        s->next = metrics_shards;
+        __atomic_store_n(&metrics_shards, s, __ATOMIC_RELEASE);
+        pthread_mutex_unlock(&metrics_lock);
+
+        metrics_shard = s;
+    }
+
+    return metrics_shard;
+}
+
+/**
+ * Return the bucket a value goes in
+ */
+int metrics_bucket(unsigned long long v)
+{
+    if (v < (1 << METRICS_SUB_BITS)) {
+        return v;
+    }
+
+    int shift = 63 - __builtin_clzll(v) - METRICS_SUB_BITS;
+
+    return ((shift + 1) << METRICS_SUB_BITS) + ((v >> shift) & ((1 << METRICS_SUB_BITS) - 1));
+}
+
+/**
+ * Return the smallest value that goes in a bucket
+ */
+unsigned long long metrics_bucket_low(int i)
+{
+    if (i < (1 << METRICS_SUB_BITS)) {
+        return i;
+    }
+
+    int shift = (i >> METRICS_SUB_BITS) - 1;
+
+    return (unsigned long long)((i & ((1 << METRICS_SUB_BITS) - 1)) | (1 << METRICS_SUB_BITS)) << shift;
+}
+
+/**
+ * Only this thread writes to its shard, but others read it
+ */
+#define METRICS_INC(p, n) __atomic_store_n((p), *(p) + (n), __ATOMIC_RELAXED)
+
+/**
+ * Record a value (ns) in a histogram
+ */
+void metrics_observe(int id, long long ns)
+{
+    struct metrics_shard *s = metrics_my_shard();
+
+    if (s == NULL || id < 0) {
+        return;
+    }
+
+    struct metrics_hist *h = &s->hists[id];
+
+    if (ns < 0) {
+        ns = 0;
+    }
+
+    METRICS_INC(&h->buckets[metrics_bucket(ns)], 1);
+    METRICS_INC(&h->sum, ns);
+}
+
+/**
+ * Add to a counter
+ */
+void metrics_add(int id, long n)
+{
+    struct metrics_shard *s = metrics_my_shard();
+
+    if (s == NULL || id < 0) {
+        return;
+    }
+
+    METRICS_INC(&s->counters[id], n);
+}
+
+/**
+ * Append to the output
+ */
+void metrics_printf(struct metrics_out *out, char *fmt, ...)
+{
+    va_list ap;
+    int room = out->len < out->size? out->size - out->len: 0;
+
+    va_start(ap, fmt);
+    out->len += vsnprintf(room > 0? out->buf + out->len: NULL, room, fmt, ap);
+    va_end(ap);
+}
+
+/**
+ * Append a single-valued metric
+ *
+ * type is "counter" or "gauge".
+ */
+void metrics_value(struct metrics_out *out, char *name, char *type, char *help, double value)
+{
+    metrics_printf(out, "# HELP %s %s\n# TYPE %s %s\n%s %.17g\n", name, help, name, type, name, value);
+}
+
+/**
+ * Return a metric's labels in braces, or "" if it has none
+ *
+ * The result is good until the next call.
+ */
+char *metrics_labels(struct metrics_info *info)
+{
+    static char buf[256];
+
+    if (*info->labels == '\0') {
+        return "";
+    }
+
+    snprintf(buf, sizeof buf, "{%s}", info->labels);
+
+    return buf;
+}
+
+/**
+ * Add up a histogram across all the shards
+ *
+ * Returns the number of values recorded.
+ */
+long metrics_hist_total(int id, struct metrics_hist *h)
+{
+    long count = 0;
+
+    memset(h, 0, sizeof *h);
+
+    for (struct metrics_shard *s = __atomic_load_n(&metrics_shards, __ATOMIC_ACQUIRE); s != NULL; s = s->next) {
+        struct metrics_hist *sh = &s->hists[id];
+
+        for (int i = 0; i < METRICS_BUCKETS; i++) {
+            long n = __atomic_load_n(&sh->buckets[i], __ATOMIC_RELAXED);
+
+            h->buckets[i] += n;
+            count += n;
+        }
+
+        h->sum += __atomic_load_n(&sh->sum, __ATOMIC_RELAXED);
+    }
+
+    return count;
+}
+
+/**
+ * Append one labelled histogram's series
+ *
+ * The quantiles are returned in q (seconds), to go out as their own
+ * metric.
+ */
+void metrics_print_hist(struct metrics_out *out, int id, double *q)
+{
+    struct metrics_info *info = &metrics_hists[id];
+    char *sep = *info->labels != '\0'? ",": "";
+    struct metrics_hist h;
+    long count = metrics_hist_total(id, &h);
+    long cum = 0;
+    int i = 0;
+
+    // A fine bucket is counted under the first bound it starts below
+    for (int b = 0; b < METRICS_NBOUNDS; b++) {
+        for (; i < METRICS_BUCKETS && metrics_bucket_low(i) <= (unsigned long long)metrics_bounds[b]; i++) {
+            cum += h.buckets[i];
+        }
+
+        metrics_printf(out, "%s_bucket{%s%sle=\"%g\"} %ld\n",
+            info->name, info->labels, sep, metrics_bounds[b] / 1e9, cum);
+    }
+
+    metrics_printf(out, "%s_bucket{%s%sle=\"+Inf\"} %ld\n", info->name, info->labels, sep, count);
+    metrics_printf(out, "%s_sum%s %.9f\n", info->name, metrics_labels(info), h.sum / 1e9);
+    metrics_printf(out, "%s_count%s %ld\n", info->name, metrics_labels(info), count);
+
+    // Quantiles: the middle of the bucket the rank falls in
+    for (int k = 0; k < METRICS_NQUANTILES; k++) {
+        long rank = (long)(metrics_quantiles[k] * count + 0.5);
+
+        q[k] = 0;
+        cum = 0;
+
+        for (i = 0; count > 0 && i < METRICS_BUCKETS; i++) {
+            cum += h.buckets[i];
+
+            if (cum >= rank && cum > 0) {
+                unsigned long long low = metrics_bucket_low(i);
+                unsigned long long high = i + 1 < METRICS_BUCKETS? metrics_bucket_low(i + 1): low;
+
+                q[k] = (low + (high - low) / 2) / 1e9;
+                break;
+            }
+        }
+    }
+}
+
+/**
+ * Append every registered histogram and counter
+ *
+ * Histograms are in seconds; each name also gets a <name>_quantile
+ * gauge with the 50th, 90th, 99th and 99.9th percentiles.
+ */
+void metrics_print(struct metrics_out *out)
+{
+    double q[METRICS_HISTOGRAMS][METRICS_NQUANTILES];
+
+    for (int i = 0; i < metrics_nhists; i++) {
+        char *name = metrics_hists[i].name;
+        int seen = 0;
+
+        for (int j = 0; j < i && !seen; j++) {
+            seen = strcmp(metrics_hists[j].name, name) == 0;
+        }
+
+        if (seen) {
+            continue;
+        }
+
+        // All the series of a metric have to be together
+        metrics_printf(out, "# HELP %s %s\n# TYPE %s histogram\n", name, metrics_hists[i].help, name);
+
+        for (int j = i; j < metrics_nhists; j++) {
+            if (strcmp(metrics_hists[j].name, name) == 0) {
+                metrics_print_hist(out, j, q[j]);
+            }
+        }
+
+        metrics_printf(out, "# HELP %s_quantile %s (percentiles)\n# TYPE %s_quantile gauge\n",
+            name, metrics_hists[i].help, name);
+
+        for (int j = i; j < metrics_nhists; j++) {
+            struct metrics_info *info = &metrics_hists[j];
+
+            if (strcmp(info->name, name) != 0) {
+                continue;
+            }
+
+            for (int k = 0; k < METRICS_NQUANTILES; k++) {
+                metrics_printf(out, "%s_quantile{%s%squantile=\"%g\"} %.9f\n",
+                    name, info->labels, *info->labels != '\0'? ",": "",
+                    metrics_quantiles[k], q[j][k]);
+            }
+        }
+    }
+
+    for (int i = 0; i < metrics_ncounters; i++) {
+        char *name = metrics_counters[i].name;
+        int seen = 0;
+
+        for (int j = 0; j < i && !seen; j++) {
+            seen = strcmp(metrics_counters[j].name, name) == 0;
+        }
+
+        if (seen) {
+            continue;
+        }
+
+        metrics_printf(out, "# HELP %s %s\n# TYPE %s counter\n", name, metrics_counters[i].help, name);
+
+        for (int j = i; j < metrics_ncounters; j++) {
+            if (strcmp(metrics_counters[j].name, name) != 0) {
+                continue;
+            }
+
+            long total = 0;
+
+            for (struct metrics_shard *s = __atomic_load_n(&metrics_shards, __ATOMIC_ACQUIRE); s != NULL; s = s->next) {
+                total += __atomic_load_n(&s->counters[j], __ATOMIC_RELAXED);
+            }
+
+            metrics_printf(out, "%s%s %ld\n", name, metrics_labels(&metrics_counters[j]), total);
+        }
+    }
+}
@@ -0,0 +1,41 @@
+#ifndef _METRICS_H_
+#define _METRICS_H_
+
+#define METRICS_HISTOGRAMS 32 // Most histograms that can be registered
+#define METRICS_COUNTERS 32   // Most counters that can be registered
+
+// Each power of 2 is split into 1 << METRICS_SUB_BITS buckets, so a
+// recorded value is known to within 12.5%
+#define METRICS_SUB_BITS 3
+#define METRICS_BUCKETS ((64 - METRICS_SUB_BITS + 1) << METRICS_SUB_BITS)
+
+// A histogram's counts in one thread
+struct metrics_hist {
+    long long sum; // Of the values recorded (ns)
+    long buckets[METRICS_BUCKETS];
+};
+
+// One thread's share of every metric; only that thread writes to it
+struct metrics_shard {
+    struct metrics_shard *next; // All the shards
+    struct metrics_hist hists[METRICS_HISTOGRAMS];
+    long counters[METRICS_COUNTERS];
+};
+
+// Where metrics_print() and friends write to
+struct metrics_out {
+    char *buf;
+    int size;
+    int len; // Can pass size: that's how much room it would have taken
+};
+
+extern long long metrics_clock(void);
+extern int metrics_histogram(char *name, char *help, char *labels);
+extern int metrics_counter(char *name, char *help, char *labels);
+extern void metrics_observe(int id, long long ns);
+extern void metrics_add(int id, long n);
+extern void metrics_printf(struct metrics_out *out, char *fmt, ...);
+extern void metrics_value(struct metrics_out *out, char *name, char *type, char *help, double value);
+extern void metrics_print(struct metrics_out *out);
+
+#endif
@@ -0,0 +1,108 @@
+#include <stdlib.h>
+#include <string.h>
+#include "negcache.h"
+
+/**
+ * Hash a path (FNV-1a)
+ */
+unsigned int negcache_hash(char *path)
+{
+    unsigned int h = 2166136261U;
+
+    for (unsigned char *p = (unsigned char *)path; *p != '\0'; p++) {
+        h ^= *p;
+        h *= 16777619U;
+    }
+
+    return h;
+}
+
+/**
+ * Create a negative cache
+ *
+ * size: number of slots; rounded up to a power of two
+ * ttl:  seconds to remember each miss
+ *
+ * The cache is direct-mapped: a new miss simply replaces whatever was
+ * in its slot, so memory stays bounded no matter what gets requested.
+ */
+struct negcache *negcache_create(int size, int ttl)
+{
+    struct negcache *nc = malloc(sizeof *nc);
+
+    if (nc == NULL) {
+        return NULL;
+    }
+
+    nc->size = 1;
+
+    while (nc->size < size) {
+        nc->size <<= 1;
+    }
+
+    nc->slot = calloc(nc->size, sizeof *nc->slot);
+
+    if (nc->slot == NULL) {
+        free(nc);
+        return NULL;
+    }
+
+    nc->ttl = ttl;
+    nc->hits = nc->inserts = 0;
+
+    return nc;
+}
+
+/**
+ * Free a negative cache
+ */
+void negcache_free(struct negcache *nc)
+{
+    for (int i = 0; i < nc->size; i++) {
+        free(nc->slot[i].path);
+    }
+
+    free(nc->slot);
+    free(nc);
+}
+
+/**
+ * Return true if path is a known miss that hasn't expired
+ */
+int negcache_contains(struct negcache *nc, char *path)
+{
+    unsigned int h = negcache_hash(path);
+    struct negcache_slot *slot = &nc->slot[h & (nc->size - 1)];
+
+    if (slot->path == NULL || slot->hash != h || slot->expires <= time(NULL) ||
+        strcmp(slot->path, path) != 0) {
+
+        return 0;
+    }
+
+    nc->hits++;
+
+    return 1;
+}
+
+/**
+ * Remember that path doesn't exist
+ */
+void negcache_add(struct negcache *nc, char *path)
+{
+    unsigned int h = negcache_hash(path);
+    struct negcache_slot *slot = &nc->slot[h & (nc->size - 1)];
+    char *copy = strdup(path);
+
+    if (copy == NULL) {
+        return;
+    }
+
+    free(slot->path);
+
+    slot->path = copy;
+    slot->hash = h;
+    slot->expires = time(NULL) + nc->ttl;
+
+    nc->inserts++;
+}
@@ -0,0 +1,28 @@
+#ifndef _NEGCACHE_H_
+#define _NEGCACHE_H_
+
+#include <time.h>
+
+// One remembered miss
+struct negcache_slot {
+    unsigned int hash;
+    time_t expires;
+    char *path; // NULL if the slot is empty
+};
+
+// A bounded cache of paths known not to exist
+struct negcache {
+    struct negcache_slot *slot;
+    int size; // Number of slots, a power of two
+    int ttl;  // Seconds a miss is remembered
+
+    long hits;    // Lookups answered from the negative cache
+    long inserts; // Misses remembered
+};
+
+extern struct negcache *negcache_create(int size, int ttl);
+extern void negcache_free(struct negcache *nc);
+extern int negcache_contains(struct negcache *nc, char *path);
+extern void negcache_add(struct negcache *nc, char *path);
+
+#endif
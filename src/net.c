@@ -1,15 +1,17 @@
 #include <stdio.h>
 #include <unistd.h>
+#include <errno.h>
 #include <string.h>
 #include <sys/types.h>
+#include <stddef.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <netdb.h>
 #include <arpa/inet.h>
 #include "net.h"
 
-#define BACKLOG 10	 // how many pending connections queue will hold
-
 /**
  * This gets an Internet address, either IPv4 or IPv6
  *
@@ -24,66 +26,231 @@ void *get_in_addr(struct sockaddr *sa)
     return &(((struct sockaddr_in6*)sa)->sin6_addr);
 }
 
+/**
+ * Turn an IPv4 address that came in on a dual-stack socket
+ * (::ffff:a.b.c.d) back into a plain IPv4 one
+ */
+void unmap_in_addr(struct sockaddr_storage *ss)
+{
+    struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)ss;
+    struct sockaddr_in sin;
+
+    if (ss->ss_family != AF_INET6 || !IN6_IS_ADDR_V4MAPPED(&sin6->sin6_addr)) {
+        return;
+    }
+
+    memset(&sin, 0, sizeof sin);
+    sin.sin_family = AF_INET;
+    sin.sin_port = sin6->sin6_port;
+    memcpy(&sin.sin_addr, &sin6->sin6_addr.s6_addr[12], 4);
+
+    memcpy(ss, &sin, sizeof sin);
+}
+
+/**
+ * Fill in the address of a Unix socket
+ *
+ * A path starting with @ is in the abstract namespace: it has no file,
+ * and goes away with the last socket using it.
+ *
+ * Returns the address's length, or -1 if the path is too long.
+ */
+int unix_addr(struct sockaddr_un *addr, char *path)
+{
+    int len = strlen(path);
+
+    memset(addr, 0, sizeof *addr);
+    addr->sun_family = AF_UNIX;
+
+    if (len >= (int)sizeof addr->sun_path) {
+        return -1;
+    }
+
+    memcpy(addr->sun_path, path, len);
+
+    if (path[0] == '@') {
+        addr->sun_path[0] = '\0';
+
+        // The name is exactly len bytes, NUL included, not NUL-terminated
+        return offsetof(struct sockaddr_un, sun_path) + len;
+    }
+
+    return sizeof *addr;
+}
+
+/**
+ * Return a listening Unix socket
+ *
+ * A socket file left at the path by a server that's gone is removed
+ * first; a server still listening there, or anything that isn't a
+ * socket, is left alone, and the bind fails.
+ *
+ * Returns -1 on error.
+ */
+int get_unix_listener_socket(struct listener_opts *opts)
+{
+    struct sockaddr_un addr;
+    struct stat st;
+    int len = unix_addr(&addr, opts->unix_path);
+
+    if (len < 0) {
+        fprintf(stderr, "webserver: Unix socket path too long: %s\n", opts->unix_path);
+        return -1;
+    }
+
+    int sockfd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+    if (sockfd == -1) {
+        perror("socket");
+        return -1;
+    }
+
+    if (addr.sun_path[0] != '\0' && lstat(addr.sun_path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+        int probe = socket(AF_UNIX, SOCK_STREAM, 0);
+
+        if (connect(probe, (struct sockaddr *)&addr, len) == -1 && errno == ECONNREFUSED) {
+            unlink(addr.sun_path);
+        }
+
+        close(probe);
+    }
+
+    if (bind(sockfd, (struct sockaddr *)&addr, len) == -1 || listen(sockfd, opts->backlog) == -1) {
+        perror(opts->unix_path);
+        close(sockfd);
+        return -1;
+    }
+
+    return sockfd;
+}
+
+/**
+ * Fill in the default listener options
+ */
+void listener_opts_init(struct listener_opts *opts)
+{
+    memset(opts, 0, sizeof *opts);
+    opts->backlog = LISTEN_BACKLOG;
+    opts->nodelay = 1;
+}
+
+/**
+ * Set the TCP options the listener was asked for
+ *
+ * They're only tuning, so one the kernel won't take is reported and
+ * otherwise ignored.
+ */
+void set_listener_options(int sockfd, struct listener_opts *opts)
+{
+    int yes = 1;
+
+    // Accepted sockets inherit it, which saves a setsockopt() apiece.
+    // Responses are written whole, so Nagle has nothing to coalesce;
+    // it would only hold back the last piece of one until the client's
+    // (delayed) ACK.
+    if (opts->nodelay && setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof yes) == -1) {
+        perror("setsockopt: TCP_NODELAY");
+    }
+
+    // Don't wake us for a connection until it has something to read
+    if (opts->defer_accept > 0 && setsockopt(sockfd, IPPROTO_TCP, TCP_DEFER_ACCEPT,
+        &opts->defer_accept, sizeof opts->defer_accept) == -1) {
+
+        perror("setsockopt: TCP_DEFER_ACCEPT");
+    }
+
+    // Let returning clients send their request with the SYN (the
+    // kernel has to allow it too: net.ipv4.tcp_fastopen)
+    if (opts->fastopen > 0 && setsockopt(sockfd, IPPROTO_TCP, TCP_FASTOPEN,
+        &opts->fastopen, sizeof opts->fastopen) == -1) {
+
+        perror("setsockopt: TCP_FASTOPEN");
+    }
+}
+
 /**
  * Return the main listening socket
  *
+ * With no host in opts it listens on every address. That's one IPv6
+ * socket taking IPv4 too, where the kernel has IPv6; otherwise IPv4
+ * only. With a unix_path it listens there instead, and the TCP options
+ * don't apply.
+ *
  * Returns -1 or error
  */
-int get_listener_socket(char *port)
+int get_listener_socket(char *port, struct listener_opts *opts)
 {
     int sockfd;
-    struct addrinfo hints, *servinfo, *p;
-    int yes = 1;
+    struct addrinfo hints, *servinfo, *p = NULL;
+    int yes = 1, no = 0;
     int rv;
 
+    if (opts->unix_path != NULL) {
+        return get_unix_listener_socket(opts);
+    }
+
     // This block of code looks at the local network interfaces and
     // tries to find some that match our requirements (namely either
     // IPv4 or IPv6 (AF_UNSPEC) and TCP (SOCK_STREAM) and use any IP on
-    // this machine (AI_PASSIVE).
+    // this machine (AI_PASSIVE) unless we were given one.
 
     memset(&hints, 0, sizeof hints);
     hints.ai_family = AF_UNSPEC;
     hints.ai_socktype = SOCK_STREAM;
     hints.ai_flags = AI_PASSIVE; // use my IP
 
-    if ((rv = getaddrinfo(NULL, port, &hints, &servinfo)) != 0) {
+    if ((rv = getaddrinfo(opts->host, port, &hints, &servinfo)) != 0) {
         fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(rv));
         return -1;
     }
 
     // Once we have a list of potential interfaces, loop through them
     // and try to set up a socket on each. Quit looping the first time
-    // we have success.
-    for(p = servinfo; p != NULL; p = p->ai_next) {
-
-        // Try to make a socket based on this candidate interface
-        if ((sockfd = socket(p->ai_family, p->ai_socktype,
-            p->ai_protocol)) == -1) {
-            //perror("server: socket");
-            continue;
-        }
+    // we have success. IPv6 ones get the first pass, for dual stack:
+    // the wildcard address usually comes back as 0.0.0.0 first.
+    for (int pass = 0; pass < 2 && p == NULL; pass++) {
+        for(p = servinfo; p != NULL; p = p->ai_next) {
 
-        // SO_REUSEADDR prevents the "address already in use" errors
-        // that commonly come up when testing servers.
-        if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &yes,
-            sizeof(int)) == -1) {
-            perror("setsockopt");
-            close(sockfd);
-            freeaddrinfo(servinfo); // all done with this structure
-            return -2;
-        }
+            if ((p->ai_family == AF_INET6) != (pass == 0)) {
+                continue;
+            }
 
-        // See if we can bind this socket to this local IP address. This
-        // associates the file descriptor (the socket descriptor) that
-        // we will read and write on with a specific IP address.
-        if (bind(sockfd, p->ai_addr, p->ai_addrlen) == -1) {
-            close(sockfd);
-            //perror("server: bind");
-            continue;
-        }
+            // Try to make a socket based on this candidate interface
+            if ((sockfd = socket(p->ai_family, p->ai_socktype,
+                p->ai_protocol)) == -1) {
+                //perror("server: socket");
+                continue;
+            }
 
-        // If we got here, we got a bound socket and we're done
-        break;
+            // SO_REUSEADDR prevents the "address already in use" errors
+            // that commonly come up when testing servers.
+            if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &yes,
+                sizeof(int)) == -1) {
+                perror("setsockopt");
+                close(sockfd);
+                freeaddrinfo(servinfo); // all done with this structure
+                return -2;
+            }
+
+            // Take IPv4 connections on an IPv6 socket too (some
+            // systems default to not)
+            if (p->ai_family == AF_INET6) {
+                setsockopt(sockfd, IPPROTO_IPV6, IPV6_V6ONLY, &no, sizeof no);
+            }
+
+            // See if we can bind this socket to this local IP address.
+            // This associates the file descriptor (the socket
+            // descriptor) that we will read and write on with a
+            // specific IP address.
+            if (bind(sockfd, p->ai_addr, p->ai_addrlen) == -1) {
+                close(sockfd);
+                //perror("server: bind");
+                continue;
+            }
+
+            // If we got here, we got a bound socket and we're done
+            break;
+        }
     }
 
     freeaddrinfo(servinfo); // all done with this structure
@@ -97,11 +264,13 @@ int get_listener_socket(char *port)
 
     // Start listening. This is what allows remote computers to connect
     // to this socket/IP.
-    if (listen(sockfd, BACKLOG) == -1) {
+    if (listen(sockfd, opts->backlog) == -1) {
         //perror("listen");
         close(sockfd);
         return -4;
     }
 
+    set_listener_options(sockfd, opts);
+
     return sockfd;
 }
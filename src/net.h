@@ -1,7 +1,25 @@
 #ifndef _NET_H_
 #define _NET_H_
 
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define LISTEN_BACKLOG 4096 // Default listen() queue; the kernel caps it at somaxconn
+
+// How the listening socket is set up
+struct listener_opts {
+    char *unix_path;  // Listen on this Unix socket instead of TCP; @name is abstract
+    char *host;       // Address to bind, or NULL for every address, IPv4 and IPv6
+    int backlog;      // Connections that can wait to be accepted
+    int defer_accept; // Seconds to hold a connection back until its request arrives; 0 for off
+    int fastopen;     // TCP Fast Open queue length; 0 for off
+    int nodelay;      // Set TCP_NODELAY (accepted sockets inherit it)
+};
+
 void *get_in_addr(struct sockaddr *sa);
-int get_listener_socket(char *port);
+void unmap_in_addr(struct sockaddr_storage *ss);
+int unix_addr(struct sockaddr_un *addr, char *path);
+void listener_opts_init(struct listener_opts *opts);
+int get_listener_socket(char *port, struct listener_opts *opts);
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,310 @@
+/*
+
+A work-stealing thread pool for blocking work.
+
+The event loop mustn't block, but some things do: reading a file on a
+cache miss, compressing it. Those go to the pool as tasks.
+
+Each worker has its own deque of tasks. The loop hands tasks out round
+robin, pushing onto the bottom of each deque; a worker takes its own
+newest task from the bottom, and when it runs out, steals the oldest
+from the top of someone else's. So one slow task (a cold disk read)
+doesn't hold up the tasks queued behind it.
+
+Finished tasks go onto a lock-free stack, and an eventfd wakes the event
+loop, which calls pool_drain() to run each task's done() callback on
+the loop thread. That's where results touch shared state like the
+cache, so nothing outside the pool needs locks.
+
+A pool with no workers runs tasks right away, on the caller's thread.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdint.h>
+#include <sys/eventfd.h>
+#include "pool.h"
+
+#define DEQUE_SIZE 64 // Initial deque size; must be a power of 2
+
+/**
+ * Push a task onto the bottom of a worker's deque
+ *
+ * Returns 0, or -1 if out of memory.
+ */
+int deque_push(struct worker *w, struct task *t)
+{
+    pthread_mutex_lock(&w->lock);
+
+    if (w->bottom - w->top == w->size) {
+        // Full: double it, unwrapping as we go
+        struct task **tasks = malloc(2 * w->size * sizeof *tasks);
+
+        if (tasks == NULL) {
+            pthread_mutex_unlock(&w->lock);
+            return -1;
+        }
+
+        for (int i = w->top; i < w->bottom; i++) {
+            tasks[i - w->top] = w->tasks[i & (w->size - 1)];
+        }
+
+        free(w->tasks);
+
+        w->tasks = tasks;
+        w->bottom -= w->top;
+        w->top = 0;
+        w->size *= 2;
+    }
+
+    w->tasks[w->bottom & (w->size - 1)] = t;
+    w->bottom++;
+
+    pthread_mutex_unlock(&w->lock);
+
+    return 0;
+}
+
+/**
+ * Take the newest task from the bottom of a worker's own deque
+ */
+struct task *deque_pop(struct worker *w)
+{
+    struct task *t = NULL;
+
+    pthread_mutex_lock(&w->lock);
+
+    if (w->bottom > w->top) {
+        w->bottom--;
+        t = w->tasks[w->bottom & (w->size - 1)];
+    }
+
+    pthread_mutex_unlock(&w->lock);
+
+    return t;
+}
+
+/**
+ * Steal the oldest task from the top of another worker's deque
+ */
+struct task *deque_steal(struct worker *w)
+{
+    struct task *t = NULL;
+
+    // Don't wait on a busy deque; try the next one instead
+    if (pthread_mutex_trylock(&w->lock) != 0) {
+        return NULL;
+    }
+
+    if (w->bottom > w->top) {
+        t = w->tasks[w->top & (w->size - 1)];
+        w->top++;
+    }
+
+    pthread_mutex_unlock(&w->lock);
+
+    return t;
+}
+
+/**
+ * Hand a finished task back to the event loop
+ */
+void pool_complete(struct pool *pool, struct task *t)
+{
+    struct task *head = __atomic_load_n(&pool->done, __ATOMIC_RELAXED);
+
+    do {
+        t->next = head;
+    } while (!__atomic_compare_exchange_n(&pool->done, &head, t, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+    // Only the first finished task needs to wake the loop; it takes
+    // the whole stack at once
+    if (head == NULL) {
+        uint64_t one = 1;
+
+        if (write(pool->efd, &one, sizeof one) < 0) {
+            perror("write");
+        }
+    }
+}
+
+/**
+ * Find a task: our own first, then anyone else's
+ */
+struct task *worker_find_task(struct worker *w)
+{
+    struct pool *pool = w->pool;
+    struct task *t = deque_pop(w);
+
+    for (int i = 1; t == NULL && i < pool->nworkers; i++) {
+        t = deque_steal(&pool->workers[(w->id + i) % pool->nworkers]);
+
+        if (t != NULL) {
+            w->stolen++;
+        }
+    }
+
+    return t;
+}
+
+/**
+ * Worker thread
+ */
+void *worker_main(void *arg)
+{
+    struct worker *w = arg;
+    struct pool *pool = w->pool;
+
+    while (1) {
+        struct task *t = worker_find_task(w);
+
+        if (t == NULL) {
+            // Nothing anywhere: sleep until something's submitted
+            pthread_mutex_lock(&pool->idle_lock);
+
+            while (pool->queued == 0) {
+                pthread_cond_wait(&pool->idle_cond, &pool->idle_lock);
+            }
+
+            pthread_mutex_unlock(&pool->idle_lock);
+            continue;
+        }
+
+        pthread_mutex_lock(&pool->idle_lock);
+        pool->queued--;
+        pthread_mutex_unlock(&pool->idle_lock);
+
+        t->run(t);
+        w->ran++;
+
+        pool_complete(pool, t);
+    }
+
+    return NULL;
+}
+
+/**
+ * Create a pool of worker threads
+ *
+ * With 0 workers, tasks run synchronously in pool_submit().
+ */
+struct pool *pool_create(int nworkers)
+{
+    struct pool *pool = calloc(1, sizeof *pool);
+
+    if (pool == NULL) {
+        return NULL;
+    }
+
+    pool->nworkers = nworkers;
+    pool->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    pool->workers = calloc(nworkers > 0? nworkers: 1, sizeof *pool->workers);
+
+    if (pool->efd < 0 || pool->workers == NULL) {
+        perror("pool_create");
+        exit(3);
+    }
+
+    pthread_mutex_init(&pool->idle_lock, NULL);
+    pthread_cond_init(&pool->idle_cond, NULL);
+
+    for (int i = 0; i < nworkers; i++) {
+        struct worker *w = &pool->workers[i];
+
+        w->pool = pool;
+        w->id = i;
+        w->size = DEQUE_SIZE;
+        w->tasks = malloc(w->size * sizeof *w->tasks);
+
+        pthread_mutex_init(&w->lock, NULL);
+
+        if (w->tasks == NULL) {
+            perror("pool_create");
+            exit(3);
+        }
+    }
+
+    // Workers steal from each other, so every deque must be ready first
+    for (int i = 0; i < nworkers; i++) {
+        struct worker *w = &pool->workers[i];
+
+        if (pthread_create(&w->thread, NULL, worker_main, w) != 0) {
+            fprintf(stderr, "pool_create: can't start worker\n");
+            exit(3);
+        }
+    }
+
+    return pool;
+}
+
+/**
+ * Hand a task to the pool
+ *
+ * Its done() callback will be called from pool_drain() once it's run.
+ * With no workers, the task runs and its done() is called right here.
+ */
+void pool_submit(struct pool *pool, struct task *t)
+{
+    pool->submitted++;
+
+    if (pool->nworkers == 0 || deque_push(&pool->workers[pool->next], t) < 0) {
+        t->run(t);
+        pool->completed++;
+        t->done(t);
+        return;
+    }
+
+    pool->next = (pool->next + 1) % pool->nworkers;
+
+    pthread_mutex_lock(&pool->idle_lock);
+    pool->queued++;
+    pthread_cond_signal(&pool->idle_cond);
+    pthread_mutex_unlock(&pool->idle_lock);
+}
+
+/**
+ * Call done() for every finished task, in the order they finished
+ *
+ * Call this from the event loop when pool->efd is readable.
+ *
+ * Returns the number of tasks completed.
+ */
+int pool_drain(struct pool *pool)
+{
+    uint64_t count;
+    int n = 0;
+
+    // Clear the wakeup before taking the stack, so a task finishing
+    // after this wakes us again
+    if (read(pool->efd, &count, sizeof count) < 0 && errno != EAGAIN) {
+        perror("read");
+    }
+
+    struct task *t = __atomic_exchange_n(&pool->done, NULL, __ATOMIC_ACQUIRE);
+    struct task *fifo = NULL;
+
+    // The stack is newest first; flip it
+    while (t != NULL) {
+        struct task *next = t->next;
+
+        t->next = fifo;
+        fifo = t;
+        t = next;
+    }
+
+    while (fifo != NULL) {
+        struct task *next = fifo->next;
+
+        pool->completed++;
+        fifo->done(fifo);
+        n++;
+
+        fifo = next;
+    }
+
+    return n;
+}
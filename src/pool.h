@@ -0,0 +1,49 @@
+#ifndef _POOL_H_
+#define _POOL_H_
+
+#include <pthread.h>
+
+// A piece of blocking work. Embed this in a bigger struct to carry the
+// work's arguments and results.
+struct task {
+    struct task *next;
+
+    void (*run)(struct task *t);  // Does the work, on a worker thread
+    void (*done)(struct task *t); // Then this runs back on the event loop
+};
+
+// A worker thread and its deque of tasks
+struct worker {
+    pthread_t thread;
+    struct pool *pool;
+    int id;
+
+    pthread_mutex_t lock;
+    struct task **tasks; // Ring buffer: top is the oldest, bottom the newest
+    int top, bottom, size;
+
+    long ran, stolen; // Tasks run, and how many of those were stolen
+};
+
+// A pool of worker threads
+struct pool {
+    struct worker *workers;
+    int nworkers;
+    int next; // Worker the next task is handed to
+
+    // Sleeping workers wait here for tasks
+    pthread_mutex_t idle_lock;
+    pthread_cond_t idle_cond;
+    int queued; // Tasks waiting to be picked up
+
+    int efd;            // eventfd: readable when there are finished tasks
+    struct task *done;  // Finished tasks (lock-free stack, newest first)
+
+    long submitted, completed;
+};
+
+extern struct pool *pool_create(int nworkers);
+extern void pool_submit(struct pool *pool, struct task *t);
+extern int pool_drain(struct pool *pool);
+
+#endif
@@ -0,0 +1,140 @@
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include "range.h"
+
+#define OFF_T_MAX ((off_t)(~(unsigned long long)0 >> (64 - sizeof(off_t) * 8 + 1)))
+
+/**
+ * Parse one decimal byte position
+ *
+ * A position too big for an off_t comes out as OFF_T_MAX, which is past
+ * the end of anything: as a first position that makes the range
+ * unsatisfiable, as a last one it's clamped to the end like any other.
+ *
+ * Returns a pointer just past the digits, or NULL if there were none.
+ */
+char *parse_pos(char *p, off_t *pos)
+{
+    off_t v = 0;
+    char *start = p;
+
+    while (isdigit((unsigned char)*p)) {
+        int d = *p - '0';
+
+        v = v > (OFF_T_MAX - d) / 10? OFF_T_MAX: v * 10 + d;
+        p++;
+    }
+
+    if (p == start) {
+        return NULL;
+    }
+
+    *pos = v;
+
+    return p;
+}
+
+/**
+ * Parse a Range header value against a representation of size bytes
+ *
+ * Handles "bytes=0-499", "bytes=500-", "bytes=-500" and comma-separated
+ * lists of those. Ranges that start past the end are dropped; the end of
+ * a range is clamped to the end of the representation.
+ *
+ * Returns the number of satisfiable ranges stored in ranges, 0 if the
+ * header should be ignored (bad syntax, unknown unit or too many ranges)
+ * and the whole representation sent, or -1 if no range is satisfiable
+ * (416).
+ */
+int range_parse(char *value, off_t size, struct byte_range *ranges, int max_ranges)
+{
+    char *p = value;
+    int count = 0, specs = 0;
+
+    p += strspn(p, " \t");
+
+    if (strncmp(p, "bytes=", 6) != 0) {
+        return 0;
+    }
+
+    p += 6;
+
+    while (*p != '\0') {
+        off_t first, last;
+        int has_first, has_last;
+
+        p += strspn(p, " \t,");
+
+        if (*p == '\0') {
+            break;
+        }
+
+        char *q = parse_pos(p, &first);
+        has_first = q != NULL;
+
+        if (has_first) {
+            p = q;
+        }
+
+        if (*p != '-') {
+            return 0;
+        }
+
+        p++;
+
+        q = parse_pos(p, &last);
+        has_last = q != NULL;
+
+        if (has_last) {
+            p = q;
+        }
+
+        p += strspn(p, " \t");
+
+        if (*p != ',' && *p != '\0') {
+            return 0;
+        }
+
+        if (++specs > max_ranges) {
+            return 0;
+        }
+
+        if (!has_first && !has_last) {
+            return 0;
+        }
+
+        if (has_first && has_last && last < first) {
+            return 0;
+        }
+
+        if (!has_first) {
+            // Suffix range: the final last bytes
+            if (last == 0 || size == 0) {
+                continue;
+            }
+
+            first = last > size? 0: size - last;
+            last = size - 1;
+
+        } else {
+            if (first >= size) {
+                continue;
+            }
+
+            if (!has_last || last >= size) {
+                last = size - 1;
+            }
+        }
+
+        ranges[count].start = first;
+        ranges[count].end = last;
+        count++;
+    }
+
+    if (specs == 0) {
+        return 0;
+    }
+
+    return count == 0? -1: count;
+}
@@ -0,0 +1,16 @@
+#ifndef _RANGE_H_
+#define _RANGE_H_
+
+#include <sys/types.h>
+
+#define RANGE_MAX 16 // Most ranges we'll honor in one request
+
+// One satisfiable byte range, inclusive on both ends
+struct byte_range {
+    off_t start;
+    off_t end;
+};
+
+extern int range_parse(char *value, off_t size, struct byte_range *ranges, int max_ranges);
+
+#endif
@@ -0,0 +1,156 @@
+/*
+
+Per-client rate limiting: a token bucket for each client address.
+
+A client's bucket holds up to burst tokens and fills at rate tokens a
+second. Each request takes one; a request that finds the bucket empty
+is refused. A client that keeps within the rate is never refused, and
+one that saves up can burst.
+
+Buckets live in a fixed-size table, so a flood of addresses can't run
+it out of memory. It's set-associative: an address hashes to a set of
+RATELIMIT_WAYS buckets, and a new address takes the one in its set
+that was used longest ago. An address forgotten that way comes back
+with a full bucket, which errs on the side of letting clients in.
+
+Each event loop has a table of its own, so it needs no locking.
+
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <netinet/in.h>
+#include "net.h"
+#include "ratelimit.h"
+
+/**
+ * Hash an address (FNV-1a)
+ */
+unsigned int ratelimit_hash(unsigned char *addr, int len)
+{
+    unsigned int h = 2166136261U;
+
+    for (int i = 0; i < len; i++) {
+        h ^= addr[i];
+        h *= 16777619U;
+    }
+
+    return h;
+}
+
+/**
+ * Create a rate limiter
+ *
+ * size: number of buckets; rounded up to a power of 2
+ * rate: requests a second allowed each client
+ * burst: requests a client can make at once, having saved up
+ */
+struct ratelimit *ratelimit_create(int size, int rate, int burst)
+{
+    struct ratelimit *rl = malloc(sizeof *rl);
+
+    if (rl == NULL) {
+        return NULL;
+    }
+
+    rl->size = RATELIMIT_WAYS;
+
+    while (rl->size < size) {
+        rl->size <<= 1;
+    }
+
+    rl->rate = rate;
+    rl->burst = burst > 0? burst: 1;
+    rl->evictions = 0;
+    rl->buckets = calloc(rl->size, sizeof *rl->buckets);
+
+    if (rl->buckets == NULL) {
+        free(rl);
+        return NULL;
+    }
+
+    return rl;
+}
+
+/**
+ * Free a rate limiter
+ */
+void ratelimit_free(struct ratelimit *rl)
+{
+    free(rl->buckets);
+    free(rl);
+}
+
+/**
+ * Take a token for a request from addr, at now (ms)
+ *
+ * Clients without an IP address (on a Unix socket) aren't limited.
+ *
+ * Returns 1 if the request is allowed, 0 if it's over the limit.
+ */
+int ratelimit_allow(struct ratelimit *rl, struct sockaddr_storage *addr, unsigned long long now)
+{
+    int family = addr->ss_family;
+    int len = family == AF_INET? 4: family == AF_INET6? 16: 0;
+
+    if (len == 0) {
+        return 1;
+    }
+
+    unsigned char *key = get_in_addr((struct sockaddr *)addr);
+    unsigned int set = ratelimit_hash(key, len) & (rl->size - 1) & ~(RATELIMIT_WAYS - 1);
+    struct ratelimit_bucket *b = NULL, *oldest = &rl->buckets[set];
+
+    for (int i = 0; i < RATELIMIT_WAYS; i++) {
+        struct ratelimit_bucket *candidate = &rl->buckets[set + i];
+
+        if (candidate->family == family && memcmp(candidate->addr, key, len) == 0) {
+            b = candidate;
+            break;
+        }
+
+        if (candidate->family == 0 || (oldest->family != 0 && candidate->last < oldest->last)) {
+            oldest = candidate;
+        }
+    }
+
+    long full = rl->burst * 1000L;
+
+    if (b == NULL) {
+        b = oldest;
+
+        if (b->family != 0) {
+            rl->evictions++;
+        }
+
+        memset(b->addr, 0, sizeof b->addr);
+        memcpy(b->addr, key, len);
+        b->family = family;
+        b->tokens = full;
+        b->last = now;
+    }
+
+    // Top up for the time since last, a thousandth of a token per ms
+    // for every request a second allowed. Long enough ago, it's full
+    // whatever the rate (and the sum can't overflow).
+    if (now > b->last) {
+        unsigned long long elapsed = now - b->last;
+
+        if (elapsed >= (unsigned long long)full) {
+            b->tokens = full;
+        } else {
+            b->tokens += (long)elapsed * rl->rate;
+            b->tokens = b->tokens < full? b->tokens: full;
+        }
+
+        b->last = now;
+    }
+
+    if (b->tokens < 1000) {
+        return 0;
+    }
+
+    b->tokens -= 1000;
+
+    return 1;
+}
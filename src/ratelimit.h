@@ -0,0 +1,31 @@
+#ifndef _RATELIMIT_H_
+#define _RATELIMIT_H_
+
+#include <sys/socket.h>
+
+#define RATELIMIT_SIZE 16384 // Default number of buckets; a power of 2
+#define RATELIMIT_WAYS 4     // Buckets a client's address can be in
+
+// One client's tokens
+struct ratelimit_bucket {
+    unsigned char addr[16];  // IPv4 addresses use the first 4 bytes
+    int family;              // 0 if the bucket is empty
+    long tokens;             // In thousandths of a request
+    unsigned long long last; // When tokens was last topped up, in ms
+};
+
+// Token buckets for client addresses, in a fixed-size table
+struct ratelimit {
+    struct ratelimit_bucket *buckets;
+    int size;  // A power of 2, and a multiple of RATELIMIT_WAYS
+    int rate;  // Requests a second each client is allowed
+    int burst; // Requests a client can save up
+
+    long evictions; // Clients forgotten to make room for others
+};
+
+extern struct ratelimit *ratelimit_create(int size, int rate, int burst);
+extern void ratelimit_free(struct ratelimit *rl);
+extern int ratelimit_allow(struct ratelimit *rl, struct sockaddr_storage *addr, unsigned long long now);
+
+#endif
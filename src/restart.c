@@ -0,0 +1,258 @@
+/*
+
+Hot restart: handing a running server's listening socket, and
+optionally its cache, to the server replacing it.
+
+A server started with -R path listens for its replacement on a Unix
+socket at path. The replacement, started with the same -R, connects
+there first and asks for the listener (and the cache, with -C). The
+old server sends them back as file descriptors with SCM_RIGHTS, stops
+accepting and drains its connections, then exits. The listener is
+never closed, so connections arriving meanwhile wait in its queue for
+the new server rather than being refused. The new server then takes
+over path, ready for the restart after it.
+
+    ./server -R serverfiles/restart.sock &
+    ...install the new binary...
+    ./server -R serverfiles/restart.sock -C &
+
+The cache goes over as a memfd holding a shared cache segment (see
+shmcache.c and cache_export()).
+
+*/
+
+#define _GNU_SOURCE // accept4()
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "restart.h"
+
+#define RESTART_LISTENER 'L' // Asking for the listener
+#define RESTART_CACHE 'C'    // Asking for the listener and the cache
+#define RESTART_HANDOFF 'H'  // Here they are
+
+/**
+ * Fill in the address of the Unix socket at path
+ *
+ * Returns -1 if the path is too long.
+ */
+int restart_addr(struct sockaddr_un *addr, char *path)
+{
+    memset(addr, 0, sizeof *addr);
+    addr->sun_family = AF_UNIX;
+
+    if (strlen(path) >= sizeof addr->sun_path) {
+        fprintf(stderr, "restart: path too long: %s\n", path);
+        return -1;
+    }
+
+    strcpy(addr->sun_path, path);
+
+    return 0;
+}
+
+/**
+ * Give a socket a timeout, in ms, for sends and receives
+ */
+void restart_timeout(int fd, int ms)
+{
+    struct timeval tv = { ms / 1000, (ms % 1000) * 1000 };
+
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof tv);
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof tv);
+}
+
+/**
+ * Take over from the server listening for its replacement at path
+ *
+ * On success, *listenfd is its listening socket and *cachefd a memfd
+ * holding its cache, or -1 if it wasn't asked for or wasn't sent.
+ *
+ * Returns 1 if we took over, 0 if there's no server there, or -1 on
+ * error.
+ */
+int restart_takeover(char *path, int want_cache, int *listenfd, int *cachefd)
+{
+    struct sockaddr_un addr;
+    char ask = want_cache? RESTART_CACHE: RESTART_LISTENER, answer;
+
+    *listenfd = *cachefd = -1;
+
+    if (restart_addr(&addr, path) < 0) {
+        return -1;
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+    if (fd < 0) {
+        perror("socket");
+        return -1;
+    }
+
+    if (connect(fd, (struct sockaddr *)&addr, sizeof addr) < 0) {
+        int nobody = errno == ENOENT || errno == ECONNREFUSED;
+
+        if (!nobody) {
+            perror(path);
+        }
+
+        close(fd);
+        return nobody? 0: -1;
+    }
+
+    restart_timeout(fd, RESTART_TIMEOUT);
+
+    // Room for two descriptors
+    union {
+        char buf[CMSG_SPACE(2 * sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    struct iovec iov = { &answer, 1 };
+    struct msghdr msg;
+
+    memset(&msg, 0, sizeof msg);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof control.buf;
+
+    if (send(fd, &ask, 1, 0) != 1 || recvmsg(fd, &msg, MSG_CMSG_CLOEXEC) != 1 || answer != RESTART_HANDOFF) {
+        fprintf(stderr, "restart: no handoff from the server at %s\n", path);
+        close(fd);
+        return -1;
+    }
+
+    close(fd);
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+
+    if (cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+        fprintf(stderr, "restart: handoff came without a listener\n");
+        return -1;
+    }
+
+    int fds[2] = { -1, -1 };
+    int nfds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+
+    memcpy(fds, CMSG_DATA(cmsg), (nfds < 2? nfds: 2) * sizeof(int));
+
+    *listenfd = fds[0];
+    *cachefd = fds[1];
+
+    return 1;
+}
+
+/**
+ * Listen for a replacement at path
+ *
+ * Anything already at path is removed: either it's the server we've
+ * just taken over from, which is done with it, or it's stale.
+ *
+ * Returns the listening socket (non-blocking), or -1 on error.
+ */
+int restart_listen(char *path)
+{
+    struct sockaddr_un addr;
+
+    if (restart_addr(&addr, path) < 0) {
+        return -1;
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+
+    if (fd < 0) {
+        perror("socket");
+        return -1;
+    }
+
+    unlink(path);
+
+    if (bind(fd, (struct sockaddr *)&addr, sizeof addr) < 0 || listen(fd, 1) < 0) {
+        perror(path);
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+/**
+ * See if a replacement is asking to take over
+ *
+ * Doesn't block if nobody is. *want_cache is set if it asked for the
+ * cache too.
+ *
+ * Returns a socket to answer it on with restart_send(), or -1.
+ */
+int restart_accept(int restartfd, int *want_cache)
+{
+    char ask;
+    int fd = accept4(restartfd, NULL, NULL, SOCK_CLOEXEC);
+
+    if (fd < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            perror("restart: accept");
+        }
+        return -1;
+    }
+
+    // It asks as soon as it's connected
+    restart_timeout(fd, RESTART_TIMEOUT);
+
+    if (recv(fd, &ask, 1, 0) != 1 || (ask != RESTART_LISTENER && ask != RESTART_CACHE)) {
+        close(fd);
+        return -1;
+    }
+
+    *want_cache = ask == RESTART_CACHE;
+
+    return fd;
+}
+
+/**
+ * Hand the listener, and the cache unless cachefd is -1, to a
+ * replacement, and hang up on it
+ *
+ * Returns 0, or -1 on error.
+ */
+int restart_send(int fd, int listenfd, int cachefd)
+{
+    union {
+        char buf[CMSG_SPACE(2 * sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    int fds[2] = { listenfd, cachefd };
+    int nfds = cachefd >= 0? 2: 1;
+    char answer = RESTART_HANDOFF;
+    struct iovec iov = { &answer, 1 };
+    struct msghdr msg;
+
+    memset(&msg, 0, sizeof msg);
+    memset(&control, 0, sizeof control);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = CMSG_SPACE(nfds * sizeof(int));
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(nfds * sizeof(int));
+    memcpy(CMSG_DATA(cmsg), fds, nfds * sizeof(int));
+
+    int rv = sendmsg(fd, &msg, 0);
+
+    if (rv != 1) {
+        perror("restart: sendmsg");
+    }
+
+    close(fd);
+
+    return rv == 1? 0: -1;
+}
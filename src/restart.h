@@ -0,0 +1,11 @@
+#ifndef _RESTART_H_
+#define _RESTART_H_
+
+#define RESTART_TIMEOUT 5000 // ms a new server waits for the old one to answer
+
+extern int restart_takeover(char *path, int want_cache, int *listenfd, int *cachefd);
+extern int restart_listen(char *path);
+extern int restart_accept(int restartfd, int *want_cache);
+extern int restart_send(int fd, int listenfd, int cachefd);
+
+#endif
@@ -0,0 +1,333 @@
+/*
+
+Request routing.
+
+Routes map a method and a path (exact, or a prefix) to a handler. They
+are registered at startup and then compiled into a radix trie per
+method: each node's edge is labelled with a run of path bytes, so a
+lookup walks the request path once, comparing each byte at most once,
+however many routes there are.
+
+The compiled trie lives in two flat arrays (nodes and their labels),
+and a node's children sit next to each other sorted by their first
+byte, so picking the next edge is a binary search over a short array.
+
+Matching rules:
+
+  * an exact route wins if the whole path matches it
+  * otherwise the longest matching prefix route wins
+  * otherwise the router's not_found handler is used
+
+So a catch-all (e.g. static files under "/") is just a prefix route,
+and anything more specific takes precedence over it.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "router.h"
+
+#define ROUTES_SIZE 16 // Initial room for registered routes
+
+/**
+ * Create a router
+ *
+ * not_found handles requests no route matches.
+ */
+struct router *router_create(route_handler not_found)
+{
+    struct router *r = calloc(1, sizeof *r);
+
+    if (r == NULL) {
+        return NULL;
+    }
+
+    r->not_found = not_found;
+
+    return r;
+}
+
+/**
+ * Free the compiled trie
+ */
+void router_free_compiled(struct router *r)
+{
+    free(r->nodes);
+    free(r->labels);
+
+    r->nodes = NULL;
+    r->labels = NULL;
+    r->nnodes = 0;
+    r->nmethods = 0;
+}
+
+/**
+ * Free a router
+ */
+void router_free(struct router *r)
+{
+    for (int i = 0; i < r->nroutes; i++) {
+        free(r->routes[i].method);
+        free(r->routes[i].path);
+    }
+
+    router_free_compiled(r);
+    free(r->routes);
+    free(r);
+}
+
+/**
+ * Register a route
+ *
+ * flags is ROUTE_EXACT or ROUTE_PREFIX. Takes effect on the next
+ * router_compile().
+ *
+ * Returns 0, or -1 if out of memory.
+ */
+int router_add(struct router *r, char *method, char *path, int flags, route_handler handler)
+{
+    if (r->nroutes == r->routes_size) {
+        int size = r->routes_size? r->routes_size * 2: ROUTES_SIZE;
+        struct route *routes = realloc(r->routes, size * sizeof *routes);
+
+        if (routes == NULL) {
+            return -1;
+        }
+
+        r->routes = routes;
+        r->routes_size = size;
+    }
+
+    struct route *route = &r->routes[r->nroutes];
+
+    route->method = strdup(method);
+    route->path = strdup(path);
+    route->flags = flags;
+    route->handler = handler;
+
+    if (route->method == NULL || route->path == NULL) {
+        free(route->method);
+        free(route->path);
+        return -1;
+    }
+
+    r->nroutes++;
+
+    return 0;
+}
+
+/**
+ * qsort() comparison: by method, then path
+ */
+int route_cmp(const void *a, const void *b)
+{
+    const struct route *ra = a, *rb = b;
+    int cmp = strcmp(ra->method, rb->method);
+
+    return cmp != 0? cmp: strcmp(ra->path, rb->path);
+}
+
+/**
+ * Fill in a trie node from routes[lo..hi)
+ *
+ * The routes are sorted and all share their first depth bytes, which
+ * is where this node is.
+ *
+ * Returns 0, or -1 if two routes are the same.
+ */
+int router_build(struct router *r, int lo, int hi, int depth, int node, int *nlabels)
+{
+    struct router_node *n = &r->nodes[node];
+    int i = lo;
+
+    // Routes ending here sort first
+    for (; i < hi && r->routes[i].path[depth] == '\0'; i++) {
+        struct route *route = &r->routes[i];
+        route_handler *slot = route->flags == ROUTE_PREFIX? &n->prefix: &n->exact;
+
+        if (*slot != NULL) {
+            fprintf(stderr, "router: duplicate route %s %s\n", route->method, route->path);
+            return -1;
+        }
+
+        *slot = route->handler;
+    }
+
+    // The rest are grouped by their next byte, one child per group
+    int nchildren = 0;
+
+    for (int j = i; j < hi; j++) {
+        if (j == i || r->routes[j].path[depth] != r->routes[j - 1].path[depth]) {
+            nchildren++;
+        }
+    }
+
+    n->children = r->nnodes;
+    n->nchildren = nchildren;
+    r->nnodes += nchildren;
+
+    for (int child = n->children; i < hi; child++) {
+        char *first = r->routes[i].path;
+        int end = i + 1;
+
+        while (end < hi && r->routes[end].path[depth] == first[depth]) {
+            end++;
+        }
+
+        // Sorted, so what the first and last share, they all share
+        char *last = r->routes[end - 1].path;
+        int split = depth + 1;
+
+        while (first[split] != '\0' && first[split] == last[split]) {
+            split++;
+        }
+
+        struct router_node *cn = &r->nodes[child];
+
+        cn->label = *nlabels;
+        cn->label_len = split - depth;
+        memcpy(r->labels + *nlabels, first + depth, cn->label_len);
+        *nlabels += cn->label_len;
+
+        if (router_build(r, i, end, split, child, nlabels) < 0) {
+            return -1;
+        }
+
+        i = end;
+    }
+
+    return 0;
+}
+
+/**
+ * Compile the registered routes for lookup
+ *
+ * Returns 0, or -1 on error (out of memory, duplicate routes or too
+ * many methods).
+ */
+int router_compile(struct router *r)
+{
+    size_t label_space = 1;
+
+    router_free_compiled(r);
+
+    qsort(r->routes, r->nroutes, sizeof *r->routes, route_cmp);
+
+    for (int i = 0; i < r->nroutes; i++) {
+        label_space += strlen(r->routes[i].path);
+    }
+
+    // A radix trie has at most two nodes per key, plus the roots
+    r->nodes = calloc(2 * r->nroutes + ROUTER_METHODS, sizeof *r->nodes);
+    r->labels = malloc(label_space);
+
+    if (r->nodes == NULL || r->labels == NULL) {
+        router_free_compiled(r);
+        return -1;
+    }
+
+    int nlabels = 0;
+
+    for (int lo = 0, hi; lo < r->nroutes; lo = hi) {
+        hi = lo + 1;
+
+        while (hi < r->nroutes && strcmp(r->routes[hi].method, r->routes[lo].method) == 0) {
+            hi++;
+        }
+
+        if (r->nmethods == ROUTER_METHODS) {
+            fprintf(stderr, "router: too many methods\n");
+            router_free_compiled(r);
+            return -1;
+        }
+
+        int root = r->nnodes++;
+
+        r->methods[r->nmethods] = r->routes[lo].method;
+        r->roots[r->nmethods] = root;
+        r->nmethods++;
+
+        if (router_build(r, lo, hi, 0, root, &nlabels) < 0) {
+            router_free_compiled(r);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Find the child of a node whose label starts with byte c, or -1
+ */
+int router_child(struct router *r, struct router_node *n, unsigned char c)
+{
+    int lo = n->children, hi = n->children + n->nchildren;
+
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        unsigned char first = r->labels[r->nodes[mid].label];
+
+        if (first == c) {
+            return mid;
+        }
+
+        if (first < c) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    return -1;
+}
+
+/**
+ * Find the handler for a request
+ *
+ * Only the first path_len bytes of path are matched (e.g. to leave
+ * off a query string). Never returns NULL unless the router's
+ * not_found handler is.
+ */
+route_handler router_lookup(struct router *r, char *method, char *path, int path_len)
+{
+    int m;
+
+    for (m = 0; m < r->nmethods; m++) {
+        if (strcmp(r->methods[m], method) == 0) {
+            break;
+        }
+    }
+
+    if (m == r->nmethods) {
+        return r->not_found;
+    }
+
+    struct router_node *n = &r->nodes[r->roots[m]];
+    route_handler best = r->not_found;
+    int i = 0;
+
+    while (1) {
+        if (n->prefix != NULL) {
+            best = n->prefix;
+        }
+
+        if (i == path_len) {
+            return n->exact != NULL? n->exact: best;
+        }
+
+        int child = router_child(r, n, path[i]);
+
+        if (child < 0) {
+            return best;
+        }
+
+        n = &r->nodes[child];
+
+        if (n->label_len > path_len - i || memcmp(r->labels + n->label, path + i, n->label_len) != 0) {
+            return best;
+        }
+
+        i += n->label_len;
+    }
+}
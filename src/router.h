@@ -0,0 +1,56 @@
+#ifndef _ROUTER_H_
+#define _ROUTER_H_
+
+struct conn;
+struct cache;
+
+// Handles a request; path is the request path as sent
+typedef void (*route_handler)(struct conn *c, struct cache *cache, char *path);
+
+#define ROUTE_EXACT 0  // Route matches the path exactly
+#define ROUTE_PREFIX 1 // Route matches any path starting with it
+
+#define ROUTER_METHODS 8 // Most distinct methods
+
+// A registered route
+struct route {
+    char *method;
+    char *path;
+    int flags;
+    route_handler handler;
+};
+
+// A node in a compiled trie. Children are contiguous, sorted by the
+// first byte of their labels.
+struct router_node {
+    int label;    // Offset of this node's edge label in the label pool
+    int label_len;
+    int children; // Index of the first child
+    int nchildren;
+    route_handler exact;  // Route ending here, or NULL
+    route_handler prefix; // Prefix route ending here, or NULL
+};
+
+struct router {
+    struct route *routes; // Registered so far
+    int nroutes, routes_size;
+
+    // Compiled: one trie per method, all sharing the arrays below
+    char *methods[ROUTER_METHODS];
+    int roots[ROUTER_METHODS];
+    int nmethods;
+
+    struct router_node *nodes;
+    int nnodes;
+    char *labels;
+
+    route_handler not_found; // When nothing matches
+};
+
+extern struct router *router_create(route_handler not_found);
+extern void router_free(struct router *r);
+extern int router_add(struct router *r, char *method, char *path, int flags, route_handler handler);
+extern int router_compile(struct router *r);
+extern route_handler router_lookup(struct router *r, char *method, char *path, int path_len);
+
+#endif
@@ -0,0 +1,232 @@
+/*
+
+An append-only log of saved request bodies, with group commit.
+
+Bodies are written as they arrive, a record per piece, so a save never
+has to fit in memory. Saves arriving at the same time interleave, so
+every record carries the id of the save it belongs to: the offset of
+that save's BEGIN record. The last record is flagged END, or ABORT if
+the client gave up partway.
+
+Records are written with plain appends on the event loop; those only
+reach the page cache and don't wait for the disk. A save isn't
+acknowledged until an fdatasync() covers its END record. That runs in
+the pool, one at a time: every save that finishes while a sync is
+under way shares the next one. A save can also wait up to sync_delay
+ms before its sync starts, so that others can join it. Either way,
+write throughput isn't limited to one save per disk flush.
+
+*/
+
+#define _GNU_SOURCE // clock_nanosleep()
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+#include "savelog.h"
+
+/**
+ * Return monotonic time in ns
+ */
+long long savelog_clock(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/**
+ * Flush the log to disk (worker thread)
+ */
+void savelog_sync_run(struct task *t)
+{
+    struct savelog *log = (struct savelog *)t;
+    struct timespec ts;
+
+    // Give more saves a chance to join in
+    ts.tv_sec = log->sync_at / 1000000000LL;
+    ts.tv_nsec = log->sync_at % 1000000000LL;
+
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {
+        // Interrupted; go back to sleep
+    }
+
+    // Whatever had been written by now is what this sync covers
+    log->sync_end = __atomic_load_n(&log->end, __ATOMIC_ACQUIRE);
+    log->sync_error = fdatasync(log->fd) < 0;
+}
+
+/**
+ * Start a sync for the oldest waiting save
+ */
+void savelog_sync_start(struct savelog *log)
+{
+    log->syncing = 1;
+    log->sync_at = log->waiting->deadline;
+
+    pool_submit(log->pool, &log->task);
+}
+
+/**
+ * A sync has finished; tell the saves it covered (event loop)
+ */
+void savelog_sync_done(struct task *t)
+{
+    struct savelog *log = (struct savelog *)t;
+
+    log->syncs++;
+
+    if (log->sync_error) {
+        perror("savelog: fdatasync");
+    }
+
+    while (log->waiting != NULL && log->waiting->end <= log->sync_end) {
+        struct savelog_wait *w = log->waiting;
+
+        log->waiting = w->next;
+
+        if (log->waiting == NULL) {
+            log->waiting_tail = NULL;
+        }
+
+        // Saves committed from in here (say, the next one pipelined
+        // on this connection) just queue up, as we're still syncing
+        w->done(w->arg, log->sync_error);
+    }
+
+    log->syncing = 0;
+
+    // These came in too late to be covered
+    if (log->waiting != NULL) {
+        savelog_sync_start(log);
+    }
+}
+
+/**
+ * Open (or create) a save log
+ *
+ * Syncs run in pool. sync_delay is the most ms a save waits for others
+ * to share its sync.
+ *
+ * Returns NULL on error.
+ */
+struct savelog *savelog_open(char *path, struct pool *pool, int sync_delay)
+{
+    struct savelog *log = calloc(1, sizeof *log);
+    struct stat st;
+
+    if (log == NULL) {
+        return NULL;
+    }
+
+    log->fd = open(path, O_WRONLY|O_CREAT|O_APPEND|O_CLOEXEC, 0644);
+
+    if (log->fd < 0 || fstat(log->fd, &st) < 0) {
+        perror(path);
+
+        if (log->fd >= 0) {
+            close(log->fd);
+        }
+
+        free(log);
+        return NULL;
+    }
+
+    log->end = st.st_size;
+    log->pool = pool;
+    log->sync_delay = sync_delay;
+    log->task.run = savelog_sync_run;
+    log->task.done = savelog_sync_done;
+
+    return log;
+}
+
+/**
+ * Append a record
+ *
+ * Returns 0, or -1 on error.
+ */
+int savelog_append(struct savelog *log, int64_t id, void *data, int len, int flags)
+{
+    struct savelog_record rec;
+    struct iovec iov[2];
+
+    rec.id = id;
+    rec.len = len;
+    rec.flags = flags;
+
+    iov[0].iov_base = &rec;
+    iov[0].iov_len = sizeof rec;
+    iov[1].iov_base = data;
+    iov[1].iov_len = len;
+
+    ssize_t rv = writev(log->fd, iov, len > 0? 2: 1);
+
+    if (rv > 0) {
+        __atomic_store_n(&log->end, log->end + rv, __ATOMIC_RELEASE);
+    }
+
+    if (rv != (ssize_t)(sizeof rec + len)) {
+        perror("savelog: write");
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Start a new save
+ *
+ * Returns its id, or -1 on error.
+ */
+int64_t savelog_begin(struct savelog *log)
+{
+    // The server we took over from (see restart.c) may still be
+    // appending as it drains, so find where the log really ends
+    off_t end = lseek(log->fd, 0, SEEK_END);
+
+    if (end > log->end) {
+        __atomic_store_n(&log->end, end, __ATOMIC_RELEASE);
+    }
+
+    int64_t id = log->end;
+
+    if (savelog_append(log, id, NULL, 0, SAVELOG_BEGIN) < 0) {
+        return -1;
+    }
+
+    return id;
+}
+
+/**
+ * Wait for everything written so far to reach the disk
+ *
+ * w->done(w->arg, error) is called from the event loop once it has;
+ * fill in those two fields first. w must stay put until then.
+ */
+void savelog_commit(struct savelog *log, struct savelog_wait *w)
+{
+    w->next = NULL;
+    w->end = log->end;
+    w->deadline = savelog_clock() + log->sync_delay * 1000000LL;
+
+    if (log->waiting_tail == NULL) {
+        log->waiting = w;
+    } else {
+        log->waiting_tail->next = w;
+    }
+
+    log->waiting_tail = w;
+    log->saves++;
+
+    if (!log->syncing) {
+        savelog_sync_start(log);
+    }
+}
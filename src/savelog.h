@@ -0,0 +1,51 @@
+#ifndef _SAVELOG_H_
+#define _SAVELOG_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+#include "pool.h"
+
+#define SAVELOG_BEGIN 1 // First record of a save; its offset is the save's id
+#define SAVELOG_END 2   // Last record of a save that finished
+#define SAVELOG_ABORT 4 // Last record of a save that didn't
+
+// Each record in the log: this, then len bytes of data
+struct savelog_record {
+    int64_t id;     // The save this is part of
+    uint32_t len;
+    uint32_t flags; // SAVELOG_*
+};
+
+// A save waiting for its records to reach the disk
+struct savelog_wait {
+    struct savelog_wait *next;
+    off_t end;          // Everything up to here must be synced
+    long long deadline; // Sync no later than this (monotonic ns)
+    void (*done)(void *arg, int error);
+    void *arg;
+};
+
+// An append-only log of saved bodies
+struct savelog {
+    struct task task; // The sync in flight; must be first
+
+    int fd;
+    off_t end;        // Where the next record goes
+    int sync_delay;   // ms a save may wait for others to share its sync
+    struct pool *pool;
+
+    struct savelog_wait *waiting, *waiting_tail; // Oldest first
+    int syncing;          // A sync is in flight...
+    long long sync_at;    // ...that starts at this time (monotonic ns)...
+    off_t sync_end;       // ...and covers up to here, once it's run
+    int sync_error;
+
+    long saves, syncs;
+};
+
+extern struct savelog *savelog_open(char *path, struct pool *pool, int sync_delay);
+extern int64_t savelog_begin(struct savelog *log);
+extern int savelog_append(struct savelog *log, int64_t id, void *data, int len, int flags);
+extern void savelog_commit(struct savelog *log, struct savelog_wait *w);
+
+#endif
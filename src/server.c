@@ -6,16 +6,25 @@
  *    curl -D - http://localhost:3490/
  *    curl -D - http://localhost:3490/d20
  *    curl -D - http://localhost:3490/date
+ *    curl -D - http://localhost:3490/d20?n=1000000   (streamed, chunked)
+ *    curl http://localhost:3490/metrics              (Prometheus format)
+ *    curl --unix-socket web.sock http://localhost/   (run with -U web.sock)
  * 
  * You can also test the above URLs in your browser! They should work!
  * 
  * Posting Data:
  * 
  *    curl -D - -X POST -H 'Content-Type: text/plain' -d 'Hello, sample data!' http://localhost:3490/save
+ *    curl -D - -X POST -H 'Transfer-Encoding: chunked' --data-binary @big.file http://localhost:3490/save
+ *
+ * Saved bodies are appended to serverfiles/save.log (see savelog.h for
+ * the format).
  * 
  * (Posting data is harder to test from a browser.)
  */
 
+#define _GNU_SOURCE // ppoll()
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -27,200 +36,2505 @@
 #include <netdb.h>
 #include <arpa/inet.h>
 #include <time.h>
-#include <sys/file.h>
+#include <limits.h>
 #include <fcntl.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <poll.h>
 #include "net.h"
 #include "file.h"
 #include "mime.h"
 #include "cache.h"
+#include "hashtable.h"
+#include "range.h"
+#include "compress.h"
+#include "negcache.h"
+#include "http.h"
+#include "conn.h"
+#include "loop.h"
+#include "pool.h"
+#include "arena.h"
+#include "router.h"
+#include "savelog.h"
+#include "accesslog.h"
+#include "metrics.h"
+#include "trace.h"
+#include "restart.h"
 
 #define PORT "3490"  // the port users will be connecting to
 
 #define SERVER_FILES "./serverfiles"
 #define SERVER_ROOT "./serverroot"
+#define SAVE_LOG "./serverfiles/save.log"
+#define ACCESS_LOG "./serverfiles/access.log"
+
+#define CACHE_ENTRIES 10 // Default maximum number of cache entries
+#define MAX_CACHE_FILE_SIZE (1024 * 1024) // Bigger files are cached in segments
+#define SEGMENT_SIZE (256 * 1024) // Default size of those segments
+#define SEGMENT_MIN_SIZE 4096     // Smallest segment size allowed
+#define SEGMENT_LOAD_MAX 8        // Segments a response can have loaded
+#define SEGMENT_CACHE_BYTES (64 * 1024 * 1024) // Default room for those segments
+#define SEGMENT_VERSION_SIZE 80   // Room for a file's version (see segment_version())
+
+#define D20_BATCH 1024 // Rolls generated at a time for /d20?n=
+
+#define PATH_SIZE 4096 // Room for a file path or cache key
+#define HEADER_SIZE 2048 // Room for a response header
+#define EXTRA_HEADERS_SIZE 1024 // Room for the header lines send_content() adds
+
+#define POOL_WORKERS 4 // Default threads for blocking work
+#define POOL_MAX_WORKERS 1024 // Most -j allows
+#define SAVE_SYNC_DELAY 2 // Default ms a save waits to share a disk sync
+
+#define PREFORK_CACHE_BYTES (64 * 1024 * 1024) // Default shared cache size with -p
+#define PREFORK_MAX_PROCS 1024 // Most -p allows
+
+#define NEGCACHE_SIZE 1024 // Missing paths remembered
+#define NEGCACHE_TTL 5      // Seconds a missing path is remembered
+
+#define METRICS_OUT_SIZE 32768 // Room for a /metrics response; grown if need be
+
+// Where a response body comes from
+struct body {
+    void *data;  // In-memory content (e.g. from the cache), or NULL
+    struct cache_entry *ce; // Cache entry data belongs to, so it can be
+                            // sent without a copy, or NULL
+    int file_fd; // Otherwise, send from this open file
+
+    // A file too big to cache whole (see get_large_file()): what's
+    // cached of it goes out from its segments, the rest from file_fd
+    struct cache *cache;   // segment_cache, or NULL
+    char *segment_path;    // File they're cut from
+    char *version;         // Which version of it (see segment_version())
+    off_t size;
+    int missing[SEGMENT_LOAD_MAX]; // Segments that weren't cached
+    int nmissing;
+};
+
+// The 404 response after the Date and Connection fields, built once at
+// startup (see resp_404_init())
+char *resp_404_data;
+int resp_404_length;
+
+// Paths we recently found don't exist
+struct negcache *negcache;
+
+// Seconds before cached files are reloaded from disk, 0 for never
+int file_ttl;
+
+// Bytes in each cached segment of a large file, 0 not to cache them
+int segment_size = SEGMENT_SIZE;
+
+// Where those segments are cached: apart from whole files, so a big
+// download can't push out every small file by filling the entry count
+struct cache *segment_cache;
+
+// Which handler each request goes to (see routes_init())
+struct router *router;
+
+// Endpoints that take their request bodies as they arrive
+struct router *stream_router;
+
+// Where POSTed bodies are saved
+struct savelog *savelog;
+
+// Metric ids (see metrics.h): request latency by route, and the
+// phases of serving a file
+struct {
+    int d20, date, save, file, metrics, not_found;
+} route_metric;
+
+int cache_lookup_metric, file_load_metric;
+
+// A POST /save in progress. Lives in the connection's arena.
+struct save {
+    struct savelog_wait wait;
+    struct conn *c;
+    int64_t id; // In the save log, or -1 if we couldn't start it
+    long bytes;
+};
+
+// A cache miss, loaded (and maybe compressed) off the event loop. See
+// get_file(). Lives in the connection's arena.
+struct file_load {
+    struct task task;
+
+    struct conn *c;
+    struct cache *cache;
+    char *request_header;
+    char filepath[PATH_SIZE];
+    char *content_type;
+    char *encoding; // What the client wants, or NULL
+    int vary;
+
+    struct cache_entry *identity_ce; // Cached identity content to encode, or NULL
+
+    // Results
+    int too_big;
+    struct file_data *identity; // Identity content read from disk, or NULL
+    void *variant;              // Encoded content, or NULL
+    int variant_size;
+    time_t variant_mtime;
+    int variant_is_identity;    // Encoding didn't help; cache the identity bytes
+
+    unsigned long trace_id;  // The request's, if it's traced (see trace.h)
+    unsigned long long queued; // When it was handed to the pool, if so
+};
+
+// Segments of a large file being loaded into the cache, off the event
+// loop. See segment_load_start(). Outlives the response that started
+// it, so it's malloc()ed rather than in the arena.
+struct segment_load {
+    struct task task;
+    struct segment_load *next; // Loads in flight
+
+    struct cache *cache;
+    char path[PATH_SIZE];
+    char *content_type;
+    char *encoding; // Of the file itself, or NULL
+    char version[SEGMENT_VERSION_SIZE]; // What the file has to still be
+    time_t mtime;
+    off_t size;
+
+    int n;
+    int index[SEGMENT_LOAD_MAX];
+    void *data[SEGMENT_LOAD_MAX]; // Results: NULL if it couldn't be read
+};
+
+// Segment loads in flight, so a file isn't loaded twice at once
+struct segment_load *segment_loads;
 
 /**
- * Send an HTTP response
+ * Describe which version of a file st is
  *
- * header:       "HTTP/1.1 404 NOT FOUND" or "HTTP/1.1 200 OK", etc.
- * content_type: "text/plain", etc.
- * body:         the data to send.
- * 
- * Return the value from the send() function.
+ * Segments are only good for the version they were cut from. The
+ * modification time alone is in whole seconds as far as HTTP goes, but
+ * a file rewritten within the same second gets a new nanosecond
+ * timestamp, and a file replaced by rename() a new inode.
+ */
+void segment_version(char *buf, int bufsize, struct stat *st)
+{
+    snprintf(buf, bufsize, "%lx.%lx.%llx.%llx.%09ld",
+        (unsigned long)st->st_dev, (unsigned long)st->st_ino, (unsigned long long)st->st_size,
+        (unsigned long long)st->st_mtim.tv_sec, st->st_mtim.tv_nsec);
+}
+
+/**
+ * Build the cache key for segment index of a version of a large file
+ *
+ * Like variant_key(), the tab keeps it from colliding with a real
+ * path; the # keeps it from colliding with a variant. Segments of older
+ * versions are never found again, and age out.
+ *
+ * With version NULL, it's the key of the file's manifest instead (see
+ * segment_manifest_add()).
+ */
+void segment_key(char *buf, int bufsize, char *filepath, char *version, int index)
+{
+    if (version == NULL) {
+        snprintf(buf, bufsize, "%s\t#", filepath);
+    } else {
+        snprintf(buf, bufsize, "%s\t#%s:%d", filepath, version, index);
+    }
+}
+
+/**
+ * Note that a segment had to be sent from the file, so it gets loaded
+ */
+void segment_missing(struct body *body, int index)
+{
+    for (int i = 0; i < body->nmissing; i++) {
+        if (body->missing[i] == index) {
+            return;
+        }
+    }
+
+    if (body->nmissing < SEGMENT_LOAD_MAX) {
+        body->missing[body->nmissing++] = index;
+    }
+}
+
+/**
+ * Queue len bytes of a large file starting at offset, from its cached
+ * segments where they're there and from the file where they're not
+ *
+ * The segment pieces are referenced, not copied, and go out together
+ * with the header in one writev (see conn_flush()).
+ *
+ * Returns 0 on success, or -1 on error.
  */
-int send_response(int fd, char *header, char *content_type, void *body, int content_length)
+int send_segments(struct conn *c, struct body *body, off_t offset, off_t len)
 {
-    const int max_response_size = 262144;
-    char response[max_response_size];
+    char key[PATH_SIZE];
 
-    // Build HTTP response and store it in response
+    while (len > 0) {
+        int index = offset / segment_size;
+        off_t start = (off_t)index * segment_size;
+        int seg_len = body->size - start < segment_size? body->size - start: segment_size;
+        off_t n = start + seg_len - offset;
+        void *data = NULL;
+        int rv;
 
-    ///////////////////
-    // IMPLEMENT ME! //
-    ///////////////////
+        n = n < len? n: len;
 
-    // Send it all!
-    int rv = send(fd, response, response_length, 0);
+        segment_key(key, sizeof key, body->segment_path, body->version, index);
 
-    if (rv < 0) {
-        perror("send");
+        struct cache_entry *ce = cache_get(body->cache, key);
+
+        if (ce != NULL) {
+            data = cache_entry_content(body->cache, ce);
+        }
+
+        if (data != NULL && data == ce->content) {
+            cache_entry_ref(ce);
+            rv = conn_write_ref(c, (char *)data + (offset - start), n, cache_entry_unref, ce);
+        } else if (data != NULL) {
+            // Decompressed into scratch space
+            rv = conn_write(c, (char *)data + (offset - start), n);
+        } else {
+            segment_missing(body, index);
+            rv = conn_write_file(c, body->file_fd, offset, n);
+        }
+
+        if (rv < 0) {
+            return -1;
+        }
+
+        offset += n;
+        len -= n;
     }
 
-    return rv;
+    return 0;
 }
 
+/**
+ * Queue len bytes of a body starting at offset
+ *
+ * Cached content is sent straight from the entry, which is kept alive
+ * until it's out; other in-memory bodies are copied. File bodies go
+ * through sendfile() so they never pass through userspace, or come
+ * from the file's cached segments.
+ *
+ * Returns 0 on success, or -1 on error.
+ */
+int send_body(struct conn *c, struct body *body, off_t offset, off_t len)
+{
+    if (body->cache != NULL) {
+        return send_segments(c, body, offset, len);
+    }
+
+    if (body->ce != NULL) {
+        cache_entry_ref(body->ce);
+
+        return conn_write_ref(c, (char *)body->data + offset, len, cache_entry_unref, body->ce);
+    }
+
+    if (body->data != NULL) {
+        return conn_write(c, (char *)body->data + offset, len);
+    }
+
+    return conn_write_file(c, body->file_fd, offset, len);
+}
 
 /**
- * Send a /d20 endpoint response
+ * Build the status line and common header fields of a response
+ *
+ * content_length is -1 for a streamed body (see send_stream()).
+ *
+ * Returns the length of the header, including the blank line, or -1 if
+ * it doesn't fit in buf.
  */
-void get_d20(int fd)
+int format_header(struct conn *c, char *buf, int bufsize, char *header, char *content_type, off_t content_length, char *extra_headers)
 {
-    // Generate a random number between 1 and 20 inclusive
-    
-    ///////////////////
-    // IMPLEMENT ME! //
-    ///////////////////
+    char date[64], length[64] = "";
 
-    // Use send_response() to send it back as text/plain data
+    http_date(date, sizeof date, time(NULL));
+
+    if (content_length >= 0) {
+        snprintf(length, sizeof length, "Content-Length: %lld\r\n", (long long)content_length);
+    } else if (c->out_chunked) {
+        strcpy(length, "Transfer-Encoding: chunked\r\n");
+    }
+
+    c->status = http_status(header);
+
+    int len = snprintf(buf, bufsize,
+        "%s\r\n"
+        "Date: %s\r\n"
+        "Connection: %s\r\n"
+        "%s"
+        "Content-Type: %s\r\n"
+        "%s"
+        "\r\n",
+        header, date, c->keep_alive? "keep-alive": "close",
+        length, content_type,
+        extra_headers != NULL? extra_headers: "");
 
-    ///////////////////
-    // IMPLEMENT ME! //
-    ///////////////////
+    return len < bufsize? len: -1;
 }
 
 /**
- * Send a 404 response
+ * Send an HTTP response
+ *
+ * header:        "HTTP/1.1 404 NOT FOUND" or "HTTP/1.1 200 OK", etc.
+ * content_type:  "text/plain", etc.
+ * body:          the data to send.
+ * extra_headers: additional "Name: value\r\n" lines, or NULL.
+ *
+ * The response is queued on the connection; the event loop sends it.
+ *
+ * Returns 0 on success, or -1 on error.
  */
-void resp_404(int fd)
+int send_response(struct conn *c, char *header, char *content_type, void *body, int content_length, char *extra_headers)
 {
-    char filepath[4096];
-    struct file_data *filedata; 
-    char *mime_type;
+    char response[HEADER_SIZE];
 
-    // Fetch the 404.html file
-    snprintf(filepath, sizeof filepath, "%s/404.html", SERVER_FILES);
-    filedata = file_load(filepath);
+    // Build HTTP response header and queue it with the body
+    int response_length = format_header(c, response, sizeof response,
+        header, content_type, content_length, extra_headers);
 
-    if (filedata == NULL) {
-        // TODO: make this non-fatal
-        fprintf(stderr, "cannot find system 404 file\n");
-        exit(3);
+    if (response_length < 0) {
+        fprintf(stderr, "send_response: header too long\n");
+        return -1;
+    }
+
+    if (conn_write(c, response, response_length) < 0 ||
+        conn_write(c, body, content_length) < 0) {
+        perror("send_response");
+        return -1;
     }
 
-    mime_type = mime_type_get(filepath);
+    return 0;
+}
 
-    send_response(fd, "HTTP/1.1 404 NOT FOUND", mime_type, filedata->data, filedata->size);
+/**
+ * Send a 500 in place of a response whose header lines didn't fit
+ *
+ * Only for use before any of the response has been queued.
+ */
+void send_header_too_long(struct conn *c)
+{
+    char *body = "Internal Server Error\n";
 
-    file_free(filedata);
+    fprintf(stderr, "webserver: response header too long\n");
+    send_response(c, "HTTP/1.1 500 INTERNAL SERVER ERROR", "text/plain", body, strlen(body), NULL);
 }
 
 /**
- * Read and return a file from disk or cache
+ * Send an HTTP response whose body is made as it goes
+ *
+ * produce(c, arg) is called for each piece of the body as the client
+ * is ready for it, and release(arg) once it's done; see conn_produce().
+ * Nothing is buffered beyond the piece being sent, however big the
+ * body gets.
+ *
+ * Returns 0 on success, or -1 on error.
  */
-void get_file(int fd, struct cache *cache, char *request_path)
+int send_stream(struct conn *c, char *header, char *content_type, int (*produce)(struct conn *, void *), void (*release)(void *), void *arg, char *extra_headers)
 {
-    ///////////////////
-    // IMPLEMENT ME! //
-    ///////////////////
+    char response[HEADER_SIZE];
+
+    // Decides how the body is delimited, which the header has to say
+    conn_produce(c, produce, release, arg);
+
+    int response_length = format_header(c, response, sizeof response,
+        header, content_type, -1, extra_headers);
+
+    if (response_length < 0 || conn_write(c, response, response_length) < 0) {
+        perror("send_stream");
+        return -1;
+    }
+
+    return 0;
 }
 
 /**
- * Search for the end of the HTTP header
- * 
- * "Newlines" in HTTP can be \r\n (carriage return followed by newline) or \n
- * (newline) or \r (carriage return).
+ * Format the validator header lines for a response
+ *
+ * etag may be NULL if the representation doesn't have one.
  */
-char *find_start_of_body(char *header)
+void format_validators(char *buf, int bufsize, char *etag, time_t last_modified)
 {
-    ///////////////////
-    // IMPLEMENT ME! // (Stretch)
-    ///////////////////
+    char date[64];
+    int len = 0;
+
+    buf[0] = '\0';
+
+    if (etag != NULL) {
+        len += snprintf(buf + len, bufsize - len, "ETag: %s\r\n", etag);
+    }
+
+    http_date(date, sizeof date, last_modified);
+    snprintf(buf + len, bufsize - len, "Last-Modified: %s\r\n", date);
 }
 
 /**
- * Handle HTTP request and send response
+ * Send a 304 Not Modified response
+ *
+ * This is header-only: the body is never touched.
  */
-void handle_http_request(int fd, struct cache *cache)
+int send_not_modified(struct conn *c, char *validators)
 {
-    const int request_buffer_size = 65536; // 64K
-    char request[request_buffer_size];
+    char response[HEADER_SIZE];
+    char date[64];
 
-    // Read request
-    int bytes_recvd = recv(fd, request, request_buffer_size - 1, 0);
+    http_date(date, sizeof date, time(NULL));
 
-    if (bytes_recvd < 0) {
-        perror("recv");
-        return;
+    int response_length = snprintf(response, sizeof response,
+        "HTTP/1.1 304 NOT MODIFIED\r\n"
+        "Date: %s\r\n"
+        "Connection: %s\r\n"
+        "%s"
+        "\r\n",
+        date, c->keep_alive? "keep-alive": "close", validators);
+
+    if (response_length >= (int)sizeof response) {
+        send_header_too_long(c);
+        return 0;
     }
 
+    c->status = 304;
 
-    ///////////////////
-    // IMPLEMENT ME! //
-    ///////////////////
+    return conn_write(c, response, response_length);
+}
 
-    // Read the first two components of the first line of the request 
- 
-    // If GET, handle the get endpoints
+/**
+ * Return true if an If-None-Match list matches the entity tag
+ *
+ * Uses the weak comparison function, as RFC 7232 requires for
+ * If-None-Match.
+ */
+int etag_list_match(char *list, char *etag)
+{
+    char *p = list;
+
+    while (*p != '\0') {
+        p += strspn(p, " \t,");
+
+        if (*p == '\0') {
+            break;
+        }
+
+        int len = strcspn(p, " \t,");
+
+        if (len == 1 && *p == '*') {
+            return 1;
+        }
 
-    //    Check if it's /d20 and handle that special case
-    //    Otherwise serve the requested file by calling get_file()
+        char *tag = p;
+        int tag_len = len;
 
+        if (tag_len > 2 && strncmp(tag, "W/", 2) == 0) {
+            tag += 2;
+            tag_len -= 2;
+        }
+
+        if (etag != NULL && tag_len == (int)strlen(etag) && strncmp(tag, etag, tag_len) == 0) {
+            return 1;
+        }
+
+        p += len;
+    }
 
-    // (Stretch) If POST, handle the post request
+    return 0;
 }
 
 /**
- * Main
+ * Return true if the request's validators say the client's copy is
+ * still good
+ *
+ * If-None-Match takes precedence over If-Modified-Since.
  */
-int main(void)
+int not_modified(char *etag, time_t last_modified, char *request_header)
 {
-    int newfd;  // listen on sock_fd, new connection on newfd
-    struct sockaddr_storage their_addr; // connector's address information
-    char s[INET6_ADDRSTRLEN];
+    char value[1024];
 
-    struct cache *cache = cache_create(10, 0);
+    if (get_header(request_header, "If-None-Match", value, sizeof value) != NULL) {
+        return etag_list_match(value, etag);
+    }
 
-    // Get a listening socket
-    int listenfd = get_listener_socket(PORT);
+    if (get_header(request_header, "If-Modified-Since", value, sizeof value) != NULL) {
+        time_t since = http_date_parse(value);
 
-    if (listenfd < 0) {
-        fprintf(stderr, "webserver: fatal error getting listening socket\n");
-        exit(1);
+        return since != -1 && last_modified <= since;
     }
 
-    printf("webserver: waiting for connections on port %s...\n", PORT);
+    return 0;
+}
+
+/**
+ * Return true if the Range header should be honored
+ *
+ * If-Range carries either an entity tag, which must match strongly, or
+ * a date, which must match the last modification time exactly.
+ */
+int if_range_match(char *etag, time_t last_modified, char *request_header)
+{
+    char value[256];
+
+    if (get_header(request_header, "If-Range", value, sizeof value) == NULL) {
+        return 1;
+    }
 
-    // This is the main loop that accepts incoming connections and
-    // responds to the request. The main parent process
-    // then goes back to waiting for new connections.
-    
-    while(1) {
-        socklen_t sin_size = sizeof their_addr;
+    if (value[0] == '"' || strncmp(value, "W/", 2) == 0) {
+        return etag != NULL && strcmp(value, etag) == 0;
+    }
 
-        // Parent process will block on the accept() call until someone
-        // makes a new connection:
-        newfd = accept(listenfd, (struct sockaddr *)&their_addr, &sin_size);
-        if (newfd == -1) {
-            perror("accept");
-            continue;
+    return http_date_parse(value) == last_modified;
+}
+
+/**
+ * Send a 206 response with one or more byte ranges of a body
+ *
+ * A single range goes out as a plain body with a Content-Range header.
+ * Several ranges go out as multipart/byteranges. Either way, the data
+ * comes straight from the cached content or the file; only the little
+ * part headers are copied.
+ *
+ * extra_headers has to fit in EXTRA_HEADERS_SIZE. If the header still
+ * doesn't fit, a 500 goes out instead.
+ */
+int send_ranges(struct conn *c, char *content_type, struct body *body, off_t size, struct byte_range *ranges, int nranges, char *extra_headers)
+{
+    char header[HEADER_SIZE], extra[EXTRA_HEADERS_SIZE + 128];
+    int header_length;
+
+    if (nranges == 1) {
+        off_t len = ranges[0].end - ranges[0].start + 1;
+        int extra_length = snprintf(extra, sizeof extra, "Content-Range: bytes %lld-%lld/%lld\r\n%s",
+            (long long)ranges[0].start, (long long)ranges[0].end, (long long)size,
+            extra_headers);
+
+        header_length = extra_length < (int)sizeof extra? format_header(c, header, sizeof header,
+            "HTTP/1.1 206 PARTIAL CONTENT", content_type, len, extra): -1;
+
+        if (header_length < 0) {
+            send_header_too_long(c);
+            return 0;
+        }
+
+        if (conn_write(c, header, header_length) < 0) {
+            return -1;
+        }
+
+        return send_body(c, body, ranges[0].start, len);
+    }
+
+    // Multipart: every part gets its own little header
+    char boundary[32];
+    char part_header[RANGE_MAX][256];
+    int part_header_length[RANGE_MAX];
+    char closing[64];
+    off_t content_length = 0;
+
+    snprintf(boundary, sizeof boundary, "%08x%08x", rand(), rand());
+
+    for (int i = 0; i < nranges; i++) {
+        part_header_length[i] = snprintf(part_header[i], sizeof part_header[i],
+            "\r\n--%s\r\n"
+            "Content-Type: %s\r\n"
+            "Content-Range: bytes %lld-%lld/%lld\r\n"
+            "\r\n",
+            boundary, content_type,
+            (long long)ranges[i].start, (long long)ranges[i].end, (long long)size);
+
+        if (part_header_length[i] >= (int)sizeof part_header[i]) {
+            send_header_too_long(c);
+            return 0;
         }
 
-        // Print out a message that we got the connection
-        inet_ntop(their_addr.ss_family,
-            get_in_addr((struct sockaddr *)&their_addr),
-            s, sizeof s);
-        printf("server: got connection from %s\n", s);
-        
-        // newfd is a new socket descriptor for the new connection.
-        // listenfd is still listening for new connections.
+        content_length += part_header_length[i] + ranges[i].end - ranges[i].start + 1;
+    }
+
+    int closing_length = snprintf(closing, sizeof closing, "\r\n--%s--\r\n", boundary);
+    content_length += closing_length;
 
-        handle_http_request(newfd, cache);
+    char multipart_type[64];
+    snprintf(multipart_type, sizeof multipart_type, "multipart/byteranges; boundary=%s", boundary);
 
-        close(newfd);
+    header_length = format_header(c, header, sizeof header,
+        "HTTP/1.1 206 PARTIAL CONTENT", multipart_type, content_length, extra_headers);
+
+    if (header_length < 0) {
+        send_header_too_long(c);
+        return 0;
     }
 
-    // Unreachable code
+    if (conn_write(c, header, header_length) < 0) {
+        return -1;
+    }
 
-    return 0;
+    for (int i = 0; i < nranges; i++) {
+        if (conn_write(c, part_header[i], part_header_length[i]) < 0) {
+            return -1;
+        }
+
+        if (send_body(c, body, ranges[i].start, ranges[i].end - ranges[i].start + 1) < 0) {
+            return -1;
+        }
+    }
+
+    return conn_write(c, closing, closing_length);
+}
+
+/**
+ * Send a 416 Range Not Satisfiable response
+ */
+int send_range_not_satisfiable(struct conn *c, off_t size)
+{
+    char extra[64];
+
+    snprintf(extra, sizeof extra, "Content-Range: bytes */%lld\r\n", (long long)size);
+
+    return send_response(c, "HTTP/1.1 416 RANGE NOT SATISFIABLE", "text/plain", "", 0, extra);
+}
+
+/**
+ * Send the content of a file, from the cache or straight from disk
+ *
+ * Handles conditional requests (304), Range requests (206/416) and
+ * plain 200s. extra_headers (or NULL) go out with every one of them.
+ * If they don't fit with the rest of the header, a 500 goes out instead.
+ */
+void send_content(struct conn *c, char *request_header, char *content_type, struct body *body, off_t size, char *etag, time_t last_modified, char *extra_headers)
+{
+    char headers[EXTRA_HEADERS_SIZE], validators[256], extra[EXTRA_HEADERS_SIZE], value[1024];
+    struct byte_range ranges[RANGE_MAX];
+
+    format_validators(validators, sizeof validators, etag, last_modified);
+
+    int headers_length = snprintf(headers, sizeof headers, "%s%s", extra_headers != NULL? extra_headers: "", validators);
+    int extra_length = snprintf(extra, sizeof extra, "Accept-Ranges: bytes\r\n%s", headers);
+
+    if (headers_length >= (int)sizeof headers || extra_length >= (int)sizeof extra) {
+        send_header_too_long(c);
+        return;
+    }
+
+    if (not_modified(etag, last_modified, request_header)) {
+        send_not_modified(c, headers);
+        return;
+    }
+
+    if (get_header(request_header, "Range", value, sizeof value) != NULL &&
+        if_range_match(etag, last_modified, request_header)) {
+
+        int nranges = range_parse(value, size, ranges, RANGE_MAX);
+
+        if (nranges < 0) {
+            send_range_not_satisfiable(c, size);
+            return;
+        }
+
+        if (nranges > 0) {
+            if (send_ranges(c, content_type, body, size, ranges, nranges, extra) < 0) {
+                perror("send_ranges");
+            }
+            return;
+        }
+    }
+
+    char header[HEADER_SIZE];
+    int header_length = format_header(c, header, sizeof header, "HTTP/1.1 200 OK", content_type, size, extra);
+
+    if (header_length < 0) {
+        send_header_too_long(c);
+        return;
+    }
+
+    if (conn_write(c, header, header_length) < 0 || send_body(c, body, 0, size) < 0) {
+        perror("send_content");
+    }
+}
+
+/**
+ * Send a /d20 endpoint response
+ */
+void get_d20(struct conn *c)
+{
+    char body[8];
+
+    // Generate a random number between 1 and 20 inclusive
+    int body_length = snprintf(body, sizeof body, "%d\n", rand() % 20 + 1);
+
+    // Use send_response() to send it back as text/plain data
+    send_response(c, "HTTP/1.1 200 OK", "text/plain", body, body_length, NULL);
+}
+
+/**
+ * Send a /date endpoint response
+ */
+void get_date(struct conn *c)
+{
+    char body[64];
+
+    http_date(body, sizeof body - 1, time(NULL));
+    strcat(body, "\n");
+
+    send_response(c, "HTTP/1.1 200 OK", "text/plain", body, strlen(body), NULL);
 }
 
+/**
+ * Build the 404 response once, at startup
+ *
+ * Every 404 then goes out with no file I/O; only the Date and
+ * Connection fields are filled in per response, and the rest is sent
+ * straight from this buffer. If the 404 page is missing we fall back
+ * to a plain-text body rather than dying.
+ */
+void resp_404_init(void)
+{
+    char filepath[PATH_SIZE], header[1024];
+    struct file_data *filedata; 
+    char *mime_type, *body;
+    int body_length;
+
+    // Fetch the 404.html file
+    snprintf(filepath, sizeof filepath, "%s/404.html", SERVER_FILES);
+    filedata = file_load(filepath);
+
+    if (filedata != NULL) {
+        mime_type = mime_type_get(filepath);
+        body = filedata->data;
+        body_length = filedata->size;
+    } else {
+        fprintf(stderr, "cannot find system 404 file, using a plain one\n");
+        mime_type = "text/plain";
+        body = "404 Not Found\n";
+        body_length = strlen(body);
+    }
+
+    int header_length = snprintf(header, sizeof header,
+        "Content-Length: %d\r\n"
+        "Content-Type: %s\r\n"
+        "\r\n",
+        body_length, mime_type);
+
+    resp_404_length = header_length + body_length;
+    resp_404_data = malloc(resp_404_length);
+
+    if (resp_404_data == NULL) {
+        fprintf(stderr, "webserver: out of memory\n");
+        exit(3);
+    }
+
+    memcpy(resp_404_data, header, header_length);
+    memcpy(resp_404_data + header_length, body, body_length);
+
+    if (filedata != NULL) {
+        file_free(filedata);
+    }
+}
+
+/**
+ * Send a 404 response
+ */
+void resp_404(struct conn *c)
+{
+    char header[128], date[64];
+
+    http_date(date, sizeof date, time(NULL));
+
+    int header_length = snprintf(header, sizeof header,
+        "HTTP/1.1 404 NOT FOUND\r\n"
+        "Date: %s\r\n"
+        "Connection: %s\r\n",
+        date, c->keep_alive? "keep-alive": "close");
+
+    c->status = 404;
+
+    if (conn_write(c, header, header_length) < 0 ||
+        conn_write_ref(c, resp_404_data, resp_404_length, NULL, NULL) < 0) {
+        perror("resp_404");
+    }
+}
+
+/**
+ * Send a 404 for a missing file and remember the miss
+ */
+void resp_404_missing(struct conn *c, char *filepath)
+{
+    negcache_add(negcache, filepath);
+    resp_404(c);
+}
+
+/**
+ * Send a 500 response
+ */
+void resp_500(struct conn *c)
+{
+    char *body = "Internal Server Error\n";
+
+    send_response(c, "HTTP/1.1 500 INTERNAL SERVER ERROR", "text/plain", body, strlen(body), NULL);
+}
+
+/**
+ * Send a 503 response: too busy just now
+ */
+void resp_503(struct conn *c)
+{
+    char *body = "Service Unavailable\n";
+
+    send_response(c, "HTTP/1.1 503 SERVICE UNAVAILABLE", "text/plain", body, strlen(body), "Retry-After: 1\r\n");
+}
+
+/**
+ * Send a 400 response
+ */
+void resp_400(struct conn *c)
+{
+    char *body = "Bad Request\n";
+
+    send_response(c, "HTTP/1.1 400 BAD REQUEST", "text/plain", body, strlen(body), NULL);
+}
+
+/**
+ * Send a cache entry
+ *
+ * vary is true if the response depends on Accept-Encoding.
+ */
+void send_entry(struct conn *c, struct cache *cache, char *request_header, struct cache_entry *ce, int vary)
+{
+    char extra[128] = "";
+    struct body body;
+
+    // Only decompress if we're going to need the body
+    memset(&body, 0, sizeof body);
+    body.file_fd = -1;
+
+    if (ce->content_encoding != NULL) {
+        snprintf(extra, sizeof extra, "Content-Encoding: %s\r\n", ce->content_encoding);
+    }
+
+    if (vary) {
+        strcat(extra, "Vary: Accept-Encoding\r\n");
+    }
+
+    if (!not_modified(ce->etag, ce->last_modified, request_header)) {
+        body.data = cache_entry_content(cache, ce);
+
+        if (body.data == NULL) {
+            resp_500(c);
+            return;
+        }
+
+        // Uncompressed content can go out straight from the entry;
+        // decompressed content lives in scratch space and gets copied
+        if (body.data == ce->content) {
+            body.ce = ce;
+        }
+    }
+
+    send_content(c, request_header, ce->content_type, &body, ce->content_length, ce->etag, ce->last_modified, extra);
+}
+
+/**
+ * Load segments of a large file (worker thread)
+ *
+ * Nothing is loaded if the file has changed since the response that
+ * wanted them.
+ */
+void segment_load_run(struct task *task)
+{
+    struct segment_load *sl = (struct segment_load *)task;
+    char version[SEGMENT_VERSION_SIZE];
+    struct stat st;
+    int fd = open(sl->path, O_RDONLY);
+
+    if (fd < 0) {
+        return;
+    }
+
+    if (fstat(fd, &st) < 0) {
+        close(fd);
+        return;
+    }
+
+    segment_version(version, sizeof version, &st);
+
+    if (strcmp(version, sl->version) != 0) {
+        close(fd);
+        return;
+    }
+
+    for (int i = 0; i < sl->n; i++) {
+        off_t start = (off_t)sl->index[i] * segment_size;
+        int len = sl->size - start < segment_size? sl->size - start: segment_size;
+        char *data = malloc(len);
+        int got = 0;
+
+        while (data != NULL && got < len) {
+            ssize_t rv = pread(fd, data + got, len - got, start + got);
+
+            if (rv <= 0) {
+                free(data);
+                data = NULL;
+                break;
+            }
+
+            got += rv;
+        }
+
+        sl->data[i] = data;
+    }
+
+    close(fd);
+}
+
+/**
+ * Store loaded segments in the cache (event loop)
+ */
+void segment_load_done(struct task *task)
+{
+    struct segment_load *sl = (struct segment_load *)task, **p;
+    char key[PATH_SIZE];
+
+    for (p = &segment_loads; *p != sl; p = &(*p)->next);
+    *p = sl->next;
+
+    for (int i = 0; i < sl->n; i++) {
+        if (sl->data[i] == NULL) {
+            continue;
+        }
+
+        off_t start = (off_t)sl->index[i] * segment_size;
+        int len = sl->size - start < segment_size? sl->size - start: segment_size;
+
+        segment_key(key, sizeof key, sl->path, sl->version, sl->index[i]);
+
+        struct cache_entry *ce = cache_put_meta(sl->cache, key, sl->content_type, sl->data[i], len,
+            sl->encoding, sl->mtime);
+
+        if (ce != NULL) {
+            cache_set_ttl(sl->cache, ce, file_ttl);
+        }
+
+        free(sl->data[i]);
+    }
+
+    free(sl);
+}
+
+/**
+ * Have the segments a response had to send from the file loaded into
+ * the cache, for the responses after it
+ *
+ * Skipped if the file's already being loaded, or the pool's too far
+ * behind to take on optional work (see loop_shed()).
+ */
+void segment_load_start(struct loop *loop, struct body *body, char *content_type, char *encoding, time_t mtime)
+{
+    if (body->nmissing == 0 || loop_shed(loop)) {
+        return;
+    }
+
+    for (struct segment_load *sl = segment_loads; sl != NULL; sl = sl->next) {
+        if (strcmp(sl->path, body->segment_path) == 0) {
+            return;
+        }
+    }
+
+    struct segment_load *sl = calloc(1, sizeof *sl);
+
+    if (sl == NULL) {
+        return;
+    }
+
+    sl->task.run = segment_load_run;
+    sl->task.done = segment_load_done;
+    sl->cache = body->cache;
+    snprintf(sl->path, sizeof sl->path, "%s", body->segment_path);
+    sl->content_type = content_type;
+    sl->encoding = encoding;
+    snprintf(sl->version, sizeof sl->version, "%s", body->version);
+    sl->mtime = mtime;
+    sl->size = body->size;
+    sl->n = body->nmissing;
+    memcpy(sl->index, body->missing, sl->n * sizeof *sl->index);
+
+    sl->next = segment_loads;
+    segment_loads = sl;
+
+    pool_submit(loop->pool, &sl->task);
+}
+
+/**
+ * See if a large file's manifest covers requests for encoding (NULL
+ * for none)
+ */
+int segment_manifest_has(struct cache_entry *manifest, char *encoding)
+{
+    char *content = cache_entry_content(segment_cache, manifest);
+    char *name = encoding != NULL? encoding: "identity";
+    int len = strlen(name);
+
+    if (content == NULL) {
+        return 0;
+    }
+
+    // A list of names, each followed by a space
+    for (int i = 0; i + len < manifest->content_length; i++) {
+        if ((i == 0 || content[i - 1] == ' ') && memcmp(content + i, name, len) == 0 && content[i + len] == ' ') {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Note in a large file's manifest that requests for encoding (NULL for
+ * none) are answered by get_large_file()
+ *
+ * The manifest is a small entry in segment_cache listing the encodings
+ * that have been. get_file() sends requests for those straight here,
+ * without a trip to the pool to find out the file's too big to cache
+ * whole. An encoding whose precompressed sibling is small enough to be
+ * cached whole isn't listed, so it still is.
+ */
+void segment_manifest_add(char *filepath, char *content_type, char *encoding, time_t mtime)
+{
+    char key[PATH_SIZE], list[128] = "";
+    struct cache_entry *manifest;
+
+    segment_key(key, sizeof key, filepath, NULL, 0);
+    manifest = cache_get(segment_cache, key);
+
+    if (manifest != NULL) {
+        if (segment_manifest_has(manifest, encoding)) {
+            return;
+        }
+
+        char *content = cache_entry_content(segment_cache, manifest);
+
+        if (content != NULL && manifest->content_length < (int)sizeof list - 32) {
+            memcpy(list, content, manifest->content_length);
+            list[manifest->content_length] = '\0';
+        }
+    }
+
+    strcat(list, encoding != NULL? encoding: "identity");
+    strcat(list, " ");
+
+    manifest = cache_put_meta(segment_cache, key, content_type, list, strlen(list), NULL, mtime);
+
+    if (manifest != NULL) {
+        cache_set_ttl(segment_cache, manifest, file_ttl);
+    }
+}
+
+/**
+ * Send a file that's too big to cache whole
+ *
+ * It's cached in fixed-size segments instead, each its own entry in
+ * segment_cache, so the parts of it that are asked for most stay
+ * cached and the rest get evicted. The response doesn't wait for any of that: segments that
+ * aren't cached go out with sendfile() and are loaded afterwards (see
+ * send_segments()), ranges included. If encoding is set, a
+ * precompressed sibling is used when there is one.
+ */
+void get_large_file(struct conn *c, char *filepath, char *content_type, char *encoding, char *request_header)
+{
+    char sibling[PATH_SIZE], key[PATH_SIZE], extra[128] = "", version[SEGMENT_VERSION_SIZE];
+    char *path = filepath, *wanted = encoding;
+    struct stat st;
+    struct body body;
+
+    memset(&body, 0, sizeof body);
+    body.file_fd = -1;
+
+    if (encoding != NULL) {
+        snprintf(sibling, sizeof sibling, "%s%s", filepath, compress_suffix(encoding));
+        body.file_fd = open(sibling, O_RDONLY);
+
+        if (body.file_fd >= 0) {
+            snprintf(extra, sizeof extra, "Content-Encoding: %s\r\n", encoding);
+            path = sibling;
+        } else {
+            encoding = NULL;
+        }
+    }
+
+    if (body.file_fd < 0) {
+        body.file_fd = open(filepath, O_RDONLY);
+    }
+
+    if (body.file_fd < 0) {
+        resp_404(c);
+        return;
+    }
+
+    if (fstat(body.file_fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+        close(body.file_fd);
+        resp_404(c);
+        return;
+    }
+
+    if (compress_type_ok(content_type)) {
+        strcat(extra, "Vary: Accept-Encoding\r\n");
+    }
+
+    if (segment_size > 0 && st.st_size > MAX_CACHE_FILE_SIZE) {
+        segment_version(version, sizeof version, &st);
+
+        body.cache = segment_cache;
+        body.segment_path = path;
+        body.version = version;
+        body.size = st.st_size;
+
+        segment_manifest_add(filepath, content_type, wanted, st.st_mtime);
+
+    } else if (segment_size > 0) {
+        // It's shrunk: back to being cached whole, once the manifest
+        // doesn't send it here
+        segment_key(key, sizeof key, filepath, NULL, 0);
+
+        struct cache_entry *manifest = cache_get(segment_cache, key);
+
+        if (manifest != NULL) {
+            cache_delete(segment_cache, manifest);
+        }
+    }
+
+    // No content hash for these; Last-Modified is the only validator
+    send_content(c, request_header, content_type, &body, st.st_size, NULL, st.st_mtime, extra);
+
+    segment_load_start(c->loop, &body, content_type, encoding, st.st_mtime);
+
+    // The file is still needed until the response is out
+    conn_write_close(c, body.file_fd);
+}
+
+/**
+ * Build the cache key for an encoded variant of a file
+ *
+ * Request paths can't contain whitespace, so a tab can't collide with
+ * a real path.
+ */
+void variant_key(char *buf, int bufsize, char *filepath, char *encoding)
+{
+    snprintf(buf, bufsize, "%s\t%s", filepath, encoding);
+}
+
+/**
+ * Load a cache miss from disk (worker thread)
+ *
+ * Doesn't touch the cache: results are stored in it by
+ * file_load_done(), back on the event loop.
+ */
+void file_load_read(struct file_load *fl)
+{
+    char sibling[PATH_SIZE];
+    struct stat st;
+    void *content;
+    int content_length;
+    time_t last_modified;
+
+    if (fl->encoding != NULL) {
+        // Prefer a precompressed sibling on disk
+        snprintf(sibling, sizeof sibling, "%s%s", fl->filepath, compress_suffix(fl->encoding));
+
+        if (stat(sibling, &st) == 0 && st.st_size <= MAX_CACHE_FILE_SIZE) {
+            struct file_data *filedata = file_load(sibling);
+
+            if (filedata != NULL) {
+                fl->variant = filedata->data;
+                fl->variant_size = filedata->size;
+                fl->variant_mtime = filedata->mtime;
+
+                free(filedata); // Keeping the data
+                return;
+            }
+        }
+    }
+
+    if (fl->identity_ce != NULL) {
+        content = fl->identity_ce->content;
+        content_length = fl->identity_ce->content_length;
+        last_modified = fl->identity_ce->last_modified;
+
+    } else {
+        if (stat(fl->filepath, &st) == -1 || !S_ISREG(st.st_mode)) {
+            return;
+        }
+
+        if (st.st_size > MAX_CACHE_FILE_SIZE) {
+            fl->too_big = 1;
+            return;
+        }
+
+        fl->identity = file_load(fl->filepath);
+
+        if (fl->identity == NULL) {
+            return;
+        }
+
+        content = fl->identity->data;
+        content_length = fl->identity->size;
+        last_modified = fl->identity->mtime;
+    }
+
+    if (fl->encoding == NULL || content_length < COMPRESS_MIN_SIZE) {
+        return;
+    }
+
+    // Compress it ourselves. The cost is paid on the first request only.
+    int compressed_size;
+    void *compressed = compress_buffer(fl->encoding, content, content_length, &compressed_size);
+
+    if (compressed == NULL) {
+        return;
+    }
+
+    fl->variant_mtime = last_modified;
+
+    if (compressed_size < content_length) {
+        fl->variant = compressed;
+        fl->variant_size = compressed_size;
+    } else {
+        // Didn't help; remember that by caching the identity bytes
+        // under the variant key so we don't try again
+        free(compressed);
+        fl->variant_is_identity = 1;
+    }
+}
+
+/**
+ * Pool task: load a cache miss, timing it
+ */
+void file_load_run(struct task *task)
+{
+    struct file_load *fl = (struct file_load *)task;
+    long long start = metrics_clock();
+
+    TRACE_END(fl->trace_id, "pool_wait", fl->queued);
+
+    unsigned long long t = TRACE_BEGIN(fl->trace_id);
+
+    file_load_read(fl);
+
+    TRACE_END(fl->trace_id, "file_load", t);
+    metrics_observe(file_load_metric, metrics_clock() - start);
+}
+
+/**
+ * Store a loaded cache miss and send the response (event loop)
+ */
+void file_load_done(struct task *task)
+{
+    struct file_load *fl = (struct file_load *)task;
+    struct conn *c = fl->c;
+    struct cache *cache = fl->cache;
+    struct cache_entry *ce = NULL, *identity = fl->identity_ce;
+    char *key = arena_alloc(&c->arena, PATH_SIZE);
+    unsigned long long t = TRACE_BEGIN(fl->trace_id);
+
+    if (fl->identity != NULL) {
+        identity = cache_put_meta(cache, fl->filepath, fl->content_type, fl->identity->data, fl->identity->size,
+            NULL, fl->identity->mtime);
+
+        if (identity != NULL) {
+            cache_set_ttl(cache, identity, file_ttl);
+        }
+    }
+
+    // Encoded variants are cached under their own (path, encoding) key
+    if (key != NULL && (fl->variant != NULL || (fl->variant_is_identity && identity != NULL))) {
+        variant_key(key, PATH_SIZE, fl->filepath, fl->encoding);
+
+        if (fl->variant != NULL) {
+            ce = cache_put_meta(cache, key, fl->content_type, fl->variant, fl->variant_size,
+                fl->encoding, fl->variant_mtime);
+        } else {
+            ce = cache_put_meta(cache, key, fl->content_type, identity->content, identity->content_length,
+                NULL, fl->variant_mtime);
+        }
+
+        // NOTE: that may have evicted identity, so don't touch it past
+        // this point
+
+        if (ce != NULL) {
+            cache_set_ttl(cache, ce, file_ttl);
+        }
+
+    } else {
+        ce = identity;
+    }
+
+    TRACE_END(fl->trace_id, "cache_put", t);
+
+    // If they hung up meanwhile, the cache still gets the file
+    if (!c->closed) {
+        if (ce != NULL) {
+            send_entry(c, cache, fl->request_header, ce, fl->vary);
+        } else if (fl->too_big) {
+            get_large_file(c, fl->filepath, fl->content_type, fl->encoding, fl->request_header);
+        } else if (fl->identity != NULL || fl->identity_ce != NULL) {
+            resp_500(c);
+        } else {
+            resp_404_missing(c, fl->filepath);
+        }
+    }
+
+    if (fl->identity_ce != NULL) {
+        cache_entry_unref(fl->identity_ce);
+    }
+
+    if (fl->identity != NULL) {
+        file_free(fl->identity);
+    }
+
+    free(fl->variant);
+
+    conn_resume(c);
+}
+
+/**
+ * Read and return a file from disk or cache
+ *
+ * Conditional requests (If-None-Match, If-Modified-Since) are answered
+ * with a 304 using the validators stored in the cache entry. Range
+ * requests are answered with a 206 sliced straight out of the cached
+ * content or, for files too big to cache whole, out of their cached
+ * segments and sendfile().
+ *
+ * Compressible types are sent gzip- or brotli-encoded when the client
+ * accepts it.
+ */
+void get_file(struct conn *c, struct cache *cache, char *request_path, char *request_header)
+{
+    char *filepath, *typepath, *key, value[1024];
+    char *encoding = NULL;
+
+    filepath = arena_alloc(&c->arena, PATH_SIZE);
+    typepath = arena_alloc(&c->arena, PATH_SIZE);
+    key = arena_alloc(&c->arena, PATH_SIZE);
+
+    if (filepath == NULL || typepath == NULL || key == NULL) {
+        resp_500(c);
+        return;
+    }
+
+    // Don't let anyone wander outside the server root
+    if (request_path[0] != '/' || strstr(request_path, "..") != NULL) {
+        resp_404(c);
+        return;
+    }
+
+    snprintf(filepath, PATH_SIZE, "%s%s", SERVER_ROOT, request_path);
+
+    // Directories get their index.html
+    if (filepath[strlen(filepath) - 1] == '/') {
+        strncat(filepath, "index.html", PATH_SIZE - strlen(filepath) - 1);
+    }
+
+    // Known misses are answered without touching the filesystem
+    if (negcache_contains(negcache, filepath)) {
+        resp_404(c);
+        return;
+    }
+
+    // mime_type_get() lowercases in place, so hand it a copy rather
+    // than the cache key
+    strcpy(typepath, filepath);
+
+    unsigned long long t = TRACE_BEGIN(c->trace_id);
+    char *content_type = mime_type_get(typepath);
+
+    TRACE_END(c->trace_id, "mime_type_get", t);
+
+    int vary = compress_type_ok(content_type);
+
+    if (vary && get_header(request_header, "Accept-Encoding", value, sizeof value) != NULL) {
+        encoding = compress_negotiate(value);
+    }
+
+    struct cache_entry *ce = NULL, *identity = NULL;
+    long long lookup_start = metrics_clock();
+
+    t = TRACE_BEGIN(c->trace_id);
+
+    if (encoding != NULL) {
+        variant_key(key, PATH_SIZE, filepath, encoding);
+        ce = cache_get(cache, key);
+    }
+
+    if (ce == NULL) {
+        identity = cache_get(cache, filepath);
+
+        // The identity content will do if it's not to be encoded, or
+        // is too small to bother
+        if (identity != NULL && (encoding == NULL || identity->content_length < COMPRESS_MIN_SIZE)) {
+            ce = identity;
+        }
+    }
+
+    TRACE_END(c->trace_id, "cache_get", t);
+    metrics_observe(cache_lookup_metric, metrics_clock() - lookup_start);
+
+    if (ce != NULL) {
+        send_entry(c, cache, request_header, ce, vary);
+        return;
+    }
+
+    // A file we've found is too big to cache whole can go straight out,
+    // from its segments or a precompressed sibling; there's nothing to
+    // load first
+    if (segment_size > 0) {
+        segment_key(key, PATH_SIZE, filepath, NULL, 0);
+
+        struct cache_entry *manifest = cache_get(segment_cache, key);
+
+        if (manifest != NULL && segment_manifest_has(manifest, encoding)) {
+            get_large_file(c, filepath, content_type, encoding, request_header);
+            return;
+        }
+    }
+
+    // A miss: reading (and compressing) the file could block, so it's
+    // done in the pool and the response is sent once it's back. Unless
+    // the pool's too far behind already; then it's refused straight
+    // away.
+    if (loop_shed(c->loop)) {
+        resp_503(c);
+        return;
+    }
+
+    struct file_load *fl = arena_calloc(&c->arena, sizeof *fl);
+
+    if (fl == NULL) {
+        resp_500(c);
+        return;
+    }
+
+    fl->task.run = file_load_run;
+    fl->task.done = file_load_done;
+    fl->c = c;
+    fl->cache = cache;
+    fl->request_header = request_header;
+    strcpy(fl->filepath, filepath);
+    fl->content_type = content_type;
+    fl->encoding = encoding;
+    fl->vary = vary;
+    fl->trace_id = c->trace_id;
+    fl->queued = TRACE_BEGIN(fl->trace_id);
+
+    // The worker can compress cached identity content straight from
+    // the entry, unless it's LZ4-compressed; then it rereads the file
+    if (identity != NULL && identity->compressed_length == 0) {
+        cache_entry_ref(identity);
+        fl->identity_ce = identity;
+    }
+
+    conn_suspend(c);
+    pool_submit(c->loop->pool, &fl->task);
+}
+
+/**
+ * Send the response for a save that failed
+ */
+void resp_save_error(struct conn *c)
+{
+    char *response = "{\"status\":\"error\"}\n";
+
+    send_response(c, "HTTP/1.1 500 INTERNAL SERVER ERROR", "application/json", response, strlen(response), NULL);
+}
+
+/**
+ * Append a piece of a POSTed body to the save log
+ */
+int save_data(struct conn *c, char *data, int len)
+{
+    struct save *save = c->body_arg;
+
+    if (save->id < 0) {
+        return -1;
+    }
+
+    save->bytes += len;
+
+    return savelog_append(savelog, save->id, data, len, 0);
+}
+
+/**
+ * A save has reached the disk (or failed to): answer the client
+ */
+void save_committed(void *arg, int error)
+{
+    struct save *save = arg;
+    struct conn *c = save->c;
+    char response[128];
+
+    if (!c->closed) {
+        if (error) {
+            resp_save_error(c);
+        } else {
+            int len = snprintf(response, sizeof response,
+                "{\"status\":\"ok\",\"id\":%lld,\"bytes\":%ld}\n",
+                (long long)save->id, save->bytes);
+
+            send_response(c, "HTTP/1.1 200 OK", "application/json", response, len, NULL);
+        }
+    }
+
+    conn_resume(c);
+}
+
+/**
+ * The whole POSTed body is in the log, or never will be
+ *
+ * The response waits until the log has been synced.
+ */
+void save_done(struct conn *c, int error)
+{
+    struct save *save = c->body_arg;
+
+    if (save->id < 0) {
+        if (!error) {
+            resp_save_error(c);
+        }
+        return;
+    }
+
+    if (error) {
+        savelog_append(savelog, save->id, NULL, 0, SAVELOG_ABORT);
+        return;
+    }
+
+    if (savelog_append(savelog, save->id, NULL, 0, SAVELOG_END) < 0) {
+        resp_save_error(c);
+        return;
+    }
+
+    save->wait.done = save_committed;
+    save->wait.arg = save;
+
+    conn_suspend(c);
+    savelog_commit(savelog, &save->wait);
+}
+
+/**
+ * Stream a POSTed body into the save log as it arrives
+ */
+void post_save(struct conn *c)
+{
+    struct save *save = arena_calloc(&c->arena, sizeof *save);
+
+    if (save == NULL) {
+        return; // Read as usual; a 404 then
+    }
+
+    save->c = c;
+    save->id = savelog_begin(savelog);
+
+    conn_stream_body(c, save_data, save_done, save);
+}
+
+/**
+ * Produce the next batch of /d20?n= rolls
+ */
+int d20_rolls_produce(struct conn *c, void *arg)
+{
+    long *left = arg;
+    char buf[D20_BATCH * 3];
+    int len = 0;
+
+    for (int i = 0; i < D20_BATCH && *left > 0; i++, (*left)--) {
+        len += sprintf(buf + len, "%d\n", rand() % 20 + 1);
+    }
+
+    if (conn_write_chunk(c, buf, len) < 0) {
+        return -1;
+    }
+
+    return *left > 0;
+}
+
+/**
+ * Send a /d20?n= endpoint response: n rolls, one per line
+ *
+ * However many are asked for, they're generated a batch at a time as
+ * the client reads them.
+ */
+void get_d20_rolls(struct conn *c, long n)
+{
+    long *left = arena_alloc(&c->arena, sizeof *left);
+
+    if (left == NULL) {
+        resp_500(c);
+        return;
+    }
+
+    *left = n;
+
+    send_stream(c, "HTTP/1.1 200 OK", "text/plain", d20_rolls_produce, NULL, left, NULL);
+}
+
+/**
+ * Print everything /metrics reports
+ */
+void metrics_report(struct metrics_out *out, struct conn *c, struct cache *cache)
+{
+    struct hashtable *index = cache->index;
+    long lookups = 0, probes = 0;
+
+    metrics_print(out);
+
+    metrics_value(out, "webserver_connections", "gauge", "Open connections", c->loop->nconns);
+
+    if (c->loop->accesslog != NULL) {
+        metrics_value(out, "webserver_accesslog_dropped_total", "counter",
+            "Access log records dropped because the writer fell behind",
+            accesslog_dropped(c->loop->accesslog));
+    }
+
+    metrics_value(out, "webserver_cache_hits_total", "counter", "Cache lookups that found an entry", cache->hits);
+    metrics_value(out, "webserver_cache_misses_total", "counter", "Cache lookups that didn't", cache->misses);
+    metrics_value(out, "webserver_cache_insertions_total", "counter", "Entries stored in the cache", cache->insertions);
+    metrics_value(out, "webserver_cache_evictions_total", "counter", "Entries evicted to make room", cache->evictions);
+    metrics_value(out, "webserver_cache_expirations_total", "counter", "Entries removed when their TTL ran out", cache->expirations);
+    metrics_value(out, "webserver_cache_entries", "gauge", "Entries in the cache", cache->cur_size);
+    metrics_value(out, "webserver_cache_bytes", "gauge", "Bytes of content stored, after compression", cache->cur_bytes);
+    metrics_value(out, "webserver_cache_raw_bytes", "gauge", "Bytes of content stored, as if uncompressed", cache->raw_bytes);
+
+    if (segment_cache != NULL) {
+        metrics_value(out, "webserver_segment_cache_hits_total", "counter", "Large file segment lookups that found one", segment_cache->hits);
+        metrics_value(out, "webserver_segment_cache_misses_total", "counter", "Large file segment lookups that didn't", segment_cache->misses);
+        metrics_value(out, "webserver_segment_cache_evictions_total", "counter", "Large file segments evicted to make room", segment_cache->evictions);
+        metrics_value(out, "webserver_segment_cache_entries", "gauge", "Large file segments cached", segment_cache->cur_size);
+        metrics_value(out, "webserver_segment_cache_bytes", "gauge", "Bytes of large file segments cached", segment_cache->cur_bytes);
+    }
+
+    // A shared cache's index is in the segment, out of sight
+    if (cache->shm != NULL) {
+        return;
+    }
+
+    metrics_value(out, "webserver_cache_index_load", "gauge", "Entries per bucket in the cache's hash table", index->load);
+
+    // The last count is for that many probes or more
+    metrics_printf(out,
+        "# HELP webserver_cache_index_probes Entries compared against per cache index lookup\n"
+        "# TYPE webserver_cache_index_probes histogram\n");
+
+    for (int i = 0; i < HASHTABLE_PROBES; i++) {
+        lookups += index->probes[i];
+        probes += i * index->probes[i];
+
+        if (i < HASHTABLE_PROBES - 1) {
+            metrics_printf(out, "webserver_cache_index_probes_bucket{le=\"%d\"} %ld\n", i, lookups);
+        }
+    }
+
+    metrics_printf(out,
+        "webserver_cache_index_probes_bucket{le=\"+Inf\"} %ld\n"
+        "webserver_cache_index_probes_sum %ld\n"
+        "webserver_cache_index_probes_count %ld\n",
+        lookups, probes, lookups);
+}
+
+/**
+ * Send a /metrics endpoint response, in Prometheus text format
+ */
+void get_metrics(struct conn *c, struct cache *cache)
+{
+    struct metrics_out out;
+
+    out.size = METRICS_OUT_SIZE;
+    out.buf = arena_alloc(&c->arena, out.size);
+    out.len = 0;
+
+    if (out.buf != NULL) {
+        metrics_report(&out, c, cache);
+
+        // Didn't fit: now we know how much room it needs
+        if (out.len >= out.size) {
+            out.size = out.len + 1;
+            out.buf = arena_alloc(&c->arena, out.size);
+            out.len = 0;
+
+            if (out.buf != NULL) {
+                metrics_report(&out, c, cache);
+            }
+        }
+    }
+
+    if (out.buf == NULL || out.len >= out.size) {
+        resp_500(c);
+        return;
+    }
+
+    send_response(c, "HTTP/1.1 200 OK", "text/plain; version=0.0.4", out.buf, out.len, NULL);
+}
+
+/**
+ * Route handlers: all take the same arguments
+ */
+void route_d20(struct conn *c, struct cache *cache, char *path)
+{
+    char *query = strchr(path, '?');
+    long n;
+
+    (void)cache;
+
+    c->metric = route_metric.d20;
+
+    if (query != NULL && sscanf(query, "?n=%ld", &n) == 1 && n > 1) {
+        get_d20_rolls(c, n);
+    } else {
+        get_d20(c);
+    }
+}
+
+void route_date(struct conn *c, struct cache *cache, char *path)
+{
+    (void)cache;
+    (void)path;
+
+    c->metric = route_metric.date;
+    get_date(c);
+}
+
+void route_save(struct conn *c, struct cache *cache, char *path)
+{
+    (void)cache;
+    (void)path;
+
+    c->metric = route_metric.save;
+    post_save(c);
+}
+
+void route_file(struct conn *c, struct cache *cache, char *path)
+{
+    c->metric = route_metric.file;
+    get_file(c, cache, path, c->in);
+}
+
+void route_metrics(struct conn *c, struct cache *cache, char *path)
+{
+    (void)path;
+
+    c->metric = route_metric.metrics;
+    get_metrics(c, cache);
+}
+
+void route_404(struct conn *c, struct cache *cache, char *path)
+{
+    (void)cache;
+    (void)path;
+
+    c->metric = route_metric.not_found;
+    resp_404(c);
+}
+
+/**
+ * Register a route's latency histogram
+ */
+int route_metric_init(char *labels)
+{
+    return metrics_histogram("webserver_request_duration_seconds",
+        "Time from a request's header arriving to the last byte of its response going out", labels);
+}
+
+/**
+ * Register the endpoints
+ *
+ * Anything GET that isn't an endpoint is looked for in the server
+ * root; everything else is a 404.
+ */
+void routes_init(void)
+{
+    route_metric.d20 = route_metric_init("route=\"/d20\"");
+    route_metric.date = route_metric_init("route=\"/date\"");
+    route_metric.save = route_metric_init("route=\"/save\"");
+    route_metric.file = route_metric_init("route=\"/\"");
+    route_metric.metrics = route_metric_init("route=\"/metrics\"");
+    route_metric.not_found = route_metric_init("route=\"none\"");
+
+    cache_lookup_metric = metrics_histogram("webserver_phase_duration_seconds",
+        "Time spent in each phase of handling a request", "phase=\"cache_lookup\"");
+    file_load_metric = metrics_histogram("webserver_phase_duration_seconds",
+        "Time spent in each phase of handling a request", "phase=\"file_load\"");
+
+    router = router_create(route_404);
+
+    if (router == NULL
+        || router_add(router, "GET", "/d20", ROUTE_EXACT, route_d20) < 0
+        || router_add(router, "GET", "/date", ROUTE_EXACT, route_date) < 0
+        || router_add(router, "GET", "/metrics", ROUTE_EXACT, route_metrics) < 0
+        || router_add(router, "GET", "/", ROUTE_PREFIX, route_file) < 0
+        || router_compile(router) < 0) {
+
+        fprintf(stderr, "webserver: can't set up routes\n");
+        exit(3);
+    }
+
+    // No match here means the body is read as usual
+    stream_router = router_create(NULL);
+
+    if (stream_router == NULL
+        || router_add(stream_router, "POST", "/save", ROUTE_EXACT, route_save) < 0
+        || router_compile(stream_router) < 0) {
+
+        fprintf(stderr, "webserver: can't set up routes\n");
+        exit(3);
+    }
+}
+
+/**
+ * Look at a request header, before the body is read
+ *
+ * Endpoints that stream their bodies get them set up here; for
+ * everything else, this does nothing and handle_http_request() gets
+ * the whole request once it's in.
+ */
+void handle_http_header(struct conn *c, struct cache *cache)
+{
+    char method[16];
+    char *path = arena_alloc(&c->arena, PATH_SIZE);
+
+    if (path == NULL || sscanf(c->in, "%15s %4095s", method, path) != 2) {
+        return;
+    }
+
+    route_handler handler = router_lookup(stream_router, method, path, strcspn(path, "?"));
+
+    if (handler != NULL) {
+        handler(c, cache, path);
+    }
+}
+
+/**
+ * Handle HTTP request and queue the response
+ *
+ * The event loop calls this once the whole request (header and body)
+ * is in the connection's buffer.
+ */
+void handle_http_request(struct conn *c, struct cache *cache)
+{
+    char *request = c->in;
+    char method[16], protocol[16];
+
+    char *path = arena_alloc(&c->arena, PATH_SIZE);
+
+    if (path == NULL) {
+        resp_500(c);
+        return;
+    }
+
+    // Read the first two components of the first line of the request 
+    if (sscanf(request, "%15s %4095s %15s", method, path, protocol) != 3) {
+        resp_400(c);
+        return;
+    }
+
+    // Routes don't include the query string
+    route_handler handler = router_lookup(router, method, path, strcspn(path, "?"));
+
+    handler(c, cache, path);
+}
+
+// The prefork master's workers, by number less 1; 0 for none
+pid_t *prefork_pids;
+int prefork_n;
+volatile sig_atomic_t prefork_stop;  // Set by SIGINT or SIGTERM
+volatile sig_atomic_t prefork_drain; // Set by SIGQUIT
+
+/**
+ * Signal handler for the prefork master
+ *
+ * These signals are blocked except in sigsuspend(), so this can't
+ * catch prefork_pids being changed.
+ */
+void prefork_signal(int sig)
+{
+    switch (sig) {
+        case SIGUSR1:
+        case SIGUSR2:
+            // Stats and tracing are the workers' business
+            for (int i = 0; i < prefork_n; i++) {
+                if (prefork_pids[i] > 0) {
+                    kill(prefork_pids[i], sig);
+                }
+            }
+            break;
+
+        case SIGINT:
+        case SIGTERM:
+            prefork_stop = 1;
+            break;
+
+        case SIGQUIT:
+            prefork_drain = 1;
+            break;
+    }
+}
+
+/**
+ * Fork a worker
+ *
+ * Returns 0 in the worker; in the master, its pid, or 0 on error.
+ */
+pid_t prefork_spawn(sigset_t *oldmask)
+{
+    pid_t pid = fork();
+
+    if (pid < 0) {
+        perror("fork");
+        return 0;
+    }
+
+    if (pid == 0) {
+        // The master's handlers aren't for us. The event loop sets its
+        // own for SIGUSR1, SIGUSR2 and SIGQUIT; till then, don't die of
+        // them.
+        signal(SIGINT, SIG_DFL);
+        signal(SIGTERM, SIG_DFL);
+        signal(SIGCHLD, SIG_DFL);
+        signal(SIGUSR1, SIG_IGN);
+        signal(SIGUSR2, SIG_IGN);
+        signal(SIGQUIT, SIG_IGN);
+        sigprocmask(SIG_SETMASK, oldmask, NULL);
+    }
+
+    return pid;
+}
+
+/**
+ * Hand the listener and cache to a replacement, if one's asking
+ *
+ * Returns 1 if they were handed over.
+ */
+int prefork_handoff(int restartfd, int listenfd, struct cache *cache)
+{
+    int want_cache;
+    int fd = restart_accept(restartfd, &want_cache);
+
+    if (fd < 0) {
+        return 0;
+    }
+
+    int cachefd = want_cache? cache_export(cache): -1;
+    int rv = restart_send(fd, listenfd, cachefd);
+
+    if (cachefd >= 0) {
+        close(cachefd);
+    }
+
+    if (rv < 0) {
+        return 0;
+    }
+
+    fprintf(stderr, "webserver: handed over to a new server\n");
+
+    return 1;
+}
+
+/**
+ * Fork n worker processes and look after them
+ *
+ * Workers return from this, numbered from 1, to run an event loop of
+ * their own on the inherited listener, sharing the cache if it was
+ * created with cache_create_shared(). The master never returns: it
+ * starts a new worker whenever one dies, passes SIGUSR1 and SIGUSR2 on
+ * to them all, and on SIGINT or SIGTERM stops them and exits. On
+ * SIGQUIT, or once it's handed the listener to a replacement waiting
+ * on restartfd (-1 for none), it has the workers drain and exits when
+ * they have.
+ */
+int prefork(int n, int restartfd, int listenfd, struct cache *cache)
+{
+    struct sigaction sa;
+    sigset_t mask, oldmask;
+    time_t *started = calloc(n, sizeof *started);
+
+    prefork_pids = calloc(n, sizeof *prefork_pids);
+    prefork_n = n;
+
+    if (started == NULL || prefork_pids == NULL) {
+        fprintf(stderr, "webserver: out of memory\n");
+        exit(3);
+    }
+
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    sigaddset(&mask, SIGUSR1);
+    sigaddset(&mask, SIGUSR2);
+    sigaddset(&mask, SIGQUIT);
+    sigprocmask(SIG_BLOCK, &mask, &oldmask);
+
+    // SIGCHLD needs a handler, even one that does nothing, to wake
+    // ppoll()
+    sa.sa_handler = prefork_signal;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = 0;
+    sigaction(SIGCHLD, &sa, NULL);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGUSR1, &sa, NULL);
+    sigaction(SIGUSR2, &sa, NULL);
+    sigaction(SIGQUIT, &sa, NULL);
+
+    // Anything still buffered would come out once per worker
+    fflush(stdout);
+
+    for (int i = 0; i < n; i++) {
+        if ((prefork_pids[i] = prefork_spawn(&oldmask)) == 0) {
+            if (restartfd >= 0) {
+                close(restartfd);
+            }
+            free(started);
+            return i + 1;
+        }
+
+        started[i] = time(NULL);
+    }
+
+    printf("webserver: %d worker processes\n", n);
+    fflush(stdout);
+
+    int draining = 0, alive = n;
+    struct pollfd pfd = { restartfd, POLLIN, 0 };
+
+    while (!prefork_stop && !(draining && alive == 0)) {
+        pid_t pid;
+        int status;
+
+        // Signals are only let in here
+        if (ppoll(&pfd, restartfd >= 0 && !draining? 1: 0, NULL, &oldmask) > 0 &&
+            prefork_handoff(restartfd, listenfd, cache)) {
+
+            prefork_drain = 1;
+        }
+
+        if (prefork_drain && !draining) {
+            draining = 1;
+
+            for (int i = 0; i < n; i++) {
+                if (prefork_pids[i] > 0) {
+                    kill(prefork_pids[i], SIGQUIT);
+                }
+            }
+
+            // The workers have it now, and the replacement if any
+            close(listenfd);
+
+            if (restartfd >= 0) {
+                close(restartfd);
+            }
+        }
+
+        while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+            for (int i = 0; i < n; i++) {
+                if (prefork_pids[i] != pid) {
+                    continue;
+                }
+
+                if (WIFSIGNALED(status)) {
+                    fprintf(stderr, "webserver: worker %d (pid %d) killed by signal %d\n", i + 1, pid, WTERMSIG(status));
+                } else {
+                    fprintf(stderr, "webserver: worker %d (pid %d) exited with status %d\n", i + 1, pid, WEXITSTATUS(status));
+                }
+
+                prefork_pids[i] = 0;
+                alive--;
+
+                if (prefork_stop || draining) {
+                    break;
+                }
+
+                // Don't spin if it dies as soon as it starts
+                if (time(NULL) - started[i] < 1) {
+                    sleep(1);
+                }
+
+                if ((prefork_pids[i] = prefork_spawn(&oldmask)) == 0) {
+                    if (restartfd >= 0) {
+                        close(restartfd);
+                    }
+                    free(started);
+                    return i + 1;
+                }
+
+                alive++;
+                started[i] = time(NULL);
+            }
+        }
+    }
+
+    for (int i = 0; i < n; i++) {
+        if (prefork_pids[i] > 0) {
+            kill(prefork_pids[i], SIGTERM);
+        }
+    }
+
+    while (wait(NULL) > 0) {
+    }
+
+    exit(0);
+}
+
+/**
+ * Give a worker process its own copy of a file it writes
+ *
+ * ./serverfiles/save.log becomes ./serverfiles/save-2.log for worker 2.
+ * Worker 0, when there's no prefork master, keeps the path as it is.
+ *
+ * Returns NULL if out of memory.
+ */
+char *worker_path(char *path, int worker)
+{
+    if (worker == 0) {
+        return path;
+    }
+
+    int size = strlen(path) + 16;
+    char *buf = malloc(size);
+    char *dot = strrchr(path, '.');
+
+    if (buf == NULL) {
+        return NULL;
+    }
+
+    if (dot == NULL || strchr(dot, '/') != NULL) {
+        snprintf(buf, size, "%s-%d", path, worker);
+    } else {
+        snprintf(buf, size, "%.*s-%d%s", (int)(dot - path), path, worker, dot);
+    }
+
+    return buf;
+}
+
+/**
+ * Print usage and exit
+ */
+void usage(char *progname)
+{
+    fprintf(stderr,
+        "usage: %s [-e entries] [-b bytes] [-z hot] [-t ttl] [-g bytes] [-G bytes]\n"
+        "          [-H ms] [-B ms] [-W ms] [-K ms] [-u] [-j threads] [-S ms]\n"
+        "          [-l file] [-T n] [-p procs] [-R path [-C]]\n"
+        "          [-a host] [-q backlog] [-D secs] [-F qlen] [-N] [-U path]\n"
+        "          [-M conns] [-r rate [-y burst]] [-Q depth]\n"
+        "\n"
+        "  -e entries  maximum number of cache entries (default %d)\n"
+        "  -b bytes    maximum bytes of cached content (default no limit;\n"
+        "              %dM shared between them with -p)\n"
+        "  -z hot      LZ4-compress cached content outside the hot most\n"
+        "              recently used entries (default 0: never)\n"
+        "  -t ttl      seconds before cached files are reloaded from disk\n"
+        "              (default 0: never)\n"
+        "  -g bytes    files bigger than %dK are cached in segments of\n"
+        "              this size, %d to %d (default %dK)\n"
+        "  -G bytes    room for those segments, apart from -e and -b\n"
+        "              (default %dM; 0 sends them from disk)\n"
+        "  -H ms       time allowed to send a request header (default %d)\n"
+        "  -B ms       time allowed between pieces of a request body\n"
+        "              (default %d)\n"
+        "  -W ms       time allowed between pieces of a response being\n"
+        "              read (default %d)\n"
+        "  -K ms       time an idle keep-alive connection is held open\n"
+        "              (default %d)\n"
+        "  -u          use io_uring rather than epoll, if the kernel\n"
+        "              supports it (6.0 or later)\n"
+        "  -j threads  threads for blocking work like cache misses\n"
+        "              (default %d; 0 does it on the event loop)\n"
+        "  -S ms       longest a POST /save waits for others to share its\n"
+        "              disk sync (default %d)\n"
+        "  -l file     access log (default %s; - for stdout, \"\" for\n"
+        "              none)\n"
+        "  -T n        trace 1 request in n from the start (default off;\n"
+        "              kill -USR2 turns tracing on and off, writing %s\n"
+        "              as it goes off)\n"
+        "  -p procs    fork procs worker processes, each with its own event\n"
+        "              loop and pool, sharing the listener and one cache in\n"
+        "              shared memory; -z is ignored, and save logs and\n"
+        "              traces are per worker, e.g. save-1.log (default 0:\n"
+        "              one process)\n"
+        "  -R path     hot restart: take over the listener from the server\n"
+        "              at Unix socket path if there is one, which then\n"
+        "              drains and exits; then listen there for our own\n"
+        "              replacement\n"
+        "  -C          with -R, take over its cache too\n"
+        "  -a host     address to listen on (default every address, IPv4\n"
+        "              and IPv6)\n"
+        "  -q backlog  connections that can queue to be accepted (default\n"
+        "              %d, capped by net.core.somaxconn)\n"
+        "  -D secs     TCP_DEFER_ACCEPT: don't accept a connection until\n"
+        "              its request arrives, for up to secs (default 0: off)\n"
+        "  -F qlen     TCP Fast Open, with up to qlen pending (default 0:\n"
+        "              off)\n"
+        "  -N          leave Nagle's algorithm on (default TCP_NODELAY)\n"
+        "  -U path     listen on a Unix socket at path rather than on TCP,\n"
+        "              for a proxy on the same machine; @name is in the\n"
+        "              abstract namespace\n"
+        "  -M conns    most connections open at once (per process, with\n"
+        "              -p); more are refused with a 503 (default 0: no\n"
+        "              limit)\n"
+        "  -r rate     requests a second allowed each client address;\n"
+        "              more get a 429 (default 0: no limit)\n"
+        "  -y burst    requests a client can make at once, having saved\n"
+        "              up (default the same as -r)\n"
+        "  -Q depth    refuse cache misses with a 503 while this many are\n"
+        "              already waiting for the pool (default 0: never)\n",
+        progname, CACHE_ENTRIES, PREFORK_CACHE_BYTES / (1024 * 1024),
+        MAX_CACHE_FILE_SIZE / 1024, SEGMENT_MIN_SIZE, MAX_CACHE_FILE_SIZE,
+        SEGMENT_SIZE / 1024, SEGMENT_CACHE_BYTES / (1024 * 1024),
+        HEADER_TIMEOUT, BODY_TIMEOUT, WRITE_TIMEOUT, KEEPALIVE_TIMEOUT,
+        POOL_WORKERS, SAVE_SYNC_DELAY, ACCESS_LOG, TRACE_FILE, LISTEN_BACKLOG);
+
+    exit(2);
+}
+
+/**
+ * Parse an option's number, or exit with usage() if it isn't one or
+ * isn't from min to max
+ */
+long option_number(char *arg, long min, long max, char *progname)
+{
+    char *end;
+
+    errno = 0;
+
+    long n = strtol(arg, &end, 10);
+
+    if (end == arg || *end != '\0' || errno == ERANGE || n < min || n > max) {
+        usage(progname);
+    }
+
+    return n;
+}
+
+/**
+ * Main
+ */
+int main(int argc, char **argv)
+{
+    int opt;
+
+    int cache_entries = CACHE_ENTRIES;
+    long cache_bytes = 0;
+    long segment_arg = SEGMENT_SIZE, segment_bytes = SEGMENT_CACHE_BYTES;
+    int cache_hot = 0;
+
+    int header_timeout = HEADER_TIMEOUT;
+    int body_timeout = BODY_TIMEOUT;
+    int write_timeout = WRITE_TIMEOUT;
+    int keepalive_timeout = KEEPALIVE_TIMEOUT;
+    int use_uring = 0;
+    int workers = POOL_WORKERS;
+    int save_sync_delay = SAVE_SYNC_DELAY;
+    char *access_log = ACCESS_LOG;
+    int trace_rate = 0;
+    int procs = 0;
+    char *restart_path = NULL;
+    int carry_cache = 0;
+    struct listener_opts listener;
+    int max_conns = 0, rate = 0, burst = 0, shed_queue = 0;
+
+    listener_opts_init(&listener);
+
+    while ((opt = getopt(argc, argv, "e:b:z:t:g:G:H:B:W:K:uj:S:l:T:p:R:Ca:q:D:F:NU:M:r:y:Q:")) != -1) {
+        switch (opt) {
+            case 'e': cache_entries = option_number(optarg, 1, INT_MAX, argv[0]); break;
+            case 't': file_ttl = atoi(optarg); break;
+            case 'g': segment_arg = option_number(optarg, 0, LONG_MAX, argv[0]); break;
+            case 'G': segment_bytes = option_number(optarg, 0, LONG_MAX, argv[0]); break;
+            case 'b': cache_bytes = atol(optarg); break;
+            case 'z': cache_hot = atoi(optarg); break;
+            case 'H': header_timeout = atoi(optarg); break;
+            case 'B': body_timeout = atoi(optarg); break;
+            case 'W': write_timeout = atoi(optarg); break;
+            case 'K': keepalive_timeout = atoi(optarg); break;
+            case 'u': use_uring = 1; break;
+            case 'j': workers = option_number(optarg, 0, POOL_MAX_WORKERS, argv[0]); break;
+            case 'S': save_sync_delay = atoi(optarg); break;
+            case 'l': access_log = optarg; break;
+            case 'T': trace_rate = atoi(optarg); break;
+            case 'p': procs = option_number(optarg, 0, PREFORK_MAX_PROCS, argv[0]); break;
+            case 'R': restart_path = optarg; break;
+            case 'C': carry_cache = 1; break;
+            case 'a': listener.host = optarg; break;
+            case 'q': listener.backlog = option_number(optarg, 1, INT_MAX, argv[0]); break;
+            case 'D': listener.defer_accept = option_number(optarg, 0, INT_MAX, argv[0]); break;
+            case 'F': listener.fastopen = option_number(optarg, 0, INT_MAX, argv[0]); break;
+            case 'N': listener.nodelay = 0; break;
+            case 'U': listener.unix_path = optarg; break;
+            case 'M': max_conns = option_number(optarg, 0, INT_MAX, argv[0]); break;
+            case 'r': rate = option_number(optarg, 0, INT_MAX, argv[0]); break;
+            case 'y': burst = option_number(optarg, 0, INT_MAX, argv[0]); break;
+            case 'Q': shed_queue = option_number(optarg, 0, INT_MAX, argv[0]); break;
+            default: usage(argv[0]);
+        }
+    }
+
+    // A segment has to fit in a cache entry, and the room for them has
+    // to hold at least one
+    if (segment_arg < SEGMENT_MIN_SIZE || segment_arg > MAX_CACHE_FILE_SIZE ||
+        segment_bytes < 0 || (segment_bytes > 0 && segment_bytes < segment_arg)) {
+        usage(argv[0]);
+    }
+
+    segment_size = segment_bytes > 0? segment_arg: 0;
+
+    struct cache *cache;
+
+    if (procs > 0) {
+        cache = cache_create_shared(cache_entries, cache_bytes > 0? cache_bytes: PREFORK_CACHE_BYTES);
+    } else {
+        cache = cache_create(cache_entries, 0);
+    }
+
+    negcache = negcache_create(NEGCACHE_SIZE, NEGCACHE_TTL);
+
+    if (cache == NULL || negcache == NULL) {
+        fprintf(stderr, "webserver: out of memory\n");
+        exit(3);
+    }
+
+    cache_set_max_bytes(cache, cache_bytes);
+    cache_set_compression(cache, cache_hot);
+
+    // Segments get a budget of their own. The entry count has room for
+    // every segment that fits, and then some for the last, short
+    // segments of files.
+    if (segment_size > 0) {
+        int segment_entries = 2 * (segment_bytes / segment_size) + 1;
+
+        if (procs > 0) {
+            segment_cache = cache_create_shared(segment_entries, segment_bytes);
+        } else {
+            segment_cache = cache_create(segment_entries, 0);
+        }
+
+        if (segment_cache == NULL) {
+            fprintf(stderr, "webserver: out of memory\n");
+            exit(3);
+        }
+
+        cache_set_max_bytes(segment_cache, segment_bytes);
+    }
+
+    resp_404_init();
+    routes_init();
+
+    srand(time(NULL));
+
+    // Don't die if a client hangs up while we're sending
+    signal(SIGPIPE, SIG_IGN);
+
+    // Get a listening socket: the running server's, if we're replacing
+    // one, otherwise a new one
+    int listenfd = -1, cachefd = -1, restartfd = -1;
+
+    if (restart_path != NULL && restart_takeover(restart_path, carry_cache, &listenfd, &cachefd) == 1) {
+        printf("webserver: took over from the server at %s\n", restart_path);
+    } else {
+        listenfd = get_listener_socket(PORT, &listener);
+    }
+
+    if (listenfd < 0) {
+        fprintf(stderr, "webserver: fatal error getting listening socket\n");
+        exit(1);
+    }
+
+    if (cachefd >= 0) {
+        printf("webserver: %d cache entries carried over\n", cache_import(cache, cachefd));
+    }
+
+    if (restart_path != NULL && (restartfd = restart_listen(restart_path)) < 0) {
+        fprintf(stderr, "webserver: can't listen for a replacement at %s\n", restart_path);
+    }
+
+    if (listener.unix_path != NULL) {
+        printf("webserver: waiting for connections on %s...\n", listener.unix_path);
+    } else {
+        printf("webserver: waiting for connections on port %s...\n", PORT);
+    }
+
+    // Everything from here on is done by each worker
+    int worker = procs > 0? prefork(procs, restartfd, listenfd, cache): 0;
+    char *save_log = worker_path(SAVE_LOG, worker);
+    char *trace_file = worker_path(TRACE_FILE, worker);
+
+    if (save_log == NULL || trace_file == NULL) {
+        fprintf(stderr, "webserver: out of memory\n");
+        exit(3);
+    }
+
+    // This is the main loop that accepts incoming connections, reads
+    // requests and sends responses. Nothing in it blocks: a slow client
+    // just waits its turn (and is dropped if it's too slow).
+    struct loop *loop = loop_create(listenfd, cache, handle_http_request);
+
+    if (loop == NULL) {
+        fprintf(stderr, "webserver: fatal error setting up event loop\n");
+        exit(1);
+    }
+
+    loop->header_timeout = header_timeout;
+    loop->body_timeout = body_timeout;
+    loop->write_timeout = write_timeout;
+    loop->keepalive_timeout = keepalive_timeout;
+    loop->header_handler = handle_http_header;
+    loop->trace_file = trace_file;
+    loop->restart_fd = worker == 0? restartfd: -1;
+    loop->max_conns = max_conns;
+    loop->shed_queue = shed_queue;
+
+    if (rate > 0) {
+        loop->ratelimit = ratelimit_create(RATELIMIT_SIZE, rate, burst > 0? burst: rate);
+
+        if (loop->ratelimit == NULL) {
+            fprintf(stderr, "webserver: out of memory\n");
+            exit(3);
+        }
+    }
+
+    if (trace_rate > 0) {
+        loop->trace_every = trace_rate;
+        trace_start(trace_rate);
+    }
+
+    if (use_uring) {
+        if (loop_use_uring(loop) < 0) {
+            fprintf(stderr, "webserver: io_uring not available, using epoll\n");
+        } else {
+            printf("webserver: using io_uring\n");
+        }
+    }
+
+    struct pool *pool = pool_create(workers > 0? workers: 0);
+
+    if (pool == NULL) {
+        fprintf(stderr, "webserver: out of memory\n");
+        exit(3);
+    }
+
+    loop_set_pool(loop, pool);
+
+    savelog = savelog_open(save_log, pool, save_sync_delay);
+
+    if (savelog == NULL) {
+        fprintf(stderr, "webserver: can't open save log\n");
+        exit(1);
+    }
+
+    if (*access_log != '\0') {
+        loop->accesslog = accesslog_open(access_log);
+
+        if (loop->accesslog == NULL) {
+            fprintf(stderr, "webserver: can't open access log\n");
+            exit(1);
+        }
+    }
+
+    loop_run(loop);
+
+    // Unreachable code
+
+    return 0;
+}
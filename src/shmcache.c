@@ -0,0 +1,624 @@
+/*
+
+A cache kept in shared memory, so that worker processes forked from
+the same master share one copy of everything cached (see cache.c,
+which presents it through the usual cache API).
+
+The segment is a memfd mapped MAP_SHARED before the workers are forked.
+It holds a header, the hash chains of the index, and a heap of blocks
+from a buddy allocator: sizes are powers of 2, a block that's split
+has a "buddy" it's merged back with when both are free, and the free
+blocks of each size are on a list. An entry is one block: a header
+(links, validators, refcount), then its path, then its content.
+Nothing in the segment holds a pointer: links are offsets from the
+start of the segment.
+
+One process-shared mutex guards the index, the LRU list and the heap.
+It's robust, so a worker that dies holding it doesn't hang the rest.
+Content is copied in with the lock dropped: the entry is allocated,
+filled and then linked in, and nobody can see it until then.
+
+Entries are reference counted across processes. A lookup takes a
+reference, which is dropped once the response sending the content is
+out. Evicting a referenced entry only unlinks it; its block is freed
+with the last reference, like cache_entry_unref().
+
+Expired entries are dropped when a lookup finds them (there's no timer
+wheel to share) or when they reach the end of the LRU list.
+
+*/
+
+#define _GNU_SOURCE // memfd_create()
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "shmcache.h"
+
+/**
+ * Lock the segment
+ *
+ * If the last holder died with it, the structures it was changing may
+ * be half-done. Those changes are a handful of stores each, so that's
+ * unlikely enough that we only say so and carry on.
+ */
+void shmcache_lock(struct shmcache *shm)
+{
+    if (pthread_mutex_lock(&shm->lock) == EOWNERDEAD) {
+        pthread_mutex_consistent(&shm->lock);
+        shm->recoveries++;
+        fprintf(stderr, "shmcache: recovered lock from a dead process\n");
+    }
+}
+
+void shmcache_unlock(struct shmcache *shm)
+{
+    pthread_mutex_unlock(&shm->lock);
+}
+
+/**
+ * FNV-1a, for the index
+ */
+unsigned int shmcache_hash(char *path)
+{
+    unsigned int h = 2166136261u;
+
+    for (unsigned char *p = (unsigned char *)path; *p != '\0'; p++) {
+        h = (h ^ *p) * 16777619u;
+    }
+
+    return h;
+}
+
+/**
+ * Get a block by its offset
+ */
+struct shmcache_block *block_at(struct shmcache *shm, unsigned long off)
+{
+    return (struct shmcache_block *)((char *)shm + off);
+}
+
+/**
+ * Put a block on the free list for its order
+ */
+void block_push(struct shmcache *shm, unsigned long off, int order)
+{
+    struct shmcache_block *b = block_at(shm, off);
+
+    b->free = 1;
+    b->order = order;
+    b->prev = 0;
+    b->next = shm->free_lists[order];
+
+    if (b->next != 0) {
+        block_at(shm, b->next)->prev = off;
+    }
+
+    shm->free_lists[order] = off;
+}
+
+/**
+ * Take a block off the free list it's on
+ */
+void block_unlink(struct shmcache *shm, unsigned long off)
+{
+    struct shmcache_block *b = block_at(shm, off);
+
+    if (b->prev == 0) {
+        shm->free_lists[b->order] = b->next;
+    } else {
+        block_at(shm, b->prev)->next = b->next;
+    }
+
+    if (b->next != 0) {
+        block_at(shm, b->next)->prev = b->prev;
+    }
+
+    b->free = 0;
+}
+
+/**
+ * Return the size of the block an entry takes, or 0 if it's too big to
+ * store
+ */
+long shmcache_block_size(int path_length, int content_length)
+{
+    long size = sizeof(struct shmcache_entry) + path_length + 1 + content_length;
+    long block = SHMCACHE_MIN_BLOCK;
+
+    while (block < size) {
+        block *= 2;
+    }
+
+    return block <= SHMCACHE_MAX_BLOCK? block: 0;
+}
+
+/**
+ * Allocate a block of at least size bytes
+ *
+ * Returns its offset, or 0 if there's no free block big enough.
+ */
+unsigned long block_alloc(struct shmcache *shm, long size)
+{
+    int order = 0, k;
+
+    while (order < SHMCACHE_ORDERS && ((long)SHMCACHE_MIN_BLOCK << order) < size) {
+        order++;
+    }
+
+    for (k = order; k < SHMCACHE_ORDERS && shm->free_lists[k] == 0; k++) {
+    }
+
+    if (k == SHMCACHE_ORDERS) {
+        return 0;
+    }
+
+    unsigned long off = shm->free_lists[k];
+
+    block_unlink(shm, off);
+
+    // Split it down to size, freeing the upper halves
+    while (k > order) {
+        k--;
+        block_push(shm, off + ((long)SHMCACHE_MIN_BLOCK << k), k);
+    }
+
+    block_at(shm, off)->order = order;
+    shm->used_bytes += (long)SHMCACHE_MIN_BLOCK << order;
+
+    return off;
+}
+
+/**
+ * Free a block, merging it with its buddy as far as they go
+ */
+void block_free(struct shmcache *shm, unsigned long off)
+{
+    int order = block_at(shm, off)->order;
+    unsigned long rel = off - shm->heap; // Buddies are found relative to the heap
+
+    shm->used_bytes -= (long)SHMCACHE_MIN_BLOCK << order;
+
+    while (order < SHMCACHE_ORDERS - 1) {
+        unsigned long buddy = rel ^ ((unsigned long)SHMCACHE_MIN_BLOCK << order);
+        struct shmcache_block *b = block_at(shm, shm->heap + buddy);
+
+        if (!b->free || b->order != order) {
+            break;
+        }
+
+        block_unlink(shm, shm->heap + buddy);
+
+        if (buddy < rel) {
+            rel = buddy;
+        }
+
+        order++;
+    }
+
+    block_push(shm, shm->heap + rel, order);
+}
+
+/**
+ * Create a shared cache
+ *
+ * max_size: maximum number of entries
+ * max_bytes: room for entries, rounded up to whole SHMCACHE_MAX_BLOCKs;
+ *   every entry takes a block, sized to the next power of 2 that holds
+ *   its header, path and content
+ * fdp: if not NULL, gets the memfd, to hand to another process; else
+ *   it's closed, leaving only the mapping
+ *
+ * Returns NULL on error.
+ */
+struct shmcache *shmcache_create(int max_size, long max_bytes, int *fdp)
+{
+    long heap_size = (max_bytes + SHMCACHE_MAX_BLOCK - 1) / SHMCACHE_MAX_BLOCK * SHMCACHE_MAX_BLOCK;
+
+    if (heap_size < SHMCACHE_MAX_BLOCK) {
+        heap_size = SHMCACHE_MAX_BLOCK;
+    }
+
+    // No more chains than there can be entries
+    long most = heap_size / SHMCACHE_MIN_BLOCK;
+    unsigned int nbuckets = 16;
+
+    while ((long)nbuckets < max_size && (long)nbuckets < most) {
+        nbuckets *= 2;
+    }
+
+    unsigned long buckets = (sizeof(struct shmcache) + 63) & ~63UL;
+    unsigned long heap = (buckets + nbuckets * sizeof(unsigned long) + 4095) & ~4095UL;
+    size_t size = heap + heap_size;
+
+    int fd = memfd_create("webserver-cache", MFD_CLOEXEC);
+
+    if (fd < 0) {
+        perror("memfd_create");
+        return NULL;
+    }
+
+    if (ftruncate(fd, size) < 0) {
+        perror("ftruncate");
+        close(fd);
+        return NULL;
+    }
+
+    struct shmcache *shm = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+
+    if (shm == MAP_FAILED) {
+        perror("mmap");
+        close(fd);
+        return NULL;
+    }
+
+    if (fdp != NULL) {
+        *fdp = fd;
+    } else {
+        close(fd);
+    }
+
+    // A fresh memfd is all zeroes, so the index starts out empty
+    pthread_mutexattr_t attr;
+
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&shm->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+
+    shm->magic = SHMCACHE_MAGIC;
+    shm->header_size = sizeof *shm;
+    shm->size = size;
+    shm->buckets = buckets;
+    shm->nbuckets = nbuckets;
+    shm->max_size = max_size;
+    shm->heap = heap;
+    shm->heap_size = heap_size;
+
+    for (long off = 0; off < heap_size; off += SHMCACHE_MAX_BLOCK) {
+        block_push(shm, heap + off, SHMCACHE_ORDERS - 1);
+    }
+
+    return shm;
+}
+
+/**
+ * Map a shared cache created by another process, e.g. one handed over
+ * on a restart
+ *
+ * Closes fd, whether or not it works.
+ *
+ * Returns NULL if fd isn't a segment with our layout.
+ */
+struct shmcache *shmcache_attach(int fd)
+{
+    struct stat st;
+    struct shmcache *shm;
+
+    if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof *shm) {
+        close(fd);
+        return NULL;
+    }
+
+    shm = mmap(NULL, st.st_size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (shm == MAP_FAILED) {
+        perror("mmap");
+        return NULL;
+    }
+
+    if (shm->magic != SHMCACHE_MAGIC || shm->header_size != sizeof *shm || shm->size != (size_t)st.st_size) {
+        fprintf(stderr, "shmcache: segment has a different layout\n");
+        munmap(shm, st.st_size);
+        return NULL;
+    }
+
+    return shm;
+}
+
+/**
+ * Unmap a shared cache
+ *
+ * Other processes that have it mapped keep it.
+ */
+void shmcache_destroy(struct shmcache *shm)
+{
+    munmap(shm, shm->size);
+}
+
+/**
+ * Get the hash chain for a hash
+ */
+unsigned long *shmcache_bucket(struct shmcache *shm, unsigned int hash)
+{
+    unsigned long *buckets = (unsigned long *)((char *)shm + shm->buckets);
+
+    return &buckets[hash & (shm->nbuckets - 1)];
+}
+
+/**
+ * Find an entry in the index (locked)
+ *
+ * Returns its offset, or 0.
+ */
+unsigned long shmcache_find(struct shmcache *shm, char *path, unsigned int hash)
+{
+    for (unsigned long off = *shmcache_bucket(shm, hash); off != 0; off = SHMCACHE_ENTRY(shm, off)->hnext) {
+        struct shmcache_entry *e = SHMCACHE_ENTRY(shm, off);
+
+        if (e->hash == hash && strcmp(e->data, path) == 0) {
+            return off;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Unlink an entry from the LRU list (locked)
+ */
+void shm_list_remove(struct shmcache *shm, struct shmcache_entry *e)
+{
+    if (e->prev == 0) {
+        shm->head = e->next;
+    } else {
+        SHMCACHE_ENTRY(shm, e->prev)->next = e->next;
+    }
+
+    if (e->next == 0) {
+        shm->tail = e->prev;
+    } else {
+        SHMCACHE_ENTRY(shm, e->next)->prev = e->prev;
+    }
+
+    e->prev = e->next = 0;
+}
+
+/**
+ * Link an entry in at the head of the LRU list (locked)
+ */
+void shm_list_insert_head(struct shmcache *shm, unsigned long off)
+{
+    struct shmcache_entry *e = SHMCACHE_ENTRY(shm, off);
+
+    e->prev = 0;
+    e->next = shm->head;
+
+    if (shm->head == 0) {
+        shm->tail = off;
+    } else {
+        SHMCACHE_ENTRY(shm, shm->head)->prev = off;
+    }
+
+    shm->head = off;
+}
+
+/**
+ * Take an entry out of the index and list, and free it unless it's
+ * still referenced (locked)
+ */
+void shmcache_unlink(struct shmcache *shm, unsigned long off)
+{
+    struct shmcache_entry *e = SHMCACHE_ENTRY(shm, off);
+    unsigned long *p = shmcache_bucket(shm, e->hash);
+
+    while (*p != off) {
+        p = &SHMCACHE_ENTRY(shm, *p)->hnext;
+    }
+
+    *p = e->hnext;
+    e->hnext = 0;
+
+    shm_list_remove(shm, e);
+
+    shm->cur_size--;
+    shm->cur_bytes -= e->content_length;
+    e->removed = 1;
+
+    if (e->refcount == 0) {
+        block_free(shm, off);
+    }
+}
+
+/**
+ * Evict the least-recently-used entry (locked)
+ */
+void shmcache_evict_tail(struct shmcache *shm)
+{
+    shm->evictions++;
+    shm->evicted_bytes += SHMCACHE_ENTRY(shm, shm->tail)->content_length;
+    shmcache_unlink(shm, shm->tail);
+}
+
+/**
+ * Look up an entry, taking a reference to it
+ *
+ * Returns its offset, or 0 if there's no such entry or it's expired.
+ * Drop the reference with shmcache_unref().
+ */
+unsigned long shmcache_get(struct shmcache *shm, char *path)
+{
+    unsigned int hash = shmcache_hash(path);
+
+    shmcache_lock(shm);
+
+    unsigned long off = shmcache_find(shm, path, hash);
+
+    if (off != 0) {
+        struct shmcache_entry *e = SHMCACHE_ENTRY(shm, off);
+
+        if (e->expires != 0 && e->expires <= time(NULL)) {
+            shm->expirations++;
+            shmcache_unlink(shm, off);
+            off = 0;
+
+        } else {
+            shm_list_remove(shm, e);
+            shm_list_insert_head(shm, off);
+            e->refcount++;
+        }
+    }
+
+    if (off != 0) {
+        shm->hits++;
+    } else {
+        shm->misses++;
+    }
+
+    shmcache_unlock(shm);
+
+    return off;
+}
+
+/**
+ * Store an entry, taking a reference to it
+ *
+ * Least-recently-used entries are evicted to make room, and an existing
+ * entry for the same path is replaced. Everything about the entry goes
+ * in with it: other processes can see it as soon as it's linked in.
+ *
+ * Returns its offset, or 0 if there's no room even after evicting all
+ * that can be.
+ */
+unsigned long shmcache_put(struct shmcache *shm, char *path, char *content_type, void *content, int content_length, char *etag, char *content_encoding, time_t last_modified)
+{
+    int path_length = strlen(path);
+    long size = sizeof(struct shmcache_entry) + path_length + 1 + content_length;
+
+    if (size > SHMCACHE_MAX_BLOCK) {
+        return 0;
+    }
+
+    shmcache_lock(shm);
+
+    unsigned long off;
+
+    while ((off = block_alloc(shm, size)) == 0 && shm->tail != 0) {
+        shmcache_evict_tail(shm);
+    }
+
+    shmcache_unlock(shm);
+
+    if (off == 0) {
+        return 0;
+    }
+
+    // Nobody else can see it yet, so fill it in unlocked
+    struct shmcache_entry *e = SHMCACHE_ENTRY(shm, off);
+
+    e->hnext = e->prev = e->next = 0;
+    e->hash = shmcache_hash(path);
+    e->refcount = 1;
+    e->removed = 0;
+    e->path_length = path_length;
+    e->content_length = content_length;
+    snprintf(e->content_type, sizeof e->content_type, "%s", content_type);
+    snprintf(e->content_encoding, sizeof e->content_encoding, "%s", content_encoding != NULL? content_encoding: "");
+    snprintf(e->etag, sizeof e->etag, "%s", etag);
+    e->last_modified = last_modified;
+    e->expires = 0;
+    memcpy(e->data, path, path_length + 1);
+    memcpy(e->data + path_length + 1, content, content_length);
+
+    shmcache_lock(shm);
+
+    // Replaces any entry for the path, even one stored meanwhile
+    unsigned long old = shmcache_find(shm, path, e->hash);
+
+    if (old != 0) {
+        shmcache_unlink(shm, old);
+    }
+
+    unsigned long *bucket = shmcache_bucket(shm, e->hash);
+
+    e->hnext = *bucket;
+    *bucket = off;
+    shm_list_insert_head(shm, off);
+
+    shm->cur_size++;
+    shm->cur_bytes += content_length;
+    shm->insertions++;
+
+    // Never evict the entry we just added
+    while (shm->cur_size > shm->max_size && shm->tail != off) {
+        shmcache_evict_tail(shm);
+    }
+
+    shmcache_unlock(shm);
+
+    return off;
+}
+
+/**
+ * Take a reference to every entry, least recently used first
+ *
+ * Puts up to max offsets in offs, for copying the entries out without
+ * holding the lock. Drop each with shmcache_unref().
+ *
+ * Returns how many there were.
+ */
+int shmcache_snapshot(struct shmcache *shm, unsigned long *offs, int max)
+{
+    int n = 0;
+
+    shmcache_lock(shm);
+
+    for (unsigned long off = shm->tail; off != 0 && n < max; off = SHMCACHE_ENTRY(shm, off)->prev) {
+        SHMCACHE_ENTRY(shm, off)->refcount++;
+        offs[n++] = off;
+    }
+
+    shmcache_unlock(shm);
+
+    return n;
+}
+
+/**
+ * Set when an entry expires, 0 for never
+ */
+void shmcache_set_expires(struct shmcache *shm, unsigned long off, time_t expires)
+{
+    shmcache_lock(shm);
+    SHMCACHE_ENTRY(shm, off)->expires = expires;
+    shmcache_unlock(shm);
+}
+
+/**
+ * Remove an entry from the index, if it hasn't been already
+ *
+ * The caller's reference stays good.
+ */
+void shmcache_remove(struct shmcache *shm, unsigned long off)
+{
+    shmcache_lock(shm);
+
+    if (!SHMCACHE_ENTRY(shm, off)->removed) {
+        shmcache_unlink(shm, off);
+    }
+
+    shmcache_unlock(shm);
+}
+
+/**
+ * Drop a reference taken by shmcache_get() or shmcache_put()
+ */
+void shmcache_unref(struct shmcache *shm, unsigned long off)
+{
+    struct shmcache_entry *e = SHMCACHE_ENTRY(shm, off);
+
+    shmcache_lock(shm);
+
+    if (--e->refcount == 0 && e->removed) {
+        block_free(shm, off);
+    }
+
+    shmcache_unlock(shm);
+}
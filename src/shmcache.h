@@ -0,0 +1,92 @@
+#ifndef _SHMCACHE_H_
+#define _SHMCACHE_H_
+
+#include <time.h>
+#include <pthread.h>
+
+#define SHMCACHE_MIN_BLOCK 256 // Smallest block allocated; a power of 2
+#define SHMCACHE_ORDERS 14     // Block sizes, each double the last: 256 bytes to 2M
+#define SHMCACHE_MAX_BLOCK ((long)SHMCACHE_MIN_BLOCK << (SHMCACHE_ORDERS - 1))
+
+#define SHMCACHE_TYPE_SIZE 128    // Room for a content type
+#define SHMCACHE_ENCODING_SIZE 8  // Room for a content encoding
+#define SHMCACHE_ETAG_SIZE 20     // Same as CACHE_ETAG_SIZE
+
+#define SHMCACHE_MAGIC 0x57534331 // "WSC1": bump if the layout changes
+
+// Everything in the segment refers to everything else by its offset
+// from the start of the segment, so it means the same in every process
+// whatever address the segment is mapped at. 0 is the header, so it
+// stands for none.
+
+// A block on a free list
+struct shmcache_block {
+    int free;  // 1 here; shared with shmcache_entry
+    int order; // The block is SHMCACHE_MIN_BLOCK << order bytes
+    unsigned long prev, next; // Free list of its order
+};
+
+// An entry, at the start of the block that holds it, followed by its
+// path (NUL-terminated) and then its content
+struct shmcache_entry {
+    int free;  // 0 here; shared with shmcache_block
+    int order;
+
+    unsigned long hnext;      // Hash chain
+    unsigned long prev, next; // LRU list, most recent first
+    unsigned int hash;
+
+    int refcount; // Views still in use, in any process
+    int removed;  // Out of the index; freed once refcount drops to 0
+
+    int path_length;
+    int content_length;
+    char content_type[SHMCACHE_TYPE_SIZE];
+    char content_encoding[SHMCACHE_ENCODING_SIZE]; // "" for none
+    char etag[SHMCACHE_ETAG_SIZE];
+    time_t last_modified;
+    time_t expires; // 0 for never
+
+    char data[];
+};
+
+// The segment's header, at offset 0
+struct shmcache {
+    unsigned int magic;       // SHMCACHE_MAGIC
+    unsigned int header_size; // sizeof(struct shmcache), as another build sees it
+
+    pthread_mutex_t lock; // Process-shared and robust; guards everything below
+    size_t size;          // Of the whole segment
+
+    unsigned long buckets; // Hash chains, nbuckets of them
+    unsigned int nbuckets; // A power of 2
+
+    unsigned long head, tail; // LRU list
+    int max_size;             // Maximum number of entries
+    int cur_size;
+
+    unsigned long heap; // Where blocks start
+    long heap_size;     // A multiple of SHMCACHE_MAX_BLOCK
+    unsigned long free_lists[SHMCACHE_ORDERS];
+    long used_bytes;    // In allocated blocks
+
+    long cur_bytes; // Content stored
+    long hits, misses, insertions, evictions, expirations;
+    long long evicted_bytes;
+    long recoveries; // Times the lock was found held by a dead process
+};
+
+#define SHMCACHE_ENTRY(shm, off) ((struct shmcache_entry *)((char *)(shm) + (off)))
+
+extern struct shmcache *shmcache_create(int max_size, long max_bytes, int *fdp);
+extern struct shmcache *shmcache_attach(int fd);
+extern void shmcache_destroy(struct shmcache *shm);
+extern long shmcache_block_size(int path_length, int content_length);
+extern int shmcache_snapshot(struct shmcache *shm, unsigned long *offs, int max);
+extern unsigned long shmcache_get(struct shmcache *shm, char *path);
+extern unsigned long shmcache_put(struct shmcache *shm, char *path, char *content_type, void *content, int content_length, char *etag, char *content_encoding, time_t last_modified);
+extern void shmcache_set_expires(struct shmcache *shm, unsigned long off, time_t expires);
+extern void shmcache_remove(struct shmcache *shm, unsigned long off);
+extern void shmcache_unref(struct shmcache *shm, unsigned long off);
+
+#endif
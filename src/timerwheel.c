@@ -0,0 +1,227 @@
+/*
+
+A hierarchical timer wheel.
+
+Level 0 has a slot per tick for the next 64 ticks. Level 1 has a slot per
+64 ticks for the next 64^2, and so on. Adding and deleting a timer are
+O(1). As time passes, each time a level wraps around, the next slot of
+the level above is "cascaded" down: its timers are re-added, now landing
+in a finer level.
+
+Ticks are whatever unit the user wants (seconds for the cache, say).
+Timers are embedded in the structures they time out, so the wheel never
+allocates.
+
+Example:
+
+struct timerwheel *tw = timerwheel_create(now);
+
+timer_init(&conn->timer, conn_timeout, conn);
+timerwheel_add(tw, &conn->timer, now + 30);
+
+// Later, every so often:
+timerwheel_run(tw, now, 100); // Fire at most 100 expired timers
+
+*/
+
+#include <stdlib.h>
+#include "timerwheel.h"
+
+#define SLOT_MASK (TIMERWHEEL_SLOTS - 1)
+
+// Furthest out we can schedule a timer
+#define MAX_DELTA ((1ULL << (TIMERWHEEL_BITS * TIMERWHEEL_LEVELS)) - 1)
+
+/**
+ * Create a timer wheel, starting at tick now
+ */
+struct timerwheel *timerwheel_create(unsigned long long now)
+{
+    struct timerwheel *tw = malloc(sizeof *tw);
+
+    if (tw == NULL) {
+        return NULL;
+    }
+
+    tw->now = now;
+    tw->count = 0;
+
+    for (int level = 0; level < TIMERWHEEL_LEVELS; level++) {
+        for (int i = 0; i < TIMERWHEEL_SLOTS; i++) {
+            struct timer *head = &tw->slot[level][i];
+
+            head->prev = head->next = head;
+        }
+    }
+
+    return tw;
+}
+
+/**
+ * Free a timer wheel
+ *
+ * NOTE: doesn't touch any pending timers
+ */
+void timerwheel_free(struct timerwheel *tw)
+{
+    free(tw);
+}
+
+/**
+ * Initialize a timer
+ *
+ * callback is called with the timer and arg when it fires.
+ */
+void timer_init(struct timer *t, void (*callback)(struct timer *, void *), void *arg)
+{
+    t->prev = t->next = NULL;
+    t->expires = 0;
+    t->callback = callback;
+    t->arg = arg;
+    t->pending = 0;
+}
+
+/**
+ * Put a timer in the right slot for its expiry
+ */
+void timerwheel_place(struct timerwheel *tw, struct timer *t)
+{
+    unsigned long long delta = t->expires - tw->now;
+    struct timer *head;
+
+    if (t->expires < tw->now) {
+        // Already late: fire on the next tick we process
+        head = &tw->slot[0][tw->now & SLOT_MASK];
+
+    } else {
+        int level = 0;
+
+        if (delta > MAX_DELTA) {
+            t->expires = tw->now + MAX_DELTA;
+            delta = MAX_DELTA;
+        }
+
+        while (delta >= (1ULL << (TIMERWHEEL_BITS * (level + 1)))) {
+            level++;
+        }
+
+        head = &tw->slot[level][(t->expires >> (TIMERWHEEL_BITS * level)) & SLOT_MASK];
+    }
+
+    t->prev = head->prev;
+    t->next = head;
+    head->prev->next = t;
+    head->prev = t;
+}
+
+/**
+ * Add a timer to fire at tick expires
+ *
+ * If it's already pending, it's rescheduled.
+ */
+void timerwheel_add(struct timerwheel *tw, struct timer *t, unsigned long long expires)
+{
+    if (t->pending) {
+        timerwheel_del(tw, t);
+    }
+
+    t->expires = expires;
+    t->pending = 1;
+    tw->count++;
+
+    timerwheel_place(tw, t);
+}
+
+/**
+ * Cancel a timer
+ *
+ * Does nothing if the timer isn't pending.
+ */
+void timerwheel_del(struct timerwheel *tw, struct timer *t)
+{
+    if (!t->pending) {
+        return;
+    }
+
+    t->prev->next = t->next;
+    t->next->prev = t->prev;
+    t->prev = t->next = NULL;
+    t->pending = 0;
+
+    tw->count--;
+}
+
+/**
+ * Move every timer in a slot down to where it belongs now
+ *
+ * Returns the index of the slot.
+ */
+int timerwheel_cascade(struct timerwheel *tw, int level)
+{
+    int index = (tw->now >> (TIMERWHEEL_BITS * level)) & SLOT_MASK;
+    struct timer *head = &tw->slot[level][index];
+    struct timer *t = head->next;
+
+    head->prev = head->next = head;
+
+    while (t != head) {
+        struct timer *next = t->next;
+
+        timerwheel_place(tw, t);
+        t = next;
+    }
+
+    return index;
+}
+
+/**
+ * Fire expired timers, up to tick now
+ *
+ * At most max timers are fired (0 for no limit), so a big batch of
+ * expirations can be spread over several calls. Callbacks may add and
+ * delete timers, including their own.
+ *
+ * Returns the number of timers fired.
+ */
+int timerwheel_run(struct timerwheel *tw, unsigned long long now, int max)
+{
+    int fired = 0;
+
+    while (tw->now <= now) {
+        if (tw->count == 0) {
+            // Nothing to do; skip straight to the present
+            tw->now = now + 1;
+            break;
+        }
+
+        int index = tw->now & SLOT_MASK;
+
+        // Cascading is idempotent, so it's fine to redo it if we ran out
+        // of budget partway through this tick last time
+        if (index == 0) {
+            for (int level = 1; level < TIMERWHEEL_LEVELS; level++) {
+                if (timerwheel_cascade(tw, level) != 0) {
+                    break;
+                }
+            }
+        }
+
+        struct timer *head = &tw->slot[0][index];
+
+        while (head->next != head) {
+            if (max > 0 && fired >= max) {
+                return fired;
+            }
+
+            struct timer *t = head->next;
+
+            timerwheel_del(tw, t);
+            t->callback(t, t->arg);
+            fired++;
+        }
+
+        tw->now++;
+    }
+
+    return fired;
+}
@@ -0,0 +1,31 @@
+#ifndef _TIMERWHEEL_H_
+#define _TIMERWHEEL_H_
+
+#define TIMERWHEEL_BITS 6
+#define TIMERWHEEL_SLOTS (1 << TIMERWHEEL_BITS) // Slots per level
+#define TIMERWHEEL_LEVELS 4 // Covers 64^4 ticks; later timers are clamped
+
+// A timer, embedded in whatever it times out
+struct timer {
+    struct timer *prev, *next; // Circular list in a wheel slot
+    unsigned long long expires; // Tick at which to fire
+    void (*callback)(struct timer *t, void *arg);
+    void *arg;
+    int pending; // True if the timer is in the wheel
+};
+
+// A hierarchical timer wheel
+struct timerwheel {
+    unsigned long long now; // Next tick to process
+    int count; // Pending timers
+    struct timer slot[TIMERWHEEL_LEVELS][TIMERWHEEL_SLOTS]; // List heads
+};
+
+extern struct timerwheel *timerwheel_create(unsigned long long now);
+extern void timerwheel_free(struct timerwheel *tw);
+extern void timer_init(struct timer *t, void (*callback)(struct timer *, void *), void *arg);
+extern void timerwheel_add(struct timerwheel *tw, struct timer *t, unsigned long long expires);
+extern void timerwheel_del(struct timerwheel *tw, struct timer *t);
+extern int timerwheel_run(struct timerwheel *tw, unsigned long long now, int max);
+
+#endif
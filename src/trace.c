@@ -0,0 +1,223 @@
+/*
+
+Per-request phase tracing, written out in Chrome's trace_event format
+for chrome://tracing or Perfetto.
+
+While tracing is on, one request in trace_every is picked as it starts
+and given an id. Each phase it goes through (recv, parsing, the cache
+lookup, loading from disk, sending...) adds an event to a ring
+belonging to the thread it ran on. Timestamps are raw TSC ticks, so
+an event costs two rdtsc's and a few stores: no locks and no system
+calls. Rings keep the most recent events, overwriting the oldest, like
+a flight recorder.
+
+While it's off, requests get id 0, and every trace point is one branch
+on that.
+
+trace_dump() converts ticks to time against CLOCK_MONOTONIC readings
+from when tracing was first started and from the dump itself, and
+writes each event as a "complete" (ph X) event, one track per thread.
+An event can be caught half-overwritten if its thread is still tracing,
+so stop first.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#include "trace.h"
+
+int trace_every;
+
+// The event loop's thread picks the requests
+int trace_countdown;
+unsigned long trace_last_id;
+
+struct trace_ring *trace_rings;
+int trace_nrings;
+pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER; // Held only to add a ring
+
+// This thread's ring, once it's traced something
+__thread struct trace_ring *trace_ring;
+
+// Where ticks are measured from
+unsigned long long trace_tsc0;
+long long trace_ns0;
+
+/**
+ * Return the time in ticks: TSC where there is one, else ns
+ */
+unsigned long long trace_clock(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+/**
+ * Return monotonic time in ns
+ */
+long long trace_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/**
+ * Start tracing 1 request in every
+ */
+void trace_start(int every)
+{
+    if (trace_ns0 == 0) {
+        trace_tsc0 = trace_clock();
+        trace_ns0 = trace_ns();
+    }
+
+    trace_countdown = 0;
+    trace_every = every > 0? every: 1;
+}
+
+/**
+ * Stop picking requests to trace
+ *
+ * Requests already picked go on adding events until they're done.
+ */
+void trace_stop(void)
+{
+    trace_every = 0;
+}
+
+/**
+ * Decide whether to trace a request that's starting
+ *
+ * Returns its id if so, else 0.
+ */
+unsigned long trace_request(void)
+{
+    if (trace_every == 0 || --trace_countdown > 0) {
+        return 0;
+    }
+
+    trace_countdown = trace_every;
+
+    return ++trace_last_id;
+}
+
+/**
+ * Give the calling thread a ring
+ *
+ * Returns NULL if out of memory.
+ */
+struct trace_ring *trace_ring_create(void)
+{
+    struct trace_ring *ring = calloc(1, sizeof *ring);
+
+    if (ring == NULL) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&trace_lock);
+    ring->tid = trace_nrings++;
+    ring->next = trace_rings;
+    __atomic_store_n(&trace_rings, ring, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&trace_lock);
+
+    trace_ring = ring;
+
+    return ring;
+}
+
+/**
+ * Record a phase of request id that started at start and ends now
+ */
+void trace_add(unsigned long id, const char *name, unsigned long long start)
+{
+    unsigned long long end = trace_clock();
+    struct trace_ring *ring = trace_ring;
+
+    if (ring == NULL && (ring = trace_ring_create()) == NULL) {
+        return;
+    }
+
+    unsigned long head = ring->head;
+    struct trace_event *ev = &ring->events[head & (TRACE_RING_SIZE - 1)];
+
+    ev->name = name;
+    ev->id = id;
+    ev->start = start;
+    ev->end = end;
+
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Write every thread's events to a file as Chrome trace JSON
+ *
+ * Returns the number of events written, or -1 on error.
+ */
+int trace_dump(char *path)
+{
+    if (trace_ns0 == 0) {
+        return 0;
+    }
+
+    FILE *fp = fopen(path, "w");
+
+    if (fp == NULL) {
+        perror(path);
+        return -1;
+    }
+
+    // How fast the clock ticks, measured over the whole time since
+    // tracing started
+    long long ns = trace_ns() - trace_ns0;
+    unsigned long long ticks = trace_clock() - trace_tsc0;
+    double ticks_per_us = ns > 0? ticks / (ns / 1000.0): 1000;
+    int pid = getpid();
+    int n = 0;
+    char *sep = "";
+
+    fprintf(fp, "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [");
+
+    for (struct trace_ring *ring = __atomic_load_n(&trace_rings, __ATOMIC_ACQUIRE); ring != NULL; ring = ring->next) {
+        unsigned long head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        unsigned long first = head > TRACE_RING_SIZE? head - TRACE_RING_SIZE: 0;
+
+        fprintf(fp, "%s\n{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": %d, \"tid\": %d, \"args\": {\"name\": \"thread %d\"}}",
+            sep, pid, ring->tid, ring->tid);
+        sep = ",";
+
+        for (unsigned long i = first; i < head; i++) {
+            struct trace_event *ev = &ring->events[i & (TRACE_RING_SIZE - 1)];
+
+            fprintf(fp, ",\n{\"name\": \"%s\", \"ph\": \"X\", \"pid\": %d, \"tid\": %d, \"ts\": %.3f, \"dur\": %.3f, \"args\": {\"request\": %lu}}",
+                ev->name, pid, ring->tid,
+                trace_ns0 / 1000.0 + (long long)(ev->start - trace_tsc0) / ticks_per_us,
+                (ev->end - ev->start) / ticks_per_us, ev->id);
+            n++;
+        }
+    }
+
+    fprintf(fp, "\n]}\n");
+
+    if (fclose(fp) != 0) {
+        perror(path);
+        return -1;
+    }
+
+    return n;
+}
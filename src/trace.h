@@ -0,0 +1,42 @@
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#include <pthread.h>
+
+#define TRACE_RING_SIZE 16384 // Events kept per thread; a power of 2
+
+// A phase of a request, timed
+struct trace_event {
+    const char *name;  // Must stay put, e.g. a string constant
+    unsigned long id;  // Request it was part of
+    unsigned long long start, end; // trace_clock() ticks
+};
+
+// One thread's most recent events; only that thread writes to it
+struct trace_ring {
+    struct trace_ring *next; // All the rings
+    int tid;                 // Numbered in the order threads first traced
+    unsigned long head;      // Events ever added
+    struct trace_event events[TRACE_RING_SIZE];
+};
+
+// 1 in this many requests is traced; 0 when tracing is off. Only the
+// event loop's thread changes it or reads it.
+extern int trace_every;
+
+// Time a phase of request id, if it's being traced:
+//
+//     unsigned long long t = TRACE_BEGIN(c->trace_id);
+//     ...
+//     TRACE_END(c->trace_id, "parse", t);
+#define TRACE_BEGIN(id) ((id) != 0? trace_clock(): 0)
+#define TRACE_END(id, name, start) do { if ((id) != 0) trace_add((id), (name), (start)); } while (0)
+
+extern unsigned long long trace_clock(void);
+extern void trace_start(int every);
+extern void trace_stop(void);
+extern unsigned long trace_request(void);
+extern void trace_add(unsigned long id, const char *name, unsigned long long start);
+extern int trace_dump(char *path);
+
+#endif
@@ -0,0 +1,741 @@
+/*
+
+io_uring event loop backend.
+
+Instead of waiting for readiness and then making a syscall per
+operation, operations are queued in a submission ring and everything
+queued goes to the kernel in one io_uring_enter(), which also waits for
+completions:
+
+  * accept is multishot: one request keeps producing connections, and
+    the listener is a registered file so there's no fd lookup per
+    accept
+  * recv is multishot too, into a ring of provided buffers registered
+    with the kernel, so idle connections don't pin a buffer each
+  * responses go out with a sendmsg per run of memory segments; file
+    ranges still go out with sendfile() (io_uring has no equivalent
+    that avoids a copy), with a ring poll to wait for room
+
+This needs kernel 6.0 or later; on anything older uring_create()
+returns NULL and the caller falls back to epoll.
+
+liburing isn't required: the rings are set up with the raw syscalls.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include "http.h"
+#include "loop.h"
+#include "uring.h"
+#include "bufpool.h"
+
+#define URING_ENTRIES 256  // Submission ring size
+#define URING_CQ_ENTRIES 4096
+
+#define BUF_GROUP 0        // Provided buffer group for recv
+#define BUF_COUNT 128      // Must be a power of 2
+#define BUF_SIZE 16384
+
+// What a completion is for, kept in the low bits of user_data (the
+// rest is the connection)
+#define OP_ACCEPT 1
+#define OP_RECV 2
+#define OP_SEND 3
+#define OP_POLL 4
+#define OP_CANCEL 5
+#define OP_WAKE 6
+#define OP_MASK 7
+
+struct uring {
+    int fd;
+
+    // Submission ring
+    unsigned sq_entries;
+    unsigned *sq_head, *sq_tail, *sq_mask;
+    struct io_uring_sqe *sqes;
+    unsigned sq_local_tail; // Includes entries not yet published
+    unsigned to_submit;     // Entries filled in since the last submit
+
+    // Completion ring
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    void *sq_ring, *cq_ring;
+    size_t sq_ring_size, cq_ring_size, sqes_size;
+
+    // Provided buffers for recv
+    struct io_uring_buf_ring *buf_ring;
+    char *bufs;
+    unsigned short buf_tail;
+};
+
+/**
+ * Thin wrappers for the io_uring syscalls
+ */
+int sys_io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags, void *arg, size_t argsz)
+{
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, argsz);
+}
+
+int sys_io_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args)
+{
+    return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+/**
+ * Return true if the kernel supports an operation
+ */
+int uring_op_supported(struct uring *u, int op)
+{
+    size_t size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = calloc(1, size);
+    int supported = 0;
+
+    if (probe == NULL) {
+        return 0;
+    }
+
+    if (sys_io_uring_register(u->fd, IORING_REGISTER_PROBE, probe, 256) == 0 && op <= probe->last_op) {
+        supported = (probe->ops[op].flags & IO_URING_OP_SUPPORTED) != 0;
+    }
+
+    free(probe);
+
+    return supported;
+}
+
+/**
+ * Tear down a ring
+ */
+void uring_free(struct uring *u)
+{
+    if (u->bufs != NULL) {
+        free(u->bufs);
+    }
+
+    if (u->buf_ring != NULL) {
+        munmap(u->buf_ring, BUF_COUNT * sizeof(struct io_uring_buf));
+    }
+
+    if (u->sqes != NULL) {
+        munmap(u->sqes, u->sqes_size);
+    }
+
+    if (u->cq_ring != NULL && u->cq_ring != u->sq_ring) {
+        munmap(u->cq_ring, u->cq_ring_size);
+    }
+
+    if (u->sq_ring != NULL) {
+        munmap(u->sq_ring, u->sq_ring_size);
+    }
+
+    if (u->fd >= 0) {
+        close(u->fd);
+    }
+
+    free(u);
+}
+
+/**
+ * Hand a provided buffer back to the kernel
+ */
+void uring_buf_recycle(struct uring *u, int bid)
+{
+    struct io_uring_buf *buf = &u->buf_ring->bufs[u->buf_tail & (BUF_COUNT - 1)];
+
+    buf->addr = (unsigned long)(u->bufs + bid * BUF_SIZE);
+    buf->len = BUF_SIZE;
+    buf->bid = bid;
+
+    u->buf_tail++;
+    __atomic_store_n(&u->buf_ring->tail, u->buf_tail, __ATOMIC_RELEASE);
+}
+
+/**
+ * Set up the rings and provided buffers
+ *
+ * Returns 0, or -1 if the kernel isn't up to it.
+ */
+int uring_setup(struct uring *u)
+{
+    struct io_uring_params p;
+
+    memset(&p, 0, sizeof p);
+    p.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_COOP_TASKRUN;
+    p.cq_entries = URING_CQ_ENTRIES;
+
+    u->fd = sys_io_uring_setup(URING_ENTRIES, &p);
+
+    if (u->fd < 0 && errno == EINVAL) {
+        // Older kernels don't know the optimization flags
+        memset(&p, 0, sizeof p);
+        p.flags = IORING_SETUP_CQSIZE;
+        p.cq_entries = URING_CQ_ENTRIES;
+
+        u->fd = sys_io_uring_setup(URING_ENTRIES, &p);
+    }
+
+    if (u->fd < 0) {
+        perror("io_uring_setup");
+        return -1;
+    }
+
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_EXT_ARG) ||
+        !(p.features & IORING_FEAT_NODROP)) {
+        fprintf(stderr, "io_uring: kernel too old\n");
+        return -1;
+    }
+
+    // Multishot recv arrived with zero-copy send, in 6.0
+    if (!uring_op_supported(u, IORING_OP_SEND_ZC)) {
+        fprintf(stderr, "io_uring: kernel too old for multishot recv\n");
+        return -1;
+    }
+
+    u->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    u->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+
+    if (u->cq_ring_size > u->sq_ring_size) {
+        u->sq_ring_size = u->cq_ring_size;
+    }
+
+    u->cq_ring_size = u->sq_ring_size;
+    u->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+
+    u->sq_ring = mmap(NULL, u->sq_ring_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+
+    if (u->sq_ring == MAP_FAILED) {
+        u->sq_ring = NULL;
+        perror("mmap");
+        return -1;
+    }
+
+    u->cq_ring = u->sq_ring;
+
+    u->sqes = mmap(NULL, u->sqes_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, u->fd, IORING_OFF_SQES);
+
+    if (u->sqes == MAP_FAILED) {
+        u->sqes = NULL;
+        perror("mmap");
+        return -1;
+    }
+
+    char *sq = u->sq_ring, *cq = u->cq_ring;
+
+    u->sq_entries = p.sq_entries;
+    u->sq_head = (unsigned *)(sq + p.sq_off.head);
+    u->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    u->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    u->sq_local_tail = *u->sq_tail;
+
+    // Submission entries are always used in order, so the indirection
+    // array is just the identity
+    unsigned *array = (unsigned *)(sq + p.sq_off.array);
+
+    for (unsigned i = 0; i < p.sq_entries; i++) {
+        array[i] = i;
+    }
+
+    u->cq_head = (unsigned *)(cq + p.cq_off.head);
+    u->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    u->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+    // Provided buffer ring: the kernel picks a buffer for each recv
+    // as data arrives
+    u->buf_ring = mmap(NULL, BUF_COUNT * sizeof(struct io_uring_buf), PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    u->bufs = malloc(BUF_COUNT * BUF_SIZE);
+
+    if (u->buf_ring == MAP_FAILED || u->bufs == NULL) {
+        if (u->buf_ring == MAP_FAILED) {
+            u->buf_ring = NULL;
+        }
+        fprintf(stderr, "io_uring: out of memory\n");
+        return -1;
+    }
+
+    struct io_uring_buf_reg reg;
+
+    memset(&reg, 0, sizeof reg);
+    reg.ring_addr = (unsigned long)u->buf_ring;
+    reg.ring_entries = BUF_COUNT;
+    reg.bgid = BUF_GROUP;
+
+    if (sys_io_uring_register(u->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        perror("io_uring_register");
+        return -1;
+    }
+
+    for (int i = 0; i < BUF_COUNT; i++) {
+        uring_buf_recycle(u, i);
+    }
+
+    return 0;
+}
+
+/**
+ * Publish queued submissions and, optionally, wait for completions
+ *
+ * ts is how long to wait for at least one completion, or NULL to just
+ * submit.
+ */
+void uring_enter(struct uring *u, struct timespec *ts)
+{
+    struct io_uring_getevents_arg arg;
+    unsigned flags = 0;
+    int wait = 0;
+
+    __atomic_store_n(u->sq_tail, u->sq_local_tail, __ATOMIC_RELEASE);
+
+    memset(&arg, 0, sizeof arg);
+
+    if (ts != NULL) {
+        arg.ts = (unsigned long)ts;
+        flags = IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+        wait = 1;
+    }
+
+    int rv = sys_io_uring_enter(u->fd, u->to_submit, wait, flags, ts != NULL? &arg: NULL, ts != NULL? sizeof arg: 0);
+
+    if (rv < 0) {
+        if (errno != ETIME && errno != EINTR && errno != EBUSY) {
+            perror("io_uring_enter");
+        }
+        return;
+    }
+
+    u->to_submit -= rv;
+}
+
+/**
+ * Get a submission entry to fill in
+ */
+struct io_uring_sqe *uring_sqe(struct uring *u, void *ptr, int op)
+{
+    // Ring full: push what we have to the kernel first
+    while (u->sq_local_tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) >= u->sq_entries) {
+        uring_enter(u, NULL);
+    }
+
+    struct io_uring_sqe *sqe = &u->sqes[u->sq_local_tail & *u->sq_mask];
+
+    memset(sqe, 0, sizeof *sqe);
+    sqe->user_data = (uintptr_t)ptr | op;
+
+    u->sq_local_tail++;
+    u->to_submit++;
+
+    return sqe;
+}
+
+/**
+ * Start (or restart) accepting on the registered listener
+ */
+void uring_accept(struct uring *u)
+{
+    struct io_uring_sqe *sqe = uring_sqe(u, NULL, OP_ACCEPT);
+
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = 0; // Index in the registered files
+    sqe->flags = IOSQE_FIXED_FILE;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+}
+
+/**
+ * Stop accepting
+ */
+void uring_stop_accept(struct uring *u)
+{
+    struct io_uring_sqe *sqe = uring_sqe(u, NULL, OP_CANCEL);
+
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = OP_ACCEPT; // The accept's user_data
+
+    uring_enter(u, NULL);
+}
+
+/**
+ * Start (or restart) receiving on a connection
+ */
+void uring_recv(struct uring *u, struct conn *c)
+{
+    struct io_uring_sqe *sqe = uring_sqe(u, c, OP_RECV);
+
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = c->fd;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = BUF_GROUP;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+
+    c->ops++;
+}
+
+/**
+ * Wait for room to send on a connection
+ */
+void uring_poll_out(struct uring *u, struct conn *c)
+{
+    struct io_uring_sqe *sqe = uring_sqe(u, c, OP_POLL);
+
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = c->fd;
+    sqe->poll32_events = POLLOUT;
+
+    c->sending = 1;
+    c->ops++;
+}
+
+/**
+ * Wake up for finished offloaded work when an eventfd is readable
+ */
+void uring_watch(struct uring *u, int efd)
+{
+    struct io_uring_sqe *sqe = uring_sqe(u, NULL, OP_WAKE);
+
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = efd;
+    sqe->poll32_events = POLLIN;
+    sqe->len = IORING_POLL_ADD_MULTI;
+}
+
+/**
+ * Create the io_uring backend for an event loop
+ *
+ * Returns NULL if io_uring isn't available.
+ */
+struct uring *uring_create(struct loop *loop)
+{
+    struct uring *u = calloc(1, sizeof *u);
+
+    if (u == NULL) {
+        return NULL;
+    }
+
+    u->fd = -1;
+
+    if (uring_setup(u) < 0) {
+        uring_free(u);
+        return NULL;
+    }
+
+    if (sys_io_uring_register(u->fd, IORING_REGISTER_FILES, &loop->listenfd, 1) < 0) {
+        perror("io_uring_register");
+        uring_free(u);
+        return NULL;
+    }
+
+    uring_accept(u);
+
+    return u;
+}
+
+/**
+ * Start receiving on a new connection
+ */
+int uring_add(struct conn *c)
+{
+    c->iov = bufpool_alloc(CONN_MAX_IOV * sizeof *c->iov);
+
+    if (c->iov == NULL) {
+        return -1;
+    }
+
+    uring_recv(c->loop->uring, c);
+
+    return 0;
+}
+
+/**
+ * Start sending what's queued on a connection
+ *
+ * Returns 1 if the queue is empty, 0 if a send is under way (we carry
+ * on when it completes), or -1 on error.
+ */
+int uring_send(struct conn *c)
+{
+    struct uring *u = c->loop->uring;
+
+    if (c->sending) {
+        return 0;
+    }
+
+    while (1) {
+        int iovcnt = conn_gather(c, c->iov, CONN_MAX_IOV);
+
+        if (c->out_head == NULL) {
+            return 1;
+        }
+
+        if (iovcnt > 0) {
+            struct io_uring_sqe *sqe = uring_sqe(u, c, OP_SEND);
+
+            memset(&c->msg, 0, sizeof c->msg);
+            c->msg.msg_iov = c->iov;
+            c->msg.msg_iovlen = iovcnt;
+
+            sqe->opcode = IORING_OP_SENDMSG;
+            sqe->fd = c->fd;
+            sqe->addr = (unsigned long)&c->msg;
+            sqe->len = 1;
+            sqe->msg_flags = conn_send_flags(c, iovcnt);
+
+            c->sending = 1;
+            c->ops++;
+
+            return 0;
+        }
+
+        ssize_t rv = conn_sendfile(c);
+
+        if (rv < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                uring_poll_out(u, c);
+                return 0;
+            }
+
+            return -1;
+        }
+    }
+}
+
+/**
+ * Close a connection, once nothing's in flight on it
+ */
+void uring_close(struct conn *c)
+{
+    struct uring *u = c->loop->uring;
+
+    if (c->ops == 0) {
+        conn_free(c);
+        return;
+    }
+
+    c->closing = 1;
+
+    struct io_uring_sqe *sqe = uring_sqe(u, NULL, OP_CANCEL);
+
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = c->fd;
+    sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+
+    // Cancel now, while the fd still means this connection
+    uring_enter(u, NULL);
+}
+
+/**
+ * Data arrived in a provided buffer
+ */
+void uring_received(struct conn *c, char *data, int len)
+{
+    int space = CONN_BUFFER_SIZE - 1 - c->in_len;
+    int overflow = 0;
+
+    // A streamed body makes room as it goes, so keep feeding it
+    while (len > space && c->streaming && space > 0) {
+        memcpy(c->in + c->in_len, data, space);
+        c->in_len += space;
+        c->in[c->in_len] = '\0';
+        data += space;
+        len -= space;
+
+        conn_received(c);
+
+        if (c->closing || c->closed) {
+            return;
+        }
+
+        space = CONN_BUFFER_SIZE - 1 - c->in_len;
+    }
+
+    if (len > space) {
+        len = space;
+        overflow = 1;
+    }
+
+    memcpy(c->in + c->in_len, data, len);
+    c->in_len += len;
+    c->in[c->in_len] = '\0';
+
+    // More than we can buffer. A request header that's too big gets a
+    // 431; anything else is a client pipelining too far ahead of us.
+    if (overflow && !(c->state == CONN_READ_HEADER && find_start_of_body(c->in) == NULL)) {
+        conn_close(c);
+        return;
+    }
+
+    conn_received(c);
+}
+
+/**
+ * Handle a completion for a connection
+ */
+void uring_conn_complete(struct uring *u, struct conn *c, int op, int res, int more, char *data)
+{
+    if (!more) {
+        c->ops--;
+    }
+
+    if (op == OP_SEND || op == OP_POLL) {
+        c->sending = 0;
+    }
+
+    if (c->closing) {
+        if (c->ops == 0) {
+            conn_free(c);
+        }
+        return;
+    }
+
+    // Closed with work still pending; see conn_resume()
+    if (c->closed) {
+        return;
+    }
+
+    switch (op) {
+        case OP_RECV:
+            if (res == 0) {
+                // Hung up. If they're still waiting on a response,
+                // finish sending it first.
+                if (c->state == CONN_WRITE) {
+                    c->keep_alive = 0;
+                } else {
+                    conn_close(c);
+                }
+                break;
+            }
+
+            if (res < 0 && res != -ENOBUFS && res != -EAGAIN && res != -EINTR) {
+                conn_close(c);
+                break;
+            }
+
+            // Out of buffers or otherwise stopped: start again
+            if (!more) {
+                uring_recv(u, c);
+            }
+
+            if (res > 0) {
+                uring_received(c, data, res);
+            }
+            break;
+
+        case OP_SEND:
+            if (res < 0 && res != -EAGAIN && res != -EINTR) {
+                conn_close(c);
+                break;
+            }
+
+            if (res > 0) {
+                conn_sent(c, res);
+            }
+
+            conn_writable(c);
+            break;
+
+        case OP_POLL:
+            conn_writable(c);
+            break;
+    }
+}
+
+/**
+ * Handle one completion
+ */
+void uring_complete(struct loop *loop, struct io_uring_cqe *cqe)
+{
+    struct uring *u = loop->uring;
+    int op = cqe->user_data & OP_MASK;
+    int more = (cqe->flags & IORING_CQE_F_MORE) != 0;
+
+    if (op == OP_CANCEL) {
+        return;
+    }
+
+    if (op == OP_WAKE) {
+        pool_drain(loop->pool);
+
+        if (!more) {
+            uring_watch(u, loop->pool->efd);
+        }
+        return;
+    }
+
+    if (op == OP_ACCEPT) {
+        if (cqe->res >= 0) {
+            loop_add_conn(loop, cqe->res, NULL);
+        } else if (cqe->res != -EAGAIN && cqe->res != -EINTR && cqe->res != -ECANCELED) {
+            fprintf(stderr, "accept: %s\n", strerror(-cqe->res));
+        }
+
+        if (!more && !loop->draining) {
+            uring_accept(u);
+        }
+        return;
+    }
+
+    struct conn *c = (struct conn *)(uintptr_t)(cqe->user_data & ~(uint64_t)OP_MASK);
+
+    if (cqe->flags & IORING_CQE_F_BUFFER) {
+        int bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+
+        uring_conn_complete(u, c, op, cqe->res, more, u->bufs + bid * BUF_SIZE);
+
+        // The data's been copied out; the kernel can have the buffer
+        // back
+        uring_buf_recycle(u, bid);
+        return;
+    }
+
+    uring_conn_complete(u, c, op, cqe->res, more, NULL);
+}
+
+/**
+ * Run the event loop forever on io_uring
+ */
+void uring_run(struct loop *loop)
+{
+    struct uring *u = loop->uring;
+
+    while (1) {
+        struct timespec ts = { 0, LOOP_TICK * 1000000L };
+
+        // Submit everything queued and wait for something to happen
+        uring_enter(u, &ts);
+
+        loop->now = loop_clock();
+
+        unsigned head = *u->cq_head;
+
+        while (head != __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE)) {
+            struct io_uring_cqe cqe = u->cqes[head & *u->cq_mask];
+
+            head++;
+            __atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+
+            uring_complete(loop, &cqe);
+        }
+
+        loop_tick(loop);
+    }
+}
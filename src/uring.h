@@ -0,0 +1,16 @@
+#ifndef _URING_H_
+#define _URING_H_
+
+#include "conn.h"
+
+struct loop;
+
+extern struct uring *uring_create(struct loop *loop);
+extern void uring_run(struct loop *loop);
+extern int uring_add(struct conn *c);
+extern int uring_send(struct conn *c);
+extern void uring_close(struct conn *c);
+extern void uring_watch(struct uring *u, int efd);
+extern void uring_stop_accept(struct uring *u);
+
+#endif